@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fiemap.h"
+#include "uring.h"
+
+// Throughput comparison of reading the same data four ways: through a file
+// via the page cache, through the file with O_DIRECT, through the raw block
+// device via its page cache and through the device with O_DIRECT. As in
+// block_vs_file.c we use FIEMAP to find where the file's blocks live on the
+// device, so each mode reads exactly the same sectors, in the same order, at
+// each read size and queue depth.
+//
+// The device must be the one the filesystem lives on (a partition or loop
+// device, not a whole disk) since FIEMAP physical offsets are relative to it.
+// loop_setup.sh creates a suitable loop device and file.
+
+#define DEFAULT_SIZES "4,16,64,256,1024"
+#define DEFAULT_DEPTHS "1,4,16,32"
+#define MAX_DEPTH (256)
+
+#define ROUND_UP(val, multiple) \
+	(((val) + (multiple) - 1) & ~((multiple) - 1))
+
+#define DIV_UP(val, multiple) \
+	(ROUND_UP(val, multiple) / (multiple))
+
+enum mode {
+	MODE_FILE_BUFFERED,
+	MODE_FILE_DIRECT,
+	MODE_DEV_BUFFERED,
+	MODE_DEV_DIRECT,
+	NUM_MODES
+};
+
+static const char *const mode_names[] = {
+	"file", "file-dio", "dev", "dev-dio",
+};
+
+// A physically contiguous run of the file.
+struct extent {
+	uint64_t file_offset, dev_offset, len;
+};
+
+// A single read, identical for file and device bar the offset.
+struct chunk {
+	uint64_t file_offset, dev_offset;
+	uint32_t len;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Parse a comma-separated list of positive integers.
+static size_t parse_list(const char *arg, unsigned long *out, size_t max)
+{
+	char *copy = strdup(arg), *tok, *end;
+	size_t count = 0;
+
+	for (tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		unsigned long val = strtoul(tok, &end, 10);
+
+		if (*end != '\0' || val == 0 || count == max) {
+			fprintf(stderr, "Invalid list '%s'\n", arg);
+			exit(EXIT_FAILURE);
+		}
+		out[count++] = val;
+	}
+
+	free(copy);
+	return count;
+}
+
+// Map the file's layout via FIEMAP and merge physically contiguous extents.
+static struct extent *get_extents(int fd, uint64_t size, size_t *num_extents)
+{
+	const uint32_t unreadable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+		FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED |
+		FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE |
+		FIEMAP_EXTENT_UNWRITTEN;
+	struct file_extent *fes;
+	struct extent *extents;
+	size_t count = 0, num_fes, i;
+	uint64_t expected = 0;
+
+	fes = fiemap_read(fd, 0, size, true, &num_fes);
+	if (fes == NULL) {
+		perror("ioctl FIEMAP");
+		exit(EXIT_FAILURE);
+	}
+
+	extents = calloc(num_fes ? num_fes : 1, sizeof(struct extent));
+	if (extents == NULL) {
+		fprintf(stderr, "Unable to allocate\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num_fes; i++) {
+		const struct file_extent *fe = &fes[i];
+		struct extent *prev = count > 0 ? &extents[count - 1] : NULL;
+		// The last extent covers whole blocks, possibly past EOF.
+		const uint64_t len = fe->logical + fe->len > size ?
+			size - fe->logical : fe->len;
+
+		if (fe->logical != expected) {
+			fprintf(stderr, "Hole at %lu, write the file out in full\n",
+				expected);
+			exit(EXIT_FAILURE);
+		}
+		if (fe->flags & unreadable) {
+			fprintf(stderr, "Extent at %lu (flags %#x) can't be read via the device\n",
+				fe->logical, fe->flags);
+			exit(EXIT_FAILURE);
+		}
+		expected = fe->logical + fe->len;
+
+		if (prev != NULL && prev->dev_offset + prev->len == fe->physical) {
+			prev->len += len;
+			continue;
+		}
+
+		extents[count].file_offset = fe->logical;
+		extents[count].dev_offset = fe->physical;
+		extents[count].len = len;
+		count++;
+	}
+
+	if (expected < size) {
+		fprintf(stderr, "Hole at %lu, write the file out in full\n", expected);
+		exit(EXIT_FAILURE);
+	}
+
+	free(fes);
+	*num_extents = count;
+	return extents;
+}
+
+// Split extents into reads of at most size bytes, never spanning an extent so
+// that device reads cover the same data as the file reads.
+static struct chunk *get_chunks(const struct extent *extents, size_t num_extents,
+				uint64_t size, size_t *num_chunks)
+{
+	struct chunk *chunks;
+	size_t i, count = 0, max = 0;
+
+	for (i = 0; i < num_extents; i++)
+		max += DIV_UP(extents[i].len, size);
+
+	chunks = malloc(max * sizeof(struct chunk));
+	if (chunks == NULL) {
+		fprintf(stderr, "Unable to allocate\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num_extents; i++) {
+		uint64_t offset;
+
+		for (offset = 0; offset < extents[i].len; offset += size) {
+			uint64_t len = extents[i].len - offset;
+
+			chunks[count].file_offset = extents[i].file_offset + offset;
+			chunks[count].dev_offset = extents[i].dev_offset + offset;
+			chunks[count].len = len < size ? len : size;
+			count++;
+		}
+	}
+
+	*num_chunks = count;
+	return chunks;
+}
+
+static int open_mode(const char *path, bool direct)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC | (direct ? O_DIRECT : 0));
+
+	if (fd < 0) {
+		fprintf(stderr, "open %s%s: %s\n", path,
+			direct ? " O_DIRECT" : "", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+// Drop any cached pages so buffered reads start cold. For a block device
+// this invalidates its own page cache, separate to the file's.
+static void drop_cache(int fd)
+{
+	int err;
+
+	if (fsync(fd) && errno != EINVAL) {
+		perror("fsync");
+		exit(EXIT_FAILURE);
+	}
+
+	err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	if (err) {
+		fprintf(stderr, "posix_fadvise: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void reap(struct uring *ring, const struct chunk *chunks)
+{
+	struct io_uring_cqe *cqe = uring_wait_cqe(ring);
+
+	if (cqe == NULL) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cqe->res != (int)chunks[cqe->user_data].len) {
+		fprintf(stderr, "io_uring read: %s\n",
+			cqe->res < 0 ? strerror(-cqe->res) : "short read");
+		exit(EXIT_FAILURE);
+	}
+
+	uring_cqe_seen(ring);
+}
+
+// Read every chunk in order with up to depth reads in flight, returning MiB/s.
+static double run(struct uring *ring, int fd, bool dev, char *buf,
+		  uint64_t size, unsigned int depth, const struct chunk *chunks,
+		  size_t num_chunks, uint64_t total)
+{
+	unsigned int in_flight = 0;
+	uint64_t start;
+	size_t i;
+
+	start = now_ns();
+
+	for (i = 0; i < num_chunks; i++) {
+		const struct chunk *chunk = &chunks[i];
+		struct io_uring_sqe *sqe;
+
+		if (in_flight == depth) {
+			reap(ring, chunks);
+			in_flight--;
+		}
+
+		sqe = uring_get_sqe(ring);
+		if (sqe == NULL) {
+			fprintf(stderr, "io_uring submission queue full\n");
+			exit(EXIT_FAILURE);
+		}
+
+		// Slot reuse is fine, we never look at the data.
+		uring_prep_read(sqe, fd, &buf[(i % depth) * size], chunk->len,
+				dev ? chunk->dev_offset : chunk->file_offset, i);
+		if (uring_submit(ring, 0) < 0) {
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+		in_flight++;
+	}
+
+	for (; in_flight > 0; in_flight--)
+		reap(ring, chunks);
+
+	return (double)total / (1UL << 20) / ((now_ns() - start) / 1e9);
+}
+
+// Make sure the FIEMAP translation is right before measuring anything by
+// comparing the first and last extents read directly through each.
+static void verify(int file_fd, int dev_fd, const struct extent *extents,
+		   size_t num_extents, unsigned int blksize)
+{
+	const struct extent *check[] = { &extents[0], &extents[num_extents - 1] };
+	char *file_buf, *dev_buf;
+	size_t i;
+
+	if (posix_memalign((void **)&file_buf, blksize, blksize) ||
+	    posix_memalign((void **)&dev_buf, blksize, blksize)) {
+		fprintf(stderr, "Unable to allocate\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < 2; i++) {
+		const size_t len = check[i]->len < blksize ? check[i]->len : blksize;
+
+		if (pread(file_fd, file_buf, blksize, check[i]->file_offset) < (ssize_t)len ||
+		    pread(dev_fd, dev_buf, blksize, check[i]->dev_offset) != blksize) {
+			perror("pread");
+			exit(EXIT_FAILURE);
+		}
+
+		if (memcmp(file_buf, dev_buf, len)) {
+			fprintf(stderr, "File and device data differ at file offset %lu, "
+				"is the device the filesystem's own?\n",
+				check[i]->file_offset);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(file_buf);
+	free(dev_buf);
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [-s KiB,...] [-q depth,...] [-r repeats] [path to file] [/dev/...]\n",
+		bin);
+	fprintf(stderr, "  -s  read sizes in KiB (default %s)\n", DEFAULT_SIZES);
+	fprintf(stderr, "  -q  queue depths (default %s)\n", DEFAULT_DEPTHS);
+	fprintf(stderr, "  -r  runs per measurement, best is reported (default 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long sizes[32], depths[32];
+	size_t num_sizes, num_depths, num_extents, s, d;
+	unsigned int blksize, repeats = 1, max_depth = 0;
+	const char *path, *dev_path;
+	struct extent *extents;
+	int fds[NUM_MODES];
+	uint64_t max_size = 0;
+	struct uring ring;
+	struct stat st;
+	char *buf;
+	int opt, m;
+
+	num_sizes = parse_list(DEFAULT_SIZES, sizes, 32);
+	num_depths = parse_list(DEFAULT_DEPTHS, depths, 32);
+
+	while ((opt = getopt(argc, argv, "s:q:r:h")) != -1) {
+		switch (opt) {
+		case 's':
+			num_sizes = parse_list(optarg, sizes, 32);
+			break;
+		case 'q':
+			num_depths = parse_list(optarg, depths, 32);
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 2 || repeats == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	path = argv[optind];
+	dev_path = argv[optind + 1];
+
+	for (s = 0; s < num_sizes; s++) {
+		sizes[s] <<= 10;
+		if (sizes[s] > max_size)
+			max_size = sizes[s];
+	}
+	for (d = 0; d < num_depths; d++) {
+		if (depths[d] > MAX_DEPTH) {
+			fprintf(stderr, "Maximum queue depth is %d\n", MAX_DEPTH);
+			return EXIT_FAILURE;
+		}
+		if (depths[d] > max_depth)
+			max_depth = depths[d];
+	}
+
+	fds[MODE_FILE_BUFFERED] = open_mode(path, false);
+	fds[MODE_FILE_DIRECT] = open_mode(path, true);
+	fds[MODE_DEV_BUFFERED] = open_mode(dev_path, false);
+	fds[MODE_DEV_DIRECT] = open_mode(dev_path, true);
+
+	if (fstat(fds[MODE_FILE_BUFFERED], &st) < 0) {
+		perror("fstat");
+		return EXIT_FAILURE;
+	}
+	blksize = st.st_blksize;
+
+	if (st.st_size == 0) {
+		fprintf(stderr, "Empty file?\n");
+		return EXIT_FAILURE;
+	}
+
+	// Otherwise the final O_DIRECT read would be misaligned.
+	if (st.st_size % blksize != 0) {
+		fprintf(stderr, "File size must be a multiple of the %u byte block size\n",
+			blksize);
+		return EXIT_FAILURE;
+	}
+
+	for (s = 0; s < num_sizes; s++) {
+		if (sizes[s] % blksize != 0) {
+			fprintf(stderr, "Read sizes must be a multiple of the %u byte block size\n",
+				blksize);
+			return EXIT_FAILURE;
+		}
+	}
+
+	extents = get_extents(fds[MODE_FILE_BUFFERED], st.st_size, &num_extents);
+	verify(fds[MODE_FILE_DIRECT], fds[MODE_DEV_DIRECT], extents, num_extents,
+	       blksize);
+
+	printf("%s: %lu bytes in %zu extent(s) of %u byte blocks on %s\n", path,
+	       st.st_size, num_extents, blksize, dev_path);
+
+	// One slot per read in flight. Page aligned, so good for O_DIRECT.
+	buf = mmap(NULL, max_size * max_depth, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	if (uring_init(&ring, max_depth)) {
+		perror("io_uring_setup");
+		return EXIT_FAILURE;
+	}
+
+	printf("%8s %5s", "size KiB", "depth");
+	for (m = 0; m < NUM_MODES; m++)
+		printf(" %10s", mode_names[m]);
+	printf("   (MiB/s, buffered modes read cold)\n");
+
+	for (s = 0; s < num_sizes; s++) {
+		size_t num_chunks;
+		struct chunk *chunks = get_chunks(extents, num_extents, sizes[s],
+						  &num_chunks);
+
+		for (d = 0; d < num_depths; d++) {
+			printf("%8lu %5lu", sizes[s] >> 10, depths[d]);
+
+			for (m = 0; m < NUM_MODES; m++) {
+				const bool dev = m == MODE_DEV_BUFFERED ||
+					m == MODE_DEV_DIRECT;
+				double best = 0;
+				unsigned int r;
+
+				for (r = 0; r < repeats; r++) {
+					double mibs;
+
+					drop_cache(fds[m]);
+					mibs = run(&ring, fds[m], dev, buf, sizes[s],
+						   depths[d], chunks, num_chunks,
+						   st.st_size);
+					if (mibs > best)
+						best = mibs;
+				}
+
+				printf(" %10.1f", best);
+				fflush(stdout);
+			}
+			printf("\n");
+		}
+
+		free(chunks);
+	}
+
+	uring_exit(&ring);
+	for (m = 0; m < NUM_MODES; m++)
+		close(fds[m]);
+	free(extents);
+
+	return EXIT_SUCCESS;
+}
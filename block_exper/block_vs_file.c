@@ -11,6 +11,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 
+#include "../fiemap/fiemap.h"
 #include "../read-pageflags/read-pageflags.h"
 
 /*
@@ -53,39 +54,30 @@ static char next_char(char chr)
 
 static void print_buffers(char *file_buf, char *dev_buf)
 {
+	const void *ptrs[] = { file_buf, dev_buf };
+	const char *descrs[] = { "file", "dev" };
+
 	printf("file=%s", file_buf);
 	printf("---\n");
 	printf("dev =%s", dev_buf);
 	printf("---\n");
-	print_flags_virt(file_buf, "file");
-	print_flags_virt(dev_buf, "dev");
+	// Sample both together so that one read doesn't skew the other.
+	print_flags_virt_batch(ptrs, descrs, 2);
 	printf("---\n");
 }
 
-static unsigned long *get_block_nums(int fd, unsigned long num_blocks,
-				     unsigned int blksize)
+// Map the file's layout on the device. FIEMAP hands back whole extents in a
+// couple of ioctls rather than one FIBMAP per block.
+static struct file_extent *get_extents(int fd, uint64_t size,
+				       size_t *num_extents)
 {
-	// Linux hardcodes 'logical' sector size to 512 bytes.
-	const unsigned long sectors_per_block = blksize / 512;
-	unsigned long *ret = calloc(num_blocks, sizeof(unsigned long));
-	int i;
+	struct file_extent *ret = fiemap_read(fd, 0, size, true, num_extents);
 
 	if (ret == NULL) {
-		fprintf(stderr, "Unable to allocate\n");
+		perror("ioctl FIEMAP");
 		exit(EXIT_FAILURE);
 	}
 
-	for (i = 0; i < num_blocks; i++) {
-		unsigned long blknum_sects = i * sectors_per_block;
-
-		if (ioctl(fd, FIBMAP, &blknum_sects)) {
-			perror("ioctl FIBMAP");
-			exit(EXIT_FAILURE);
-		}
-
-		ret[i] = blknum_sects;
-	}
-
 	return ret;
 }
 
@@ -99,14 +91,15 @@ int main(int argc, char **argv)
 	unsigned int blksize;
 	const char *path;
 	const char *dev_path;
-	unsigned long *block_nums;
+	struct file_extent *extents;
+	size_t num_extents;
 	char *file_buf, *dev_buf;
 	unsigned long size_in_pages;
-	unsigned long offset, offset_page_start, start_block;
+	unsigned long first_block, offset, offset_page_start, start_block;
 	struct local_hd_geometry geometry;
 	char next_chr, next_next_chr;
 #ifdef PRINT_BLOCK_NUMS
-	unsigned long i;
+	size_t i;
 #endif
 
 	if (argc < 3) {
@@ -153,19 +146,21 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	block_nums = get_block_nums(fd, num_blocks, blksize);
+	extents = get_extents(fd, st.st_size, &num_extents);
 #ifdef PRINT_BLOCK_NUMS
-	for (i = 0; i < num_blocks; i++) {
-		printf("%lu ", block_nums[i]);
+	for (i = 0; i < num_extents; i++) {
+		printf("%lu-%lu ", extents[i].physical / blksize,
+		       (extents[i].physical + extents[i].len) / blksize - 1);
 	}
 	printf("\n");
 #endif
-	if (block_nums[0] == 0) {
+	if (num_extents == 0 || extents[0].logical != 0) {
 		fprintf(stderr, "First block a hole\n");
 		return EXIT_FAILURE;
 	}
+	first_block = extents[0].physical / blksize;
 
-	printf("First LBA is %lu\n", block_nums[0]);
+	printf("First LBA is %lu\n", first_block);
 
 	// Map first page.
 
@@ -176,7 +171,7 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	offset = block_nums[0] * page_size;
+	offset = extents[0].physical;
 	offset_page_start = ROUND_DOWN(offset, page_size);
 
 	printf("Offset=%lu, offset_page_start=%lu, delta=%lu\n", offset,
@@ -1,3 +1,6 @@
 #!/bin/bash
 
-gcc -Wall block_vs_file.c ../read-pageflags/read-pageflags.c -o block_vs_file
+gcc -Wall -I../procfd -I../uring block_vs_file.c ../read-pageflags/read-pageflags.c \
+	../procfd/procfd.c ../procfd/procbatch.c ../uring/uring.c ../fiemap/fiemap.c -o block_vs_file
+gcc -Wall -O2 -I../fiemap -I../uring block_bench.c ../fiemap/fiemap.c ../uring/uring.c \
+	-o block_bench
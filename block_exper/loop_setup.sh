@@ -0,0 +1,40 @@
+#!/bin/bash
+# Create a loop device backed by an ext4 image with a test file on it for
+# block_bench, or tear it down again. Needs root.
+#
+#   ./loop_setup.sh setup [image] [image MiB] [file MiB]
+#   ./loop_setup.sh teardown [image]
+
+set -e
+
+cmd=${1:-setup}
+image=${2:-block_bench.img}
+image_mib=${3:-1024}
+file_mib=${4:-512}
+mnt=${image%.img}.mnt
+
+case $cmd in
+setup)
+	truncate -s ${image_mib}M $image
+	mkfs.ext4 -q -F -b 4096 $image
+	# direct-io so the loop driver doesn't cache the image in the host
+	# page cache too, which would hide device reads behind memcpy.
+	dev=$(losetup --find --show --direct-io=on $image)
+	mkdir -p $mnt
+	mount $dev $mnt
+	dd if=/dev/urandom of=$mnt/test.dat bs=1M count=$file_mib status=none
+	sync
+	echo "./block_bench $mnt/test.dat $dev"
+	;;
+teardown)
+	dev=$(losetup -j $image | cut -d: -f1)
+	umount $mnt
+	losetup -d $dev
+	rmdir $mnt
+	rm -f $image
+	;;
+*)
+	echo "usage: $0 setup|teardown [image] [image MiB] [file MiB]" >&2
+	exit 1
+	;;
+esac
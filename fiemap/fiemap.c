@@ -0,0 +1,126 @@
+#include "fiemap.h"
+
+#include <errno.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+// Upper bound on extents fetched per ioctl, so the kernel's copy stays small
+// even if the initial count was badly out of date.
+#define MAX_BATCH (4096)
+
+// Ask how many extents cover the range without fetching them.
+static long count_extents(int fd, uint64_t start, uint64_t len, uint32_t flags)
+{
+	struct fiemap fm;
+
+	memset(&fm, 0, sizeof(fm));
+	fm.fm_start = start;
+	fm.fm_length = len;
+	fm.fm_flags = flags;
+	fm.fm_extent_count = 0;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm))
+		return -1;
+
+	return fm.fm_mapped_extents;
+}
+
+struct file_extent *fiemap_read(int fd, uint64_t start, uint64_t len, bool sync,
+				size_t *count)
+{
+	const uint32_t flags = sync ? FIEMAP_FLAG_SYNC : 0;
+	const uint64_t end = len > UINT64_MAX - start ? UINT64_MAX : start + len;
+	struct file_extent *extents = NULL;
+	size_t num = 0, capacity;
+	struct fiemap *fm = NULL;
+	uint32_t batch;
+	long expected;
+	int saved_errno;
+
+	expected = count_extents(fd, start, len, flags);
+	if (expected < 0)
+		return NULL;
+
+	// Leave room for a few extents appearing between the calls.
+	batch = expected + 16 > MAX_BATCH ? MAX_BATCH : expected + 16;
+	capacity = expected + 16;
+
+	fm = (struct fiemap *)malloc(sizeof(*fm) +
+				     batch * sizeof(struct fiemap_extent));
+	extents = (struct file_extent *)malloc(capacity * sizeof(*extents));
+	if (fm == NULL || extents == NULL)
+		goto err;
+
+	while (start < end) {
+		bool last = false;
+		uint32_t i;
+
+		memset(fm, 0, sizeof(*fm));
+		fm->fm_start = start;
+		fm->fm_length = end - start;
+		fm->fm_flags = flags;
+		fm->fm_extent_count = batch;
+
+		if (ioctl(fd, FS_IOC_FIEMAP, fm))
+			goto err;
+
+		if (fm->fm_mapped_extents == 0)
+			break;
+
+		if (num + fm->fm_mapped_extents > capacity) {
+			struct file_extent *grown;
+
+			capacity = (num + fm->fm_mapped_extents) * 2;
+			grown = (struct file_extent *)realloc(extents,
+					capacity * sizeof(*extents));
+			if (grown == NULL)
+				goto err;
+			extents = grown;
+		}
+
+		for (i = 0; i < fm->fm_mapped_extents; i++) {
+			const struct fiemap_extent *fe = &fm->fm_extents[i];
+			struct file_extent *out = &extents[num++];
+
+			out->logical = fe->fe_logical;
+			out->physical = fe->fe_physical;
+			out->len = fe->fe_length;
+			out->flags = fe->fe_flags;
+
+			last |= fe->fe_flags & FIEMAP_EXTENT_LAST;
+		}
+
+		if (last)
+			break;
+
+		// Continue after the final extent returned.
+		start = extents[num - 1].logical + extents[num - 1].len;
+	}
+
+	free(fm);
+	*count = num;
+	return extents;
+
+err:
+	saved_errno = errno;
+	free(fm);
+	free(extents);
+	errno = saved_errno;
+	return NULL;
+}
+
+size_t fiemap_discontiguities(const struct file_extent *extents, size_t count)
+{
+	size_t i, gaps = 0;
+
+	for (i = 1; i < count; i++) {
+		if (extents[i - 1].physical + extents[i - 1].len !=
+		    extents[i].physical)
+			gaps++;
+	}
+
+	return gaps;
+}
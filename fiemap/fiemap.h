@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Read a file's physical layout with the FIEMAP ioctl, which hands back whole
+// extents rather than the single block FIBMAP resolves per call. A file of any
+// size typically takes a couple of ioctls: one to count the extents and one
+// to fetch them.
+
+struct file_extent {
+	// Byte offsets within the file and on the underlying device.
+	uint64_t logical, physical;
+	uint64_t len;
+	// FIEMAP_EXTENT_* flags, see linux/fiemap.h.
+	uint32_t flags;
+};
+
+// Map the extents overlapping [start, start + len) of the file open at fd.
+// If sync is set, dirty data is flushed first so delayed allocations have
+// physical blocks. Returns an array of *count extents in file order which the
+// caller frees, or NULL with errno set on error. An empty or fully sparse
+// range returns a valid allocation with *count of 0.
+struct file_extent *fiemap_read(int fd, uint64_t start, uint64_t len, bool sync,
+				size_t *count);
+
+// Number of physical discontiguities between successive extents, i.e. the
+// seeks a sequential read of the file would incur. Adjacent extents which
+// continue on the device (split only by the filesystem's maximum extent size
+// or by unwritten/written state) don't count.
+size_t fiemap_discontiguities(const struct file_extent *extents, size_t count);
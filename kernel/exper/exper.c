@@ -3,6 +3,8 @@
 #include <linux/gfp.h>
 #include <linux/init.h>
 #include <linux/list.h>
+#include <linux/memcontrol.h>
+#include <linux/memory_hotplug.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/mm_types.h>
@@ -11,35 +13,36 @@
 #include <linux/page-flags.h>
 #include <linux/pageblock-flags.h>
 #include <linux/percpu-defs.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "pfninfo.h"
+#include "querydev.h"
 
 MODULE_AUTHOR("Lorenzo Stoakes <lstoakes@gmail.com>");
 MODULE_DESCRIPTION("Experiments");
 MODULE_LICENSE("GPL");
 
-static char refcount_buf[255] = "0";
-static int refcount_buf_size = 2;
+static int parse_pfn(const char *query, struct page **pg)
+{
+	unsigned long pfn;
 
-// TODO: HORRENDOUS duplication.
+	if (kstrtoul(query, 10, &pfn))
+		return -EINVAL;
 
-static char pagebuffers_buf[255] = "[]";
-static int pagebuffers_buf_size = 3;
+	if (!pfn_valid(pfn))
+		return -EINVAL;
 
-static ssize_t pagebuffers_read_(struct file *file, char __user *out,
-				 size_t size, loff_t *off)
-{
-	return simple_read_from_buffer(out, size, off, pagebuffers_buf,
-				       pagebuffers_buf_size);
+	*pg = pfn_to_page(pfn);
+	return 0;
 }
 
-static void read_buffer_head(struct buffer_head *bh) {
-	int size = sizeof(pagebuffers_buf) - 1;
-
-	pagebuffers_buf[0] = '[';
-	pagebuffers_buf[1] = '\0';
-
+static void print_buffer_head(struct buffer_head *bh, struct seq_buf *out)
+{
 #define CHECK_FLAG(flag_, str_) \
 	if (bh->b_state & (1U << flag_))		\
-		strncat(pagebuffers_buf, str_, size);
+		seq_buf_puts(out, str_);
 
 	CHECK_FLAG(BH_Uptodate, "U");
 	CHECK_FLAG(BH_Dirty, "D");
@@ -57,105 +60,291 @@ static void read_buffer_head(struct buffer_head *bh) {
 	CHECK_FLAG(BH_Meta, "Me");
 	CHECK_FLAG(BH_Prio, "!");
 	CHECK_FLAG(BH_Defer_Completion, "@");
-
 #undef CHECK_FLAG
-
-	strncat(pagebuffers_buf, "]", size);
-
-	pagebuffers_buf_size = strlen(pagebuffers_buf);
 }
 
-static ssize_t pagebuffers_write_(struct file *file, const char __user *in,
-				  size_t size, loff_t *off)
+static int pagebuffers_query(struct querydev_file *qf, const char *query,
+			     struct seq_buf *out)
 {
-	char pfn_buf[255];
-	uint64_t pfn;
-	ssize_t count;
 	struct page *pg;
+	int err;
 
-	count = simple_write_to_buffer(pfn_buf, 254, off, in, size);
-	if (count <= 0)
-		return -EINVAL;
-	pfn_buf[count] = '\0';
-
-	if (sscanf(pfn_buf, "%llu", &pfn) != 1)
-		return -EINVAL;
-
-	pg = pfn_to_page(pfn);
-	if (pg == NULL)
-		return -EINVAL;
+	err = parse_pfn(query, &pg);
+	if (err)
+		return err;
 
+	seq_buf_putc(out, '[');
 	if (page_has_buffers(pg)) {
 		pr_err("IVG: Page has buffers\n");
-		read_buffer_head(page_buffers(pg));
-	} else {
-		pagebuffers_buf[0] = '[';
-		pagebuffers_buf[1] = ']';
-		pagebuffers_buf[2] = '\0';
-		pagebuffers_buf_size = 3;
+		print_buffer_head(page_buffers(pg), out);
 	}
+	seq_buf_putc(out, ']');
 
-	*off = size;
-	return size;
+	return 0;
 }
 
-static const struct file_operations pagebuffers_fops = {
-	.owner = THIS_MODULE,
-	.read = pagebuffers_read_,
-	.write = pagebuffers_write_
+static struct querydev pagebuffers_dev = {
+	.name = "pagebuffers",
+	.query = pagebuffers_query,
 };
 
-static struct miscdevice pagebuffers_dev = {
-	.minor = MISC_DYNAMIC_MINOR,
-	.name = "pagebuffers",
-	.fops = &pagebuffers_fops
+static int refcount_query(struct querydev_file *qf, const char *query,
+			  struct seq_buf *out)
+{
+	struct page *pg;
+	int err;
+
+	err = parse_pfn(query, &pg);
+	if (err)
+		return err;
+
+	seq_buf_printf(out, "%d", page_ref_count(pg));
+	return 0;
+}
+
+static struct querydev refcount_dev = {
+	.name = "refcount",
+	.query = refcount_query,
 };
 
-static ssize_t refcount_read_(struct file *file, char __user *out,
-			      size_t size, loff_t *off)
+// PFNs handled per copy to and from userspace by the pfninfo ioctl.
+#define PFNINFO_BATCH (256)
+
+static u32 pfninfo_bh_state(const struct buffer_head *bh)
+{
+	static const struct {
+		int bit;
+		u32 flag;
+	} bits[] = {
+		{ BH_Uptodate, PFNINFO_BH_UPTODATE },
+		{ BH_Dirty, PFNINFO_BH_DIRTY },
+		{ BH_Lock, PFNINFO_BH_LOCK },
+		{ BH_Req, PFNINFO_BH_REQ },
+		{ BH_Mapped, PFNINFO_BH_MAPPED },
+		{ BH_New, PFNINFO_BH_NEW },
+		{ BH_Async_Read, PFNINFO_BH_ASYNC_READ },
+		{ BH_Async_Write, PFNINFO_BH_ASYNC_WRITE },
+		{ BH_Delay, PFNINFO_BH_DELAY },
+		{ BH_Boundary, PFNINFO_BH_BOUNDARY },
+		{ BH_Write_EIO, PFNINFO_BH_WRITE_EIO },
+		{ BH_Unwritten, PFNINFO_BH_UNWRITTEN },
+		{ BH_Quiet, PFNINFO_BH_QUIET },
+		{ BH_Meta, PFNINFO_BH_META },
+		{ BH_Prio, PFNINFO_BH_PRIO },
+		{ BH_Defer_Completion, PFNINFO_BH_DEFER_COMPLETION },
+	};
+	const unsigned long state = READ_ONCE(bh->b_state);
+	u32 ret = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bits); i++) {
+		if (state & (1UL << bits[i].bit))
+			ret |= bits[i].flag;
+	}
+
+	return ret;
+}
+
+static u32 pfninfo_folio_flags(struct folio *folio)
 {
-	return simple_read_from_buffer(out, size, off, refcount_buf,
-				       refcount_buf_size);
+	u32 flags = 0;
+
+#define CHECK_FLAG(test_, flag_)	\
+	if (test_(folio))		\
+		flags |= flag_;
+
+	CHECK_FLAG(folio_test_locked, PFNINFO_LOCKED);
+	CHECK_FLAG(folio_test_referenced, PFNINFO_REFERENCED);
+	CHECK_FLAG(folio_test_uptodate, PFNINFO_UPTODATE);
+	CHECK_FLAG(folio_test_dirty, PFNINFO_DIRTY);
+	CHECK_FLAG(folio_test_lru, PFNINFO_LRU);
+	CHECK_FLAG(folio_test_active, PFNINFO_ACTIVE);
+	CHECK_FLAG(folio_test_workingset, PFNINFO_WORKINGSET);
+	CHECK_FLAG(folio_test_writeback, PFNINFO_WRITEBACK);
+	CHECK_FLAG(folio_test_reclaim, PFNINFO_RECLAIM);
+	CHECK_FLAG(folio_test_swapbacked, PFNINFO_SWAPBACKED);
+	CHECK_FLAG(folio_test_unevictable, PFNINFO_UNEVICTABLE);
+	CHECK_FLAG(folio_test_mlocked, PFNINFO_MLOCKED);
+	CHECK_FLAG(folio_test_private, PFNINFO_PRIVATE);
+	CHECK_FLAG(folio_test_anon, PFNINFO_ANON);
+	CHECK_FLAG(folio_test_ksm, PFNINFO_KSM);
+	CHECK_FLAG(folio_test_swapcache, PFNINFO_SWAPCACHE);
+	CHECK_FLAG(folio_test_large, PFNINFO_LARGE);
+	CHECK_FLAG(folio_test_hugetlb, PFNINFO_HUGETLB);
+	CHECK_FLAG(folio_test_reserved, PFNINFO_RESERVED);
+#undef CHECK_FLAG
+
+	if (page_has_type(&folio->page))
+		flags |= PFNINFO_TYPED;
+
+	return flags;
 }
 
-static ssize_t refcount_write_(struct file *file, const char __user *in,
-			       size_t size, loff_t *off)
+static void pfninfo_buffers(struct folio *folio, struct pfninfo_record *rec)
 {
-	char pfn_buf[255];
-	uint64_t pfn;
-	ssize_t count;
-	int refcount;
-	struct page *pg;
+	struct buffer_head *head, *bh;
+
+	// Anon private data isn't buffer heads, and page cache buffers are only
+	// stable under the folio lock. Don't wait for it, we may be looking at
+	// a folio our caller has locked.
+	if (!folio_test_private(folio) || folio_test_anon(folio) ||
+	    folio->mapping == NULL)
+		return;
+
+	if (!folio_trylock(folio)) {
+		rec->flags |= PFNINFO_BUFFERS_UNKNOWN;
+		return;
+	}
 
-	count = simple_write_to_buffer(pfn_buf, 254, off, in, size);
-	if (count <= 0)
-		return -EINVAL;
-	pfn_buf[count] = '\0';
+	head = folio_buffers(folio);
+	if (head != NULL) {
+		bh = head;
+		do {
+			if (rec->nr_buffers < PFNINFO_MAX_BUFFERS)
+				rec->bh_state[rec->nr_buffers] = pfninfo_bh_state(bh);
+			rec->nr_buffers++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
 
-	if (sscanf(pfn_buf, "%llu", &pfn) != 1)
-		return -EINVAL;
+	folio_unlock(folio);
+}
 
-	pg = pfn_to_page(pfn);
-	if (pg == NULL)
-		return -EINVAL;
+// Returns false if pfn is a hole or offline, which we skip.
+static bool pfninfo_fill(unsigned long pfn, struct pfninfo_record *rec)
+{
+	struct page *page = pfn_to_online_page(pfn);
+	struct folio *folio;
+
+	if (page == NULL)
+		return false;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->pfn = pfn;
+	rec->head_pfn = pfn;
+	rec->mapcount = -1;
+
+	// Pin the folio so it can't be freed or split under us, then make sure
+	// the page still belongs to it.
+	folio = page_folio(page);
+	if (!folio_try_get(folio)) {
+		rec->flags = PFNINFO_FREE;
+		return true;
+	}
+	if (unlikely(page_folio(page) != folio)) {
+		folio_put(folio);
+		rec->flags = PFNINFO_FREE;
+		return true;
+	}
+
+	rec->head_pfn = folio_pfn(folio);
+	rec->order = folio_order(folio);
+	rec->flags = pfninfo_folio_flags(folio);
+	rec->refcount = folio_ref_count(folio) - 1;
+
+	// Typed pages (slab, page tables, ...) reuse the mapcount field.
+	if (!(rec->flags & PFNINFO_TYPED)) {
+		rec->mapcount = folio_mapcount(folio);
+
+#ifdef CONFIG_MEMCG
+		if (folio_test_lru(folio) || folio_mapped(folio)) {
+			struct mem_cgroup *memcg;
 
-	refcount = page_ref_count(pg);
-	refcount_buf_size = snprintf(refcount_buf, 255, "%d", refcount) + 1;
+			rcu_read_lock();
+			memcg = folio_memcg(folio);
+			if (memcg != NULL)
+				rec->memcg_id = mem_cgroup_id(memcg);
+			rcu_read_unlock();
+		}
+#endif
 
-	*off = size;
-	return size;
+		pfninfo_buffers(folio, rec);
+	}
+
+	folio_put(folio);
+	return true;
+}
+
+static long pfninfo_query(struct pfninfo_query __user *uquery)
+{
+	struct pfninfo_query query;
+	struct pfninfo_record *records;
+	u64 *pfns;
+	u64 done, nr_records = 0;
+	long ret = 0;
+
+	if (copy_from_user(&query, uquery, sizeof(query)))
+		return -EFAULT;
+
+	pfns = kmalloc_array(PFNINFO_BATCH, sizeof(*pfns), GFP_KERNEL);
+	records = kmalloc_array(PFNINFO_BATCH, sizeof(*records), GFP_KERNEL);
+	if (pfns == NULL || records == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (done = 0; done < query.count; done += PFNINFO_BATCH) {
+		const u64 count = min_t(u64, query.count - done, PFNINFO_BATCH);
+		const u64 __user *in =
+			(const u64 __user *)u64_to_user_ptr(query.pfns) + done;
+		struct pfninfo_record __user *out =
+			(struct pfninfo_record __user *)u64_to_user_ptr(query.records) +
+			nr_records;
+		u64 i, filled = 0;
+
+		if (copy_from_user(pfns, in, count * sizeof(*pfns))) {
+			ret = -EFAULT;
+			goto out;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (pfninfo_fill(pfns[i], &records[filled]))
+				filled++;
+		}
+
+		if (copy_to_user(out, records, filled * sizeof(*records))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		nr_records += filled;
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			goto out;
+		}
+		cond_resched();
+	}
+
+	if (put_user(nr_records, &uquery->nr_records))
+		ret = -EFAULT;
+
+out:
+	kfree(pfns);
+	kfree(records);
+	return ret;
 }
 
-static const struct file_operations refcount_fops = {
+static long pfninfo_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case PFNINFO_IOC_QUERY:
+		return pfninfo_query((struct pfninfo_query __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+// Stateless, so unlike the querydev devices needs no per-open data.
+static const struct file_operations pfninfo_fops = {
 	.owner = THIS_MODULE,
-	.read = refcount_read_,
-	.write = refcount_write_
+	.unlocked_ioctl = pfninfo_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
-static struct miscdevice refcount_dev = {
+static struct miscdevice pfninfo_dev = {
 	.minor = MISC_DYNAMIC_MINOR,
-	.name = "refcount",
-	.fops = &refcount_fops
+	.name = "pfninfo",
+	.fops = &pfninfo_fops
 };
 
 static void list_exper(void)
@@ -252,21 +441,31 @@ static int __init exper_init(void)
 	pr_err("HUGETLB_PAGE_ORDER = %u, pageblock_order = %u\n",
 	       HUGETLB_PAGE_ORDER, pageblock_order);
 
-	err = misc_register(&refcount_dev);
+	err = querydev_register(&refcount_dev);
 	if (err)
 		return err;
 
-	err = misc_register(&pagebuffers_dev);
-	if (err)
+	err = querydev_register(&pagebuffers_dev);
+	if (err) {
+		querydev_deregister(&refcount_dev);
 		return err;
+	}
+
+	err = misc_register(&pfninfo_dev);
+	if (err) {
+		querydev_deregister(&pagebuffers_dev);
+		querydev_deregister(&refcount_dev);
+		return err;
+	}
 
 	return 0;
 }
 
 static void __exit exper_exit(void)
 {
-	misc_deregister(&refcount_dev);
-	misc_deregister(&pagebuffers_dev);
+	querydev_deregister(&refcount_dev);
+	querydev_deregister(&pagebuffers_dev);
+	misc_deregister(&pfninfo_dev);
 }
 
 module_init(exper_init);
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// Shared between exper's /dev/pfninfo and userspace.
+//
+// PFNINFO_IOC_QUERY takes an array of PFNs and fills a packed array with a
+// record for each which is online memory. Holes and offline PFNs are skipped,
+// so match records to queries by their pfn field. Records are a racy snapshot,
+// much as /proc/kpageflags is, but a million PFNs take a single call.
+
+// Buffer head states recorded per folio, the rest are only counted.
+#define PFNINFO_MAX_BUFFERS (8)
+
+// Stable equivalents of the kernel's folio flags, which are internal.
+#define PFNINFO_LOCKED		(1U << 0)
+#define PFNINFO_REFERENCED	(1U << 1)
+#define PFNINFO_UPTODATE	(1U << 2)
+#define PFNINFO_DIRTY		(1U << 3)
+#define PFNINFO_LRU		(1U << 4)
+#define PFNINFO_ACTIVE		(1U << 5)
+#define PFNINFO_WORKINGSET	(1U << 6)
+#define PFNINFO_WRITEBACK	(1U << 7)
+#define PFNINFO_RECLAIM		(1U << 8)
+#define PFNINFO_SWAPBACKED	(1U << 9)
+#define PFNINFO_UNEVICTABLE	(1U << 10)
+#define PFNINFO_MLOCKED		(1U << 11)
+#define PFNINFO_PRIVATE		(1U << 12)
+#define PFNINFO_ANON		(1U << 13)
+#define PFNINFO_KSM		(1U << 14)
+#define PFNINFO_SWAPCACHE	(1U << 15)
+#define PFNINFO_LARGE		(1U << 16)
+#define PFNINFO_HUGETLB		(1U << 17)
+#define PFNINFO_RESERVED	(1U << 18)
+#define PFNINFO_TYPED		(1U << 19) // Slab, page table etc., no mapcount.
+// Free, or being freed, so nothing beyond the PFN is meaningful.
+#define PFNINFO_FREE		(1U << 30)
+// Has private data but we couldn't lock it to look for buffer heads.
+#define PFNINFO_BUFFERS_UNKNOWN	(1U << 31)
+
+// Stable equivalents of the kernel's buffer_head state bits.
+#define PFNINFO_BH_UPTODATE	(1U << 0)
+#define PFNINFO_BH_DIRTY	(1U << 1)
+#define PFNINFO_BH_LOCK		(1U << 2)
+#define PFNINFO_BH_REQ		(1U << 3)
+#define PFNINFO_BH_MAPPED	(1U << 4)
+#define PFNINFO_BH_NEW		(1U << 5)
+#define PFNINFO_BH_ASYNC_READ	(1U << 6)
+#define PFNINFO_BH_ASYNC_WRITE	(1U << 7)
+#define PFNINFO_BH_DELAY	(1U << 8)
+#define PFNINFO_BH_BOUNDARY	(1U << 9)
+#define PFNINFO_BH_WRITE_EIO	(1U << 10)
+#define PFNINFO_BH_UNWRITTEN	(1U << 11)
+#define PFNINFO_BH_QUIET	(1U << 12)
+#define PFNINFO_BH_META		(1U << 13)
+#define PFNINFO_BH_PRIO		(1U << 14)
+#define PFNINFO_BH_DEFER_COMPLETION (1U << 15)
+
+struct pfninfo_record {
+	__u64 pfn;
+	// First PFN of the folio containing pfn.
+	__u64 head_pfn;
+	// PFNINFO_* flags.
+	__u32 flags;
+	// Of the folio, excluding our own reference while inspecting it.
+	__u32 refcount;
+	// Of the folio, -1 if it can't be mapped.
+	__s32 mapcount;
+	__u32 order;
+	// 0 if not charged to a memcg.
+	__u32 memcg_id;
+	// Buffer heads attached, the first PFNINFO_MAX_BUFFERS in bh_state.
+	__u32 nr_buffers;
+	// PFNINFO_BH_* states.
+	__u32 bh_state[PFNINFO_MAX_BUFFERS];
+};
+
+struct pfninfo_query {
+	// User pointers to count PFNs in, and room for count records out.
+	__u64 pfns;
+	__u64 records;
+	__u64 count;
+	// Output: records written.
+	__u64 nr_records;
+};
+
+#define PFNINFO_IOC_QUERY _IOWR('p', 0x01, struct pfninfo_query)
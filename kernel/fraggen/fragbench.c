@@ -0,0 +1,591 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+// Harness for the fraggen module. Measures how well the system copes with
+// large allocations, fragments memory, then measures again:
+//
+// - THP allocation success rate, faulting in a MADV_HUGEPAGE region.
+// - Compaction work and latency, from /proc/vmstat deltas across the THP
+//   faults and, optionally, across an explicit /proc/sys/vm/compact_memory.
+// - vmalloc_huge() time, via fraggen's control file.
+//
+// Fragmentation comes from fraggen (unmovable or unmigratable-but-movable
+// kernel allocations) and/or from ourselves: anon memory with every other
+// granule freed, some share of what remains pinned long-term by registering
+// it as io_uring buffers (FOLL_LONGTERM) so compaction can't migrate it.
+
+#define FRAGGEN_DIR "/sys/kernel/debug/fraggen/"
+#define THP_SIZE (2UL << 20)
+// io_uring's limit on buffers registered per ring.
+#define MAX_BUFS_PER_RING (16384)
+
+static const char *const vmstat_names[] = {
+	"thp_fault_alloc",
+	"thp_fault_fallback",
+	"compact_stall",
+	"compact_success",
+	"compact_fail",
+	"compact_migrate_scanned",
+	"compact_free_scanned",
+	"compact_isolated",
+};
+#define NUM_VMSTATS (sizeof(vmstat_names) / sizeof(vmstat_names[0]))
+
+// Indices into vmstat_names used in reports.
+enum {
+	VM_THP_ALLOC,
+	VM_THP_FALLBACK,
+	VM_COMPACT_STALL,
+	VM_COMPACT_SUCCESS,
+	VM_COMPACT_FAIL,
+	VM_COMPACT_MIGRATE_SCANNED,
+	VM_COMPACT_FREE_SCANNED,
+	VM_COMPACT_ISOLATED,
+};
+
+struct options {
+	uint64_t thp_mib;
+	// Userspace fragmentation.
+	uint64_t user_mib;
+	uint64_t granule_kib;
+	unsigned int pin_percent;
+	// Kernel fragmentation via fraggen, passed through to debugfs.
+	bool use_fraggen;
+	const char *order, *split_order, *pattern, *free_percent,
+		*movable_percent, *max_mib;
+	// vmalloc test, also via fraggen.
+	unsigned int vmalloc_count, vmalloc_kib;
+	bool compact;
+};
+
+struct measurement {
+	double thp_percent;
+	double fault_ms;
+	uint64_t fault_deltas[NUM_VMSTATS];
+
+	bool compacted;
+	double compact_ms;
+	uint64_t compact_deltas[NUM_VMSTATS];
+
+	bool vmalloc_done;
+	unsigned int vmalloc_ok;
+	double vmalloc_avg_us, vmalloc_max_us;
+};
+
+// Memory we fragmented from userspace.
+struct user_frag {
+	char *ptr;
+	size_t size;
+	struct uring *rings;
+	unsigned int num_rings;
+	uint64_t pinned_bytes, held_bytes;
+};
+
+static struct options opts;
+static long page_size;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void read_vmstat(uint64_t *vals)
+{
+	char name[64];
+	uint64_t val;
+	FILE *fp;
+	size_t i;
+
+	memset(vals, 0, NUM_VMSTATS * sizeof(*vals));
+
+	fp = fopen("/proc/vmstat", "r");
+	if (fp == NULL) {
+		perror("/proc/vmstat");
+		exit(EXIT_FAILURE);
+	}
+
+	while (fscanf(fp, "%63s %lu", name, &val) == 2) {
+		for (i = 0; i < NUM_VMSTATS; i++) {
+			if (!strcmp(name, vmstat_names[i]))
+				vals[i] = val;
+		}
+	}
+
+	fclose(fp);
+}
+
+static void vmstat_deltas(const uint64_t *before, const uint64_t *after,
+			  uint64_t *deltas)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_VMSTATS; i++)
+		deltas[i] = after[i] - before[i];
+}
+
+// AnonHugePages for our process, in KiB.
+static uint64_t anon_huge_kib(void)
+{
+	char line[256];
+	uint64_t kib = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/smaps_rollup", "r");
+	if (fp == NULL) {
+		perror("/proc/self/smaps_rollup");
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "AnonHugePages: %lu kB", &kib) == 1)
+			break;
+	}
+
+	fclose(fp);
+	return kib;
+}
+
+static bool write_file(const char *path, const char *val)
+{
+	const size_t len = strlen(val);
+	bool ok;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		return false;
+	}
+
+	ok = write(fd, val, len) == (ssize_t)len;
+	if (!ok)
+		perror(path);
+
+	close(fd);
+	return ok;
+}
+
+static bool fraggen_available(void)
+{
+	return access(FRAGGEN_DIR "control", W_OK) == 0;
+}
+
+static bool fraggen_param(const char *name, const char *val)
+{
+	char path[128];
+
+	if (val == NULL)
+		return true;
+
+	snprintf(path, sizeof(path), FRAGGEN_DIR "%s", name);
+	return write_file(path, val);
+}
+
+// Read a key=value field from fraggen's status.
+static uint64_t fraggen_status(const char *key)
+{
+	char buf[1024], needle[64];
+	uint64_t val = 0;
+	const char *pos;
+	ssize_t len;
+	int fd;
+
+	fd = open(FRAGGEN_DIR "control", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	snprintf(needle, sizeof(needle), "%s=", key);
+	pos = strstr(buf, needle);
+	if (pos != NULL)
+		sscanf(pos + strlen(needle), "%lu", &val);
+
+	return val;
+}
+
+// Fault in a MADV_HUGEPAGE region and see how much of it THPs back.
+static void measure_thp(struct measurement *m)
+{
+	const size_t size = opts.thp_mib << 20;
+	uint64_t before[NUM_VMSTATS], after[NUM_VMSTATS];
+	uint64_t base_kib, start;
+	char *ptr, *aligned;
+	size_t offset;
+
+	base_kib = anon_huge_kib();
+
+	ptr = mmap(NULL, size + THP_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	aligned = (char *)(((uintptr_t)ptr + THP_SIZE - 1) & ~(THP_SIZE - 1));
+
+	if (madvise(aligned, size, MADV_HUGEPAGE)) {
+		perror("madvise MADV_HUGEPAGE");
+		exit(EXIT_FAILURE);
+	}
+
+	read_vmstat(before);
+	start = now_ns();
+	for (offset = 0; offset < size; offset += page_size)
+		aligned[offset] = 1;
+	m->fault_ms = (now_ns() - start) / 1e6;
+	read_vmstat(after);
+	vmstat_deltas(before, after, m->fault_deltas);
+
+	m->thp_percent = 100. * (anon_huge_kib() - base_kib) / (size >> 10);
+
+	munmap(ptr, size + THP_SIZE);
+}
+
+static void measure_compact(struct measurement *m)
+{
+	uint64_t before[NUM_VMSTATS], after[NUM_VMSTATS];
+	uint64_t start;
+
+	read_vmstat(before);
+	start = now_ns();
+	m->compacted = write_file("/proc/sys/vm/compact_memory", "1");
+	m->compact_ms = (now_ns() - start) / 1e6;
+	read_vmstat(after);
+	vmstat_deltas(before, after, m->compact_deltas);
+}
+
+static void measure_vmalloc(struct measurement *m)
+{
+	char cmd[64];
+	uint64_t ok;
+
+	snprintf(cmd, sizeof(cmd), "vmalloc %u %u", opts.vmalloc_count,
+		 opts.vmalloc_kib);
+	if (!write_file(FRAGGEN_DIR "control", cmd))
+		return;
+
+	ok = fraggen_status("vmalloc_ok");
+	m->vmalloc_done = true;
+	m->vmalloc_ok = ok;
+	if (ok > 0) {
+		m->vmalloc_avg_us = fraggen_status("vmalloc_total_ns") / 1e3 / ok;
+		m->vmalloc_max_us = fraggen_status("vmalloc_max_ns") / 1e3;
+	}
+}
+
+static void measure(struct measurement *m, bool have_fraggen)
+{
+	memset(m, 0, sizeof(*m));
+
+	measure_thp(m);
+	if (opts.compact)
+		measure_compact(m);
+	if (have_fraggen && opts.vmalloc_count > 0)
+		measure_vmalloc(m);
+}
+
+// Pin count granules, each stride bytes apart, starting at ptr.
+static void pin_granules(struct user_frag *frag, char *ptr, size_t count,
+			 size_t stride)
+{
+	const size_t granule = opts.granule_kib << 10;
+	struct iovec *iovs;
+	size_t done, i;
+
+	iovs = malloc(MAX_BUFS_PER_RING * sizeof(*iovs));
+	frag->num_rings = (count + MAX_BUFS_PER_RING - 1) / MAX_BUFS_PER_RING;
+	frag->rings = calloc(frag->num_rings, sizeof(*frag->rings));
+	if (iovs == NULL || frag->rings == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (done = 0; done < count; done += MAX_BUFS_PER_RING) {
+		const size_t nr = count - done < MAX_BUFS_PER_RING ?
+			count - done : MAX_BUFS_PER_RING;
+		struct uring *ring = &frag->rings[done / MAX_BUFS_PER_RING];
+
+		for (i = 0; i < nr; i++) {
+			iovs[i].iov_base = ptr + (done + i) * stride;
+			iovs[i].iov_len = granule;
+		}
+
+		if (uring_init(ring, 1)) {
+			perror("io_uring_setup");
+			exit(EXIT_FAILURE);
+		}
+		if (uring_register_buffers(ring, iovs, nr)) {
+			perror("io_uring_register");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	frag->pinned_bytes = count * granule;
+	free(iovs);
+}
+
+// Fill opts.user_mib of anon memory, free every other granule and pin
+// opts.pin_percent of the remainder.
+static void fragment_user(struct user_frag *frag)
+{
+	const size_t granule = opts.granule_kib << 10;
+	size_t num_granules, held, to_pin, offset;
+
+	memset(frag, 0, sizeof(*frag));
+	if (opts.user_mib == 0)
+		return;
+
+	frag->size = opts.user_mib << 20;
+	frag->ptr = mmap(NULL, frag->size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (frag->ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	// Base pages, so freeing granules leaves holes in physical memory.
+	madvise(frag->ptr, frag->size, MADV_NOHUGEPAGE);
+	for (offset = 0; offset < frag->size; offset += page_size)
+		frag->ptr[offset] = 1;
+
+	num_granules = frag->size / granule;
+	for (offset = granule; offset < frag->size; offset += 2 * granule) {
+		if (madvise(frag->ptr + offset, granule, MADV_DONTNEED)) {
+			perror("madvise MADV_DONTNEED");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Even granules are held, pin the first pin_percent of them. Which ones
+	// doesn't much matter, each pageblock gets a similar mix either way.
+	held = (num_granules + 1) / 2;
+	frag->held_bytes = held * granule;
+	to_pin = held * opts.pin_percent / 100;
+	if (to_pin > 0)
+		pin_granules(frag, frag->ptr, to_pin, 2 * granule);
+}
+
+static void release_user(struct user_frag *frag)
+{
+	unsigned int i;
+
+	for (i = 0; i < frag->num_rings; i++) {
+		uring_unregister_buffers(&frag->rings[i]);
+		uring_exit(&frag->rings[i]);
+	}
+	free(frag->rings);
+
+	if (frag->ptr != NULL)
+		munmap(frag->ptr, frag->size);
+}
+
+static bool fragment_kernel(void)
+{
+	if (!fraggen_param("order", opts.order) ||
+	    !fraggen_param("split_order", opts.split_order) ||
+	    !fraggen_param("pattern", opts.pattern) ||
+	    !fraggen_param("free_percent", opts.free_percent) ||
+	    !fraggen_param("movable_percent", opts.movable_percent) ||
+	    !fraggen_param("max_mib", opts.max_mib))
+		return false;
+
+	return write_file(FRAGGEN_DIR "control", "run");
+}
+
+static void print_row_f(const char *name, double before, double after,
+			const char *unit)
+{
+	printf("%-28s %14.2f %14.2f  %s\n", name, before, after, unit);
+}
+
+static void print_row_u(const char *name, uint64_t before, uint64_t after)
+{
+	printf("%-28s %14lu %14lu\n", name, before, after);
+}
+
+static void print_report(const struct measurement *before,
+			 const struct measurement *after)
+{
+	size_t i;
+
+	printf("%-28s %14s %14s\n", "", "before", "after");
+
+	print_row_f("THP success", before->thp_percent, after->thp_percent, "%");
+	print_row_f("THP fault time", before->fault_ms, after->fault_ms, "ms");
+	for (i = 0; i < NUM_VMSTATS; i++)
+		print_row_u(vmstat_names[i], before->fault_deltas[i],
+			    after->fault_deltas[i]);
+
+	// Direct compaction stalls happen within faults, so their share of the
+	// fault time is as close as vmstat gets us to compaction latency.
+	print_row_f("fault ms per compact stall",
+		    before->fault_deltas[VM_COMPACT_STALL] ?
+		    before->fault_ms / before->fault_deltas[VM_COMPACT_STALL] : 0,
+		    after->fault_deltas[VM_COMPACT_STALL] ?
+		    after->fault_ms / after->fault_deltas[VM_COMPACT_STALL] : 0,
+		    "ms (upper bound)");
+
+	if (before->compacted || after->compacted) {
+		print_row_f("compact_memory time", before->compact_ms,
+			    after->compact_ms, "ms");
+		print_row_u("  compact_migrate_scanned",
+			    before->compact_deltas[VM_COMPACT_MIGRATE_SCANNED],
+			    after->compact_deltas[VM_COMPACT_MIGRATE_SCANNED]);
+		print_row_u("  compact_free_scanned",
+			    before->compact_deltas[VM_COMPACT_FREE_SCANNED],
+			    after->compact_deltas[VM_COMPACT_FREE_SCANNED]);
+		print_row_u("  compact_isolated",
+			    before->compact_deltas[VM_COMPACT_ISOLATED],
+			    after->compact_deltas[VM_COMPACT_ISOLATED]);
+	}
+
+	if (before->vmalloc_done || after->vmalloc_done) {
+		print_row_u("vmalloc succeeded", before->vmalloc_ok,
+			    after->vmalloc_ok);
+		print_row_f("vmalloc avg", before->vmalloc_avg_us,
+			    after->vmalloc_avg_us, "us");
+		print_row_f("vmalloc max", before->vmalloc_max_us,
+			    after->vmalloc_max_us, "us");
+	}
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [-t MiB] [-u MiB] [-g KiB] [-p pin %%] [-k] "
+		"[-o order] [-s split order] [-P pattern] [-f free %%] "
+		"[-M movable %%] [-x max MiB] [-v count,KiB] [-c]\n", bin);
+	fprintf(stderr, "  -t  THP probe size (default 256)\n");
+	fprintf(stderr, "  -u  anon memory to fragment from userspace (default 0)\n");
+	fprintf(stderr, "  -g  granule freed/held from userspace (default 64)\n");
+	fprintf(stderr, "  -p  share of held userspace granules to pin (default 0)\n");
+	fprintf(stderr, "  -k  fragment with the fraggen module, configured by:\n");
+	fprintf(stderr, "      -o -s -P -f -M -x  its order, split_order, pattern,\n");
+	fprintf(stderr, "      free_percent, movable_percent and max_mib\n");
+	fprintf(stderr, "  -v  vmalloc test via fraggen (default 32,2048, 0 to skip)\n");
+	fprintf(stderr, "  -c  also time an explicit /proc/sys/vm/compact_memory\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct measurement before, after;
+	struct user_frag frag;
+	bool have_fraggen;
+	int opt;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	opts.thp_mib = 256;
+	opts.granule_kib = 64;
+	opts.vmalloc_count = 32;
+	opts.vmalloc_kib = 2048;
+
+	while ((opt = getopt(argc, argv, "t:u:g:p:ko:s:P:f:M:x:v:ch")) != -1) {
+		switch (opt) {
+		case 't':
+			opts.thp_mib = strtoull(optarg, NULL, 10);
+			break;
+		case 'u':
+			opts.user_mib = strtoull(optarg, NULL, 10);
+			break;
+		case 'g':
+			opts.granule_kib = strtoull(optarg, NULL, 10);
+			break;
+		case 'p':
+			opts.pin_percent = atoi(optarg);
+			break;
+		case 'k':
+			opts.use_fraggen = true;
+			break;
+		case 'o':
+			opts.order = optarg;
+			break;
+		case 's':
+			opts.split_order = optarg;
+			break;
+		case 'P':
+			opts.pattern = optarg;
+			break;
+		case 'f':
+			opts.free_percent = optarg;
+			break;
+		case 'M':
+			opts.movable_percent = optarg;
+			break;
+		case 'x':
+			opts.max_mib = optarg;
+			break;
+		case 'v':
+			if (!strcmp(optarg, "0"))
+				opts.vmalloc_count = 0;
+			else if (sscanf(optarg, "%u,%u", &opts.vmalloc_count,
+					&opts.vmalloc_kib) != 2)
+				opts.vmalloc_count = 0;
+			break;
+		case 'c':
+			opts.compact = true;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc || opts.thp_mib == 0 || opts.granule_kib == 0 ||
+	    (opts.granule_kib << 10) % page_size != 0 || opts.pin_percent > 100) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	have_fraggen = fraggen_available();
+	if (!have_fraggen) {
+		if (opts.use_fraggen) {
+			fprintf(stderr, "fraggen not loaded (or debugfs not mounted)\n");
+			return EXIT_FAILURE;
+		}
+		if (opts.vmalloc_count > 0)
+			fprintf(stderr, "fraggen not loaded, skipping vmalloc test\n");
+	}
+
+	measure(&before, have_fraggen);
+
+	fragment_user(&frag);
+	if (opts.user_mib > 0)
+		printf("userspace: holding %lu MiB, %lu MiB of it pinned\n",
+		       frag.held_bytes >> 20, frag.pinned_bytes >> 20);
+
+	if (opts.use_fraggen) {
+		if (!fragment_kernel())
+			return EXIT_FAILURE;
+		printf("fraggen: %lu blocks (%lu movable), holding %lu MiB, freed %lu MiB\n",
+		       fraggen_status("blocks"), fraggen_status("movable_blocks"),
+		       fraggen_status("held_pages") * page_size >> 20,
+		       fraggen_status("freed_pages") * page_size >> 20);
+	}
+
+	measure(&after, have_fraggen);
+	print_report(&before, &after);
+
+	release_user(&frag);
+	if (opts.use_fraggen)
+		write_file(FRAGGEN_DIR "control", "release");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,371 @@
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/init.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mm_types.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+MODULE_AUTHOR("Lorenzo Stoakes <lstoakes@gmail.com>");
+MODULE_DESCRIPTION("Configurable fragmentation generator");
+MODULE_LICENSE("GPL");
+
+/*
+ * A configurable take on fragment/fragment2. We grab blocks of 1 << order
+ * pages, optionally with __GFP_MOVABLE so they land in (and pollute) movable
+ * pageblocks despite being unmigratable, split them and free pieces of
+ * 1 << split_order pages according to a pattern, leaving the rest held until
+ * released. Controlled via /sys/kernel/debug/fraggen/:
+ *
+ *   order           - order of the blocks grabbed (default 9).
+ *   split_order     - order of the pieces freed or held (default 0).
+ *   pattern         - which pieces to free: alternate, half, random or none.
+ *   free_percent    - share of pieces freed by the random pattern.
+ *   movable_percent - share of blocks allocated movable, the rest unmovable.
+ *   max_mib         - stop after grabbing this much, 0 for all we can get.
+ *
+ *   control         - write "run" to fragment, "release" to free everything
+ *                     held, or "vmalloc <count> <KiB>" to time vmalloc_huge()
+ *                     (freeing each again afterwards). Read for status.
+ *
+ * Pinned memory is best created from userspace, see fragbench.c.
+ */
+
+enum pattern {
+	PATTERN_ALTERNATE,
+	PATTERN_HALF,
+	PATTERN_RANDOM,
+	PATTERN_NONE,
+	NUM_PATTERNS
+};
+
+static const char *const pattern_names[] = {
+	"alternate", "half", "random", "none",
+};
+
+// A block we grabbed, whose pieces set in held are still ours.
+struct frag_block {
+	struct list_head node;
+	struct page *page;
+	bool movable;
+	unsigned long held[];
+};
+
+static DEFINE_MUTEX(lock);
+static LIST_HEAD(blocks);
+static struct dentry *dir;
+
+// Parameters, which take effect at the next run.
+static u32 order = 9;
+static u32 split_order;
+static u32 free_percent = 50;
+static u32 movable_percent;
+static u32 max_mib;
+static enum pattern pattern;
+
+// The results of the last run and vmalloc test.
+static struct {
+	unsigned long blocks, movable_blocks;
+	unsigned long held_pages, freed_pages;
+	u64 alloc_ns;
+	// Parameters the blocks on the list were grabbed with.
+	u32 order, split_order;
+
+	u32 vmalloc_count, vmalloc_kib, vmalloc_ok;
+	u64 vmalloc_total_ns, vmalloc_max_ns;
+} stats;
+
+static bool free_piece(unsigned long piece, unsigned long num_pieces)
+{
+	switch (pattern) {
+	case PATTERN_ALTERNATE:
+		return piece & 1;
+	case PATTERN_HALF:
+		return piece >= num_pieces / 2;
+	case PATTERN_RANDOM:
+		return get_random_u32_below(100) < free_percent;
+	default:
+		return false;
+	}
+}
+
+static void free_pages_range(struct page *page, unsigned long count)
+{
+	unsigned long i;
+
+	// split_page() left us with order-0 pages, so free them one at a time
+	// and let the buddy allocator merge what it can.
+	for (i = 0; i < count; i++)
+		__free_page(&page[i]);
+}
+
+static void release_blocks(void)
+{
+	const unsigned long num_pieces = 1UL << (stats.order - stats.split_order);
+	const unsigned long piece_pages = 1UL << stats.split_order;
+	struct frag_block *block, *tmp;
+
+	list_for_each_entry_safe(block, tmp, &blocks, node) {
+		unsigned long piece;
+
+		for_each_set_bit(piece, block->held, num_pieces)
+			free_pages_range(&block->page[piece * piece_pages],
+					 piece_pages);
+
+		list_del(&block->node);
+		kfree(block);
+		cond_resched();
+	}
+
+	stats.held_pages = 0;
+}
+
+static int run(u32 block_order, u32 piece_order)
+{
+	const unsigned long num_pieces = 1UL << (block_order - piece_order);
+	const unsigned long piece_pages = 1UL << piece_order;
+	const unsigned long max_blocks = max_mib ?
+		((unsigned long)max_mib << (20 - PAGE_SHIFT)) >> block_order : ULONG_MAX;
+	u32 movable_acc = 0;
+	u64 start;
+
+	release_blocks();
+	memset(&stats, 0, offsetof(typeof(stats), vmalloc_count));
+	stats.order = block_order;
+	stats.split_order = piece_order;
+
+	start = ktime_get_ns();
+
+	while (stats.blocks < max_blocks) {
+		struct frag_block *block;
+		unsigned long piece;
+		gfp_t gfp = GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY;
+
+		// Spread movable blocks evenly through the run.
+		movable_acc += movable_percent;
+		if (movable_acc >= 100) {
+			movable_acc -= 100;
+			gfp = GFP_HIGHUSER_MOVABLE | __GFP_NOWARN | __GFP_NORETRY;
+		}
+
+		block = kzalloc(struct_size(block, held, BITS_TO_LONGS(num_pieces)),
+				GFP_KERNEL);
+		if (block == NULL)
+			break;
+
+		block->page = alloc_pages(gfp, block_order);
+		if (block->page == NULL) {
+			kfree(block);
+			break;
+		}
+		block->movable = gfp & __GFP_MOVABLE;
+		split_page(block->page, block_order);
+
+		for (piece = 0; piece < num_pieces; piece++) {
+			struct page *page = &block->page[piece * piece_pages];
+
+			if (free_piece(piece, num_pieces)) {
+				free_pages_range(page, piece_pages);
+				stats.freed_pages += piece_pages;
+			} else {
+				__set_bit(piece, block->held);
+				stats.held_pages += piece_pages;
+			}
+		}
+
+		list_add_tail(&block->node, &blocks);
+		stats.blocks++;
+		if (block->movable)
+			stats.movable_blocks++;
+
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+
+	stats.alloc_ns = ktime_get_ns() - start;
+
+	pr_info("fraggen: %lu order-%u blocks (%lu movable), holding %lu MiB, freed %lu MiB\n",
+		stats.blocks, block_order, stats.movable_blocks,
+		stats.held_pages >> (20 - PAGE_SHIFT),
+		stats.freed_pages >> (20 - PAGE_SHIFT));
+
+	return 0;
+}
+
+static int time_vmalloc(u32 count, u32 kib)
+{
+	void **ptrs;
+	u32 i;
+
+	ptrs = kvcalloc(count, sizeof(*ptrs), GFP_KERNEL);
+	if (ptrs == NULL)
+		return -ENOMEM;
+
+	stats.vmalloc_count = count;
+	stats.vmalloc_kib = kib;
+	stats.vmalloc_ok = 0;
+	stats.vmalloc_total_ns = 0;
+	stats.vmalloc_max_ns = 0;
+
+	for (i = 0; i < count; i++) {
+		const u64 start = ktime_get_ns();
+		u64 elapsed;
+
+		// As fragment does, this behaves as kvmalloc_node() would.
+		ptrs[i] = vmalloc_huge((unsigned long)kib << 10, GFP_KERNEL | __GFP_NOWARN);
+		elapsed = ktime_get_ns() - start;
+
+		if (ptrs[i] == NULL)
+			continue;
+
+		stats.vmalloc_ok++;
+		stats.vmalloc_total_ns += elapsed;
+		stats.vmalloc_max_ns = max(stats.vmalloc_max_ns, elapsed);
+	}
+
+	for (i = 0; i < count; i++)
+		vfree(ptrs[i]);
+	kvfree(ptrs);
+
+	return 0;
+}
+
+static ssize_t control_read(struct file *file, char __user *out, size_t size,
+			    loff_t *off)
+{
+	char buf[512];
+	int len;
+
+	mutex_lock(&lock);
+	len = scnprintf(buf, sizeof(buf),
+			"blocks=%lu movable_blocks=%lu order=%u split_order=%u held_pages=%lu freed_pages=%lu alloc_ns=%llu\n"
+			"vmalloc_count=%u vmalloc_kib=%u vmalloc_ok=%u vmalloc_total_ns=%llu vmalloc_max_ns=%llu\n",
+			stats.blocks, stats.movable_blocks, stats.order,
+			stats.split_order, stats.held_pages, stats.freed_pages,
+			stats.alloc_ns, stats.vmalloc_count, stats.vmalloc_kib,
+			stats.vmalloc_ok, stats.vmalloc_total_ns,
+			stats.vmalloc_max_ns);
+	mutex_unlock(&lock);
+
+	return simple_read_from_buffer(out, size, off, buf, len);
+}
+
+static ssize_t control_write(struct file *file, const char __user *in,
+			     size_t size, loff_t *off)
+{
+	char buf[64];
+	u32 count, kib;
+	ssize_t ret;
+
+	if (size >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, in, size))
+		return -EFAULT;
+	buf[size] = '\0';
+
+	mutex_lock(&lock);
+
+	if (sysfs_streq(buf, "run")) {
+		// The debugfs files may change under us, so take a snapshot.
+		const u32 ord = READ_ONCE(order), split = READ_ONCE(split_order);
+
+		if (ord > MAX_PAGE_ORDER || split > ord ||
+		    free_percent > 100 || movable_percent > 100)
+			ret = -EINVAL;
+		else
+			ret = run(ord, split);
+	} else if (sysfs_streq(buf, "release")) {
+		release_blocks();
+		ret = 0;
+	} else if (sscanf(buf, "vmalloc %u %u", &count, &kib) == 2 &&
+		   count > 0 && kib > 0) {
+		ret = time_vmalloc(count, kib);
+	} else {
+		ret = -EINVAL;
+	}
+
+	mutex_unlock(&lock);
+
+	return ret ? ret : size;
+}
+
+static const struct file_operations control_fops = {
+	.owner = THIS_MODULE,
+	.read = control_read,
+	.write = control_write,
+	.llseek = default_llseek,
+};
+
+static ssize_t pattern_read(struct file *file, char __user *out, size_t size,
+			    loff_t *off)
+{
+	char buf[32];
+	int len;
+
+	len = scnprintf(buf, sizeof(buf), "%s\n", pattern_names[READ_ONCE(pattern)]);
+	return simple_read_from_buffer(out, size, off, buf, len);
+}
+
+static ssize_t pattern_write(struct file *file, const char __user *in,
+			     size_t size, loff_t *off)
+{
+	char buf[32];
+	int i;
+
+	if (size >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, in, size))
+		return -EFAULT;
+	buf[size] = '\0';
+
+	i = sysfs_match_string(pattern_names, buf);
+	if (i < 0)
+		return i;
+
+	WRITE_ONCE(pattern, i);
+	return size;
+}
+
+static const struct file_operations pattern_fops = {
+	.owner = THIS_MODULE,
+	.read = pattern_read,
+	.write = pattern_write,
+	.llseek = default_llseek,
+};
+
+static int __init fraggen_init(void)
+{
+	dir = debugfs_create_dir("fraggen", NULL);
+
+	debugfs_create_u32("order", 0600, dir, &order);
+	debugfs_create_u32("split_order", 0600, dir, &split_order);
+	debugfs_create_u32("free_percent", 0600, dir, &free_percent);
+	debugfs_create_u32("movable_percent", 0600, dir, &movable_percent);
+	debugfs_create_u32("max_mib", 0600, dir, &max_mib);
+	debugfs_create_file("pattern", 0600, dir, NULL, &pattern_fops);
+	debugfs_create_file("control", 0600, dir, NULL, &control_fops);
+
+	return 0;
+}
+
+static void __exit fraggen_exit(void)
+{
+	debugfs_remove_recursive(dir);
+
+	mutex_lock(&lock);
+	release_blocks();
+	mutex_unlock(&lock);
+}
+
+module_init(fraggen_init);
+module_exit(fraggen_exit);
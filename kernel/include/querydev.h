@@ -0,0 +1,262 @@
+#pragma once
+
+// Common plumbing for our misc devices which answer queries: write one or
+// more queries (PFNs, addresses, ...) separated by whitespace or commas, then
+// read back one line of answer per query in the same order. Failed queries
+// answer "error=<errno>" so the rest of a batch still gets through.
+//
+// Each open file gets its own output buffer and lock, so several monitoring
+// threads can each open the device and query at once without clobbering each
+// other's results. A file also pins the opener's mm_struct (not its address
+// space), for queries about the opener's VMAs.
+//
+// Header-only so each module can just include it. Usage:
+//
+//	static int foo_query(struct querydev_file *qf, const char *query,
+//			     struct seq_buf *out);
+//
+//	static struct querydev foo_dev = {
+//		.name = "foo",
+//		.query = foo_query,
+//	};
+//
+//	querydev_register(&foo_dev) / querydev_deregister(&foo_dev)
+
+#include <linux/fs.h>
+#include <linux/err.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mm_types.h>
+#include <linux/mmap_lock.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sched/mm.h>
+#include <linux/seq_buf.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+// Largest batch of queries accepted in a single write.
+#define QUERYDEV_MAX_INPUT (64 * 1024)
+// Room for the answers to a batch.
+#define QUERYDEV_MAX_OUTPUT (256 * 1024)
+
+struct querydev_file;
+
+struct querydev {
+	const char *name;
+
+	// Answer a single query by printing one line, without the newline, to
+	// out. Return a negative errno to answer with an error instead. Called
+	// with qf->lock held.
+	int (*query)(struct querydev_file *qf, const char *query,
+		     struct seq_buf *out);
+
+	// Optional. Set up and tear down qf->private.
+	int (*open)(struct querydev_file *qf);
+	void (*release)(struct querydev_file *qf);
+
+	// Optional. Replaces the default read of the answers, for devices with
+	// another output mode. Called with qf->lock held, may use
+	// querydev_read_answers() for the default behaviour.
+	ssize_t (*read)(struct querydev_file *qf, char __user *out, size_t size,
+			loff_t *off);
+
+	struct miscdevice misc;
+};
+
+// Per-open state.
+struct querydev_file {
+	struct querydev *dev;
+	struct mutex lock;
+	// The opener's mm, or NULL for kernel threads. Use mmget_not_zero()
+	// before looking at its VMAs.
+	struct mm_struct *mm;
+
+	char *output;
+	size_t output_len;
+
+	void *private;
+};
+
+static inline ssize_t querydev_read_answers(struct querydev_file *qf,
+					    char __user *out, size_t size,
+					    loff_t *off)
+{
+	return simple_read_from_buffer(out, size, off, qf->output,
+				       qf->output_len);
+}
+
+// Find the opener's VMA containing addr. On success the mm is held and read
+// locked until querydev_unlock_vma(), otherwise returns an ERR_PTR().
+static inline struct vm_area_struct *querydev_lock_vma(struct querydev_file *qf,
+						       unsigned long addr)
+{
+	struct mm_struct *mm = qf->mm;
+	struct vm_area_struct *vma;
+
+	if (mm == NULL || !mmget_not_zero(mm))
+		return ERR_PTR(-ESRCH);
+
+	if (mmap_read_lock_killable(mm)) {
+		mmput(mm);
+		return ERR_PTR(-EINTR);
+	}
+
+	vma = find_vma(mm, addr);
+	if (vma == NULL || addr < vma->vm_start) {
+		mmap_read_unlock(mm);
+		mmput(mm);
+		return ERR_PTR(-ENXIO);
+	}
+
+	return vma;
+}
+
+static inline void querydev_unlock_vma(struct querydev_file *qf)
+{
+	mmap_read_unlock(qf->mm);
+	mmput(qf->mm);
+}
+
+static int querydev_open_(struct inode *inode, struct file *file)
+{
+	// misc_open() points private_data at our miscdevice.
+	struct miscdevice *misc = file->private_data;
+	struct querydev *dev = container_of(misc, struct querydev, misc);
+	struct querydev_file *qf;
+	int err;
+
+	qf = kzalloc(sizeof(*qf), GFP_KERNEL);
+	if (qf == NULL)
+		return -ENOMEM;
+
+	qf->output = kvmalloc(QUERYDEV_MAX_OUTPUT, GFP_KERNEL);
+	if (qf->output == NULL) {
+		kfree(qf);
+		return -ENOMEM;
+	}
+
+	qf->dev = dev;
+	mutex_init(&qf->lock);
+	if (current->mm != NULL) {
+		qf->mm = current->mm;
+		mmgrab(qf->mm);
+	}
+
+	if (dev->open != NULL) {
+		err = dev->open(qf);
+		if (err) {
+			if (qf->mm != NULL)
+				mmdrop(qf->mm);
+			kvfree(qf->output);
+			kfree(qf);
+			return err;
+		}
+	}
+
+	file->private_data = qf;
+	return 0;
+}
+
+static int querydev_release_(struct inode *inode, struct file *file)
+{
+	struct querydev_file *qf = file->private_data;
+
+	if (qf->dev->release != NULL)
+		qf->dev->release(qf);
+	if (qf->mm != NULL)
+		mmdrop(qf->mm);
+	kvfree(qf->output);
+	kfree(qf);
+	return 0;
+}
+
+static ssize_t querydev_read_(struct file *file, char __user *out,
+			      size_t size, loff_t *off)
+{
+	struct querydev_file *qf = file->private_data;
+	ssize_t ret;
+
+	mutex_lock(&qf->lock);
+	if (qf->dev->read != NULL)
+		ret = qf->dev->read(qf, out, size, off);
+	else
+		ret = querydev_read_answers(qf, out, size, off);
+	mutex_unlock(&qf->lock);
+
+	return ret;
+}
+
+static ssize_t querydev_write_(struct file *file, const char __user *in,
+			       size_t size, loff_t *off)
+{
+	struct querydev_file *qf = file->private_data;
+	char *input, *cursor, *query;
+	struct seq_buf out;
+	ssize_t ret = size;
+
+	if (size == 0 || size > QUERYDEV_MAX_INPUT)
+		return -EINVAL;
+
+	input = memdup_user_nul(in, size);
+	if (IS_ERR(input))
+		return PTR_ERR(input);
+
+	mutex_lock(&qf->lock);
+
+	seq_buf_init(&out, qf->output, QUERYDEV_MAX_OUTPUT);
+	cursor = input;
+	while ((query = strsep(&cursor, " \t\n,")) != NULL) {
+		size_t before = seq_buf_used(&out);
+		int err;
+
+		if (*query == '\0')
+			continue;
+
+		err = qf->dev->query(qf, query, &out);
+		if (err) {
+			// Discard any partial answer.
+			out.len = before;
+			seq_buf_printf(&out, "error=%d", err);
+		}
+		seq_buf_putc(&out, '\n');
+
+		if (seq_buf_has_overflowed(&out)) {
+			ret = -ENOSPC;
+			break;
+		}
+	}
+
+	qf->output_len = ret < 0 ? 0 : seq_buf_used(&out);
+	mutex_unlock(&qf->lock);
+
+	kfree(input);
+
+	// Reads start from the first answer.
+	*off = 0;
+	return ret;
+}
+
+static const struct file_operations querydev_fops = {
+	.owner = THIS_MODULE,
+	.open = querydev_open_,
+	.release = querydev_release_,
+	.read = querydev_read_,
+	.write = querydev_write_,
+	.llseek = default_llseek,
+};
+
+static inline int querydev_register(struct querydev *dev)
+{
+	dev->misc.minor = MISC_DYNAMIC_MINOR;
+	dev->misc.name = dev->name;
+	dev->misc.fops = &querydev_fops;
+
+	return misc_register(&dev->misc);
+}
+
+static inline void querydev_deregister(struct querydev *dev)
+{
+	misc_deregister(&dev->misc);
+}
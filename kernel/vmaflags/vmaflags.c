@@ -1,7 +1,6 @@
 #include <linux/fs.h>
 #include <linux/gfp.h>
 #include <linux/init.h>
-#include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/module.h>
@@ -10,71 +9,45 @@
 #include <linux/pageblock-flags.h>
 #include <linux/percpu-defs.h>
 
+#include "querydev.h"
+
 MODULE_AUTHOR("Lorenzo Stoakes <lstoakes@gmail.com>");
 MODULE_DESCRIPTION("VMA info");
 MODULE_LICENSE("GPL");
 
-static char output_buf[4096] = "";
-static int output_buf_size = 1;
-
-static ssize_t vmaflags_read_(struct file *file, char __user *out,
-			      size_t size, loff_t *off)
-{
-	return simple_read_from_buffer(out, size, off, output_buf,
-				       output_buf_size);
-}
-
-static ssize_t vmaflags_write_(struct file *file, const char __user *in,
-			       size_t size, loff_t *off)
+// Answer the flags of the opener's VMA containing the address in query.
+static int vmaflags_query(struct querydev_file *qf, const char *query,
+			  struct seq_buf *out)
 {
-	char start_buf[255];
-	unsigned long start;
-	ssize_t count;
 	struct vm_area_struct *vma;
+	unsigned long start;
 
-	// We always reset the output buffer.
-	output_buf[0] = '\0';
-	output_buf_size = 1;
-
-	count = simple_write_to_buffer(start_buf, sizeof(start_buf) - 1, off, in, size);
-	if (count <= 0)
-		return -EINVAL;
-	start_buf[count] = '\0';
-
-	if (sscanf(start_buf, "%lu", &start) != 1)
+	if (kstrtoul(query, 10, &start))
 		return -EINVAL;
 
-	vma = find_vma(current->mm, start);
-	if (vma == NULL || start < vma->vm_start)
-		return -ENXIO;
+	vma = querydev_lock_vma(qf, start);
+	if (IS_ERR(vma))
+		return PTR_ERR(vma);
 
-	output_buf_size += snprintf(output_buf, 4096 - output_buf_size,
-				    "%lx", vma->vm_flags);
+	seq_buf_printf(out, "%lx", (unsigned long)vma->vm_flags);
 
-	*off = size;
-	return size;
+	querydev_unlock_vma(qf);
+	return 0;
 }
 
-static const struct file_operations vmaflags_fops = {
-	.owner = THIS_MODULE,
-	.read = vmaflags_read_,
-	.write = vmaflags_write_
-};
-
-static struct miscdevice vmaflags_dev = {
-	.minor = MISC_DYNAMIC_MINOR,
+static struct querydev vmaflags_dev = {
 	.name = "vmaflags",
-	.fops = &vmaflags_fops
+	.query = vmaflags_query,
 };
 
 static int __init vmaflags_init(void)
 {
-	return misc_register(&vmaflags_dev);
+	return querydev_register(&vmaflags_dev);
 }
 
 static void __exit vmaflags_exit(void)
 {
-	misc_deregister(&vmaflags_dev);
+	querydev_deregister(&vmaflags_dev);
 }
 
 module_init(vmaflags_init);
@@ -1,81 +1,230 @@
 #include <linux/fs.h>
 #include <linux/gfp.h>
 #include <linux/init.h>
-#include <linux/miscdevice.h>
+#include <linux/kdev_t.h>
 #include <linux/mm.h>
 #include <linux/mm_types.h>
+#include <linux/mmap_lock.h>
 #include <linux/module.h>
 #include <linux/page_ref.h>
 #include <linux/page-flags.h>
 #include <linux/pageblock-flags.h>
 #include <linux/percpu-defs.h>
+#include <linux/random.h>
+#include <linux/sched/mm.h>
+#include <linux/siphash.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "querydev.h"
+#include "vmainfo.h"
 
 MODULE_AUTHOR("Lorenzo Stoakes <lstoakes@gmail.com>");
 MODULE_DESCRIPTION("VMA info");
 MODULE_LICENSE("GPL");
 
-static char output_buf[4096] = "";
-static int output_buf_size = 1;
+// Records gathered per mmap lock hold in bulk mode, we drop the lock to copy
+// each batch out so we never fault on the user buffer while holding it.
+#define BULK_BATCH (4096)
+
+// Per-open bulk mode state, querydev handles the rest.
+struct vmainfo_state {
+	bool bulk;
+	unsigned long next_addr;
+	struct vmainfo_record *records;
+};
+
+// Keys the anon_vma ids we hand out, so they don't leak kernel addresses.
+static siphash_key_t anon_vma_key;
+
+static u64 anon_vma_id(const struct anon_vma *anon_vma)
+{
+	u64 id;
+
+	if (anon_vma == NULL)
+		return 0;
+
+	id = siphash_1u64((u64)(unsigned long)anon_vma, &anon_vma_key);
+	// 0 means none.
+	return id ?: 1;
+}
 
-static ssize_t vmainfo_read_(struct file *file, char __user *out,
-			      size_t size, loff_t *off)
+static void fill_record(struct vm_area_struct *vma, struct vmainfo_record *rec)
 {
-	return simple_read_from_buffer(out, size, off, output_buf,
-				       output_buf_size);
+	struct file *file = vma->vm_file;
+
+	rec->start = vma->vm_start;
+	rec->end = vma->vm_end;
+	rec->flags = vma->vm_flags;
+	rec->pgoff = vma->vm_pgoff;
+	rec->anon_vma = anon_vma_id(vma->anon_vma);
+	rec->ino = file ? file_inode(file)->i_ino : 0;
+	rec->dev = file ? new_encode_dev(file_inode(file)->i_sb->s_dev) : 0;
+	rec->pad = 0;
 }
 
-static ssize_t vmainfo_write_(struct file *file, const char __user *in,
-			       size_t size, loff_t *off)
+// Gather up to max records from state->next_addr onwards. Returns the number
+// gathered, or a negative error.
+static long gather_records(struct mm_struct *mm, struct vmainfo_state *state,
+			   size_t max)
 {
-	char start_buf[255];
-	unsigned long start;
-	ssize_t count;
 	struct vm_area_struct *vma;
+	long count = 0;
+	int err;
+
+	VMA_ITERATOR(vmi, mm, state->next_addr);
 
-	// We always reset the output buffer.
-	output_buf[0] = '\0';
-	output_buf_size = 1;
+	err = mmap_read_lock_killable(mm);
+	if (err)
+		return err;
 
-	count = simple_write_to_buffer(start_buf, sizeof(start_buf) - 1, off, in, size);
-	if (count <= 0)
+	for_each_vma(vmi, vma) {
+		if (count == max)
+			break;
+
+		fill_record(vma, &state->records[count++]);
+		state->next_addr = vma->vm_end;
+	}
+
+	mmap_read_unlock(mm);
+	return count;
+}
+
+static ssize_t read_bulk(struct querydev_file *qf, char __user *out,
+			 size_t size, loff_t *off)
+{
+	const size_t max = size / sizeof(struct vmainfo_record);
+	struct vmainfo_state *state = qf->private;
+	ssize_t copied = 0;
+
+	if (max == 0)
 		return -EINVAL;
-	start_buf[count] = '\0';
 
-	if (sscanf(start_buf, "%lu", &start) != 1)
+	if (*off == 0)
+		state->next_addr = 0;
+
+	if (qf->mm == NULL || !mmget_not_zero(qf->mm))
+		return 0;
+
+	while (copied / sizeof(struct vmainfo_record) < max) {
+		const size_t remaining = max - copied / sizeof(struct vmainfo_record);
+		long count = gather_records(qf->mm, state,
+					    min_t(size_t, remaining, BULK_BATCH));
+		size_t bytes;
+
+		if (count <= 0) {
+			if (count < 0 && copied == 0)
+				copied = count;
+			break;
+		}
+
+		bytes = count * sizeof(struct vmainfo_record);
+		if (copy_to_user(out + copied, state->records, bytes)) {
+			if (copied == 0)
+				copied = -EFAULT;
+			break;
+		}
+		copied += bytes;
+
+		if (fatal_signal_pending(current))
+			break;
+	}
+
+	mmput(qf->mm);
+
+	if (copied > 0)
+		*off += copied;
+	return copied;
+}
+
+static ssize_t vmainfo_read(struct querydev_file *qf, char __user *out,
+			    size_t size, loff_t *off)
+{
+	struct vmainfo_state *state = qf->private;
+
+	if (state->bulk)
+		return read_bulk(qf, out, size, off);
+
+	return querydev_read_answers(qf, out, size, off);
+}
+
+// A query of VMAINFO_BULK_CMD switches to bulk mode, any other is an address
+// whose VMA we describe, switching back to text answers.
+static int vmainfo_query(struct querydev_file *qf, const char *query,
+			 struct seq_buf *out)
+{
+	struct vmainfo_state *state = qf->private;
+	struct vm_area_struct *vma;
+	unsigned long start;
+
+	if (!strcmp(query, VMAINFO_BULK_CMD)) {
+		state->bulk = true;
+		state->next_addr = 0;
+		seq_buf_puts(out, VMAINFO_BULK_CMD);
+		return 0;
+	}
+
+	state->bulk = false;
+
+	if (kstrtoul(query, 10, &start))
 		return -EINVAL;
 
-	vma = find_vma(current->mm, start);
-	if (vma == NULL || start < vma->vm_start)
-		return -ENXIO;
+	vma = querydev_lock_vma(qf, start);
+	if (IS_ERR(vma))
+		return PTR_ERR(vma);
 
-	output_buf_size += snprintf(output_buf, 4096 - output_buf_size,
-				    "start=%lx, end=%lx, flags=%lx",
-				    vma->vm_start, vma->vm_end, vma->vm_flags);
+	seq_buf_printf(out, "start=%lx, end=%lx, flags=%lx",
+		       vma->vm_start, vma->vm_end,
+		       (unsigned long)vma->vm_flags);
 
-	*off = size;
-	return size;
+	querydev_unlock_vma(qf);
+	return 0;
 }
 
-static const struct file_operations vmainfo_fops = {
-	.owner = THIS_MODULE,
-	.read = vmainfo_read_,
-	.write = vmainfo_write_
-};
+static int vmainfo_open(struct querydev_file *qf)
+{
+	struct vmainfo_state *state;
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (state == NULL)
+		return -ENOMEM;
+
+	state->records = kvmalloc_array(BULK_BATCH, sizeof(struct vmainfo_record),
+					GFP_KERNEL);
+	if (state->records == NULL) {
+		kfree(state);
+		return -ENOMEM;
+	}
+
+	qf->private = state;
+	return 0;
+}
+
+static void vmainfo_release(struct querydev_file *qf)
+{
+	struct vmainfo_state *state = qf->private;
+
+	kvfree(state->records);
+	kfree(state);
+}
 
-static struct miscdevice vmainfo_dev = {
-	.minor = MISC_DYNAMIC_MINOR,
+static struct querydev vmainfo_dev = {
 	.name = "vmainfo",
-	.fops = &vmainfo_fops
+	.query = vmainfo_query,
+	.open = vmainfo_open,
+	.release = vmainfo_release,
+	.read = vmainfo_read,
 };
 
 static int __init vmainfo_init(void)
 {
-	return misc_register(&vmainfo_dev);
+	get_random_bytes(&anon_vma_key, sizeof(anon_vma_key));
+	return querydev_register(&vmainfo_dev);
 }
 
 static void __exit vmainfo_exit(void)
 {
-	misc_deregister(&vmainfo_dev);
+	querydev_deregister(&vmainfo_dev);
 }
 
 module_init(vmainfo_init);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <linux/types.h>
+
+// Shared between the module and userspace readers of /dev/vmainfo.
+//
+// Writing "bulk" to an open /dev/vmainfo switches that fd to bulk mode, in
+// which read() returns as many whole struct vmainfo_record entries as fit in
+// the buffer, walking every VMA of the mm which opened the device in address
+// order. Reading at offset 0 (e.g. after lseek(fd, 0, SEEK_SET)) starts over.
+//
+// Writing addresses instead (several may be written at once, separated by
+// whitespace or commas) looks up the VMA containing each, reading back a line
+// of text per address.
+
+#define VMAINFO_BULK_CMD "bulk"
+
+struct vmainfo_record {
+	__u64 start, end;
+	__u64 flags;
+	__u64 pgoff;
+	// Opaque id of the anon_vma, 0 if none, so VMAs sharing one can be
+	// matched. Ids are stable until the module is reloaded.
+	__u64 anon_vma;
+	// Backing file, or 0 for anonymous memory.
+	__u64 ino;
+	__u32 dev;
+	__u32 pad;
+};
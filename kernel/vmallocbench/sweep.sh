@@ -0,0 +1,44 @@
+#!/bin/bash
+# Run vmallocbench across allocation sizes, thread counts and vmalloc vs
+# vmalloc_huge(), first unfragmented then pre-fragmented, printing one
+# results block per combination. Needs root and the module loaded.
+#
+#   ./sweep.sh [fragment MiB] [iterations]
+
+set -e
+
+dir=/sys/kernel/debug/vmallocbench
+frag_mib=${1:-1024}
+iterations=${2:-1000}
+sizes="4 64 1024 2048 8192"
+ncpus=$(nproc)
+threads="1 $((ncpus > 1 ? ncpus / 2 : 1)) $ncpus $((ncpus * 2))"
+
+if [ ! -w $dir/control ]; then
+	echo "vmallocbench not loaded (or debugfs not mounted)" >&2
+	exit 1
+fi
+
+sweep() {
+	local kib nr huge
+
+	for huge in 0 1; do
+		for kib in $sizes; do
+			for nr in $(echo $threads | tr ' ' '\n' | sort -nu); do
+				echo $huge > $dir/huge
+				echo $kib > $dir/kib
+				echo $nr > $dir/threads
+				echo $iterations > $dir/iterations
+				echo run > $dir/control
+				cat $dir/results
+			done
+		done
+	done
+}
+
+echo release > $dir/control
+sweep
+
+echo "fragment $frag_mib" > $dir/control
+sweep
+echo release > $dir/control
@@ -0,0 +1,475 @@
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+MODULE_AUTHOR("Lorenzo Stoakes <lstoakes@gmail.com>");
+MODULE_DESCRIPTION("vmalloc/vfree latency benchmark");
+MODULE_LICENSE("GPL");
+
+/*
+ * Where fragment just checks whether vmalloc_huge() works once memory is
+ * fragmented, this times vmalloc() (or vmalloc_huge()) and vfree() from a
+ * number of kthreads started together, so they contend on the vmap_area
+ * locks, and records per-call latency histograms. Controlled via
+ * /sys/kernel/debug/vmallocbench/:
+ *
+ *   threads    - kthreads to run, bound round-robin to online CPUs
+ *                (default: one per online CPU).
+ *   kib        - size of each allocation.
+ *   iterations - allocations per thread.
+ *   batch      - allocations each thread holds before freeing them, so
+ *                larger values keep more vmap areas live (default 1).
+ *   huge       - non-zero to use vmalloc_huge().
+ *
+ *   control    - write "run" to benchmark with the above, "fragment <MiB>" to
+ *                pre-fragment by grabbing order-9 blocks and freeing every
+ *                other page of each, or "release" to free those again.
+ *   results    - percentiles of the last run.
+ *   histogram  - the full histograms of the last run, "op lower_ns count"
+ *                per non-empty bucket.
+ *
+ * See sweep.sh for running this across sizes, thread counts and
+ * fragmentation states. fraggen can be used for finer-grained fragmentation.
+ */
+
+/*
+ * Log-linear histogram: exact below HIST_SUB ns, above that each power of two
+ * is split into HIST_SUB buckets, so percentiles are within ~6%.
+ */
+#define HIST_SUB_BITS (4)
+#define HIST_SUB (1U << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define FRAG_ORDER (9)
+
+enum op {
+	OP_VMALLOC,
+	OP_VFREE,
+	NUM_OPS
+};
+
+static const char *const op_names[] = { "vmalloc", "vfree" };
+
+struct hist {
+	u64 buckets[HIST_BUCKETS];
+	u64 count, failed, total_ns, min_ns, max_ns;
+};
+
+struct worker {
+	struct task_struct *task;
+	struct completion done;
+	unsigned int cpu;
+	void **ptrs;
+	// Kept per thread so recording doesn't add contention of its own.
+	struct hist hists[NUM_OPS];
+};
+
+static DEFINE_MUTEX(lock);
+static DECLARE_WAIT_QUEUE_HEAD(start_wq);
+static bool started;
+static struct dentry *dir;
+
+// Parameters, which take effect at the next run.
+static u32 threads;
+static u32 kib = 64;
+static u32 iterations = 1000;
+static u32 batch = 1;
+static u32 huge;
+
+// Pages held by "fragment", chained through the first page of each block.
+static LIST_HEAD(frag_blocks);
+static unsigned long frag_pages;
+
+// The results of the last run.
+static struct {
+	bool valid;
+	u32 threads, kib, iterations, batch, huge;
+	unsigned long frag_pages;
+	u64 elapsed_ns;
+	struct hist hists[NUM_OPS];
+} results;
+
+static unsigned int hist_bucket(u64 ns)
+{
+	unsigned int msb;
+
+	if (ns < HIST_SUB)
+		return ns;
+
+	msb = fls64(ns) - 1;
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static u64 hist_bucket_lower(unsigned int bucket)
+{
+	unsigned int msb;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+
+	msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	return (u64)(HIST_SUB + bucket % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+static void hist_record(struct hist *hist, u64 ns)
+{
+	hist->buckets[hist_bucket(ns)]++;
+	hist->total_ns += ns;
+	if (hist->count == 0 || ns < hist->min_ns)
+		hist->min_ns = ns;
+	hist->max_ns = max(hist->max_ns, ns);
+	hist->count++;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+	unsigned int i;
+
+	if (from->count == 0) {
+		to->failed += from->failed;
+		return;
+	}
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+
+	if (to->count == 0 || from->min_ns < to->min_ns)
+		to->min_ns = from->min_ns;
+	to->max_ns = max(to->max_ns, from->max_ns);
+	to->total_ns += from->total_ns;
+	to->count += from->count;
+	to->failed += from->failed;
+}
+
+// The lower bound of the bucket holding the permille'th value.
+static u64 hist_percentile(const struct hist *hist, unsigned int permille)
+{
+	const u64 target = div_u64(hist->count * permille + 999, 1000);
+	u64 seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target && seen > 0)
+			return hist_bucket_lower(i);
+	}
+
+	return 0;
+}
+
+static int worker_fn(void *data)
+{
+	struct worker *worker = data;
+	const unsigned long size = (unsigned long)results.kib << 10;
+	u32 remaining = results.iterations;
+
+	wait_event(start_wq, READ_ONCE(started));
+
+	while (remaining > 0) {
+		const u32 nr = min(remaining, results.batch);
+		u32 i;
+
+		for (i = 0; i < nr; i++) {
+			const u64 start = ktime_get_ns();
+			void *ptr;
+
+			if (results.huge)
+				ptr = vmalloc_huge(size, GFP_KERNEL | __GFP_NOWARN);
+			else
+				ptr = vmalloc(size);
+
+			worker->ptrs[i] = ptr;
+			if (ptr != NULL)
+				hist_record(&worker->hists[OP_VMALLOC],
+					    ktime_get_ns() - start);
+			else
+				worker->hists[OP_VMALLOC].failed++;
+		}
+
+		for (i = 0; i < nr; i++) {
+			u64 start;
+
+			if (worker->ptrs[i] == NULL)
+				continue;
+
+			start = ktime_get_ns();
+			vfree(worker->ptrs[i]);
+			hist_record(&worker->hists[OP_VFREE], ktime_get_ns() - start);
+		}
+
+		remaining -= nr;
+		cond_resched();
+	}
+
+	// We may be the last thing running module code, see kthread.h.
+	kthread_complete_and_exit(&worker->done, 0);
+}
+
+static int run(void)
+{
+	struct worker *workers;
+	unsigned int cpu = cpumask_first(cpu_online_mask);
+	u32 i, created;
+	u64 start;
+	int ret = 0;
+
+	memset(&results, 0, sizeof(results));
+	results.threads = threads ?: num_online_cpus();
+	results.kib = kib;
+	results.iterations = iterations;
+	results.batch = batch;
+	results.huge = huge;
+	results.frag_pages = frag_pages;
+
+	if (results.kib == 0 || results.iterations == 0 || results.batch == 0)
+		return -EINVAL;
+
+	workers = kvcalloc(results.threads, sizeof(*workers), GFP_KERNEL);
+	if (workers == NULL)
+		return -ENOMEM;
+
+	WRITE_ONCE(started, false);
+
+	for (created = 0; created < results.threads; created++) {
+		struct worker *worker = &workers[created];
+
+		worker->ptrs = kvcalloc(results.batch, sizeof(*worker->ptrs),
+					GFP_KERNEL);
+		if (worker->ptrs == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		init_completion(&worker->done);
+		worker->cpu = cpu;
+		worker->task = kthread_create_on_node(worker_fn, worker,
+						      cpu_to_node(cpu),
+						      "vmallocbench/%u", created);
+		if (IS_ERR(worker->task)) {
+			ret = PTR_ERR(worker->task);
+			kvfree(worker->ptrs);
+			break;
+		}
+		kthread_bind(worker->task, cpu);
+		wake_up_process(worker->task);
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	/*
+	 * Even on failure, release whoever we did create so they can exit - an
+	 * error just means their results are discarded.
+	 */
+	start = ktime_get_ns();
+	WRITE_ONCE(started, true);
+	wake_up_all(&start_wq);
+
+	for (i = 0; i < created; i++) {
+		unsigned int op;
+
+		wait_for_completion(&workers[i].done);
+		for (op = 0; op < NUM_OPS; op++)
+			hist_merge(&results.hists[op], &workers[i].hists[op]);
+		kvfree(workers[i].ptrs);
+	}
+
+	results.elapsed_ns = ktime_get_ns() - start;
+	results.valid = ret == 0;
+	kvfree(workers);
+
+	return ret;
+}
+
+static void release_fragments(void)
+{
+	struct page *page, *tmp;
+	unsigned long i;
+
+	list_for_each_entry_safe(page, tmp, &frag_blocks, lru) {
+		list_del(&page->lru);
+		// We held the even pages of each block.
+		for (i = 0; i < (1UL << FRAG_ORDER); i += 2)
+			__free_page(&page[i]);
+		cond_resched();
+	}
+
+	frag_pages = 0;
+}
+
+/*
+ * As fragment does but holding every other page, so nothing of order 1 or
+ * above is left behind in the blocks we grab.
+ */
+static int fragment(u32 mib)
+{
+	const unsigned long max_blocks =
+		((unsigned long)mib << (20 - PAGE_SHIFT)) >> FRAG_ORDER;
+	unsigned long blocks, i;
+
+	release_fragments();
+
+	for (blocks = 0; blocks < max_blocks; blocks++) {
+		struct page *page = alloc_pages(GFP_KERNEL | __GFP_NOWARN |
+						__GFP_NORETRY, FRAG_ORDER);
+
+		if (page == NULL)
+			break;
+
+		split_page(page, FRAG_ORDER);
+		for (i = 1; i < (1UL << FRAG_ORDER); i += 2)
+			__free_page(&page[i]);
+
+		// The first page is held, so its lru is ours to use.
+		list_add_tail(&page->lru, &frag_blocks);
+		frag_pages += 1UL << (FRAG_ORDER - 1);
+
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+
+	pr_info("vmallocbench: fragmented %lu order-%d blocks, holding %lu MiB\n",
+		blocks, FRAG_ORDER, frag_pages >> (20 - PAGE_SHIFT));
+
+	return 0;
+}
+
+static ssize_t control_write(struct file *file, const char __user *in,
+			     size_t size, loff_t *off)
+{
+	char buf[64];
+	ssize_t ret;
+	u32 mib;
+
+	if (size >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, in, size))
+		return -EFAULT;
+	buf[size] = '\0';
+
+	mutex_lock(&lock);
+
+	if (sysfs_streq(buf, "run")) {
+		ret = run();
+	} else if (sscanf(buf, "fragment %u", &mib) == 1) {
+		ret = fragment(mib);
+	} else if (sysfs_streq(buf, "release")) {
+		release_fragments();
+		ret = 0;
+	} else {
+		ret = -EINVAL;
+	}
+
+	mutex_unlock(&lock);
+
+	return ret ? ret : size;
+}
+
+static const struct file_operations control_fops = {
+	.owner = THIS_MODULE,
+	.write = control_write,
+	.llseek = noop_llseek,
+};
+
+static int results_show(struct seq_file *m, void *v)
+{
+	unsigned int op;
+
+	mutex_lock(&lock);
+
+	if (!results.valid) {
+		mutex_unlock(&lock);
+		return 0;
+	}
+
+	seq_printf(m, "threads=%u kib=%u iterations=%u batch=%u huge=%u frag_mib=%lu elapsed_ns=%llu\n",
+		   results.threads, results.kib, results.iterations,
+		   results.batch, results.huge,
+		   results.frag_pages >> (20 - PAGE_SHIFT), results.elapsed_ns);
+
+	for (op = 0; op < NUM_OPS; op++) {
+		const struct hist *hist = &results.hists[op];
+
+		seq_printf(m, "op=%s count=%llu failed=%llu ops_per_sec=%llu mean_ns=%llu min_ns=%llu p50_ns=%llu p90_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu\n",
+			   op_names[op], hist->count, hist->failed,
+			   results.elapsed_ns ?
+			   div64_u64(hist->count * NSEC_PER_SEC, results.elapsed_ns) : 0,
+			   hist->count ? div64_u64(hist->total_ns, hist->count) : 0,
+			   hist->min_ns, hist_percentile(hist, 500),
+			   hist_percentile(hist, 900), hist_percentile(hist, 990),
+			   hist_percentile(hist, 999), hist->max_ns);
+	}
+
+	mutex_unlock(&lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+static int histogram_show(struct seq_file *m, void *v)
+{
+	unsigned int op, i;
+
+	mutex_lock(&lock);
+
+	for (op = 0; results.valid && op < NUM_OPS; op++) {
+		const struct hist *hist = &results.hists[op];
+
+		for (i = 0; i < HIST_BUCKETS; i++) {
+			if (hist->buckets[i] > 0)
+				seq_printf(m, "%s %llu %llu\n", op_names[op],
+					   hist_bucket_lower(i), hist->buckets[i]);
+		}
+	}
+
+	mutex_unlock(&lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(histogram);
+
+static int __init vmallocbench_init(void)
+{
+	dir = debugfs_create_dir("vmallocbench", NULL);
+
+	debugfs_create_u32("threads", 0600, dir, &threads);
+	debugfs_create_u32("kib", 0600, dir, &kib);
+	debugfs_create_u32("iterations", 0600, dir, &iterations);
+	debugfs_create_u32("batch", 0600, dir, &batch);
+	debugfs_create_u32("huge", 0600, dir, &huge);
+	debugfs_create_file("control", 0200, dir, NULL, &control_fops);
+	debugfs_create_file("results", 0400, dir, NULL, &results_fops);
+	debugfs_create_file("histogram", 0400, dir, NULL, &histogram_fops);
+
+	return 0;
+}
+
+static void __exit vmallocbench_exit(void)
+{
+	debugfs_remove_recursive(dir);
+
+	mutex_lock(&lock);
+	release_fragments();
+	mutex_unlock(&lock);
+}
+
+module_init(vmallocbench_init);
+module_exit(vmallocbench_exit);
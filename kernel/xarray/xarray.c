@@ -1,3 +1,5 @@
+#include <linux/file.h>
+#include <linux/fs.h>
 #include <linux/gfp.h>
 #include <linux/init.h>
 #include <linux/mm.h>
@@ -5,10 +7,14 @@
 #include <linux/module.h>
 #include <linux/page_ref.h>
 #include <linux/page-flags.h>
+#include <linux/namei.h>
 #include <linux/pageblock-flags.h>
 #include <linux/percpu-defs.h>
+#include <linux/rcupdate.h>
 #include <linux/xarray.h>
 
+#include "querydev.h"
+
 MODULE_AUTHOR("Lorenzo Stoakes <lstoakes@gmail.com>");
 MODULE_DESCRIPTION("Experiments");
 MODULE_LICENSE("GPL");
@@ -68,6 +74,200 @@ static void examine_xa(void)
 	pr_err("IVG: Unrecognised head value %lu?\n", (unsigned long)xa.xa_head);
 }
 
+// The profiler, /dev/xaprof. Each query names an xarray:
+//
+//   demo       - the xarray populated above.
+//   fd:N       - the page cache (i_mapping->i_pages) of the querier's fd N.
+//   /some/path - the page cache of the file at that path.
+//
+// and is answered with a line of statistics: the node count, node memory per
+// entry, average and maximum pointer-chase depth from the head to an entry,
+// and for each shift level the nodes at that level, their average fill and a
+// histogram of slots used per node.
+//
+// The walk is done under RCU, as lookups are, so a concurrently modified
+// xarray gives approximate results rather than failing.
+
+// Slot fill histogram buckets, each covering XA_CHUNK_SIZE / FILL_BUCKETS
+// slots.
+#define FILL_BUCKETS (8)
+#define MAX_LEVELS (BITS_PER_LONG / XA_CHUNK_SHIFT + 1)
+
+struct xa_profile {
+	unsigned long nodes;
+	// Leaf entries, how many of those are values, and the sibling slots
+	// multi-index entries (e.g. large folios) occupy in addition.
+	unsigned long entries, values, siblings;
+	// Sum over entries of nodes traversed to reach them.
+	unsigned long depth_sum;
+	unsigned int max_depth;
+
+	struct {
+		unsigned long nodes, slots_used;
+		unsigned long fill[FILL_BUCKETS];
+	} levels[MAX_LEVELS];
+};
+
+static void profile_node(struct xa_node *node, unsigned int depth,
+			 struct xa_profile *prof)
+{
+	const unsigned int level = min_t(unsigned int,
+					 node->shift / XA_CHUNK_SHIFT,
+					 MAX_LEVELS - 1);
+	unsigned int i, used = 0;
+
+	prof->nodes++;
+	if (depth > prof->max_depth)
+		prof->max_depth = depth;
+
+	for (i = 0; i < XA_CHUNK_SIZE; i++) {
+		void *entry = rcu_dereference(node->slots[i]);
+
+		if (entry == NULL)
+			continue;
+		used++;
+
+		if (xa_is_sibling(entry)) {
+			prof->siblings++;
+		} else if (xa_is_node(entry)) {
+			profile_node(xa_to_node(entry), depth + 1, prof);
+		} else if (!xa_is_internal(entry)) {
+			// Internal entries left are retry/zero entries, skip.
+			prof->entries++;
+			prof->depth_sum += depth;
+			if (xa_is_value(entry))
+				prof->values++;
+		}
+	}
+
+	prof->levels[level].nodes++;
+	prof->levels[level].slots_used += used;
+	prof->levels[level].fill[used ? (used - 1) * FILL_BUCKETS / XA_CHUNK_SIZE : 0]++;
+}
+
+static void profile_xa(struct xarray *xa, struct xa_profile *prof)
+{
+	void *head;
+
+	memset(prof, 0, sizeof(*prof));
+
+	rcu_read_lock();
+
+	head = rcu_dereference(xa->xa_head);
+	if (xa_is_node(head)) {
+		profile_node(xa_to_node(head), 1, prof);
+	} else if (head != NULL && !xa_is_internal(head)) {
+		// A lone entry at index 0 lives in the head itself.
+		prof->entries = 1;
+		prof->values = xa_is_value(head) ? 1 : 0;
+	}
+
+	rcu_read_unlock();
+}
+
+static void print_profile(const struct xa_profile *prof, struct seq_buf *out)
+{
+	const unsigned long bytes = prof->nodes * sizeof(struct xa_node);
+	int level, i;
+
+	seq_buf_printf(out, "entries=%lu values=%lu siblings=%lu nodes=%lu bytes=%lu",
+		       prof->entries, prof->values, prof->siblings, prof->nodes,
+		       bytes);
+
+	// Fixed point to two places, no floats in the kernel.
+	if (prof->entries > 0) {
+		seq_buf_printf(out, " bytes_per_entry=%lu.%02lu avg_depth=%lu.%02lu",
+			       bytes / prof->entries,
+			       bytes * 100 / prof->entries % 100,
+			       prof->depth_sum / prof->entries,
+			       prof->depth_sum * 100 / prof->entries % 100);
+	}
+	seq_buf_printf(out, " max_depth=%u", prof->max_depth);
+
+	for (level = MAX_LEVELS - 1; level >= 0; level--) {
+		const unsigned long nodes = prof->levels[level].nodes;
+
+		if (nodes == 0)
+			continue;
+
+		seq_buf_printf(out, " shift%d=[nodes=%lu avg_fill=%lu/%d hist=",
+			       level * XA_CHUNK_SHIFT, nodes,
+			       prof->levels[level].slots_used / nodes,
+			       XA_CHUNK_SIZE);
+		for (i = 0; i < FILL_BUCKETS; i++)
+			seq_buf_printf(out, "%s%lu", i ? "," : "",
+				       prof->levels[level].fill[i]);
+		seq_buf_putc(out, ']');
+	}
+}
+
+static int answer(struct xarray *xa, struct seq_buf *out)
+{
+	// Too big for the stack.
+	struct xa_profile *prof = kmalloc(sizeof(*prof), GFP_KERNEL);
+
+	if (prof == NULL)
+		return -ENOMEM;
+
+	profile_xa(xa, prof);
+	print_profile(prof, out);
+
+	kfree(prof);
+	return 0;
+}
+
+static int answer_inode(struct inode *inode, struct seq_buf *out)
+{
+	if (inode->i_mapping == NULL)
+		return -EINVAL;
+
+	return answer(&inode->i_mapping->i_pages, out);
+}
+
+static int xaprof_query(struct querydev_file *qf, const char *query,
+			struct seq_buf *out)
+{
+	unsigned int fd;
+	int err;
+
+	if (!strcmp(query, "demo"))
+		return answer(&xa, out);
+
+	if (!strncmp(query, "fd:", 3)) {
+		struct file *file;
+
+		if (kstrtouint(query + 3, 10, &fd))
+			return -EINVAL;
+
+		file = fget(fd);
+		if (file == NULL)
+			return -EBADF;
+
+		err = answer_inode(file_inode(file), out);
+		fput(file);
+		return err;
+	}
+
+	if (query[0] == '/') {
+		struct path path;
+
+		err = kern_path(query, LOOKUP_FOLLOW, &path);
+		if (err)
+			return err;
+
+		err = answer_inode(d_inode(path.dentry), out);
+		path_put(&path);
+		return err;
+	}
+
+	return -EINVAL;
+}
+
+static struct querydev xaprof_dev = {
+	.name = "xaprof",
+	.query = xaprof_query,
+};
+
 static int __init xarray_init(void)
 {
 #ifdef ADD_SEQUENTIALLY
@@ -124,12 +324,12 @@ static int __init xarray_init(void)
 
 	examine_xa();
 
-	return 0;
+	return querydev_register(&xaprof_dev);
 }
 
 static void __exit xarray_exit(void)
 {
-
+	querydev_deregister(&xaprof_dev);
 }
 
 module_init(xarray_init);
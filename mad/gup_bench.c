@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kernel/gup_bench.h"
+
+// Stress GUP pinning via mad's /dev/gup_bench. Each thread opens the device
+// and pins its slice of a shared mapping with one ioctl per batch, then all
+// unpin together. Rounds report pin/unpin throughput, how much migration
+// pinning caused (FOLL_LONGTERM migrates pages out of ZONE_MOVABLE and CMA
+// first), and optionally how compaction fares with everything pinned.
+
+enum mem_type {
+	MEM_ANON,
+	MEM_SHMEM,
+	MEM_FILE,
+};
+
+struct options {
+	unsigned int threads;
+	uint64_t pages; // Per thread.
+	uint64_t batch;
+	unsigned int rounds;
+	uint32_t flags;
+	enum mem_type type;
+	const char *path;
+	bool no_prefault;
+	bool compact;
+};
+
+struct worker {
+	pthread_t thread;
+	char *ptr;
+	int fd;
+	// Results of the current round.
+	uint64_t pinned, pin_ns, unpinned, unpin_ns;
+	int err;
+};
+
+static const char *const vmstat_names[] = {
+	"pgmigrate_success",
+	"pgmigrate_fail",
+	"compact_stall",
+	"compact_migrate_scanned",
+	"compact_free_scanned",
+	"compact_isolated",
+	"compact_success",
+	"compact_fail",
+};
+#define NUM_VMSTATS (sizeof(vmstat_names) / sizeof(vmstat_names[0]))
+
+static struct options opts;
+static long page_size;
+static pthread_barrier_t barrier;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void read_vmstat(uint64_t *vals)
+{
+	char name[64];
+	uint64_t val;
+	FILE *fp;
+	size_t i;
+
+	memset(vals, 0, NUM_VMSTATS * sizeof(*vals));
+
+	fp = fopen("/proc/vmstat", "r");
+	if (fp == NULL) {
+		perror("/proc/vmstat");
+		exit(EXIT_FAILURE);
+	}
+
+	while (fscanf(fp, "%63s %lu", name, &val) == 2) {
+		for (i = 0; i < NUM_VMSTATS; i++) {
+			if (!strcmp(name, vmstat_names[i]))
+				vals[i] = val;
+		}
+	}
+
+	fclose(fp);
+}
+
+static void print_vmstat_deltas(const char *what, const uint64_t *before,
+				const uint64_t *after)
+{
+	size_t i;
+
+	printf("  %s:", what);
+	for (i = 0; i < NUM_VMSTATS; i++) {
+		if (after[i] != before[i])
+			printf(" %s=%lu", vmstat_names[i], after[i] - before[i]);
+	}
+	printf("\n");
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *worker = arg;
+	struct gup_bench_unpin unpin;
+	unsigned int round;
+	uint64_t done;
+
+	for (round = 0; round < opts.rounds; round++) {
+		worker->pinned = worker->pin_ns = 0;
+		worker->unpinned = worker->unpin_ns = 0;
+		worker->err = 0;
+
+		pthread_barrier_wait(&barrier);
+
+		for (done = 0; done < opts.pages && worker->err == 0;) {
+			struct gup_bench_pin pin = {
+				.uaddr = (uintptr_t)worker->ptr + done * page_size,
+				.nr_pages = opts.pages - done < opts.batch ?
+					opts.pages - done : opts.batch,
+				.flags = opts.flags,
+			};
+
+			if (ioctl(worker->fd, GUP_BENCH_IOC_PIN, &pin)) {
+				worker->err = errno;
+				break;
+			}
+
+			worker->pinned += pin.nr_pinned;
+			worker->pin_ns += pin.elapsed_ns;
+			// Short pins mean GUP failed part way, retrying would
+			// just report why.
+			done += pin.nr_pinned;
+		}
+
+		pthread_barrier_wait(&barrier);
+		// Main thread measures with everything pinned.
+		pthread_barrier_wait(&barrier);
+
+		if (ioctl(worker->fd, GUP_BENCH_IOC_UNPIN, &unpin)) {
+			if (worker->err == 0)
+				worker->err = errno;
+		} else {
+			worker->unpinned = unpin.nr_unpinned;
+			worker->unpin_ns = unpin.elapsed_ns;
+		}
+
+		pthread_barrier_wait(&barrier);
+	}
+
+	return NULL;
+}
+
+static char *map_memory(uint64_t size)
+{
+	int fd = -1, flags = MAP_SHARED;
+	char *ptr;
+
+	switch (opts.type) {
+	case MEM_ANON:
+		flags = MAP_PRIVATE | MAP_ANONYMOUS;
+		break;
+	case MEM_SHMEM:
+		fd = memfd_create("gup_bench", MFD_CLOEXEC);
+		if (fd < 0) {
+			perror("memfd_create");
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case MEM_FILE:
+		fd = open(opts.path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			perror(opts.path);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	}
+
+	if (fd >= 0 && ftruncate(fd, size)) {
+		perror("ftruncate");
+		exit(EXIT_FAILURE);
+	}
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	return ptr;
+}
+
+static void run_round(struct worker *workers, unsigned int round)
+{
+	uint64_t vm_start[NUM_VMSTATS], vm_pinned[NUM_VMSTATS],
+		vm_compacted[NUM_VMSTATS], vm_end[NUM_VMSTATS];
+	uint64_t pinned = 0, pin_ns = 0, unpinned = 0, unpin_ns = 0;
+	uint64_t start, pin_wall, compact_ns = 0, unpin_start, unpin_wall;
+	unsigned int i;
+	int err = 0;
+
+	read_vmstat(vm_start);
+	start = now_ns();
+	pthread_barrier_wait(&barrier);
+	pthread_barrier_wait(&barrier);
+	pin_wall = now_ns() - start;
+	read_vmstat(vm_pinned);
+
+	if (opts.compact) {
+		int fd = open("/proc/sys/vm/compact_memory", O_WRONLY);
+
+		start = now_ns();
+		if (fd < 0 || write(fd, "1", 1) != 1)
+			perror("/proc/sys/vm/compact_memory");
+		compact_ns = now_ns() - start;
+		if (fd >= 0)
+			close(fd);
+	}
+	read_vmstat(vm_compacted);
+
+	unpin_start = now_ns();
+	pthread_barrier_wait(&barrier);
+	pthread_barrier_wait(&barrier);
+	unpin_wall = now_ns() - unpin_start;
+	read_vmstat(vm_end);
+
+	for (i = 0; i < opts.threads; i++) {
+		pinned += workers[i].pinned;
+		pin_ns += workers[i].pin_ns;
+		unpinned += workers[i].unpinned;
+		unpin_ns += workers[i].unpin_ns;
+		if (workers[i].err != 0 && err == 0)
+			err = workers[i].err;
+	}
+
+	printf("round %u: pinned %lu of %lu pages\n", round, pinned,
+	       opts.pages * opts.threads);
+	if (err != 0)
+		printf("  error: %s\n", strerror(err));
+	if (pinned == 0)
+		return;
+
+	printf("  pin:   %.0f pages/s, %.2f GiB/s wall; %.1f ns/page in GUP\n",
+	       pinned * 1e9 / pin_wall,
+	       (double)pinned * page_size / (1UL << 30) * 1e9 / pin_wall,
+	       (double)pin_ns / pinned);
+	printf("  unpin: %.0f pages/s wall; %.1f ns/page unpinning\n",
+	       unpinned * 1e9 / unpin_wall,
+	       unpinned ? (double)unpin_ns / unpinned : 0.);
+	print_vmstat_deltas("pinning", vm_start, vm_pinned);
+	if (opts.compact) {
+		printf("  compact_memory while pinned: %.1f ms\n", compact_ns / 1e6);
+		print_vmstat_deltas("compaction", vm_pinned, vm_compacted);
+	}
+	print_vmstat_deltas("unpinning", vm_compacted, vm_end);
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-n pages] [-b batch] [-r rounds] "
+		"[-L] [-w] [-m anon|shmem|file] [-f path] [-F] [-c]\n", bin);
+	fprintf(stderr, "  -t  threads, each with its own /dev/gup_bench fd (default 1)\n");
+	fprintf(stderr, "  -n  pages pinned per thread (default 65536)\n");
+	fprintf(stderr, "  -b  pages per pin ioctl (default 512)\n");
+	fprintf(stderr, "  -r  pin/unpin rounds (default 3)\n");
+	fprintf(stderr, "  -L  pin with FOLL_LONGTERM\n");
+	fprintf(stderr, "  -w  pin with FOLL_WRITE\n");
+	fprintf(stderr, "  -m  memory to pin (default anon)\n");
+	fprintf(stderr, "  -f  file to use for -m file (default gup_bench.dat)\n");
+	fprintf(stderr, "  -F  don't fault memory in first, so GUP has to\n");
+	fprintf(stderr, "  -c  time /proc/sys/vm/compact_memory while pinned\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	uint64_t size, offset;
+	unsigned int i;
+	char *ptr;
+	int opt;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	opts.threads = 1;
+	opts.pages = 65536;
+	opts.batch = 512;
+	opts.rounds = 3;
+	opts.path = "gup_bench.dat";
+
+	while ((opt = getopt(argc, argv, "t:n:b:r:Lwm:f:Fch")) != -1) {
+		switch (opt) {
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'n':
+			opts.pages = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			opts.batch = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			opts.rounds = atoi(optarg);
+			break;
+		case 'L':
+			opts.flags |= GUP_BENCH_LONGTERM;
+			break;
+		case 'w':
+			opts.flags |= GUP_BENCH_WRITE;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "anon")) {
+				opts.type = MEM_ANON;
+			} else if (!strcmp(optarg, "shmem")) {
+				opts.type = MEM_SHMEM;
+			} else if (!strcmp(optarg, "file")) {
+				opts.type = MEM_FILE;
+			} else {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			opts.path = optarg;
+			break;
+		case 'F':
+			opts.no_prefault = true;
+			break;
+		case 'c':
+			opts.compact = true;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc || opts.threads == 0 || opts.pages == 0 ||
+	    opts.batch == 0 || opts.batch > GUP_BENCH_MAX_BATCH ||
+	    opts.rounds == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	size = opts.pages * opts.threads * page_size;
+	ptr = map_memory(size);
+	if (!opts.no_prefault) {
+		for (offset = 0; offset < size; offset += page_size)
+			ptr[offset] = 1;
+	}
+
+	workers = calloc(opts.threads, sizeof(*workers));
+	if (workers == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	if (pthread_barrier_init(&barrier, NULL, opts.threads + 1)) {
+		fprintf(stderr, "pthread_barrier_init failed\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		struct worker *worker = &workers[i];
+
+		worker->ptr = ptr + i * opts.pages * page_size;
+		worker->fd = open("/dev/gup_bench", O_RDWR | O_CLOEXEC);
+		if (worker->fd < 0) {
+			perror("open /dev/gup_bench");
+			return EXIT_FAILURE;
+		}
+
+		if (pthread_create(&worker->thread, NULL, worker_fn, worker)) {
+			fprintf(stderr, "pthread_create failed\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%u thread(s) x %lu pages in batches of %lu, %s%s%s\n",
+	       opts.threads, opts.pages, opts.batch,
+	       opts.type == MEM_ANON ? "anon" :
+	       opts.type == MEM_SHMEM ? "shmem" : "file",
+	       opts.flags & GUP_BENCH_LONGTERM ? ", FOLL_LONGTERM" : "",
+	       opts.flags & GUP_BENCH_WRITE ? ", FOLL_WRITE" : "");
+
+	for (i = 0; i < opts.rounds; i++)
+		run_round(workers, i);
+
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].fd);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	munmap(ptr, size);
+	free(workers);
+
+	return EXIT_SUCCESS;
+}
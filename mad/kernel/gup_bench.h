@@ -0,0 +1,40 @@
+#pragma once
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// Shared between mad's /dev/gup_bench and userspace.
+//
+// Each open file holds its own pins, so threads should open their own to
+// avoid serialising on it. GUP_BENCH_IOC_PIN pins a batch of pages with a
+// single pin_user_pages_fast() call (retried only if it comes up short) and
+// GUP_BENCH_IOC_UNPIN unpins everything the file holds. Closing the file
+// unpins too.
+
+#define GUP_BENCH_LONGTERM	(1U << 0)
+#define GUP_BENCH_WRITE		(1U << 1)
+
+// Per GUP_BENCH_IOC_PIN.
+#define GUP_BENCH_MAX_BATCH	(1U << 20)
+
+struct gup_bench_pin {
+	// Page aligned.
+	__u64 uaddr;
+	__u64 nr_pages;
+	// GUP_BENCH_* flags.
+	__u32 flags;
+	__u32 pad;
+	// Output: pages pinned, which may fall short of nr_pages if GUP hit an
+	// error part way through, and time spent in GUP.
+	__u64 nr_pinned;
+	__u64 elapsed_ns;
+};
+
+struct gup_bench_unpin {
+	// Output: pages unpinned and time spent unpinning them.
+	__u64 nr_unpinned;
+	__u64 elapsed_ns;
+};
+
+#define GUP_BENCH_IOC_PIN _IOWR('g', 0x01, struct gup_bench_pin)
+#define GUP_BENCH_IOC_UNPIN _IOR('g', 0x02, struct gup_bench_unpin)
@@ -2,14 +2,21 @@
 #include <linux/fs.h>
 #include <linux/gfp.h>
 #include <linux/init.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/page_ref.h>
 #include <linux/page-flags.h>
 #include <linux/pageblock-flags.h>
 #include <linux/percpu-defs.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "gup_bench.h"
 
 //#define LONGTERM
 
@@ -25,6 +32,9 @@ MODULE_LICENSE("GPL");
  * 5. echo 1 > /dev/gup_event # attempt write, dirty.
  *
  * To unpin gup mapping, echo 0 > /dev/gup_event.
+ *
+ * /dev/gup_bench pins in bulk via ioctl instead, see gup_bench.h and
+ * ../gup_bench.c.
  */
 
 static struct page *curr_page;
@@ -158,6 +168,167 @@ static struct miscdevice gup_event_dev = {
 	.fops = &gup_event_fops
 };
 
+// Pages pinned by one GUP_BENCH_IOC_PIN.
+struct pin_batch {
+	struct list_head node;
+	unsigned long nr;
+	bool dirty;
+	struct page *pages[];
+};
+
+struct gup_bench_file {
+	struct mutex lock;
+	struct list_head batches;
+};
+
+static int gup_bench_open(struct inode *inode, struct file *file)
+{
+	struct gup_bench_file *gf = kzalloc(sizeof(*gf), GFP_KERNEL);
+
+	if (!gf)
+		return -ENOMEM;
+
+	mutex_init(&gf->lock);
+	INIT_LIST_HEAD(&gf->batches);
+	file->private_data = gf;
+
+	return 0;
+}
+
+static unsigned long gup_bench_unpin_all(struct gup_bench_file *gf)
+{
+	struct pin_batch *batch, *tmp;
+	unsigned long count = 0;
+
+	list_for_each_entry_safe(batch, tmp, &gf->batches, node) {
+		// As unpin_curr_page(), pages we may have written via are dirtied.
+		if (batch->dirty)
+			unpin_user_pages_dirty_lock(batch->pages, batch->nr, true);
+		else
+			unpin_user_pages(batch->pages, batch->nr);
+
+		count += batch->nr;
+		list_del(&batch->node);
+		kvfree(batch);
+		cond_resched();
+	}
+
+	return count;
+}
+
+static int gup_bench_release(struct inode *inode, struct file *file)
+{
+	struct gup_bench_file *gf = file->private_data;
+
+	gup_bench_unpin_all(gf);
+	kfree(gf);
+
+	return 0;
+}
+
+static long gup_bench_pin(struct gup_bench_file *gf,
+			  struct gup_bench_pin __user *upin)
+{
+	struct gup_bench_pin pin;
+	struct pin_batch *batch;
+	unsigned int gup_flags = 0;
+	long ret = 0;
+	u64 start;
+
+	if (copy_from_user(&pin, upin, sizeof(pin)))
+		return -EFAULT;
+
+	if ((pin.uaddr & ~PAGE_MASK) || pin.nr_pages == 0 ||
+	    pin.nr_pages > GUP_BENCH_MAX_BATCH ||
+	    (pin.flags & ~(GUP_BENCH_LONGTERM | GUP_BENCH_WRITE)))
+		return -EINVAL;
+
+	if (pin.flags & GUP_BENCH_LONGTERM)
+		gup_flags |= FOLL_LONGTERM;
+	if (pin.flags & GUP_BENCH_WRITE)
+		gup_flags |= FOLL_WRITE;
+
+	batch = kvmalloc(struct_size(batch, pages, pin.nr_pages), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+	batch->nr = 0;
+	batch->dirty = pin.flags & GUP_BENCH_WRITE;
+
+	start = ktime_get_ns();
+	while (batch->nr < pin.nr_pages) {
+		ret = pin_user_pages_fast(pin.uaddr + (batch->nr << PAGE_SHIFT),
+					  pin.nr_pages - batch->nr, gup_flags,
+					  &batch->pages[batch->nr]);
+		if (ret <= 0)
+			break;
+		batch->nr += ret;
+	}
+	pin.elapsed_ns = ktime_get_ns() - start;
+	pin.nr_pinned = batch->nr;
+
+	if (batch->nr == 0) {
+		kvfree(batch);
+		return ret ? ret : -EFAULT;
+	}
+
+	mutex_lock(&gf->lock);
+	list_add_tail(&batch->node, &gf->batches);
+	mutex_unlock(&gf->lock);
+
+	if (put_user(pin.nr_pinned, &upin->nr_pinned) ||
+	    put_user(pin.elapsed_ns, &upin->elapsed_ns))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long gup_bench_unpin(struct gup_bench_file *gf,
+			    struct gup_bench_unpin __user *uunpin)
+{
+	struct gup_bench_unpin unpin;
+	u64 start;
+
+	mutex_lock(&gf->lock);
+	start = ktime_get_ns();
+	unpin.nr_unpinned = gup_bench_unpin_all(gf);
+	unpin.elapsed_ns = ktime_get_ns() - start;
+	mutex_unlock(&gf->lock);
+
+	if (copy_to_user(uunpin, &unpin, sizeof(unpin)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long gup_bench_ioctl(struct file *file, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct gup_bench_file *gf = file->private_data;
+
+	switch (cmd) {
+	case GUP_BENCH_IOC_PIN:
+		return gup_bench_pin(gf, (struct gup_bench_pin __user *)arg);
+	case GUP_BENCH_IOC_UNPIN:
+		return gup_bench_unpin(gf, (struct gup_bench_unpin __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations gup_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = gup_bench_open,
+	.release = gup_bench_release,
+	.unlocked_ioctl = gup_bench_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static struct miscdevice gup_bench_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "gup_bench",
+	.fops = &gup_bench_fops
+};
+
 static int __init mad_init(void)
 {
 	int err;
@@ -166,13 +337,26 @@ static int __init mad_init(void)
 	if (err)
 		return err;
 
-	return misc_register(&gup_event_dev);
+	err = misc_register(&gup_event_dev);
+	if (err) {
+		misc_deregister(&gup_uaddr_dev);
+		return err;
+	}
+
+	err = misc_register(&gup_bench_dev);
+	if (err) {
+		misc_deregister(&gup_event_dev);
+		misc_deregister(&gup_uaddr_dev);
+	}
+
+	return err;
 }
 
 static void __exit mad_exit(void)
 {
 	misc_deregister(&gup_uaddr_dev);
 	misc_deregister(&gup_event_dev);
+	misc_deregister(&gup_bench_dev);
 
 	if (curr_page)
 		unpin_curr_page();
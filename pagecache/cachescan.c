@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cachestat.h"
+
+// Report page cache residency for files, optionally walking directory trees
+// in parallel. Uses cachestat() (linux 6.5+) which also gives dirty,
+// writeback and evicted counts, falling back to mmap() + mincore() which can
+// only tell us what is resident.
+
+#define DEFAULT_MAP_WIDTH (64)
+// Bound the mincore() vector by scanning in chunks of this many pages.
+#define MINCORE_CHUNK_PAGES (1UL << 18)
+#define MAX_FDS (64)
+
+// Residency map symbols, from empty to fully resident.
+static const char map_chars[] = " .:-=+*#%@";
+#define NUM_MAP_CHARS (sizeof(map_chars) - 1)
+
+struct file_result {
+	char *path;
+	uint64_t pages;
+	struct cs_stats stats;
+	// Only resident counts are known if we fell back to mincore().
+	bool used_mincore;
+	bool failed;
+	char *map;
+};
+
+struct options {
+	unsigned int threads;
+	unsigned int map_width;
+	bool show_map;
+	bool force_mincore;
+};
+
+static struct options opts;
+static long page_size;
+
+static struct file_result *results;
+static size_t num_results, results_capacity;
+static size_t next_result;
+
+static bool cachestat_unsupported;
+
+static void add_file(const char *path, uint64_t size)
+{
+	struct file_result *result;
+
+	if (num_results == results_capacity) {
+		results_capacity = results_capacity ? results_capacity * 2 : 256;
+		results = realloc(results, results_capacity * sizeof(*results));
+		if (results == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	result = &results[num_results++];
+	memset(result, 0, sizeof(*result));
+	result->path = strdup(path);
+	result->pages = (size + page_size - 1) / page_size;
+	if (result->path == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int walk_entry(const char *path, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	(void)ftw;
+
+	if (type == FTW_F && S_ISREG(st->st_mode))
+		add_file(path, st->st_size);
+	else if (type == FTW_DNR || type == FTW_NS)
+		fprintf(stderr, "cannot access %s\n", path);
+
+	return 0;
+}
+
+static char map_char(uint64_t resident, uint64_t pages)
+{
+	if (pages == 0 || resident == 0)
+		return map_chars[0];
+	if (resident >= pages)
+		return map_chars[NUM_MAP_CHARS - 1];
+
+	// Anything resident shows as at least the first non-empty symbol.
+	return map_chars[1 + resident * (NUM_MAP_CHARS - 2) / pages];
+}
+
+// The page range covered by each map bucket.
+static void bucket_range(const struct file_result *result, unsigned int bucket,
+			 unsigned int buckets, uint64_t *first, uint64_t *last)
+{
+	*first = result->pages * bucket / buckets;
+	*last = result->pages * (bucket + 1) / buckets;
+}
+
+static bool scan_cachestat(int fd, struct file_result *result,
+			   unsigned int buckets)
+{
+	struct cs_range range = { .off = 0, .len = 0 }; // len 0 means to EOF.
+	unsigned int i;
+
+	if (cachestat(fd, &range, &result->stats))
+		return false;
+
+	for (i = 0; result->map != NULL && i < buckets; i++) {
+		struct cs_stats stats;
+		uint64_t first, last;
+
+		bucket_range(result, i, buckets, &first, &last);
+		range.off = first * page_size;
+		range.len = (last - first) * page_size;
+		if (cachestat(fd, &range, &stats))
+			return false;
+
+		result->map[i] = map_char(stats.nr_cache, last - first);
+	}
+
+	return true;
+}
+
+static bool scan_mincore(int fd, struct file_result *result,
+			 unsigned int buckets)
+{
+	unsigned char *vec;
+	uint64_t *bucket_counts = NULL;
+	uint64_t offset;
+	unsigned int i;
+
+	if (result->pages == 0)
+		goto fill_map;
+
+	vec = malloc(MINCORE_CHUNK_PAGES);
+	bucket_counts = calloc(buckets ? buckets : 1, sizeof(*bucket_counts));
+	if (vec == NULL || bucket_counts == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (offset = 0; offset < result->pages; offset += MINCORE_CHUNK_PAGES) {
+		const uint64_t count = result->pages - offset < MINCORE_CHUNK_PAGES ?
+			result->pages - offset : MINCORE_CHUNK_PAGES;
+		const size_t len = count * page_size;
+		uint64_t j, bucket = 0;
+		void *ptr;
+
+		ptr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset * page_size);
+		if (ptr == MAP_FAILED) {
+			free(vec);
+			free(bucket_counts);
+			return false;
+		}
+
+		if (mincore(ptr, len, vec)) {
+			munmap(ptr, len);
+			free(vec);
+			free(bucket_counts);
+			return false;
+		}
+		munmap(ptr, len);
+
+		for (j = 0; j < count; j++) {
+			const uint64_t page = offset + j;
+
+			if (!(vec[j] & 1))
+				continue;
+
+			result->stats.nr_cache++;
+			if (buckets == 0)
+				continue;
+
+			// Pages arrive in order, so walk buckets forward.
+			while (page >= result->pages * (bucket + 1) / buckets)
+				bucket++;
+			bucket_counts[bucket]++;
+		}
+	}
+
+	free(vec);
+
+fill_map:
+	for (i = 0; result->map != NULL && i < buckets; i++) {
+		uint64_t first, last;
+
+		bucket_range(result, i, buckets, &first, &last);
+		result->map[i] = map_char(bucket_counts ? bucket_counts[i] : 0,
+					  last - first);
+	}
+
+	free(bucket_counts);
+	return true;
+}
+
+static void scan_file(struct file_result *result)
+{
+	// No more buckets than pages, else some would cover no pages and look
+	// like holes in a fully cached file.
+	const unsigned int buckets = !opts.show_map ? 0 :
+		result->pages < opts.map_width ? result->pages : opts.map_width;
+	int fd;
+
+	if (buckets > 0) {
+		result->map = calloc(buckets + 1, 1);
+		if (result->map == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fd = open(result->path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+	if (fd < 0 && errno == EPERM)
+		fd = open(result->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		result->failed = true;
+		return;
+	}
+
+	if (!opts.force_mincore &&
+	    !__atomic_load_n(&cachestat_unsupported, __ATOMIC_RELAXED)) {
+		if (scan_cachestat(fd, result, buckets))
+			goto out;
+
+		// Some filesystems (e.g. hugetlbfs) refuse, fall back per-file.
+		if (errno == ENOSYS)
+			__atomic_store_n(&cachestat_unsupported, true,
+					 __ATOMIC_RELAXED);
+		memset(&result->stats, 0, sizeof(result->stats));
+	}
+
+	result->used_mincore = true;
+	if (!scan_mincore(fd, result, buckets))
+		result->failed = true;
+
+out:
+	close(fd);
+}
+
+static void *worker(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		const size_t i = __atomic_fetch_add(&next_result, 1, __ATOMIC_RELAXED);
+
+		if (i >= num_results)
+			break;
+
+		scan_file(&results[i]);
+	}
+
+	return NULL;
+}
+
+static void print_count(uint64_t count, bool known)
+{
+	if (known)
+		printf(" %10lu", count);
+	else
+		printf(" %10s", "-");
+}
+
+static void print_results(void)
+{
+	struct cs_stats totals = { 0 };
+	uint64_t total_pages = 0;
+	bool any_mincore = false;
+	size_t i;
+
+	printf("%10s %10s %6s %10s %10s %10s %10s  %s\n", "pages", "cached", "%",
+	       "dirty", "writeback", "evicted", "recent", "path");
+
+	for (i = 0; i < num_results; i++) {
+		const struct file_result *result = &results[i];
+		const struct cs_stats *stats = &result->stats;
+		const bool known = !result->used_mincore;
+
+		if (result->failed) {
+			fprintf(stderr, "cannot scan %s\n", result->path);
+			continue;
+		}
+
+		printf("%10lu %10lu %6.1f", result->pages, stats->nr_cache,
+		       result->pages ? 100. * stats->nr_cache / result->pages : 0.);
+		print_count(stats->nr_dirty, known);
+		print_count(stats->nr_writeback, known);
+		print_count(stats->nr_evicted, known);
+		print_count(stats->nr_recently_evicted, known);
+		printf("  %s\n", result->path);
+
+		if (result->map != NULL)
+			printf("%10s [%s]\n", "", result->map);
+
+		total_pages += result->pages;
+		totals.nr_cache += stats->nr_cache;
+		totals.nr_dirty += stats->nr_dirty;
+		totals.nr_writeback += stats->nr_writeback;
+		totals.nr_evicted += stats->nr_evicted;
+		totals.nr_recently_evicted += stats->nr_recently_evicted;
+		any_mincore |= result->used_mincore;
+	}
+
+	if (num_results < 2)
+		return;
+
+	printf("%10lu %10lu %6.1f", total_pages, totals.nr_cache,
+	       total_pages ? 100. * totals.nr_cache / total_pages : 0.);
+	print_count(totals.nr_dirty, !any_mincore);
+	print_count(totals.nr_writeback, !any_mincore);
+	print_count(totals.nr_evicted, !any_mincore);
+	print_count(totals.nr_recently_evicted, !any_mincore);
+	printf("  (total, %zu files)\n", num_results);
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-m] [-w map width] [-M] [path...]\n",
+		bin);
+	fprintf(stderr, "  -j  scan with this many threads (default: online CPUs)\n");
+	fprintf(stderr, "  -m  show a residency map for each file\n");
+	fprintf(stderr, "  -w  number of ranges in the residency map, at most one per page\n"
+		"      (default %d)\n",
+		DEFAULT_MAP_WIDTH);
+	fprintf(stderr, "  -M  use mincore() even if cachestat() is available\n");
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+	unsigned int i;
+	int opt;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	opts.map_width = DEFAULT_MAP_WIDTH;
+
+	while ((opt = getopt(argc, argv, "j:mw:Mh")) != -1) {
+		switch (opt) {
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 'm':
+			opts.show_map = true;
+			break;
+		case 'w':
+			opts.map_width = atoi(optarg);
+			break;
+		case 'M':
+			opts.force_mincore = true;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind == argc || opts.threads == 0 || opts.map_width == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (; optind < argc; optind++) {
+		if (nftw(argv[optind], walk_entry, MAX_FDS, FTW_PHYS)) {
+			perror(argv[optind]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (opts.threads > num_results)
+		opts.threads = num_results ? num_results : 1;
+
+	threads = calloc(opts.threads, sizeof(*threads));
+	if (threads == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < opts.threads; i++)
+		pthread_join(threads[i], NULL);
+
+	print_results();
+
+	return EXIT_SUCCESS;
+}
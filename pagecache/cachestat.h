@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Wrapper for cachestat() (linux 6.5+), which glibc doesn't provide. Fails
+// with ENOSYS on older kernels, so callers fall back to mmap() + mincore().
+
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+// As per include/uapi/linux/mman.h, which our headers may predate.
+struct cs_range {
+	uint64_t off;
+	uint64_t len;
+};
+
+struct cs_stats {
+	uint64_t nr_cache;
+	uint64_t nr_dirty;
+	uint64_t nr_writeback;
+	uint64_t nr_evicted;
+	uint64_t nr_recently_evicted;
+};
+
+static inline long cachestat(int fd, struct cs_range *range,
+			     struct cs_stats *stats)
+{
+	return syscall(__NR_cachestat, fd, range, stats, 0);
+}
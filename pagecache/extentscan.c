@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/fiemap.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cachestat.h"
+#include "fiemap.h"
+
+// Report how fragmented files are on disk and how much of each extent is in
+// the page cache. The layout comes from FIEMAP, so even multi-GiB files are
+// mapped in a couple of ioctls, and residency from cachestat() per extent,
+// falling back to mmap() + mincore() as cachescan does.
+
+struct options {
+	bool verbose;
+	bool sync;
+	bool force_mincore;
+};
+
+struct file_summary {
+	uint64_t extents, discontiguities, bytes;
+	uint64_t largest, unwritten, shared, other_flags;
+	uint64_t pages, cached;
+	// Extents by residency.
+	uint64_t full, partial, empty;
+	double map_us;
+};
+
+static struct options opts;
+static long page_size;
+static bool cachestat_unsupported;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static bool count_mincore(int fd, uint64_t first, uint64_t pages,
+			  uint64_t *cached)
+{
+	const size_t len = pages * page_size;
+	unsigned char *vec;
+	uint64_t i;
+	void *ptr;
+
+	vec = malloc(pages);
+	if (vec == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	ptr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, first * page_size);
+	if (ptr == MAP_FAILED) {
+		free(vec);
+		return false;
+	}
+
+	if (mincore(ptr, len, vec)) {
+		munmap(ptr, len);
+		free(vec);
+		return false;
+	}
+	munmap(ptr, len);
+
+	*cached = 0;
+	for (i = 0; i < pages; i++)
+		*cached += vec[i] & 1;
+
+	free(vec);
+	return true;
+}
+
+// Count the cached pages overlapping [first, first + pages).
+static bool count_cached(int fd, uint64_t first, uint64_t pages,
+			 uint64_t *cached)
+{
+	struct cs_range range = {
+		.off = first * page_size,
+		.len = pages * page_size,
+	};
+	struct cs_stats stats;
+
+	if (!opts.force_mincore && !cachestat_unsupported) {
+		if (!cachestat(fd, &range, &stats)) {
+			*cached = stats.nr_cache;
+			return true;
+		}
+
+		if (errno == ENOSYS)
+			cachestat_unsupported = true;
+	}
+
+	return count_mincore(fd, first, pages, cached);
+}
+
+static void describe_flags(uint32_t flags, char *buf, size_t size)
+{
+	static const struct {
+		uint32_t flag;
+		const char *name;
+	} names[] = {
+		{ FIEMAP_EXTENT_UNKNOWN, "unknown" },
+		{ FIEMAP_EXTENT_DELALLOC, "delalloc" },
+		{ FIEMAP_EXTENT_ENCODED, "encoded" },
+		{ FIEMAP_EXTENT_DATA_ENCRYPTED, "encrypted" },
+		{ FIEMAP_EXTENT_NOT_ALIGNED, "not_aligned" },
+		{ FIEMAP_EXTENT_DATA_INLINE, "inline" },
+		{ FIEMAP_EXTENT_DATA_TAIL, "tail" },
+		{ FIEMAP_EXTENT_UNWRITTEN, "unwritten" },
+		{ FIEMAP_EXTENT_MERGED, "merged" },
+		{ FIEMAP_EXTENT_SHARED, "shared" },
+	};
+	size_t i, off = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!(flags & names[i].flag))
+			continue;
+
+		off += snprintf(&buf[off], size - off, "%s%s", off ? "," : "",
+				names[i].name);
+		if (off >= size)
+			break;
+	}
+}
+
+static bool scan_file(const char *path)
+{
+	struct file_summary summary;
+	struct file_extent *extents;
+	size_t count, i;
+	struct stat st;
+	uint64_t start;
+	int fd;
+
+	memset(&summary, 0, sizeof(summary));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+	if (fd < 0 && errno == EPERM)
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		return false;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return false;
+	}
+
+	start = now_ns();
+	extents = fiemap_read(fd, 0, st.st_size, opts.sync, &count);
+	summary.map_us = (now_ns() - start) / 1000.0;
+	if (extents == NULL) {
+		fprintf(stderr, "%s: FIEMAP: %s\n", path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	summary.extents = count;
+	summary.discontiguities = fiemap_discontiguities(extents, count);
+	summary.pages = (st.st_size + page_size - 1) / page_size;
+
+	printf("%s: %lu bytes, %lu extent(s), %lu discontiguous, mapped in %.1f us\n",
+	       path, (uint64_t)st.st_size, summary.extents,
+	       summary.discontiguities, summary.map_us);
+
+	if (opts.verbose && count > 0)
+		printf("%8s %14s %14s %10s %10s %6s  %s\n", "extent", "logical",
+		       "physical", "KiB", "cached", "%", "flags");
+
+	for (i = 0; i < count; i++) {
+		const struct file_extent *extent = &extents[i];
+		// Extents are filesystem block aligned, which may be finer than a
+		// page, and the last may run past EOF.
+		const uint64_t first = extent->logical / page_size;
+		uint64_t last = (extent->logical + extent->len + page_size - 1) /
+			page_size;
+		uint64_t pages, cached = 0;
+
+		if (last > summary.pages)
+			last = summary.pages;
+		pages = last > first ? last - first : 0;
+
+		if (pages > 0 && !count_cached(fd, first, pages, &cached)) {
+			fprintf(stderr, "%s: unable to determine residency\n", path);
+			free(extents);
+			close(fd);
+			return false;
+		}
+
+		summary.bytes += extent->len;
+		if (extent->len > summary.largest)
+			summary.largest = extent->len;
+		if (extent->flags & FIEMAP_EXTENT_UNWRITTEN)
+			summary.unwritten++;
+		if (extent->flags & FIEMAP_EXTENT_SHARED)
+			summary.shared++;
+		if (extent->flags & ~(FIEMAP_EXTENT_UNWRITTEN | FIEMAP_EXTENT_SHARED |
+				      FIEMAP_EXTENT_LAST | FIEMAP_EXTENT_MERGED))
+			summary.other_flags++;
+
+		summary.cached += cached;
+		if (cached == 0)
+			summary.empty++;
+		else if (cached >= pages)
+			summary.full++;
+		else
+			summary.partial++;
+
+		if (opts.verbose) {
+			char flags[128];
+
+			describe_flags(extent->flags, flags, sizeof(flags));
+			printf("%8zu %14lu %14lu %10lu %10lu %6.1f  %s\n", i,
+			       extent->logical, extent->physical, extent->len >> 10,
+			       cached, pages ? 100. * cached / pages : 0., flags);
+		}
+	}
+
+	if (count > 0) {
+		printf("  extent KiB: avg %.1f, largest %lu; %lu unwritten, %lu shared, %lu other flags\n",
+		       summary.bytes / 1024. / count, summary.largest >> 10,
+		       summary.unwritten, summary.shared, summary.other_flags);
+		printf("  sparse: %lu of %lu bytes unallocated\n",
+		       summary.bytes < (uint64_t)st.st_size ?
+		       (uint64_t)st.st_size - summary.bytes : 0,
+		       (uint64_t)st.st_size);
+	}
+	printf("  cached: %lu of %lu pages (%.1f%%); extents %lu full, %lu partial, %lu empty\n",
+	       summary.cached, summary.pages,
+	       summary.pages ? 100. * summary.cached / summary.pages : 0.,
+	       summary.full, summary.partial, summary.empty);
+
+	free(extents);
+	close(fd);
+	return true;
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [-v] [-s] [-M] [file...]\n", bin);
+	fprintf(stderr, "  -v  list every extent\n");
+	fprintf(stderr, "  -s  flush dirty data first so delayed allocations are mapped\n");
+	fprintf(stderr, "  -M  use mincore() even if cachestat() is available\n");
+}
+
+int main(int argc, char **argv)
+{
+	bool ok = true;
+	int opt;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "vsMh")) != -1) {
+		switch (opt) {
+		case 'v':
+			opts.verbose = true;
+			break;
+		case 's':
+			opts.sync = true;
+			break;
+		case 'M':
+			opts.force_mincore = true;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind == argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (; optind < argc; optind++)
+		ok &= scan_file(argv[optind]);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -7,40 +7,55 @@
 
 static void usage(const char *bin)
 {
-	fprintf(stderr, "usage: %s [pid to trace] <-s>\n", bin);
+	fprintf(stderr, "usage: %s [pid to trace...] <-s>\n", bin);
 }
 
 int main(int argc, char **argv)
 {
-	const char *pid;
-	struct pagestat **pss;
-	bool silent = false;
+	const char **pids;
+	struct pagestat ***psss;
+	size_t num_pids = 0, i;
+	bool silent = false, failed = false;
+	int arg;
 
 	if (argc < 2) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	pid = argv[1];
-	if (argc >= 3) {
-		if (strncmp(argv[2], "-s", sizeof("-s")) != 0) {
-			usage(argv[0]);
-			return EXIT_FAILURE;
-		}
+	pids = calloc(argc, sizeof(*pids));
+	for (arg = 1; arg < argc; arg++) {
+		if (strncmp(argv[arg], "-s", sizeof("-s")) == 0)
+			silent = true;
+		else
+			pids[num_pids++] = argv[arg];
+	}
 
-		silent = true;
+	if (num_pids == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
 	}
 
-	pss = pagestat_snapshot_all(pid);
+	// Snapshot every pid together so their reads are batched.
+	psss = pagestat_snapshot_all_pids(pids, num_pids);
 
-	// Should have already reported error.
-	if (pss == NULL)
-		return EXIT_FAILURE;
+	for (i = 0; i < num_pids; i++) {
+		// Should have already reported error.
+		if (psss[i] == NULL) {
+			failed = true;
+			continue;
+		}
 
-	if (!silent)
-		pagestat_print_all(pss);
+		if (silent)
+			continue;
+
+		if (num_pids > 1)
+			printf("======== pid %s ========\n\n", pids[i]);
+		pagestat_print_all(psss[i]);
+	}
 
-	pagestat_free_all(pss);
+	pagestat_free_all_pids(psss, num_pids);
+	free(pids);
 
-	return EXIT_SUCCESS;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -1,4 +1,6 @@
 #include "pagestat.h"
+#include "procbatch.h"
+#include "smaps.h"
 
 #include "linux/kernel-page-flags.h"
 
@@ -51,204 +53,6 @@
 #define PAGEMAP_SWAP_OFFSET_NUM_BITS (50)
 #define PAGEMAP_SWAP_OFFSET_MASK BIT_MASK_LOWER(PAGEMAP_SWAP_OFFSET_NUM_BITS)
 
-static uint64_t parse_hex(const char *str)
-{
-	uint64_t ret = 0;
-
-	for (; *str != '\0'; str++) {
-		const char chr = *str;
-
-		ret <<= 4;
-
-		if (chr >= 'a' && chr <= 'f') {
-			ret += 10 + chr - 'a';
-		} else if (chr >= 'A' && chr <= 'F') {
-			ret += 10 + chr - 'A';
-		} else if (chr >= '0' && chr <= '9') {
-			ret += chr - '0';
-		} else {
-			fprintf(stderr, "ERROR: Invalid char '%c'",
-				chr);
-			return INVALID_VALUE;
-		}
-	}
-
-	return ret;
-}
-
-static bool extract_address_range(char *str, uint64_t *from_ptr, uint64_t *to_ptr)
-{
-	uint64_t from, to;
-	char *ptr = str;
-
-	for (; *ptr != '\0'; ptr++) {
-		const char chr = *ptr;
-
-		if (chr == '-')
-			break;
-	}
-
-	if (*ptr == '\0')
-		return false;
-
-	*ptr = '\0';
-	from = parse_hex(str);
-	if (from == INVALID_VALUE)
-		return false;
-
-	to = parse_hex(ptr + 1);
-	if (to == INVALID_VALUE)
-		return false;
-
-	*from_ptr = from;
-	*to_ptr = to;
-
-	return true;
-}
-
-static bool is_smap_header_field(const char *line, size_t len)
-{
-	return line[len-1] != ':';
-}
-
-static bool get_smap_header_fields(struct pagestat *ms, char *line)
-{
-	char range[255], perms[5], dev_num[64], offset[64], name[255];
-	uint64_t inode;
-	int res;
-
-	res = sscanf(line, "%s %s %s %s %lu %s", range, perms, offset, dev_num, &inode, name);
-	if (res < 5) {
-		fprintf(stderr, "ERROR: Can't parse smap header line [%s]", line);
-		return false;
-	}
-
-	ms->offset = parse_hex(offset);
-	strncpy((char *)ms->perms, perms, sizeof(perms));
-
-	if (res <= 5)
-		return true;
-
-	// If it has a name, assign it.
-	size_t len = strnlen(name, sizeof(name));
-	ms->name = malloc(len + 1);
-	strncpy((char *)ms->name, name, len + 1);
-
-	return true;
-}
-
-static bool get_smap_other_fields(struct pagestat *ms, char *line, FILE *smaps_fp)
-{
-	size_t len = 0;
-
-	while (getline(&line, &len, smaps_fp) >= 0) {
-		char key[255], unit[16];
-		uint64_t size;
-
-		sscanf(line, "%s %lu %s", key, &size, unit);
-		if (strncmp(unit, "kB", sizeof(key)) != 0) {
-			fprintf(stderr, "ERROR: Unrecognised unit '%s'\n", unit);
-			return false;
-		}
-
-		if (is_smap_header_field(key, strnlen(key, sizeof(key))))
-			break;
-
-		if (strncmp(key, "Size:", sizeof(key)) == 0)
-			ms->vm_size = size;
-		else if (strncmp(key, "Rss:", sizeof(key)) == 0)
-			ms->rss = size;
-		else if (strncmp(key, "Referenced:", sizeof(key)) == 0)
-			ms->referenced = size;
-		else if (strncmp(key, "Anonymous:", sizeof(key)) == 0)
-			ms->anon = size;
-		else if (strncmp(key, "AnonHugePages:", sizeof(key)) == 0)
-			ms->anon_huge = size;
-		else if (strncmp(key, "Swap:", sizeof(key)) == 0)
-			ms->swap = size;
-		else if (strncmp(key, "Locked:", sizeof(key)) == 0)
-			ms->locked = size;
-		else if (strncmp(key, "VmFlags:", sizeof(key)) == 0) {
-			ssize_t count;
-			const ssize_t offset = sizeof("VmFlags: ");
-
-			len = strnlen(line, len);
-			for (count = len - offset; count > 0; count--) {
-				const char chr = line[offset + count - 1];
-
-				if (chr != '\n' && chr != ' ')
-					break;
-			}
-			if (count <= 0)
-				return false;
-
-			count++;
-
-			ms->vm_flags = malloc(count + 1);
-
-			memcpy((char *)ms->vm_flags, &line[offset - 1], count);
-			((char *)ms->vm_flags)[count] = '\0';
-		}
-	}
-
-	return true;
-}
-
-// Read count uint64s from the specified path at the specified offset.
-static bool read_u64s(uint64_t *ptr, const char *path, uint64_t offset, uint64_t count,
-		      bool report_errors)
-{
-	uint64_t read;
-	FILE *fp = fopen(path, "r");
-	bool ret = true;
-
-	if (fp == NULL) {
-		const int err = errno;
-
-		if (report_errors)
-			fprintf(stderr, "ERROR: Can't open %s: %s\n", path, strerror(err));
-
-		return false;
-	}
-
-	if (fseek(fp, offset * sizeof(uint64_t), SEEK_SET) != 0) {
-		if (report_errors)
-			fprintf(stderr, "ERROR: Can't seek to pointer offset in %s\n", path);
-
-		goto error_close;
-	}
-
-	if ((read = fread(ptr, sizeof(uint64_t), count, fp)) != count) {
-		if (feof(fp) || !report_errors)
-			goto error_close;
-
-		if (ferror(fp))
-			fprintf(stderr, "ERROR: Unable to read %s\n", path);
-		else
-			fprintf(stderr, "ERROR: Unknown error on %s read\n", path);
-
-		goto error_close;
-	}
-
-	goto done_close;
-
-error_close:
-	ret = false;
-done_close:
-	fclose(fp);
-	return ret;
-}
-
-static uint64_t read_u64(const char *path, uint64_t offset, bool report_errors)
-{
-	uint64_t ret;
-
-	if (!read_u64s(&ret, path, offset, 1, report_errors))
-		return INVALID_VALUE;
-
-	return ret;
-}
-
 static bool has_pfn(uint64_t val)
 {
 	return !CHECK_BIT(val, PAGEMAP_SWAPPED_BIT) &&
@@ -293,42 +97,135 @@ static void tweak_counts(struct pagestat *ps, uint64_t count)
 	ps->rss_counted = true;
 }
 
-static bool get_pagetable_fields(const char *pid, struct pagestat *ps)
+// Read kpagecount and kpageflags entries for every present page of the count
+// VMAs in pss in one batch. pfns holds the PFN of each page of every VMA in
+// turn.
+static void get_phys_fields(struct pagestat **pss, size_t count,
+			    const uint64_t *pfns, uint64_t total)
 {
-	uint64_t i;
-	const uint64_t count = count_virt_pages(ps);
-	const uint64_t offset = ps->vma_start / getpagesize();
+	static const char *const names[] = { "kpagecount", "kpageflags" };
+	uint64_t *vals = malloc(2 * total * sizeof(uint64_t));
+	uint64_t *outs[] = { vals, vals + total };
+	uint64_t i, j, k = 0;
 
-	char path[512] = "/proc/";
+	if (vals == NULL)
+		return;
 
-	strncat(path, pid, sizeof(path) - 1);
-	strncat(path, "/pagemap", sizeof(path) - 1);
+	// Errors leave INVALID_VALUE which we will check later.
+	procbatch_read_u64s(NULL, names, 2, pfns, total, outs);
 
-	ps->pagemaps = malloc(count * sizeof(uint64_t));
-	// These may not be populated depending on whether physical pages are mapped/
-	// we have permission to access these.
-	ps->kpagecounts = calloc(count, sizeof(uint64_t));
-	ps->kpageflags = calloc(count, sizeof(uint64_t));
+	for (i = 0; i < count; i++) {
+		struct pagestat *ps = pss[i];
 
-	if (!read_u64s(ps->pagemaps, path, offset, count, true))
-		return false; // We will free pagemaps elsewhere.
+		if (ps == NULL)
+			continue;
+
+		for (j = 0; j < count_virt_pages(ps); j++, k++) {
+			if (pfns[k] == INVALID_VALUE)
+				continue;
+
+			ps->kpagecounts[j] = outs[0][k];
+			ps->kpageflags[j] = outs[1][k];
+		}
+	}
+
+	free(vals);
+}
+
+// Fill in page table fields for count VMAs, pids[i] being the pid owning
+// pss[i]. Every VMA's pagemap is read in one batch, then the kpagecount and
+// kpageflags entries of every present page across all of them in another,
+// rather than a read per VMA and two per page. VMAs whose pagemap
+// can't be read are freed and set to NULL.
+static void get_pagetable_fields(const char *const *pids, struct pagestat **pss,
+				 size_t count)
+{
+	struct procbatch_read *reads;
+	uint64_t *pfns;
+	uint64_t total = 0, i, j, k = 0;
+
+	if (count == 0)
+		return;
+
+	reads = calloc(count, sizeof(*reads));
+	if (reads == NULL) {
+		fprintf(stderr, "ERROR: Out of memory reading page tables\n");
+		for (i = 0; i < count; i++) {
+			pagestat_free(pss[i]);
+			pss[i] = NULL;
+		}
+		return;
+	}
 
-	// Get page flags and counts if they exist.
 	for (i = 0; i < count; i++) {
-		const uint64_t entry = ps->pagemaps[i];
-		const uint64_t pfn = get_pfn(entry);
+		struct pagestat *ps = pss[i];
+		const uint64_t num_pages = count_virt_pages(ps);
+
+		ps->pagemaps = malloc(num_pages * sizeof(uint64_t));
+		// These may not be populated depending on whether physical
+		// pages are mapped/we have permission to access these.
+		ps->kpagecounts = calloc(num_pages, sizeof(uint64_t));
+		ps->kpageflags = calloc(num_pages, sizeof(uint64_t));
+		// Not read, so dropped below.
+		if (ps->pagemaps == NULL || ps->kpagecounts == NULL ||
+		    ps->kpageflags == NULL)
+			continue;
+
+		reads[i].pid = pids[i];
+		reads[i].name = "pagemap";
+		reads[i].offset = ps->vma_start / getpagesize() * sizeof(uint64_t);
+		reads[i].buf = ps->pagemaps;
+		reads[i].len = num_pages * sizeof(uint64_t);
+	}
+
+	procbatch_read(reads, count);
+
+	for (i = 0; i < count; i++) {
+		struct pagestat *ps = pss[i];
+
+		if (reads[i].buf == NULL)
+			fprintf(stderr, "ERROR: Out of memory for %lx-%lx of pid %s\n",
+				ps->vma_start, ps->vma_end, pids[i]);
+		else if (reads[i].result < 0)
+			fprintf(stderr, "ERROR: Can't read /proc/%s/pagemap: %s\n",
+				pids[i], strerror(reads[i].err));
+		else if (reads[i].result > 0 &&
+			 (size_t)reads[i].result != reads[i].len)
+			// e.g. the VMA was unmapped since we read smaps. Nothing
+			// at all is expected for [vsyscall], which lies outside
+			// the range pagemap covers.
+			fprintf(stderr, "WARN: Short read of /proc/%s/pagemap for %lx-%lx (%zd of %zu bytes), skipping\n",
+				pids[i], ps->vma_start, ps->vma_end,
+				reads[i].result, reads[i].len);
+
+		if (reads[i].buf != NULL &&
+		    (size_t)reads[i].result == reads[i].len) {
+			tweak_counts(ps, count_virt_pages(ps));
+			total += count_virt_pages(ps);
+			continue;
+		}
+
+		pagestat_free(pss[i]);
+		pss[i] = NULL;
+	}
+	free(reads);
+
+	// We index the physical files by PFN, INVALID_VALUE if not present.
+	pfns = malloc((total ? total : 1) * sizeof(uint64_t));
+	if (pfns == NULL)
+		return;
 
-		if (pfn == INVALID_VALUE)
+	for (i = 0; i < count; i++) {
+		if (pss[i] == NULL)
 			continue;
 
-		// These can be set to INVALID_VALUE which we will check later.
-		ps->kpagecounts[i] = read_u64("/proc/kpagecount", pfn, false);
-		ps->kpageflags[i] = read_u64("/proc/kpageflags", pfn, false);
+		for (j = 0; j < count_virt_pages(pss[i]); j++)
+			pfns[k++] = get_pfn(pss[i]->pagemaps[j]);
 	}
 
-	tweak_counts(ps, count);
+	get_phys_fields(pss, count, pfns, total);
 
-	return true;
+	free(pfns);
 }
 
 // Output all set flags from the specified kpageflags value.
@@ -749,128 +646,219 @@ bool pagestat_print_diff_all(struct pagestat **pss_a, struct pagestat **pss_b)
 	return seen;
 }
 
-static FILE *open_smaps(const char *pid)
+static const char *dup_span(const char *text, struct smaps_span span)
 {
-	FILE *fp;
-	char path[512] = "/proc/";
+	return span.len > 0 ? strndup(&text[span.off], span.len) : NULL;
+}
 
-	strncat(path, pid, sizeof(path) - 1);
-	strncat(path, "/smaps", sizeof(path) - 1);
+// Parse smaps text into pss[], without page table fields. If vaddr isn't
+// INVALID_VALUE, only the VMA containing it is kept, if first_only only the
+// first VMA. Returns the number of VMAs parsed, or -1 on error.
+static ssize_t parse_smaps(const char *text, size_t len, uint64_t vaddr,
+			   bool first_only, struct pagestat **pss, size_t max)
+{
+	struct smaps smaps;
+	size_t num = 0, i;
 
-	fp = fopen(path, "r");
+	smaps_init(&smaps);
+	if (!smaps_parse(&smaps, text, len))
+		goto err;
 
-	if (fp == NULL) {
-		fprintf(stderr, "ERROR: Can't open %s\n", path);
-		return NULL;
+	for (i = 0; i < smaps.count; i++) {
+		struct pagestat *curr;
+
+		// INVALID_VALUE implies get all.
+		if (vaddr != INVALID_VALUE &&
+		    (vaddr < smaps.start[i] || vaddr >= smaps.end[i]))
+			continue;
+
+		if (num == max) {
+			fprintf(stderr, "ERROR: More than %d maps!", MAX_MAPS);
+			goto err;
+		}
+
+		curr = calloc(1, sizeof(*curr));
+		if (curr == NULL) {
+			fprintf(stderr, "ERROR: Out of memory parsing smaps\n");
+			goto err;
+		}
+		pss[num++] = curr;
+
+		curr->vma_start = smaps.start[i];
+		curr->vma_end = smaps.end[i];
+		memcpy((char *)curr->perms, smaps.perms[i], sizeof(smaps.perms[i]));
+		curr->offset = smaps.offset[i];
+		curr->name = dup_span(text, smaps.name[i]);
+
+		curr->vm_size = smaps.fields[SMAPS_SIZE][i];
+		curr->rss = smaps.fields[SMAPS_RSS][i];
+		curr->referenced = smaps.fields[SMAPS_REFERENCED][i];
+		curr->anon = smaps.fields[SMAPS_ANONYMOUS][i];
+		curr->anon_huge = smaps.fields[SMAPS_ANON_HUGE_PAGES][i];
+		curr->swap = smaps.fields[SMAPS_SWAP][i];
+		curr->locked = smaps.fields[SMAPS_LOCKED][i];
+		curr->vm_flags = dup_span(text, smaps.vm_flags[i]);
+
+		if (first_only)
+			break;
 	}
 
-	return fp;
+	smaps_free(&smaps);
+	return num;
+
+err:
+	while (num > 0) {
+		pagestat_free(pss[--num]);
+		pss[num] = NULL;
+	}
+	smaps_free(&smaps);
+
+	return -1;
 }
 
-static struct pagestat *get_pagestat_snapshot(FILE *fp, const char *pid, uint64_t vaddr)
+// Snapshot the VMAs of each of count pids, only the one containing vaddr
+// unless it is INVALID_VALUE, only the first if first_only. The smaps of every pid are read together, then
+// the page tables of every VMA, so I/O for many processes is pipelined.
+// Returns count MAX_MAPS-sized NULL-terminated lists, NULL for any pid we
+// couldn't read.
+static struct pagestat ***snapshot_pids(const char *const *pids, size_t count,
+					uint64_t vaddr, bool first_only)
 {
-	uint64_t from, to;
-	struct pagestat *ret = NULL;
-	bool found = false;
-	char *line = NULL;
-	size_t len = 0;
+	struct pagestat ***ret = calloc(count ? count : 1, sizeof(*ret));
+	struct procbatch_text *texts = calloc(count ? count : 1, sizeof(*texts));
+	struct pagestat **all = NULL;
+	const char **all_pids = NULL;
+	size_t num_all = 0, i, j, k;
 
-	if (fp == NULL)
+	if (ret == NULL || texts == NULL) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		free(ret);
+		free(texts);
 		return NULL;
+	}
 
-	// Find the start of the smap block.
-	while (getline(&line, &len, fp) >= 0) {
-		char buf[255];
+	for (i = 0; i < count; i++) {
+		texts[i].pid = pids[i];
+		texts[i].name = "smaps";
+	}
+	procbatch_read_text(texts, count);
 
-		sscanf(line, "%s", buf);
-		len = strnlen(buf, sizeof(buf));
+	for (i = 0; i < count; i++) {
+		ssize_t num;
 
-		if (!is_smap_header_field(buf, len))
+		if (texts[i].text == NULL) {
+			fprintf(stderr, "ERROR: Can't read /proc/%s/smaps: %s\n",
+				pids[i], strerror(texts[i].err));
 			continue;
-
-		if (!extract_address_range(buf, &from, &to))
-			goto out;
-
-		// INVALID_VALUE implies get first.
-		if (vaddr == INVALID_VALUE || (vaddr >= from && vaddr < to)) {
-			found = true;
-			break;
 		}
-	}
 
-	if (!found)
-		goto out;
+		ret[i] = calloc(MAX_MAPS, sizeof(struct pagestat *));
+		if (ret[i] == NULL) {
+			fprintf(stderr, "ERROR: Out of memory for pid %s\n", pids[i]);
+			free(texts[i].text);
+			continue;
+		}
 
-	ret = calloc(1, sizeof(*ret));
+		num = parse_smaps(texts[i].text, texts[i].len, vaddr, first_only,
+				  ret[i], MAX_MAPS - 1);
+		free(texts[i].text);
 
-	ret->vma_start = from;
-	ret->vma_end = to;
+		if (num < 0) {
+			free(ret[i]);
+			ret[i] = NULL;
+			continue;
+		}
 
-	// Extract header line fields.
-	if (!get_smap_header_fields(ret, line)) {
-		pagestat_free(ret);
-		ret = NULL;
-		goto out;
+		num_all += num;
+	}
+	free(texts);
+
+	// Finally, get page table fields for every VMA at once.
+	all = calloc(num_all ? num_all : 1, sizeof(*all));
+	all_pids = calloc(num_all ? num_all : 1, sizeof(*all_pids));
+	if (all == NULL || all_pids == NULL) {
+		fprintf(stderr, "ERROR: Out of memory reading page tables\n");
+		for (i = 0; i < count; i++) {
+			if (ret[i] != NULL) {
+				pagestat_free_all(ret[i]);
+				free(ret[i]);
+			}
+			ret[i] = NULL;
+		}
+		free(all);
+		free(all_pids);
+		return ret;
 	}
 
-	// Now get the other fields.
-	if (!get_smap_other_fields(ret, line, fp)) {
-		pagestat_free(ret);
-		ret = NULL;
-		goto out;
+	for (i = 0, k = 0; i < count; i++) {
+		for (j = 0; ret[i] != NULL && ret[i][j] != NULL; j++, k++) {
+			all[k] = ret[i][j];
+			all_pids[k] = pids[i];
+		}
 	}
 
-	// Finally, get page table fields.
-	if (!get_pagetable_fields(pid, ret)) {
-		pagestat_free(ret);
-		ret = NULL;
-		goto out;
+	get_pagetable_fields(all_pids, all, num_all);
+
+	// Drop any VMAs whose page tables we couldn't read.
+	for (i = 0, k = 0; i < count; i++) {
+		size_t kept = 0;
+
+		for (j = 0; ret[i] != NULL && ret[i][j] != NULL; j++, k++) {
+			if (all[k] != NULL)
+				ret[i][kept++] = all[k];
+		}
+
+		for (; ret[i] != NULL && kept < j; kept++)
+			ret[i][kept] = NULL;
 	}
 
-out:
-	if (line != NULL)
-		free(line);
+	free(all);
+	free(all_pids);
 
 	return ret;
 }
 
 struct pagestat *pagestat_snapshot(uint64_t vaddr)
 {
-	FILE *fp = open_smaps("self");
-	struct pagestat *ret = get_pagestat_snapshot(fp, "self", vaddr);
-
-	fclose(fp);
-
-	return ret;
+	return pagestat_snapshot_remote("self", vaddr);
 }
 
 struct pagestat *pagestat_snapshot_remote(const char *pid, uint64_t vaddr)
 {
-	FILE *fp = open_smaps(pid);
-	struct pagestat *ret = get_pagestat_snapshot(fp, pid, vaddr);
+	// As before, with no vaddr we give back the first VMA only.
+	struct pagestat ***psss = snapshot_pids(&pid, 1, vaddr, true);
+	struct pagestat *ret = NULL;
+
+	if (psss == NULL)
+		return NULL;
 
-	fclose(fp);
+	if (psss[0] != NULL) {
+		ret = psss[0][0];
+		free(psss[0]);
+	}
+	free(psss);
 
 	return ret;
 }
 
 struct pagestat **pagestat_snapshot_all(const char *pid)
 {
-	int i;
-	FILE *fp = open_smaps(pid);
-	struct pagestat **ret = calloc(MAX_MAPS, sizeof(struct pagestat*));
+	struct pagestat ***psss = snapshot_pids(&pid, 1, INVALID_VALUE, false);
+	struct pagestat **ret;
 
-	for (i = 0; i < MAX_MAPS; i++) {
-		// Get next snapshot.
-		ret[i] = get_pagestat_snapshot(fp, pid, INVALID_VALUE);
-		if (ret[i] == NULL)
-			return ret;
-	}
+	if (psss == NULL)
+		return NULL;
 
-	fprintf(stderr, "ERROR: More than %d maps!", MAX_MAPS);
-	pagestat_free_all(ret);
+	ret = psss[0];
+	free(psss);
 
-	return NULL;
+	return ret;
+}
+
+struct pagestat ***pagestat_snapshot_all_pids(const char *const *pids,
+					      size_t count)
+{
+	return snapshot_pids(pids, count, INVALID_VALUE, false);
 }
 
 void pagestat_free(struct pagestat* ps)
@@ -906,3 +894,17 @@ void pagestat_free_all(struct pagestat **pss)
 		pagestat_free(ps);
 	}
 }
+
+void pagestat_free_all_pids(struct pagestat ***psss, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (psss[i] == NULL)
+			continue;
+
+		pagestat_free_all(psss[i]);
+		free(psss[i]);
+	}
+	free(psss);
+}
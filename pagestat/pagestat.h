@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define MAX_MAPS 8192
@@ -43,6 +44,12 @@ struct pagestat *pagestat_snapshot_remote(const char *pid, uint64_t vaddr);
 // Grab snapshot of all memory mappings.
 struct pagestat **pagestat_snapshot_all(const char *pid);
 
+// Same as pagestat_snapshot_all() for count PIDs at once, batching the reads
+// for all of them. Returns an array of count snapshots, NULL for any PID which
+// couldn't be read, or NULL if out of memory.
+struct pagestat ***pagestat_snapshot_all_pids(const char *const *pids,
+					      size_t count);
+
 // Detailed information to stdout.
 bool pagestat_print(struct pagestat *ps);
 
@@ -60,3 +67,6 @@ void pagestat_free(struct pagestat *ps);
 
 // Free bulk-allocated pstat objects.
 void pagestat_free_all(struct pagestat **pss);
+
+// Free snapshots obtained from pagestat_snapshot_all_pids().
+void pagestat_free_all_pids(struct pagestat ***psss, size_t count);
@@ -0,0 +1,562 @@
+#include "procbatch.h"
+#include "procfd.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Reads in flight at once, each into its own slot of the registered buffer.
+#define QUEUE_DEPTH (64)
+#define SLOT_SIZE (32768)
+#define ARENA_SIZE (QUEUE_DEPTH * SLOT_SIZE)
+
+// Merge reads of entries at most this far apart, reading through the gap.
+#define MAX_GAP (64)
+// Entries read by a single request at most, so a run fits in a slot.
+#define MAX_RUN (SLOT_SIZE / sizeof(uint64_t))
+
+// Bytes of a text file read per request.
+#define TEXT_CHUNK (SLOT_SIZE)
+
+enum uring_state {
+	URING_UNINIT,
+	URING_READY,
+	URING_DISABLED,
+};
+
+// A slot's worth of one read.
+struct segment {
+	size_t read;
+	size_t pos;
+	unsigned int len;
+	int res;
+};
+
+struct batch_file {
+	const char *pid, *name;
+	int fd;
+};
+
+static struct uring ring;
+static char *arena;
+static enum uring_state uring_state;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool same_str(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	return !strcmp(a, b);
+}
+
+// Must hold lock.
+static bool setup_uring(void)
+{
+	struct iovec iov;
+
+	if (uring_state != URING_UNINIT)
+		return uring_state == URING_READY;
+
+	uring_state = URING_DISABLED;
+	if (getenv("PROCBATCH_NO_URING") != NULL)
+		return false;
+
+	if (uring_init(&ring, QUEUE_DEPTH))
+		return false;
+
+	arena = (char *)mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED)
+		goto err_ring;
+
+	// Pinned once here rather than on every read.
+	iov.iov_base = arena;
+	iov.iov_len = ARENA_SIZE;
+	if (uring_register_buffers(&ring, &iov, 1))
+		goto err_arena;
+
+	uring_state = URING_READY;
+	return true;
+
+err_arena:
+	munmap(arena, ARENA_SIZE);
+err_ring:
+	uring_exit(&ring);
+	return false;
+}
+
+// Must hold lock.
+static void disable_uring(void)
+{
+	munmap(arena, ARENA_SIZE);
+	uring_exit(&ring);
+	uring_state = URING_DISABLED;
+}
+
+// Obtain an fd for each read, sharing one between reads of the same file.
+// fds[] is set to -1 for files which can't be opened.
+static struct batch_file *open_files(const struct procbatch_read *reads,
+				     size_t count, int *fds, size_t *num_files)
+{
+	struct batch_file *files;
+	size_t i, j;
+
+	files = (struct batch_file *)malloc(count * sizeof(*files));
+	if (files == NULL)
+		return NULL;
+
+	*num_files = 0;
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < *num_files; j++) {
+			if (same_str(files[j].pid, reads[i].pid) &&
+			    same_str(files[j].name, reads[i].name))
+				break;
+		}
+
+		if (j == *num_files) {
+			files[j].pid = reads[i].pid;
+			files[j].name = reads[i].name;
+			files[j].fd = procfd_dup(reads[i].pid, reads[i].name);
+			(*num_files)++;
+		}
+
+		fds[i] = files[j].fd;
+	}
+
+	return files;
+}
+
+static void close_files(struct batch_file *files, size_t num_files)
+{
+	size_t i;
+
+	for (i = 0; i < num_files; i++) {
+		if (files[i].fd >= 0)
+			close(files[i].fd);
+	}
+	free(files);
+}
+
+// Account for a completed segment, in order of position within its read.
+static void complete_segment(struct procbatch_read *reads, bool *ended,
+			     const struct segment *seg, const char *slot)
+{
+	struct procbatch_read *read = &reads[seg->read];
+
+	if (ended[seg->read])
+		return;
+
+	if (seg->res < 0) {
+		// Report an error only if there's nothing before it.
+		if (read->result == 0) {
+			read->result = -1;
+			read->err = -seg->res;
+		}
+		ended[seg->read] = true;
+		return;
+	}
+
+	memcpy((char *)read->buf + seg->pos, slot, seg->res);
+	read->result += seg->res;
+	// A short read is EOF, anything we queued beyond it is discarded.
+	if ((unsigned int)seg->res < seg->len)
+		ended[seg->read] = true;
+}
+
+// Issue the reads on the ring, a slot-sized segment per request, waiting on
+// each full queue's worth with a single submit. Returns false if the ring
+// itself failed. Must hold lock.
+static bool uring_read(struct procbatch_read *reads, size_t count,
+		       const int *fds, bool *ended)
+{
+	struct segment segs[QUEUE_DEPTH];
+	size_t next_read = 0, next_pos = 0;
+
+	while (next_read < count) {
+		unsigned int queued = 0, i;
+
+		while (queued < QUEUE_DEPTH && next_read < count) {
+			const struct procbatch_read *read = &reads[next_read];
+			struct io_uring_sqe *sqe;
+			size_t len;
+
+			if (fds[next_read] < 0 || ended[next_read] ||
+			    next_pos >= read->len) {
+				next_read++;
+				next_pos = 0;
+				continue;
+			}
+
+			len = read->len - next_pos;
+			if (len > SLOT_SIZE)
+				len = SLOT_SIZE;
+
+			sqe = uring_get_sqe(&ring);
+			if (sqe == NULL)
+				return false;
+			uring_prep_read_fixed(sqe, fds[next_read],
+					      &arena[queued * SLOT_SIZE], len,
+					      read->offset + next_pos, 0, queued);
+
+			segs[queued].read = next_read;
+			segs[queued].pos = next_pos;
+			segs[queued].len = len;
+			queued++;
+			next_pos += len;
+		}
+
+		if (queued == 0)
+			break;
+
+		// Anything left unsubmitted would linger in the SQ and be picked
+		// up by a later submit, so treat a short submit as failure.
+		if (uring_submit(&ring, 0) != (int)queued)
+			return false;
+
+		for (i = 0; i < queued; i++) {
+			struct io_uring_cqe *cqe = uring_wait_cqe(&ring);
+
+			if (cqe == NULL)
+				return false;
+			segs[cqe->user_data].res = cqe->res;
+			uring_cqe_seen(&ring);
+		}
+
+		for (i = 0; i < queued; i++)
+			complete_segment(reads, ended, &segs[i],
+					 &arena[i * SLOT_SIZE]);
+	}
+
+	return true;
+}
+
+// Read as pread() does, filling as much of the read as possible, but without
+// procfd_pread()'s reopen and retry when a read comes back empty. Reaching
+// the end of a seq_file is expected, and retrying it would start it over,
+// appending part of a second snapshot to the first.
+static ssize_t pread_noretry(const struct procbatch_read *read)
+{
+	const int fd = procfd_dup(read->pid, read->name);
+	size_t done = 0;
+	int err = 0;
+
+	if (fd < 0)
+		return -1;
+
+	while (done < read->len) {
+		const ssize_t bytes = pread(fd, (char *)read->buf + done,
+					    read->len - done, read->offset + done);
+
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0)
+			err = errno;
+		if (bytes <= 0)
+			break;
+		done += bytes;
+	}
+
+	close(fd);
+	if (done == 0 && err != 0) {
+		errno = err;
+		return -1;
+	}
+	return done;
+}
+
+static void reset_results(struct procbatch_read *reads, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		reads[i].result = 0;
+		reads[i].err = 0;
+	}
+}
+
+// As procbatch_read(), only reads past the start of a file never go through
+// procfd_pread()'s reopen on an empty read unless retry_empty is set.
+static bool do_read(struct procbatch_read *reads, size_t count,
+		    bool retry_empty)
+{
+	struct batch_file *files = NULL;
+	size_t i, num_files = 0;
+	bool *ended = NULL, via_uring = false;
+	int *fds = NULL;
+	bool ret = true;
+
+	reset_results(reads, count);
+	if (count == 0)
+		return true;
+
+	pthread_mutex_lock(&lock);
+
+	if (!setup_uring())
+		goto fallback;
+
+	fds = (int *)malloc(count * sizeof(*fds));
+	ended = (bool *)calloc(count, sizeof(*ended));
+	if (fds != NULL && ended != NULL)
+		files = open_files(reads, count, fds, &num_files);
+	if (files == NULL)
+		goto fallback;
+
+	via_uring = uring_read(reads, count, fds, ended);
+	if (!via_uring) {
+		// Don't trust anything from a broken ring.
+		disable_uring();
+		reset_results(reads, count);
+	}
+
+fallback:
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < count; i++) {
+		struct procbatch_read *read = &reads[i];
+
+		// Redo failures and empty reads (which may be a process that
+		// has exited under a reused pid) via procfd, which reopens,
+		// unless an empty read past the start is expected.
+		if (read->len > 0 && (read->result < 0 ||
+				      (read->result == 0 &&
+				       (!via_uring || retry_empty ||
+					read->offset == 0)))) {
+			if (retry_empty || read->offset == 0)
+				read->result = procfd_pread(read->pid, read->name,
+							    read->buf, read->len,
+							    read->offset);
+			else
+				read->result = pread_noretry(read);
+			read->err = read->result < 0 ? errno : 0;
+		}
+
+		if (read->result < 0)
+			ret = false;
+	}
+
+	if (files != NULL)
+		close_files(files, num_files);
+	free(fds);
+	free(ended);
+	return ret;
+}
+
+bool procbatch_read(struct procbatch_read *reads, size_t count)
+{
+	return do_read(reads, count, true);
+}
+
+struct u64_entry {
+	uint64_t index;
+	size_t pos;
+};
+
+static int cmp_u64_entry(const void *a, const void *b)
+{
+	const uint64_t x = ((const struct u64_entry *)a)->index;
+	const uint64_t y = ((const struct u64_entry *)b)->index;
+
+	return x < y ? -1 : x > y;
+}
+
+bool procbatch_read_u64s(const char *pid, const char *const *names,
+			 size_t num_files, const uint64_t *indices, size_t count,
+			 uint64_t *const *outs)
+{
+	struct procbatch_read *reads = NULL;
+	struct u64_entry *entries;
+	size_t i, j, f, num_entries = 0, num_runs = 0, total = 0;
+	uint64_t *buf = NULL;
+	bool ret = false;
+	int err = 0;
+
+	for (f = 0; f < num_files; f++) {
+		for (i = 0; i < count; i++)
+			outs[f][i] = PROCBATCH_INVALID;
+	}
+
+	entries = (struct u64_entry *)malloc((count ? count : 1) *
+					     sizeof(*entries));
+	if (entries == NULL)
+		return false;
+
+	for (i = 0; i < count; i++) {
+		if (indices[i] == PROCBATCH_INVALID)
+			continue;
+
+		entries[num_entries].index = indices[i];
+		entries[num_entries].pos = i;
+		num_entries++;
+	}
+	qsort(entries, num_entries, sizeof(*entries), cmp_u64_entry);
+
+	// At most one run per entry, each read from every file.
+	reads = (struct procbatch_read *)calloc((num_entries ? num_entries : 1) *
+						num_files, sizeof(*reads));
+	if (reads == NULL)
+		goto out;
+
+	for (i = 0; i < num_entries; i = j) {
+		const uint64_t first = entries[i].index;
+		uint64_t last = first;
+
+		// Extend the run while the next entry is close enough.
+		for (j = i + 1; j < num_entries; j++) {
+			const uint64_t index = entries[j].index;
+
+			if (index - last > MAX_GAP || index - first >= MAX_RUN)
+				break;
+			last = index;
+		}
+
+		reads[num_runs].offset = first * sizeof(uint64_t);
+		reads[num_runs].len = (last - first + 1) * sizeof(uint64_t);
+		total += last - first + 1;
+		num_runs++;
+	}
+
+	buf = (uint64_t *)malloc((total ? total : 1) * num_files * sizeof(*buf));
+	if (buf == NULL)
+		goto out;
+
+	// Runs for file f are at reads[f * num_runs], all issued as one batch.
+	total = 0;
+	for (f = 0; f < num_files; f++) {
+		for (i = 0; i < num_runs; i++) {
+			struct procbatch_read *read = &reads[f * num_runs + i];
+
+			*read = reads[i];
+			read->pid = pid;
+			read->name = names[f];
+			read->buf = &buf[total];
+			total += read->len / sizeof(uint64_t);
+		}
+	}
+
+	ret = procbatch_read(reads, num_runs * num_files);
+
+	for (f = 0; f < num_files; f++) {
+		// Runs were generated in entry order, so walk them together.
+		for (i = 0, j = 0; i < num_runs; i++) {
+			const struct procbatch_read *read = &reads[f * num_runs + i];
+			const uint64_t first = read->offset / sizeof(uint64_t);
+			const uint64_t *run = (const uint64_t *)read->buf;
+			const uint64_t num_read = read->result < 0 ? 0 :
+				read->result / sizeof(uint64_t);
+
+			if (read->result < 0 && err == 0)
+				err = read->err;
+
+			// A short read leaves the remainder PROCBATCH_INVALID.
+			for (; j < num_entries; j++) {
+				const uint64_t offset = entries[j].index - first;
+
+				if (offset >= read->len / sizeof(uint64_t))
+					break;
+				if (offset < num_read)
+					outs[f][entries[j].pos] = run[offset];
+			}
+		}
+	}
+
+out:
+	free(entries);
+	free(reads);
+	free(buf);
+	if (!ret && err != 0)
+		errno = err;
+	return ret;
+}
+
+bool procbatch_read_text(struct procbatch_text *texts, size_t count)
+{
+	struct procbatch_read *reads;
+	size_t *active, *capacity;
+	size_t i, num_active;
+	bool ret = true;
+
+	reads = (struct procbatch_read *)calloc(count ? count : 1, sizeof(*reads));
+	active = (size_t *)malloc((count ? count : 1) * sizeof(*active));
+	capacity = (size_t *)calloc(count ? count : 1, sizeof(*capacity));
+	if (reads == NULL || active == NULL || capacity == NULL) {
+		free(reads);
+		free(active);
+		free(capacity);
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		texts[i].text = NULL;
+		texts[i].len = 0;
+		texts[i].err = 0;
+		active[i] = i;
+	}
+	num_active = count;
+
+	while (num_active > 0) {
+		size_t num_still_active = 0;
+
+		for (i = 0; i < num_active; i++) {
+			struct procbatch_text *text = &texts[active[i]];
+			struct procbatch_read *read = &reads[i];
+
+			// Room for the next chunk and a terminator.
+			if (capacity[active[i]] < text->len + TEXT_CHUNK + 1) {
+				const size_t new_capacity =
+					(text->len + TEXT_CHUNK + 1) * 2;
+				char *new_text = (char *)realloc(text->text,
+								 new_capacity);
+
+				if (new_text == NULL) {
+					free(reads);
+					free(active);
+					free(capacity);
+					return false;
+				}
+				text->text = new_text;
+				capacity[active[i]] = new_capacity;
+			}
+
+			read->pid = text->pid;
+			read->name = text->name;
+			read->offset = text->len;
+			read->buf = &text->text[text->len];
+			read->len = TEXT_CHUNK;
+		}
+
+		// Reaching the end of a seq_file is expected, and reading it
+		// again via procfd would restart it from scratch.
+		do_read(reads, num_active, false);
+
+		for (i = 0; i < num_active; i++) {
+			struct procbatch_text *text = &texts[active[i]];
+			const struct procbatch_read *read = &reads[i];
+
+			if (read->result < 0) {
+				free(text->text);
+				text->text = NULL;
+				text->len = 0;
+				text->err = read->err;
+				ret = false;
+				continue;
+			}
+
+			text->len += read->result;
+			text->text[text->len] = '\0';
+			if (read->result > 0)
+				active[num_still_active++] = active[i];
+		}
+
+		num_active = num_still_active;
+	}
+
+	free(reads);
+	free(active);
+	free(capacity);
+	return ret;
+}
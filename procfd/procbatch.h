@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Batched reads of the /proc files procfd caches. Every read in a batch is
+// queued on an io_uring and submitted with a single io_uring_enter() which
+// also waits for them all, reading into a registered buffer so the kernel
+// needn't pin and map our memory per request. Snapshotting many VMAs or many
+// processes then overlaps their I/O rather than issuing blocking reads one
+// at a time.
+//
+// If io_uring isn't available, or PROCBATCH_NO_URING is set in the
+// environment, each read falls back to a pread() via procfd. Reads which fail
+// or come back empty are also retried that way, so procfd's handling of
+// exited processes and permissions still applies.
+//
+// Safe to use from multiple threads, though batches are serialised.
+
+// Entries which weren't, or couldn't be, read by procbatch_read_u64s().
+#define PROCBATCH_INVALID (~(uint64_t)0)
+
+struct procbatch_read {
+	// As for procfd_pread().
+	const char *pid, *name;
+	uint64_t offset;
+	void *buf;
+	size_t len;
+
+	// Output: bytes read, short only at EOF, or -1 with err set.
+	ssize_t result;
+	int err;
+};
+
+struct procbatch_text {
+	// As for procfd_pread().
+	const char *pid, *name;
+
+	// Output: the whole file, NUL-terminated, which the caller frees. NULL
+	// with err set on error.
+	char *text;
+	size_t len;
+	int err;
+};
+
+// Perform count reads. Returns false if any failed.
+bool procbatch_read(struct procbatch_read *reads, size_t count);
+
+// Read the uint64 entry at each of indices[] from each of num_files files
+// /proc/$pid/$names[f] (or /proc/$names[f] if pid is NULL) into outs[f][].
+// Indices of PROCBATCH_INVALID are skipped. Indices are sorted and runs of
+// nearby entries coalesced into a single read, and the reads for all files
+// are issued as one batch, e.g. kpageflags and kpagecount for a set of PFNs.
+// Entries which can't be read are set to PROCBATCH_INVALID. Returns false
+// with errno set if any read failed.
+bool procbatch_read_u64s(const char *pid, const char *const *names,
+			 size_t num_files, const uint64_t *indices, size_t count,
+			 uint64_t *const *outs);
+
+// Read the whole of count text files such as smaps. seq_file hands back a
+// buffer's worth per read, so this takes several rounds, each reading the
+// next chunk of every unfinished file as one batch. Returns false if any
+// failed.
+bool procbatch_read_text(struct procbatch_text *texts, size_t count);
@@ -0,0 +1,231 @@
+#include "procfd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Past this many files, we close the least recently used.
+#define MAX_ENTRIES (64)
+#define MAX_PATH (64)
+
+// An open file, referenced by its cache entry and each read in flight on it,
+// so we can evict or reopen it while other threads read without the lock.
+struct procfd_file {
+	int fd;
+	unsigned refs;
+};
+
+struct procfd_entry {
+	char path[MAX_PATH];
+	bool per_pid;
+	// NULL if the open failed with err, which we're remembering.
+	struct procfd_file *file;
+	int err;
+	uint64_t last_used;
+};
+
+static struct procfd_entry entries[MAX_ENTRIES];
+static size_t num_entries;
+static uint64_t use_counter;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Drop a reference to file, closing it if it was the last. Must hold lock.
+static void put_file(struct procfd_file *file)
+{
+	if (file == NULL || --file->refs > 0)
+		return;
+
+	close(file->fd);
+	free(file);
+}
+
+// Take a reference to the entry's file, if open. Must hold lock.
+static struct procfd_file *get_file(struct procfd_entry *entry)
+{
+	if (entry->file != NULL)
+		entry->file->refs++;
+	return entry->file;
+}
+
+static void open_entry(struct procfd_entry *entry)
+{
+	int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+
+	entry->file = NULL;
+	entry->err = fd < 0 ? errno : 0;
+	if (fd < 0)
+		return;
+
+	entry->file = (struct procfd_file *)malloc(sizeof(*entry->file));
+	if (entry->file == NULL) {
+		close(fd);
+		entry->err = ENOMEM;
+		return;
+	}
+	entry->file->fd = fd;
+	entry->file->refs = 1;
+}
+
+static void close_entry(struct procfd_entry *entry)
+{
+	put_file(entry->file);
+	entry->file = NULL;
+}
+
+// Find or open the entry for path. Must hold lock.
+static struct procfd_entry *get_entry(const char *path, bool per_pid)
+{
+	struct procfd_entry *entry = NULL;
+	size_t i;
+
+	for (i = 0; i < num_entries; i++) {
+		if (!strcmp(entries[i].path, path)) {
+			entry = &entries[i];
+			break;
+		}
+	}
+
+	if (entry == NULL) {
+		if (num_entries < MAX_ENTRIES) {
+			entry = &entries[num_entries++];
+		} else {
+			entry = &entries[0];
+			for (i = 1; i < num_entries; i++) {
+				if (entries[i].last_used < entry->last_used)
+					entry = &entries[i];
+			}
+			close_entry(entry);
+		}
+
+		strcpy(entry->path, path);
+		entry->per_pid = per_pid;
+		open_entry(entry);
+	} else if (entry->file == NULL && per_pid &&
+		   entry->err != EACCES && entry->err != EPERM) {
+		// The process may exist now, only permissions are sticky.
+		open_entry(entry);
+	}
+
+	entry->last_used = ++use_counter;
+	return entry;
+}
+
+static void make_path(char *path, const char *pid, const char *name)
+{
+	if (pid == NULL)
+		snprintf(path, MAX_PATH, "/proc/%s", name);
+	else if (!strcmp(pid, "self"))
+		snprintf(path, MAX_PATH, "/proc/%d/%s", getpid(), name);
+	else
+		snprintf(path, MAX_PATH, "/proc/%s/%s", pid, name);
+}
+
+ssize_t procfd_pread(const char *pid, const char *name, void *buf, size_t len,
+		     uint64_t offset)
+{
+	struct procfd_entry *entry;
+	struct procfd_file *file;
+	char path[MAX_PATH];
+	bool retried = false;
+	ssize_t bytes;
+	int err = 0;
+
+	make_path(path, pid, name);
+
+	pthread_mutex_lock(&lock);
+	entry = get_entry(path, pid != NULL);
+	file = get_file(entry);
+	err = entry->err;
+	pthread_mutex_unlock(&lock);
+
+retry:
+	if (file == NULL) {
+		bytes = -1;
+		goto out;
+	}
+
+	// Read without the lock, our reference keeps the fd open.
+	bytes = pread(file->fd, buf, len, offset);
+	if (bytes < 0)
+		err = errno;
+
+	pthread_mutex_lock(&lock);
+	// An fd on a process which has exited reads nothing (or ESRCH).
+	if (pid != NULL && !retried && len > 0 &&
+	    (bytes == 0 || (bytes < 0 && err == ESRCH))) {
+		// The entry may have been evicted or reopened meanwhile.
+		entry = get_entry(path, true);
+		if (entry->file == file) {
+			close_entry(entry);
+			open_entry(entry);
+		}
+		put_file(file);
+		file = get_file(entry);
+		err = entry->err;
+		pthread_mutex_unlock(&lock);
+
+		retried = true;
+		goto retry;
+	}
+	put_file(file);
+	pthread_mutex_unlock(&lock);
+
+out:
+	if (bytes < 0)
+		errno = err;
+	return bytes;
+}
+
+ssize_t procfd_read_u64s(const char *pid, const char *name, uint64_t index,
+			 uint64_t *out, size_t count)
+{
+	const ssize_t bytes = procfd_pread(pid, name, out,
+					   count * sizeof(uint64_t),
+					   index * sizeof(uint64_t));
+
+	if (bytes < 0)
+		return -1;
+
+	return bytes / sizeof(uint64_t);
+}
+
+int procfd_dup(const char *pid, const char *name)
+{
+	struct procfd_entry *entry;
+	char path[MAX_PATH];
+	int fd, err = 0;
+
+	make_path(path, pid, name);
+
+	pthread_mutex_lock(&lock);
+	entry = get_entry(path, pid != NULL);
+	if (entry->file == NULL) {
+		err = entry->err;
+		fd = -1;
+	} else {
+		fd = fcntl(entry->file->fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0)
+			err = errno;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (fd < 0)
+		errno = err;
+	return fd;
+}
+
+void procfd_reset(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < num_entries; i++)
+		close_entry(&entries[i]);
+	num_entries = 0;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Cache of long-lived fds for the /proc files we read uint64 entries from:
+// per-pid files such as /proc/$pid/pagemap and global ones such as
+// /proc/kpageflags and /proc/kpagecount. Files are opened on first use and
+// read with pread(), so repeated lookups cost a single syscall.
+//
+// A pid of "self" is resolved to our actual pid, so a forked child gets its
+// own pagemap rather than silently reading its parent's. If a per-pid file
+// reads back empty, its process has gone (its pid may since have been
+// reused), so we reopen once and retry. Files which can't be opened due to
+// permissions (typically the global files when not root) are remembered so
+// we don't retry the open on every read.
+//
+// Safe to use from multiple threads, which read in parallel: the lock covers
+// only the cache itself, not the reads.
+
+// Read up to count uint64 entries starting at entry index of
+// /proc/$pid/$name, or /proc/$name if pid is NULL. Returns the number of
+// entries read, which is short only at EOF, or -1 with errno set on error.
+ssize_t procfd_read_u64s(const char *pid, const char *name, uint64_t index,
+			 uint64_t *out, size_t count);
+
+// Read up to len bytes at byte offset of /proc/$pid/$name, or /proc/$name if
+// pid is NULL, as pread() does.
+ssize_t procfd_pread(const char *pid, const char *name, void *buf, size_t len,
+		     uint64_t offset);
+
+// Return a duplicate of the cached fd for /proc/$pid/$name, or /proc/$name if
+// pid is NULL, for callers which issue I/O on it asynchronously (so that it
+// stays valid if the cache evicts the original). The caller closes it.
+// Returns -1 with errno set on error.
+int procfd_dup(const char *pid, const char *name);
+
+// Close and forget every cached fd, e.g. after gaining privileges.
+void procfd_reset(void);
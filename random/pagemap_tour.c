@@ -1,3 +1,5 @@
+#include "procfd.h"
+
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -17,23 +19,19 @@
 /* 'Bits 0-54  page frame number (PFN) if present */
 #define PAGEMAP_PFN_MASK ((1UL << 55) - 1)
 
-static uint64_t read_u64(const char *path, uint64_t offset)
+/* procfd keeps the files open across calls. */
+static uint64_t read_u64(const char *pid, const char *name, uint64_t index)
 {
 	uint64_t ret;
-	int fd = open(path, O_RDWR);
-
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	const ssize_t num_read = procfd_read_u64s(pid, name, index, &ret, 1);
 
-	if (lseek(fd, offset, SEEK_SET) != offset) {
-		perror("lseek");
+	if (num_read < 0) {
+		perror(name);
 		exit(1);
 	}
 
-	if (read(fd, &ret, sizeof(ret)) != sizeof(ret)) {
-		perror("read");
+	if (num_read != 1) {
+		fprintf(stderr, "%s: EOF\n", name);
 		exit(1);
 	}
 
@@ -42,21 +40,20 @@ static uint64_t read_u64(const char *path, uint64_t offset)
 
 static uint64_t read_pagemap(const void *ptr)
 {
-	const uint64_t virt_page_num = (uint64_t)ptr / getpagesize();
 	/* There is 'one 64-bit value for each virtual page'. */
-	const uint64_t offset = virt_page_num * sizeof(uint64_t);
+	const uint64_t virt_page_num = (uint64_t)ptr / getpagesize();
 
-	return read_u64("/proc/self/pagemap", offset);
+	return read_u64("self", "pagemap", virt_page_num);
 }
 
 static uint64_t read_kpageflags(uint64_t pfn)
 {
-	return read_u64("/proc/kpageflags", pfn * sizeof(uint64_t));
+	return read_u64(NULL, "kpageflags", pfn);
 }
 
 uint64_t read_mapcount(uint64_t pfn)
 {
-	return read_u64("/proc/kpagecount", pfn * sizeof(uint64_t));
+	return read_u64(NULL, "kpagecount", pfn);
 }
 
 static void describe_swapped(uint64_t pagemap)
@@ -0,0 +1,663 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// A generalisation of scan.c: compare scanning a fake memmap in physical
+// order against walking it in LRU order, via an array of pointers or via
+// linked lists, across:
+//
+// - Entry size and placement of the hot field relative to the list link, so
+//   e.g. a 64 byte struct page whose age shares a cache line with ->next can
+//   be compared with a 128 byte one where they don't.
+// - Software prefetch at distance k for the array scan, and of the next
+//   entry's hot field as soon as its address is known for list walks.
+// - Memmap backed by base pages, THP or hugetlb, showing how much TLB misses
+//   contribute.
+// - Threads scanning partitions of the memmap, array or LRU.
+// - Batched pointer chasing, the LRU being split into several lists walked
+//   in an interleaved fashion so their misses overlap.
+//
+// Each result is reported relative to a physical scan of the same layout,
+// backing and thread count, so LRU designs that stay close to 1x are the
+// scan-friendly ones.
+
+#define MAX_LIST_LEN (16)
+#define MAX_BATCH (64)
+#define THP_SIZE (2UL << 20)
+
+enum backing {
+	BACKING_ANON,
+	BACKING_THP,
+	BACKING_HUGETLB,
+	NUM_BACKINGS
+};
+
+static const char *const backing_names[] = { "anon", "thp", "hugetlb" };
+
+enum scan_type {
+	SCAN_PHYS,
+	SCAN_ARRAY,
+	SCAN_LIST,
+	SCAN_LIST_PREFETCH,
+};
+
+static const char *const scan_names[] = { "phys", "array", "list", "list-pf" };
+
+// A comma separated list of values for a parameter.
+struct param_list {
+	unsigned long vals[MAX_LIST_LEN];
+	size_t count;
+};
+
+struct options {
+	size_t entries;
+	unsigned long seed;
+	unsigned int repeats;
+	size_t link_off;
+	struct param_list sizes, hot_offs, threads, distances, batches;
+	bool backings[NUM_BACKINGS];
+};
+
+// The memmap being scanned and the layout of its entries.
+struct memmap {
+	// The mapping and the memmap within it, aligned for THP.
+	char *map, *base;
+	size_t map_size;
+	size_t stride, hot_off, link_off;
+	// Entries in LRU order.
+	char **lru;
+};
+
+struct scan_args {
+	pthread_t thread;
+	const struct memmap *mm;
+	enum scan_type type;
+	// Range of the memmap or LRU array to scan.
+	size_t from, to;
+	unsigned long param;
+	// For list scans, the heads of this thread's lists.
+	char **heads;
+	size_t nr_heads;
+
+	uint64_t start_ns, end_ns;
+	uint64_t total;
+};
+
+static struct options opts;
+static pthread_barrier_t barrier;
+static size_t cache_line;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline uint64_t hot(const struct memmap *mm, const char *entry)
+{
+	return *(const uint64_t *)(entry + mm->hot_off);
+}
+
+static inline char *next(const struct memmap *mm, const char *entry)
+{
+	return *(char *const *)(entry + mm->link_off);
+}
+
+static uint64_t scan_phys(const struct memmap *mm, size_t from, size_t to)
+{
+	const char *entry = mm->base + from * mm->stride;
+	uint64_t total = 0;
+	size_t i;
+
+	for (i = from; i < to; i++, entry += mm->stride)
+		total += hot(mm, entry);
+
+	return total;
+}
+
+static uint64_t scan_array(const struct memmap *mm, size_t from, size_t to,
+			   size_t dist)
+{
+	char *const *lru = mm->lru;
+	uint64_t total = 0;
+	size_t i = from;
+
+	// Split the loop so the prefetching part needn't check bounds.
+	if (dist > 0 && to - from > dist) {
+		for (; i < to - dist; i++) {
+			__builtin_prefetch(lru[i + dist] + mm->hot_off);
+			total += hot(mm, lru[i]);
+		}
+	}
+
+	for (; i < to; i++)
+		total += hot(mm, lru[i]);
+
+	return total;
+}
+
+// Walk nr lists at once, a step of each in turn, so up to nr misses are in
+// flight rather than one.
+static uint64_t scan_lists(const struct memmap *mm, char *const *heads,
+			   size_t nr, bool prefetch)
+{
+	char *curr[MAX_BATCH];
+	uint64_t total = 0;
+	size_t active = 0, i;
+
+	for (i = 0; i < nr; i++) {
+		curr[i] = heads[i];
+		active += curr[i] != NULL;
+	}
+
+	while (active > 0) {
+		for (i = 0; i < nr; i++) {
+			char *entry = curr[i], *succ;
+
+			if (entry == NULL)
+				continue;
+
+			succ = next(mm, entry);
+			// The hot field of the next entry may be on another line
+			// to its link, so fetch it alongside.
+			if (prefetch && succ != NULL)
+				__builtin_prefetch(succ + mm->hot_off);
+
+			total += hot(mm, entry);
+			curr[i] = succ;
+			active -= succ == NULL;
+		}
+	}
+
+	return total;
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scan_args *args = arg;
+	const struct memmap *mm = args->mm;
+
+	pthread_barrier_wait(&barrier);
+	args->start_ns = now_ns();
+
+	switch (args->type) {
+	case SCAN_PHYS:
+		args->total = scan_phys(mm, args->from, args->to);
+		break;
+	case SCAN_ARRAY:
+		args->total = scan_array(mm, args->from, args->to, args->param);
+		break;
+	case SCAN_LIST:
+	case SCAN_LIST_PREFETCH:
+		args->total = scan_lists(mm, args->heads, args->nr_heads,
+					 args->type == SCAN_LIST_PREFETCH);
+		break;
+	}
+
+	args->end_ns = now_ns();
+	return NULL;
+}
+
+// Link the LRU into nr lists of (near) equal length, each a contiguous run
+// of it, storing their heads.
+static void link_lists(struct memmap *mm, size_t nr, char **heads)
+{
+	size_t list, i;
+
+	for (list = 0; list < nr; list++) {
+		const size_t from = opts.entries * list / nr;
+		const size_t to = opts.entries * (list + 1) / nr;
+
+		heads[list] = from < to ? mm->lru[from] : NULL;
+		for (i = from; i < to; i++) {
+			char **link = (char **)(mm->lru[i] + mm->link_off);
+
+			*link = i + 1 < to ? mm->lru[i + 1] : NULL;
+		}
+	}
+}
+
+// Run a scan across nr_threads threads, returning the best wall time of
+// opts.repeats runs in ns.
+static uint64_t run_scan(struct memmap *mm, enum scan_type type,
+			 unsigned long param, size_t nr_threads)
+{
+	struct scan_args args[nr_threads];
+	char **heads = NULL;
+	uint64_t best = UINT64_MAX;
+	unsigned int rep;
+	size_t i;
+
+	// List scans get param lists per thread.
+	if (type == SCAN_LIST || type == SCAN_LIST_PREFETCH) {
+		heads = malloc(nr_threads * param * sizeof(*heads));
+		if (heads == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		link_lists(mm, nr_threads * param, heads);
+	}
+
+	for (rep = 0; rep < opts.repeats; rep++) {
+		uint64_t start = UINT64_MAX, end = 0;
+
+		pthread_barrier_init(&barrier, NULL, nr_threads);
+
+		for (i = 0; i < nr_threads; i++) {
+			struct scan_args *arg = &args[i];
+
+			memset(arg, 0, sizeof(*arg));
+			arg->mm = mm;
+			arg->type = type;
+			arg->param = param;
+			arg->from = opts.entries * i / nr_threads;
+			arg->to = opts.entries * (i + 1) / nr_threads;
+			if (heads != NULL) {
+				arg->heads = &heads[i * param];
+				arg->nr_heads = param;
+			}
+
+			if (pthread_create(&arg->thread, NULL, scan_thread, arg)) {
+				fprintf(stderr, "pthread_create failed\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		for (i = 0; i < nr_threads; i++) {
+			pthread_join(args[i].thread, NULL);
+			if (args[i].start_ns < start)
+				start = args[i].start_ns;
+			if (args[i].end_ns > end)
+				end = args[i].end_ns;
+		}
+
+		pthread_barrier_destroy(&barrier);
+
+		if (end - start < best)
+			best = end - start;
+	}
+
+	free(heads);
+	return best;
+}
+
+static void print_result(const struct memmap *mm, enum backing backing,
+			 size_t nr_threads, enum scan_type type,
+			 const char *param, uint64_t ns, uint64_t phys_ns)
+{
+	printf("%-8s %6zu %4zu %4zu %-8s %-6s %10.2f %8.2fx\n",
+	       backing_names[backing], mm->stride, mm->hot_off, nr_threads,
+	       scan_names[type], param, (double)ns / opts.entries,
+	       phys_ns ? (double)ns / phys_ns : 0.);
+}
+
+static void run_layout(struct memmap *mm, enum backing backing)
+{
+	size_t t, j;
+
+	for (t = 0; t < opts.threads.count; t++) {
+		const size_t nr_threads = opts.threads.vals[t];
+		const uint64_t phys_ns = run_scan(mm, SCAN_PHYS, 0, nr_threads);
+		// Only worth prefetching the hot field if it's on another line.
+		const bool split = mm->hot_off / cache_line !=
+			mm->link_off / cache_line;
+		char param[16];
+
+		print_result(mm, backing, nr_threads, SCAN_PHYS, "-", phys_ns,
+			     phys_ns);
+
+		for (j = 0; j < opts.distances.count; j++) {
+			const unsigned long dist = opts.distances.vals[j];
+
+			snprintf(param, sizeof(param), "pf=%lu", dist);
+			print_result(mm, backing, nr_threads, SCAN_ARRAY, param,
+				     run_scan(mm, SCAN_ARRAY, dist, nr_threads),
+				     phys_ns);
+		}
+
+		for (j = 0; j < opts.batches.count; j++) {
+			const unsigned long batch = opts.batches.vals[j];
+
+			snprintf(param, sizeof(param), "b=%lu", batch);
+			print_result(mm, backing, nr_threads, SCAN_LIST, param,
+				     run_scan(mm, SCAN_LIST, batch, nr_threads),
+				     phys_ns);
+			if (split)
+				print_result(mm, backing, nr_threads,
+					     SCAN_LIST_PREFETCH, param,
+					     run_scan(mm, SCAN_LIST_PREFETCH, batch,
+						      nr_threads),
+					     phys_ns);
+		}
+	}
+}
+
+static bool alloc_memmap(struct memmap *mm, enum backing backing)
+{
+	const size_t size = opts.entries * mm->stride;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	char *ptr;
+
+	mm->map_size = size;
+	switch (backing) {
+	case BACKING_ANON:
+		break;
+	case BACKING_THP:
+		// Leave room to align to a THP boundary.
+		mm->map_size = size + THP_SIZE;
+		break;
+	case BACKING_HUGETLB:
+		mm->map_size = (size + THP_SIZE - 1) & ~(THP_SIZE - 1);
+		flags |= MAP_HUGETLB;
+		break;
+	default:
+		return false;
+	}
+
+	ptr = mmap(NULL, mm->map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (ptr == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s, skipping\n", backing_names[backing],
+			strerror(errno));
+		return false;
+	}
+	mm->map = mm->base = ptr;
+
+	if (backing == BACKING_ANON) {
+		madvise(ptr, mm->map_size, MADV_NOHUGEPAGE);
+	} else if (backing == BACKING_THP) {
+		mm->base = (char *)(((uintptr_t)ptr + THP_SIZE - 1) & ~(THP_SIZE - 1));
+		if (madvise(mm->base, size, MADV_HUGEPAGE))
+			perror("madvise MADV_HUGEPAGE");
+	}
+
+	// Fault it all in now so we aren't timing that.
+	memset(mm->base, 0, size);
+	return true;
+}
+
+static void free_memmap(struct memmap *mm)
+{
+	munmap(mm->map, mm->map_size);
+}
+
+// Fill in hot fields and a shuffled LRU order. The LRU is the same for every
+// layout and backing, given the seed.
+static void populate(struct memmap *mm, const size_t *order)
+{
+	size_t i;
+
+	for (i = 0; i < opts.entries; i++) {
+		char *entry = mm->base + i * mm->stride;
+
+		*(uint64_t *)(entry + mm->hot_off) = i;
+		mm->lru[i] = mm->base + order[i] * mm->stride;
+	}
+}
+
+static size_t *make_order(void)
+{
+	size_t *order = malloc(opts.entries * sizeof(*order));
+	size_t i;
+
+	if (order == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < opts.entries; i++)
+		order[i] = i;
+
+	// Knuth shuffle, as scan.c.
+	srand48(opts.seed);
+	for (i = 1; i < opts.entries; i++) {
+		const size_t j = (unsigned long)mrand48() % (i + 1);
+		const size_t tmp = order[j];
+
+		order[j] = order[i];
+		order[i] = tmp;
+	}
+
+	return order;
+}
+
+// A count with an optional K, M or G suffix (powers of 1024).
+static size_t parse_count(const char *str)
+{
+	char *end;
+	size_t val = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'G':
+		val <<= 10;
+		// fallthrough
+	case 'M':
+		val <<= 10;
+		// fallthrough
+	case 'K':
+		val <<= 10;
+		end++;
+		break;
+	}
+
+	return *end == '\0' ? val : 0;
+}
+
+static bool parse_list(const char *str, struct param_list *list)
+{
+	char *end;
+
+	list->count = 0;
+	do {
+		if (list->count == MAX_LIST_LEN)
+			return false;
+
+		errno = 0;
+		list->vals[list->count++] = strtoul(str, &end, 0);
+		if (errno != 0 || end == str)
+			return false;
+		str = end + 1;
+	} while (*end == ',');
+
+	return *end == '\0';
+}
+
+static bool parse_backings(const char *str)
+{
+	char buf[64], *tok, *save;
+	int i;
+
+	if (strlen(str) >= sizeof(buf))
+		return false;
+	strcpy(buf, str);
+
+	memset(opts.backings, 0, sizeof(opts.backings));
+	for (tok = strtok_r(buf, ",", &save); tok != NULL;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < NUM_BACKINGS; i++) {
+			if (!strcmp(tok, backing_names[i]))
+				break;
+		}
+		if (i == NUM_BACKINGS)
+			return false;
+		opts.backings[i] = true;
+	}
+
+	return true;
+}
+
+static bool check_options(void)
+{
+	size_t i, j;
+
+	if (opts.entries == 0 || opts.repeats == 0 || opts.link_off % 8 != 0)
+		return false;
+
+	for (i = 0; i < opts.threads.count; i++) {
+		if (opts.threads.vals[i] == 0)
+			return false;
+	}
+
+	for (i = 0; i < opts.batches.count; i++) {
+		if (opts.batches.vals[i] == 0 || opts.batches.vals[i] > MAX_BATCH)
+			return false;
+	}
+
+	for (i = 0; i < opts.sizes.count; i++) {
+		const size_t size = opts.sizes.vals[i];
+
+		if (size % 8 != 0 || opts.link_off + 8 > size)
+			return false;
+
+		for (j = 0; j < opts.hot_offs.count; j++) {
+			const size_t hot_off = opts.hot_offs.vals[j];
+
+			if (hot_off % 8 != 0 || hot_off == opts.link_off)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [-n entries] [-S sizes] [-H hot offsets] "
+		"[-L link offset] [-t threads] [-p distances] [-b batches] "
+		"[-m backings] [-r repeats] [-s seed]\n", bin);
+	fprintf(stderr, "  lists are comma separated\n");
+	fprintf(stderr, "  -n  memmap entries, K/M/G suffixes allowed (default 4M)\n");
+	fprintf(stderr, "  -S  entry sizes in bytes (default 64,128)\n");
+	fprintf(stderr, "  -H  hot field offsets, skipped where past the entry (default 24,64)\n");
+	fprintf(stderr, "  -L  list link offset (default 8, after flags)\n");
+	fprintf(stderr, "  -t  thread counts (default 1)\n");
+	fprintf(stderr, "  -p  array scan prefetch distances, 0 for none (default 0,8,32)\n");
+	fprintf(stderr, "  -b  lists walked at once per thread (default 1,4,16)\n");
+	fprintf(stderr, "  -m  memmap backings: anon, thp, hugetlb (default anon,thp)\n");
+	fprintf(stderr, "  -r  repeats, the best is reported (default 3)\n");
+	fprintf(stderr, "  -s  shuffle seed (default: time)\n");
+}
+
+int main(int argc, char **argv)
+{
+	size_t *order;
+	size_t s, h;
+	int opt, b;
+	long line;
+
+	opts.entries = 4UL << 20;
+	opts.seed = time(NULL);
+	opts.repeats = 3;
+	opts.link_off = 8;
+	parse_list("64,128", &opts.sizes);
+	parse_list("24,64", &opts.hot_offs);
+	parse_list("1", &opts.threads);
+	parse_list("0,8,32", &opts.distances);
+	parse_list("1,4,16", &opts.batches);
+	opts.backings[BACKING_ANON] = opts.backings[BACKING_THP] = true;
+
+	while ((opt = getopt(argc, argv, "n:S:H:L:t:p:b:m:r:s:h")) != -1) {
+		bool ok = true;
+
+		switch (opt) {
+		case 'n':
+			opts.entries = parse_count(optarg);
+			break;
+		case 'S':
+			ok = parse_list(optarg, &opts.sizes);
+			break;
+		case 'H':
+			ok = parse_list(optarg, &opts.hot_offs);
+			break;
+		case 'L':
+			opts.link_off = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			ok = parse_list(optarg, &opts.threads);
+			break;
+		case 'p':
+			ok = parse_list(optarg, &opts.distances);
+			break;
+		case 'b':
+			ok = parse_list(optarg, &opts.batches);
+			break;
+		case 'm':
+			ok = parse_backings(optarg);
+			break;
+		case 'r':
+			opts.repeats = atoi(optarg);
+			break;
+		case 's':
+			opts.seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			ok = false;
+			break;
+		}
+
+		if (!ok) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc || !check_options()) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	line = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+	cache_line = line > 0 ? line : 64;
+
+	order = make_order();
+
+	printf("%zu entries, seed %lu, %zu byte cache lines\n", opts.entries,
+	       opts.seed, cache_line);
+	printf("%-8s %6s %4s %4s %-8s %-6s %10s %9s\n", "backing", "size", "hot",
+	       "thr", "scan", "param", "ns/entry", "vs phys");
+
+	for (b = 0; b < NUM_BACKINGS; b++) {
+		if (!opts.backings[b])
+			continue;
+
+		for (s = 0; s < opts.sizes.count; s++) {
+			for (h = 0; h < opts.hot_offs.count; h++) {
+				struct memmap mm = {
+					.stride = opts.sizes.vals[s],
+					.hot_off = opts.hot_offs.vals[h],
+					.link_off = opts.link_off,
+				};
+
+				if (mm.hot_off + 8 > mm.stride)
+					continue;
+
+				mm.lru = malloc(opts.entries * sizeof(*mm.lru));
+				if (mm.lru == NULL) {
+					perror("malloc");
+					return EXIT_FAILURE;
+				}
+
+				if (alloc_memmap(&mm, b)) {
+					populate(&mm, order);
+					run_layout(&mm, b);
+					free_memmap(&mm);
+				}
+
+				free(mm.lru);
+			}
+		}
+	}
+
+	free(order);
+	return EXIT_SUCCESS;
+}
@@ -147,10 +147,8 @@ void lookup_vma_flags(void *ptr)
 		exit(1);
 	}
 
-	fflush(fp);
-	fclose(fp);
-
-	fp = fopen("/dev/vmaflags", "r");
+	// Answers are per open file, so read them back on the same stream.
+	rewind(fp);
 
 	if (fscanf(fp, "%lx", &flags) < 0) {
 		perror("reading from /dev/vmaflags");
@@ -107,17 +107,18 @@ char next_char(char chr)
 struct page_state {
 	explicit page_state(char* ptr)
 		: ptr{ptr}
-		, pagemap{read_pagemap((const void *)ptr)}
-		, pfn{extract_pfn(pagemap)}
 	{
+		const void *ptrs[] = { ptr };
+
+		// Uses cached fds, so sampling doesn't perturb what we're watching.
+		read_pageflags_batch(ptrs, 1, &pagemap, &pfn, &kpageflags,
+				     &mapcount);
 		if (pfn == INVALID_VALUE) {
 			kpageflags = 0;
 			mapcount = 0;
 			return;
 		}
 
-		kpageflags = read_kpageflags(pfn);
-		mapcount = read_mapcount(pfn);
 		if (!read_mapdata((const void*)ptr, &mapfields))
 			memset(&mapfields, 0, sizeof(map_data));
 	}
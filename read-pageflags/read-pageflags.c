@@ -1,13 +1,18 @@
 #include "read-pageflags.h"
+#include "procbatch.h"
+#include "procfd.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
 #include "linux/kernel-page-flags.h"
+#include "../kernel/exper/pfninfo.h"
 
 // Define this to output noisy additional /proc/self/maps data
 //#define EXTENDED_MAP_DATA
@@ -51,42 +56,76 @@
 
 #define CHECK_BIT(_val, _bit) ((_val & BIT_MASK(_bit)) == BIT_MASK(_bit))
 
-// Read a single uint64 from the specified path at the specified offset.
-static uint64_t read_u64(const char *path, uint64_t offset)
+enum proc_file {
+	PROC_PAGEMAP,
+	PROC_KPAGEFLAGS,
+	PROC_KPAGECOUNT,
+	NUM_PROC_FILES,
+};
+
+// procfd keeps the fds open for us.
+static const struct {
+	const char *pid, *name, *path;
+} proc_files[NUM_PROC_FILES] = {
+	{ "self", "pagemap", "/proc/self/pagemap" },
+	{ NULL, "kpageflags", "/proc/kpageflags" },
+	{ NULL, "kpagecount", "/proc/kpagecount" },
+};
+
+// Read count uint64s from the specified proc file starting at entry index,
+// returning the number read or -1 on error.
+static ssize_t read_u64s(enum proc_file file, uint64_t index, uint64_t *out,
+			 size_t count)
 {
-	FILE *fp = fopen(path, "r");
-	if (fp == NULL) {
-		const int err = errno;
-		fprintf(stderr, "Can't open %s: %s\n", path, strerror(err));
+	const ssize_t num = procfd_read_u64s(proc_files[file].pid,
+					     proc_files[file].name, index, out,
+					     count);
 
-		return INVALID_VALUE;
+	if (num < 0) {
+		const int err = errno;
+		fprintf(stderr, "Unable to read %s: %s\n", proc_files[file].path,
+			strerror(err));
 	}
 
-	uint64_t ret = 0;
+	return num;
+}
 
-	if (fseek(fp, offset, SEEK_SET) != 0) {
-		fprintf(stderr, "Can't seek to pointer offset in %s\n", path);
-		goto error_close;
-	}
+// Read a single uint64 from the specified proc file at the specified offset.
+static uint64_t read_u64(enum proc_file file, uint64_t offset)
+{
+	uint64_t ret;
+	const ssize_t num = read_u64s(file, offset / sizeof(uint64_t), &ret, 1);
 
-	if (fread(&ret, sizeof(ret), 1, fp) != 1) {
-		if (feof(fp))
-			fprintf(stderr, "EOF in %s?\n", path);
-		else if (ferror(fp))
-			fprintf(stderr, "Unable to read %s", path);
-		else
-			fprintf(stderr, "Unknown error on %s read", path);
+	if (num == 0)
+		fprintf(stderr, "EOF in %s?\n", proc_files[file].path);
+	if (num != 1)
+		return INVALID_VALUE;
 
-		goto error_close;
-	}
+	return ret;
+}
+
+// Read the uint64 entry at each of indices[] from each of num_files proc
+// files, which must share a pid, into outs[], INVALID_VALUE indices being
+// skipped. procbatch coalesces nearby entries and issues the reads for all
+// files together. Entries which can't be read are set to INVALID_VALUE.
+static bool read_u64_batch(const enum proc_file *files, size_t num_files,
+			   const uint64_t *indices, size_t count,
+			   uint64_t *const *outs)
+{
+	const char *names[NUM_PROC_FILES];
+	size_t i;
 
-	goto done_close;
+	for (i = 0; i < num_files; i++)
+		names[i] = proc_files[files[i]].name;
 
-error_close:
-	ret = INVALID_VALUE;
-done_close:
-	fclose(fp);
-	return ret;
+	if (procbatch_read_u64s(proc_files[files[0]].pid, names, num_files,
+				indices, count, outs))
+		return true;
+
+	for (i = 0; i < num_files; i++)
+		fprintf(stderr, "Unable to read %s: %s\n",
+			proc_files[files[i]].path, strerror(errno));
+	return false;
 }
 
 uint64_t extract_pfn(uint64_t val)
@@ -171,10 +210,8 @@ static int get_refcount(uint64_t pfn)
 		exit(1);
 	}
 
-	fflush(fp);
-	fclose(fp);
-
-	fp = fopen("/dev/refcount", "r");
+	// Answers are per open file, so read them back on the same stream.
+	rewind(fp);
 
 	int ret = 0;
 	if (fscanf(fp, "%d", &ret) < 0) {
@@ -200,12 +237,10 @@ static void print_page_buffers(uint64_t pfn)
 		exit(1);
 	}
 
-	fflush(fp);
-	fclose(fp);
-
-	fp = fopen("/dev/pagebuffers", "r");
+	// Answers are per open file, so read them back on the same stream.
+	rewind(fp);
 
-	int count = fread(buf, sizeof(char), sizeof(buf), fp);
+	int count = fread(buf, sizeof(char), sizeof(buf) - 1, fp);
 	if (count == 0) {
 		perror("reading from /dev/pagebuffers");
 		exit(1);
@@ -217,6 +252,146 @@ static void print_page_buffers(uint64_t pfn)
 	printf("page_buffers=%s ", buf);
 }
 
+// exper's /dev/pfninfo fd, -1 if not yet opened, -2 if unavailable.
+static int pfninfo_fd = -1;
+
+static int get_pfninfo_fd(void)
+{
+	int fd = __atomic_load_n(&pfninfo_fd, __ATOMIC_ACQUIRE);
+	int expected = -1;
+
+	if (fd != -1)
+		return fd;
+
+	fd = open("/dev/pfninfo", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		fd = -2;
+
+	// Another thread may have beaten us to it.
+	if (!__atomic_compare_exchange_n(&pfninfo_fd, &expected, fd, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		if (fd >= 0)
+			close(fd);
+		fd = expected;
+	}
+
+	return fd;
+}
+
+// Inspect count PFNs with a single ioctl to exper's /dev/pfninfo, if loaded.
+// out[i] describes pfns[i], with a pfn of INVALID_VALUE if the kernel skipped
+// it as a hole or offline. Returns false if the device is unavailable.
+static bool read_pfninfo(const uint64_t *pfns, size_t count,
+			 struct pfninfo_record *out)
+{
+	struct pfninfo_record *records;
+	struct pfninfo_query query;
+	const int fd = get_pfninfo_fd();
+	size_t i, j = 0;
+
+	if (fd < 0 || count == 0)
+		return false;
+
+	// The kernel packs records, skipping PFNs, so read into a scratch array
+	// and line them back up with the PFNs they came from.
+	records = (struct pfninfo_record *)malloc(count * sizeof(*records));
+	if (records == NULL)
+		return false;
+
+	query.pfns = (uintptr_t)pfns;
+	query.records = (uintptr_t)records;
+	query.count = count;
+	query.nr_records = 0;
+
+	if (ioctl(fd, PFNINFO_IOC_QUERY, &query)) {
+		perror("ioctl PFNINFO_IOC_QUERY");
+		free(records);
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (j < query.nr_records && records[j].pfn == pfns[i]) {
+			out[i] = records[j++];
+		} else {
+			memset(&out[i], 0, sizeof(out[i]));
+			out[i].pfn = INVALID_VALUE;
+		}
+	}
+
+	free(records);
+	return true;
+}
+
+static void print_bh_state(uint32_t state)
+{
+#define CHECK_BH(flag_, str_)		\
+	if (state & PFNINFO_BH_##flag_)	\
+		printf("%s", str_);
+
+	CHECK_BH(UPTODATE, "U");
+	CHECK_BH(DIRTY, "D");
+	CHECK_BH(LOCK, "L");
+	CHECK_BH(REQ, "R");
+	CHECK_BH(MAPPED, "M");
+	CHECK_BH(NEW, "N");
+	CHECK_BH(ASYNC_READ, "Ar");
+	CHECK_BH(ASYNC_WRITE, "Aw");
+	CHECK_BH(DELAY, "De");
+	CHECK_BH(BOUNDARY, "B");
+	CHECK_BH(WRITE_EIO, "Ew");
+	CHECK_BH(UNWRITTEN, "Un");
+	CHECK_BH(QUIET, "Q");
+	CHECK_BH(META, "Me");
+	CHECK_BH(PRIO, "!");
+	CHECK_BH(DEFER_COMPLETION, "@");
+#undef CHECK_BH
+}
+
+// Print refcount and buffer heads from exper's devices, if loaded. If info is
+// NULL we look the PFN up ourselves.
+static void print_page_info(uint64_t pfn, const struct pfninfo_record *info)
+{
+	struct pfninfo_record record;
+	uint32_t i;
+
+	if (info == NULL && read_pfninfo(&pfn, 1, &record))
+		info = &record;
+
+	if (info == NULL) {
+		// Fall back to the one PFN per write devices.
+		const int refcount = get_refcount(pfn);
+
+		if (refcount != -1)
+			printf("refcount=%d ", refcount);
+
+		print_page_buffers(pfn);
+		return;
+	}
+
+	if (info->pfn == INVALID_VALUE)
+		return;
+
+	printf("refcount=%u ", info->refcount);
+
+	if (info->flags & PFNINFO_BUFFERS_UNKNOWN) {
+		printf("page_buffers=? ");
+		return;
+	}
+
+	// As for /dev/pagebuffers, though we show every buffer head.
+	printf("page_buffers=");
+	if (info->nr_buffers == 0)
+		printf("[]");
+	for (i = 0; i < info->nr_buffers && i < PFNINFO_MAX_BUFFERS; i++) {
+		printf("[");
+		print_bh_state(info->bh_state[i]);
+		printf("]");
+	}
+	if (info->nr_buffers > PFNINFO_MAX_BUFFERS)
+		printf("+%u", info->nr_buffers - PFNINFO_MAX_BUFFERS);
+	printf(" ");
+}
+
 // Prints pagemap flags.
 static void print_pagemap_flags(uint64_t val)
 {
@@ -234,7 +409,7 @@ uint64_t read_pagemap(const void *ptr)
 	// There is 'one 64-bit value for each virtual page'.
 	const uint64_t offset = virt_page_num * sizeof(uint64_t);
 
-	return read_u64("/proc/self/pagemap", offset);
+	return read_u64(PROC_PAGEMAP, offset);
 }
 
 uint64_t read_pfn(const void *ptr)
@@ -244,12 +419,61 @@ uint64_t read_pfn(const void *ptr)
 
 uint64_t read_kpageflags(uint64_t pfn)
 {
-	return read_u64("/proc/kpageflags", pfn * sizeof(uint64_t));
+	return read_u64(PROC_KPAGEFLAGS, pfn * sizeof(uint64_t));
 }
 
 uint64_t read_mapcount(uint64_t pfn)
 {
-	return read_u64("/proc/kpagecount", pfn * sizeof(uint64_t));
+	return read_u64(PROC_KPAGECOUNT, pfn * sizeof(uint64_t));
+}
+
+bool read_pageflags_batch(const void *const *ptrs, size_t count,
+			  uint64_t *pagemaps, uint64_t *pfns,
+			  uint64_t *kpageflags, uint64_t *mapcounts)
+{
+	const uint64_t page_size = getpagesize();
+	const enum proc_file pagemap_file = PROC_PAGEMAP;
+	enum proc_file phys_files[2];
+	uint64_t *phys_outs[2];
+	size_t i, num_phys = 0;
+	uint64_t *indices;
+	bool ret = true;
+
+	if (count == 0)
+		return true;
+
+	indices = (uint64_t *)malloc(count * sizeof(*indices));
+	if (indices == NULL) {
+		fprintf(stderr, "Unable to allocate\n");
+		return false;
+	}
+
+	for (i = 0; i < count; i++)
+		indices[i] = (uint64_t)ptrs[i] / page_size;
+	ret = read_u64_batch(&pagemap_file, 1, indices, count, &pagemaps);
+
+	// We index the physical files by PFN, INVALID_VALUE if not present.
+	for (i = 0; i < count; i++) {
+		indices[i] = extract_pfn(pagemaps[i]);
+		if (pfns != NULL)
+			pfns[i] = indices[i];
+	}
+
+	// Read both together if we want both.
+	if (kpageflags != NULL) {
+		phys_files[num_phys] = PROC_KPAGEFLAGS;
+		phys_outs[num_phys++] = kpageflags;
+	}
+	if (mapcounts != NULL) {
+		phys_files[num_phys] = PROC_KPAGECOUNT;
+		phys_outs[num_phys++] = mapcounts;
+	}
+	if (num_phys > 0)
+		ret &= read_u64_batch(phys_files, num_phys, indices, count,
+				      phys_outs);
+
+	free(indices);
+	return ret;
 }
 
 static uint64_t parse_hex(const char *str)
@@ -416,11 +640,7 @@ void print_flags_phys(uint64_t pfn, const char *descr)
 		return;
 	}
 
-	const int refcount = get_refcount(pfn);
-	if (refcount != -1)
-		printf("refcount=%d ", refcount);
-
-	print_page_buffers(pfn);
+	print_page_info(pfn, NULL);
 
 	const uint64_t mapcount = read_mapcount(pfn);
 
@@ -434,11 +654,12 @@ void print_flags_phys(uint64_t pfn, const char *descr)
 	printf(" [%s]\n", descr);
 }
 
-bool print_flags_virt_precalc(const void *ptr,
-			      uint64_t pagemap, uint64_t pfn,
-			      uint64_t kpageflags, uint64_t mapcount,
-			      const struct map_data* mapfields,
-			      const char *descr)
+static bool print_flags_virt_info(const void *ptr,
+				  uint64_t pagemap, uint64_t pfn,
+				  uint64_t kpageflags, uint64_t mapcount,
+				  const struct map_data* mapfields,
+				  const struct pfninfo_record *info,
+				  const char *descr)
 {
 	printf("%p: ", ptr);
 
@@ -467,11 +688,7 @@ bool print_flags_virt_precalc(const void *ptr,
 		return false;
 	}
 
-	const int refcount = get_refcount(pfn);
-	if (refcount != -1)
-		printf("refcount=%d ", refcount);
-
-	print_page_buffers(pfn);
+	print_page_info(pfn, info);
 
 	if (mapcount == INVALID_VALUE)
 		printf("mapcount=(failed) ");
@@ -485,6 +702,16 @@ bool print_flags_virt_precalc(const void *ptr,
 	return true;
 }
 
+bool print_flags_virt_precalc(const void *ptr,
+			      uint64_t pagemap, uint64_t pfn,
+			      uint64_t kpageflags, uint64_t mapcount,
+			      const struct map_data* mapfields,
+			      const char *descr)
+{
+	return print_flags_virt_info(ptr, pagemap, pfn, kpageflags, mapcount,
+				     mapfields, NULL, descr);
+}
+
 bool print_flags_virt(const void *ptr, const char *descr)
 {
 	struct map_data mapfields;
@@ -538,3 +765,48 @@ bool print_flags_virt(const void *ptr, const char *descr)
 					gotfields ? &mapfields : NULL,
 					descr);
 }
+
+bool print_flags_virt_batch(const void *const *ptrs, const char *const *descrs,
+			    size_t count)
+{
+	uint64_t *vals = (uint64_t *)malloc(4 * count * sizeof(*vals));
+	struct pfninfo_record *infos;
+	struct map_data *mapfields;
+	bool *gotfields;
+	bool ret = true, got_infos;
+	size_t i;
+
+	mapfields = (struct map_data *)malloc(count * sizeof(*mapfields));
+	gotfields = (bool *)malloc(count * sizeof(*gotfields));
+	infos = (struct pfninfo_record *)malloc(count * sizeof(*infos));
+	if (vals == NULL || mapfields == NULL || gotfields == NULL ||
+	    infos == NULL) {
+		fprintf(stderr, "Unable to allocate\n");
+		ret = false;
+		goto out;
+	}
+
+	// Take every sample before printing anything.
+	read_pageflags_batch(ptrs, count, vals, &vals[count], &vals[2 * count],
+			     &vals[3 * count]);
+	for (i = 0; i < count; i++)
+		gotfields[i] = read_mapdata(ptrs[i], &mapfields[i]);
+	// Refcounts and buffer heads for every PFN in one go, if exper is loaded.
+	got_infos = read_pfninfo(&vals[count], count, infos);
+
+	for (i = 0; i < count; i++) {
+		ret &= print_flags_virt_info(ptrs[i], vals[i], vals[count + i],
+					     vals[2 * count + i],
+					     vals[3 * count + i],
+					     gotfields[i] ? &mapfields[i] : NULL,
+					     got_infos ? &infos[i] : NULL,
+					     descrs[i]);
+	}
+
+out:
+	free(infos);
+	free(vals);
+	free(mapfields);
+	free(gotfields);
+	return ret;
+}
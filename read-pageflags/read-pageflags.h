@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define INVALID_VALUE (~(uint64_t)0)
@@ -39,6 +40,12 @@ bool print_flags_virt_precalc(const void *ptr, uint64_t pagemap, uint64_t pfn,
 			      const struct map_data* mapfields,
 			      const char *descr);
 
+// Print flags for several pointers, sampling all of them with
+// read_pageflags_batch() before printing any.
+// Return value indicates whether all succeeded.
+bool print_flags_virt_batch(const void *const *ptrs, const char *const *descrs,
+			    size_t count);
+
 // Prints flags for a physical PFN.
 void print_flags_phys(uint64_t pfn, const char *descr);
 
@@ -54,6 +61,21 @@ uint64_t read_kpageflags(uint64_t pfn);
 // If unable to retrieve, returns INVALID_VALUE.
 uint64_t read_mapcount(uint64_t pfn);
 
+// Batched equivalent of read_pagemap(), read_pfn(), read_kpageflags() and
+// read_mapcount() for count pointers. Each output array has count entries
+// and receives the value for the page containing the corresponding pointer,
+// or INVALID_VALUE if it can't be retrieved (including kpageflags and
+// mapcount for pages which aren't present). pagemaps is required, pass NULL
+// for any other output not needed to skip reading it.
+//
+// The proc files are kept open between calls, and reads are sorted and
+// coalesced so that pages close together are read with a single pread(),
+// making this cheap enough to call from tight loops.
+// Returns false if any proc file could not be read.
+bool read_pageflags_batch(const void *const *ptrs, size_t count,
+			  uint64_t *pagemaps, uint64_t *pfns,
+			  uint64_t *kpageflags, uint64_t *mapcounts);
+
 // Read data from /proc/$pid/maps and place in out. Returns true if succeeded,
 // false otherwise.
 bool read_mapdata(const void *ptr,
@@ -0,0 +1,759 @@
+#define _GNU_SOURCE
+#include "cachestat.h"
+#include "read-pageflags.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmark readahead across a matrix of access patterns, I/O methods and
+// fadvise()/madvise() hints. Each run starts from a cold page cache for the
+// test file, and reports throughput along with how many pages were actually
+// read in, so readahead amplification can be seen directly rather than by
+// tracing the kernel.
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ (22)
+#endif
+
+// As per include/uapi/linux/kernel-page-flags.h.
+#define KPF_ACTIVE (6)
+
+#define DEFAULT_PATH "readahead-bench.dat"
+#define DEFAULT_SIZE_MIB (64)
+#define DEFAULT_STRIDE (4)
+#define DEFAULT_STREAMS (4)
+#define FILL_CHUNK (1UL << 20)
+
+enum pattern {
+	PATTERN_SEQ,
+	PATTERN_STRIDE,
+	PATTERN_REVERSE,
+	PATTERN_RANDOM,
+	PATTERN_MULTI,
+	NUM_PATTERNS
+};
+
+static const char *const pattern_names[] = {
+	"seq", "stride", "reverse", "random", "multi",
+};
+
+enum method {
+	METHOD_READ,
+	METHOD_PREAD,
+	METHOD_MMAP,
+	METHOD_URING,
+	NUM_METHODS
+};
+
+static const char *const method_names[] = {
+	"read", "pread", "mmap", "uring",
+};
+
+enum hint {
+	HINT_NONE,
+	HINT_SEQUENTIAL,
+	HINT_RANDOM,
+	HINT_WILLNEED,
+	HINT_POPULATE_READ,
+	NUM_HINTS
+};
+
+static const char *const hint_names[] = {
+	"none", "seq", "random", "willneed", "populate",
+};
+
+struct options {
+	const char *path;
+	uint64_t size;
+	// Pages per access.
+	unsigned int io_pages;
+	// Pattern parameters, in units of accesses.
+	unsigned int stride;
+	unsigned int streams;
+	unsigned int queue_depth;
+	// Bitmasks of what to run.
+	unsigned int patterns, methods, hints;
+};
+
+struct result {
+	uint64_t accessed;
+	uint64_t read_in;
+	double secs;
+	// Only known for mmap.
+	bool mapped_known;
+	uint64_t mapped;
+	bool active_known;
+	uint64_t active;
+};
+
+static struct options opts;
+static long page_size;
+static uint64_t num_pages;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Number of pages of the file currently in the page cache.
+static uint64_t count_cached(int fd)
+{
+	struct cs_range range = { .off = 0, .len = 0 };
+	struct cs_stats stats;
+	unsigned char *vec;
+	uint64_t i, count = 0;
+	void *ptr;
+
+	if (!cachestat(fd, &range, &stats))
+		return stats.nr_cache;
+
+	// Pre-6.5 kernel, fall back to mincore().
+	ptr = mmap(NULL, opts.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	vec = malloc(num_pages);
+	if (vec == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (mincore(ptr, opts.size, vec)) {
+		perror("mincore");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num_pages; i++)
+		count += vec[i] & 1;
+
+	free(vec);
+	munmap(ptr, opts.size);
+	return count;
+}
+
+// Create the test file if it doesn't already exist at the right size. It is
+// filled with data rather than left sparse, so reads have to go to disk.
+static void prepare_file(void)
+{
+	struct stat st;
+	uint64_t offset;
+	char *buf;
+	int fd;
+
+	fd = open(opts.path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror(opts.path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((uint64_t)st.st_size == opts.size && st.st_blocks * 512 >= st.st_size)
+		goto out;
+
+	if (ftruncate(fd, 0)) {
+		perror("ftruncate");
+		exit(EXIT_FAILURE);
+	}
+
+	buf = malloc(FILL_CHUNK);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 'x', FILL_CHUNK);
+
+	for (offset = 0; offset < opts.size; offset += FILL_CHUNK) {
+		const size_t len = opts.size - offset < FILL_CHUNK ?
+			opts.size - offset : FILL_CHUNK;
+
+		if (pwrite(fd, buf, len, offset) != (ssize_t)len) {
+			perror("pwrite");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(buf);
+
+	// Dirty pages can't be dropped, so get them to disk now.
+	if (fsync(fd)) {
+		perror("fsync");
+		exit(EXIT_FAILURE);
+	}
+
+out:
+	close(fd);
+}
+
+// Evict the file from the page cache, so the run starts cold.
+static void drop_file_cache(void)
+{
+	uint64_t cached;
+	int fd;
+
+	fd = open(opts.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(opts.path);
+		exit(EXIT_FAILURE);
+	}
+
+	errno = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	if (errno) {
+		perror("posix_fadvise");
+		exit(EXIT_FAILURE);
+	}
+
+	// Pages mapped or pinned elsewhere survive DONTNEED.
+	cached = count_cached(fd);
+	if (cached > 0)
+		fprintf(stderr, "warning: %lu pages still cached\n", cached);
+
+	close(fd);
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+	// xorshift64, seeded identically each run so results are comparable.
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+// Generate the sequence of access indices for a pattern, each access covering
+// opts.io_pages pages. Returns the number of accesses.
+static uint64_t generate_accesses(enum pattern pattern, uint64_t *accesses)
+{
+	const uint64_t num_blocks = num_pages / opts.io_pages;
+	uint64_t i, count = 0;
+
+	switch (pattern) {
+	case PATTERN_SEQ:
+		for (i = 0; i < num_blocks; i++)
+			accesses[count++] = i;
+		break;
+	case PATTERN_STRIDE:
+		for (i = 0; i < num_blocks; i += opts.stride)
+			accesses[count++] = i;
+		break;
+	case PATTERN_REVERSE:
+		for (i = num_blocks; i > 0; i--)
+			accesses[count++] = i - 1;
+		break;
+	case PATTERN_RANDOM: {
+		uint64_t state = 0x9e3779b97f4a7c15UL;
+
+		// Touch as many distinct blocks as stride does, so the two
+		// differ only in predictability.
+		for (i = 0; i < num_blocks; i++)
+			accesses[i] = i;
+		for (i = num_blocks - 1; i > 0; i--) {
+			const uint64_t j = next_random(&state) % (i + 1);
+			const uint64_t tmp = accesses[i];
+
+			accesses[i] = accesses[j];
+			accesses[j] = tmp;
+		}
+		count = (num_blocks + opts.stride - 1) / opts.stride;
+		break;
+	}
+	case PATTERN_MULTI: {
+		const uint64_t per_stream = num_blocks / opts.streams;
+		unsigned int stream;
+
+		// Interleave sequential streams starting at evenly spaced
+		// offsets, as with several readers of the one file.
+		for (i = 0; i < per_stream; i++) {
+			for (stream = 0; stream < opts.streams; stream++)
+				accesses[count++] = stream * per_stream + i;
+		}
+		break;
+	}
+	default:
+		abort();
+	}
+
+	return count;
+}
+
+static void apply_fadvise(int fd, enum hint hint)
+{
+	int advice;
+
+	switch (hint) {
+	case HINT_NONE:
+		return;
+	case HINT_SEQUENTIAL:
+		advice = POSIX_FADV_SEQUENTIAL;
+		break;
+	case HINT_RANDOM:
+		advice = POSIX_FADV_RANDOM;
+		break;
+	case HINT_WILLNEED:
+		advice = POSIX_FADV_WILLNEED;
+		break;
+	default:
+		abort();
+	}
+
+	errno = posix_fadvise(fd, 0, 0, advice);
+	if (errno) {
+		perror("posix_fadvise");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void apply_madvise(void *ptr, enum hint hint)
+{
+	int advice;
+
+	switch (hint) {
+	case HINT_NONE:
+		return;
+	case HINT_SEQUENTIAL:
+		advice = MADV_SEQUENTIAL;
+		break;
+	case HINT_RANDOM:
+		advice = MADV_RANDOM;
+		break;
+	case HINT_WILLNEED:
+		advice = MADV_WILLNEED;
+		break;
+	case HINT_POPULATE_READ:
+		advice = MADV_POPULATE_READ;
+		break;
+	default:
+		abort();
+	}
+
+	if (madvise(ptr, opts.size, advice)) {
+		perror("madvise");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void run_read(int fd, const uint64_t *accesses, uint64_t count,
+		     char *buf, bool positional)
+{
+	const size_t len = opts.io_pages * page_size;
+	uint64_t i, pos = 0;
+
+	for (i = 0; i < count; i++) {
+		const uint64_t offset = accesses[i] * len;
+		ssize_t ret;
+
+		if (positional) {
+			ret = pread(fd, buf, len, offset);
+		} else {
+			// Only seek when the pattern jumps, as a plain reader
+			// would.
+			if (offset != pos && lseek(fd, offset, SEEK_SET) < 0) {
+				perror("lseek");
+				exit(EXIT_FAILURE);
+			}
+			ret = read(fd, buf, len);
+		}
+
+		if (ret != (ssize_t)len) {
+			perror(positional ? "pread" : "read");
+			exit(EXIT_FAILURE);
+		}
+		pos = offset + len;
+	}
+}
+
+// Count pages of the mapping which are mapped, and which the kernel has
+// promoted to the active LRU, via pagemap and kpageflags.
+static void count_mapped(const char *ptr, struct result *result)
+{
+	const void **ptrs = malloc(num_pages * sizeof(*ptrs));
+	uint64_t *pagemaps = malloc(num_pages * sizeof(*pagemaps));
+	uint64_t *kpageflags = malloc(num_pages * sizeof(*kpageflags));
+	uint64_t i;
+
+	if (ptrs == NULL || pagemaps == NULL || kpageflags == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num_pages; i++)
+		ptrs[i] = ptr + i * page_size;
+
+	// kpageflags needs root, but pagemap presence does not.
+	result->active_known = read_pageflags_batch(ptrs, num_pages, pagemaps,
+						    NULL, kpageflags, NULL);
+	result->mapped_known = true;
+
+	for (i = 0; i < num_pages; i++) {
+		if (pagemaps[i] == INVALID_VALUE) {
+			result->mapped_known = false;
+			continue;
+		}
+		if (!(pagemaps[i] & (1UL << 63)))
+			continue;
+
+		result->mapped++;
+		if (kpageflags[i] != INVALID_VALUE &&
+		    (kpageflags[i] & (1UL << KPF_ACTIVE)))
+			result->active++;
+	}
+
+	free(ptrs);
+	free(pagemaps);
+	free(kpageflags);
+}
+
+// Returns the mapping, left in place so mapped pages can be counted once
+// timing has stopped.
+static char *run_mmap(int fd, const uint64_t *accesses, uint64_t count,
+		      char *buf, enum hint hint)
+{
+	const size_t len = opts.io_pages * page_size;
+	uint64_t i;
+	char *ptr;
+
+	ptr = mmap(NULL, opts.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	apply_madvise(ptr, hint);
+
+	// Copy out so we touch every byte, as read() does.
+	for (i = 0; i < count; i++)
+		memcpy(buf, &ptr[accesses[i] * len], len);
+
+	return ptr;
+}
+
+static void reap_one(struct uring *ring, size_t len)
+{
+	struct io_uring_cqe *cqe = uring_wait_cqe(ring);
+
+	if (cqe == NULL) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cqe->res != (int)len) {
+		fprintf(stderr, "io_uring read: %s\n",
+			cqe->res < 0 ? strerror(-cqe->res) : "short read");
+		exit(EXIT_FAILURE);
+	}
+
+	uring_cqe_seen(ring);
+}
+
+static void run_uring(int fd, struct uring *ring, const uint64_t *accesses,
+		      uint64_t count, char *buf)
+{
+	const size_t len = opts.io_pages * page_size;
+	unsigned int in_flight = 0;
+	uint64_t i;
+
+	for (i = 0; i < count; i++) {
+		// Each slot of the queue gets its own buffer.
+		char *slot = buf + (i % opts.queue_depth) * len;
+		struct io_uring_sqe *sqe;
+
+		if (in_flight == opts.queue_depth) {
+			reap_one(ring, len);
+			in_flight--;
+		}
+
+		sqe = uring_get_sqe(ring);
+		if (sqe == NULL) {
+			fprintf(stderr, "io_uring submission queue full\n");
+			exit(EXIT_FAILURE);
+		}
+		uring_prep_read(sqe, fd, slot, len, accesses[i] * len, i);
+
+		if (uring_submit(ring, 0) < 0) {
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+		in_flight++;
+	}
+
+	for (; in_flight > 0; in_flight--)
+		reap_one(ring, len);
+}
+
+static void run_one(enum pattern pattern, enum method method, enum hint hint,
+		    const uint64_t *accesses, uint64_t count, char *buf,
+		    struct uring *ring, struct result *result)
+{
+	char *ptr = NULL;
+	uint64_t start;
+	int fd;
+
+	memset(result, 0, sizeof(*result));
+	result->accessed = count * opts.io_pages;
+
+	drop_file_cache();
+
+	// A fresh open each time, as fadvise state lives in the struct file.
+	fd = open(opts.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(opts.path);
+		exit(EXIT_FAILURE);
+	}
+
+	start = now_ns();
+
+	switch (method) {
+	case METHOD_READ:
+	case METHOD_PREAD:
+		apply_fadvise(fd, hint);
+		run_read(fd, accesses, count, buf, method == METHOD_PREAD);
+		break;
+	case METHOD_MMAP:
+		ptr = run_mmap(fd, accesses, count, buf, hint);
+		break;
+	case METHOD_URING:
+		apply_fadvise(fd, hint);
+		run_uring(fd, ring, accesses, count, buf);
+		break;
+	default:
+		abort();
+	}
+
+	result->secs = (now_ns() - start) / 1e9;
+
+	if (ptr != NULL) {
+		count_mapped(ptr, result);
+		munmap(ptr, opts.size);
+	}
+
+	// Includes anything WILLNEED or readahead still has in flight.
+	result->read_in = count_cached(fd);
+
+	close(fd);
+}
+
+static void print_header(void)
+{
+	printf("%-8s %-6s %-9s %10s %10s %7s %10s %10s %10s\n",
+	       "pattern", "method", "hint", "accessed", "read-in", "ampl",
+	       "MiB/s", "mapped", "active");
+}
+
+static void print_optional(uint64_t count, bool known)
+{
+	if (known)
+		printf(" %10lu", count);
+	else
+		printf(" %10s", "-");
+}
+
+static void print_result(enum pattern pattern, enum method method,
+			 enum hint hint, const struct result *result)
+{
+	const double mib = (double)result->accessed * page_size / (1UL << 20);
+
+	printf("%-8s %-6s %-9s %10lu %10lu %7.2f %10.1f",
+	       pattern_names[pattern], method_names[method], hint_names[hint],
+	       result->accessed, result->read_in,
+	       (double)result->read_in / result->accessed,
+	       result->secs > 0 ? mib / result->secs : 0);
+	print_optional(result->mapped, result->mapped_known);
+	print_optional(result->active, result->active_known);
+	printf("\n");
+	fflush(stdout);
+}
+
+// Parse a comma-separated list of names into a bitmask.
+static unsigned int parse_list(char *arg, const char *const *names,
+			       unsigned int count, const char *what)
+{
+	unsigned int mask = 0, i;
+	char *name;
+
+	for (name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+		for (i = 0; i < count; i++) {
+			if (!strcmp(name, names[i]))
+				break;
+		}
+
+		if (i == count) {
+			fprintf(stderr, "unknown %s '%s'\n", what, name);
+			exit(EXIT_FAILURE);
+		}
+		mask |= 1U << i;
+	}
+
+	return mask;
+}
+
+static void print_names(const char *const *names, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		fprintf(stderr, "%s%s", i ? "," : "", names[i]);
+	fprintf(stderr, "\n");
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [-f file] [-s MiB] [-b pages] [-t stride] "
+		"[-n streams] [-q depth] [-p patterns] [-m methods] [-a hints]\n",
+		bin);
+	fprintf(stderr, "  -f  test file, created if needed (default %s)\n",
+		DEFAULT_PATH);
+	fprintf(stderr, "  -s  test file size in MiB (default %d)\n",
+		DEFAULT_SIZE_MIB);
+	fprintf(stderr, "  -b  pages per access (default 1)\n");
+	fprintf(stderr, "  -t  stride in accesses, also sets how many random "
+		"accesses are made (default %d)\n", DEFAULT_STRIDE);
+	fprintf(stderr, "  -n  streams for the multi pattern (default %d)\n",
+		DEFAULT_STREAMS);
+	fprintf(stderr, "  -q  io_uring queue depth (default 1)\n");
+	fprintf(stderr, "  -p  patterns to run, of: ");
+	print_names(pattern_names, NUM_PATTERNS);
+	fprintf(stderr, "  -m  methods to run, of: ");
+	print_names(method_names, NUM_METHODS);
+	fprintf(stderr, "  -a  hints to run, of: ");
+	print_names(hint_names, NUM_HINTS);
+	fprintf(stderr, "populate (MADV_POPULATE_READ) only applies to mmap.\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int pattern, method, hint;
+	struct uring ring;
+	bool have_uring;
+	uint64_t *accesses;
+	char *buf;
+	int opt;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	opts.path = DEFAULT_PATH;
+	opts.size = (uint64_t)DEFAULT_SIZE_MIB << 20;
+	opts.io_pages = 1;
+	opts.stride = DEFAULT_STRIDE;
+	opts.streams = DEFAULT_STREAMS;
+	opts.queue_depth = 1;
+	opts.patterns = (1U << NUM_PATTERNS) - 1;
+	opts.methods = (1U << NUM_METHODS) - 1;
+	opts.hints = (1U << NUM_HINTS) - 1;
+
+	while ((opt = getopt(argc, argv, "f:s:b:t:n:q:p:m:a:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			opts.path = optarg;
+			break;
+		case 's':
+			opts.size = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'b':
+			opts.io_pages = atoi(optarg);
+			break;
+		case 't':
+			opts.stride = atoi(optarg);
+			break;
+		case 'n':
+			opts.streams = atoi(optarg);
+			break;
+		case 'q':
+			opts.queue_depth = atoi(optarg);
+			break;
+		case 'p':
+			opts.patterns = parse_list(optarg, pattern_names,
+						   NUM_PATTERNS, "pattern");
+			break;
+		case 'm':
+			opts.methods = parse_list(optarg, method_names,
+						  NUM_METHODS, "method");
+			break;
+		case 'a':
+			opts.hints = parse_list(optarg, hint_names, NUM_HINTS,
+						"hint");
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	num_pages = opts.size / page_size;
+	if (optind != argc || opts.io_pages == 0 || opts.stride == 0 ||
+	    opts.streams == 0 || opts.queue_depth == 0 ||
+	    num_pages / opts.io_pages < opts.streams) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	prepare_file();
+
+	accesses = malloc(num_pages * sizeof(*accesses));
+	buf = aligned_alloc(page_size,
+			    (size_t)opts.queue_depth * opts.io_pages * page_size);
+	if (accesses == NULL || buf == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	have_uring = false;
+	if (opts.methods & (1U << METHOD_URING)) {
+		if (uring_init(&ring, opts.queue_depth) == 0)
+			have_uring = true;
+		else
+			perror("io_uring_setup, skipping uring");
+	}
+
+	print_header();
+
+	for (pattern = 0; pattern < NUM_PATTERNS; pattern++) {
+		uint64_t count;
+
+		if (!(opts.patterns & (1U << pattern)))
+			continue;
+
+		count = generate_accesses(pattern, accesses);
+
+		for (method = 0; method < NUM_METHODS; method++) {
+			if (!(opts.methods & (1U << method)))
+				continue;
+			if (method == METHOD_URING && !have_uring)
+				continue;
+
+			for (hint = 0; hint < NUM_HINTS; hint++) {
+				struct result result;
+
+				if (!(opts.hints & (1U << hint)))
+					continue;
+				// There's no fadvise() equivalent.
+				if (hint == HINT_POPULATE_READ &&
+				    method != METHOD_MMAP)
+					continue;
+
+				run_one(pattern, method, hint, accesses, count,
+					buf, &ring, &result);
+				print_result(pattern, method, hint, &result);
+			}
+		}
+	}
+
+	if (have_uring)
+		uring_exit(&ring);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+#include "channel.h"
+#include "ring.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_SEC (1000000000ULL)
+
+// Bytes of slots in each direction's ring.
+#define RING_BYTES (4UL << 20)
+#define MIN_SLOTS (4)
+
+// Round trips for the latency test, fewer for larger messages.
+#define PINGPONG_ITERS (20000)
+#define PINGPONG_BYTES (64UL << 20)
+#define MIN_PINGPONG_ITERS (200)
+// Bytes to stream for the throughput test, capped at MAX_STREAM_MSGS.
+#define STREAM_BYTES (256UL << 20)
+#define MAX_STREAM_MSGS (500000)
+
+// Spin this many times waiting on a ring before yielding the CPU.
+#define SPINS_BEFORE_YIELD (128)
+
+enum transport {
+	TRANSPORT_MEMFD,
+	TRANSPORT_FUTEX,
+	TRANSPORT_POSIX,
+	TRANSPORT_SYSV,
+	TRANSPORT_SOCKET,
+	TRANSPORT_SCM_RIGHTS,
+	NUM_TRANSPORTS,
+};
+
+static const char *transport_names[] = {
+	[TRANSPORT_MEMFD] = "memfd",
+	[TRANSPORT_FUTEX] = "memfd-futex",
+	[TRANSPORT_POSIX] = "posix-shm",
+	[TRANSPORT_SYSV] = "sysv-shm",
+	[TRANSPORT_SOCKET] = "unix-socket",
+	[TRANSPORT_SCM_RIGHTS] = "scm-rights",
+};
+
+struct chan {
+	enum transport transport;
+	size_t msg_size;
+
+	// Shared memory transports: [0] carries parent->child, [1] child->parent.
+	void *region;
+	size_t region_len;
+	struct ring *rings[2];
+	// Futex transport: a channel.h channel, parent is the server.
+	struct channel *channel;
+
+	// Socket transports: [0] is the parent end, [1] the child's.
+	int socks[2];
+
+	// Which end we are.
+	int side;
+};
+
+static void fail(const char *msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void *map_memfd(size_t len)
+{
+	int fd = memfd_create("ipc_bench", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	void *ptr;
+
+	if (fd < 0)
+		fail("memfd_create");
+	if (ftruncate(fd, len))
+		fail("ftruncate");
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		fail("fcntl");
+
+	ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		fail("mmap");
+
+	close(fd);
+	return ptr;
+}
+
+static void *map_posix(size_t len)
+{
+	char name[64];
+	void *ptr;
+	int fd;
+
+	snprintf(name, sizeof(name), "/ipc_bench.%d", getpid());
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+		fail("shm_open");
+	if (ftruncate(fd, len))
+		fail("ftruncate");
+
+	ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		fail("mmap");
+
+	// The mapping keeps the object alive, and the child inherits it.
+	if (shm_unlink(name))
+		fail("shm_unlink");
+	close(fd);
+
+	return ptr;
+}
+
+static void *map_sysv(size_t len)
+{
+	int shmid = shmget(IPC_PRIVATE, len, IPC_CREAT | 0600);
+	void *ptr;
+
+	if (shmid < 0)
+		fail("shmget");
+
+	ptr = shmat(shmid, NULL, 0);
+	if (ptr == (void *)-1)
+		fail("shmat");
+
+	// Destroyed on last detach, the child inherits the attachment.
+	if (shmctl(shmid, IPC_RMID, NULL))
+		fail("shmctl");
+
+	return ptr;
+}
+
+static void chan_open(struct chan *chan, enum transport transport, size_t msg_size)
+{
+	const uint64_t slot_size = (msg_size + RING_CACHELINE - 1) & ~(RING_CACHELINE - 1);
+	uint64_t num_slots = RING_BYTES / slot_size;
+	size_t one_ring;
+
+	memset(chan, 0, sizeof(*chan));
+	chan->transport = transport;
+	chan->msg_size = msg_size;
+
+	if (transport == TRANSPORT_SOCKET || transport == TRANSPORT_SCM_RIGHTS) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, chan->socks))
+			fail("socketpair");
+		return;
+	}
+
+	if (num_slots < MIN_SLOTS)
+		num_slots = MIN_SLOTS;
+
+	if (transport == TRANSPORT_FUTEX) {
+		chan->region_len = channel_size(msg_size, num_slots);
+		chan->region = map_memfd(chan->region_len);
+		chan->channel = channel_init(chan->region, msg_size, num_slots);
+		return;
+	}
+
+	one_ring = ring_size(num_slots, slot_size);
+	chan->region_len = 2 * one_ring;
+
+	switch (transport) {
+	case TRANSPORT_MEMFD:
+		chan->region = map_memfd(chan->region_len);
+		break;
+	case TRANSPORT_POSIX:
+		chan->region = map_posix(chan->region_len);
+		break;
+	case TRANSPORT_SYSV:
+		chan->region = map_sysv(chan->region_len);
+		break;
+	default:
+		break;
+	}
+
+	chan->rings[0] = chan->region;
+	chan->rings[1] = (struct ring *)((char *)chan->region + one_ring);
+	ring_init(chan->rings[0], num_slots, slot_size);
+	ring_init(chan->rings[1], num_slots, slot_size);
+}
+
+static void chan_close(struct chan *chan)
+{
+	switch (chan->transport) {
+	case TRANSPORT_SOCKET:
+	case TRANSPORT_SCM_RIGHTS:
+		close(chan->socks[chan->side]);
+		break;
+	case TRANSPORT_SYSV:
+		shmdt(chan->region);
+		break;
+	default:
+		munmap(chan->region, chan->region_len);
+		break;
+	}
+}
+
+// Called in each process after fork.
+static void chan_set_side(struct chan *chan, int side)
+{
+	chan->side = side;
+
+	if (chan->transport == TRANSPORT_SOCKET ||
+	    chan->transport == TRANSPORT_SCM_RIGHTS)
+		close(chan->socks[!side]);
+}
+
+static void relax(unsigned int *spins)
+{
+	if (++*spins % SPINS_BEFORE_YIELD == 0)
+		sched_yield();
+}
+
+static void send_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+
+	while (len > 0) {
+		ssize_t sent = send(fd, ptr, len, 0);
+
+		if (sent < 0)
+			fail("send");
+
+		ptr += sent;
+		len -= sent;
+	}
+}
+
+static void recv_all(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+
+	while (len > 0) {
+		ssize_t nread = recv(fd, ptr, len, 0);
+
+		if (nread < 0)
+			fail("recv");
+		if (nread == 0) {
+			fprintf(stderr, "recv: unexpected EOF\n");
+			exit(EXIT_FAILURE);
+		}
+
+		ptr += nread;
+		len -= nread;
+	}
+}
+
+// Each message is a freshly created memfd holding the payload, received
+// mapped and read by the peer. This is the cost of handing over ownership of
+// data without copying it through the socket.
+static void send_scm(struct chan *chan, const void *buf)
+{
+	union {
+		struct cmsghdr cmsgh;
+		char control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+	char byte = 0;
+	struct iovec iov = {
+		.iov_base = &byte,
+		.iov_len = sizeof(byte),
+	};
+	struct msghdr msgh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control_un.control,
+		.msg_controllen = sizeof(control_un.control),
+	};
+	int fd = memfd_create("ipc_bench_msg", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	void *ptr;
+
+	if (fd < 0)
+		fail("memfd_create");
+	if (ftruncate(fd, chan->msg_size))
+		fail("ftruncate");
+
+	ptr = mmap(NULL, chan->msg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		fail("mmap");
+	memcpy(ptr, buf, chan->msg_size);
+	munmap(ptr, chan->msg_size);
+
+	// The receiver can then trust the message won't change under it.
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) < 0)
+		fail("fcntl");
+
+	control_un.cmsgh.cmsg_len = CMSG_LEN(sizeof(int));
+	control_un.cmsgh.cmsg_level = SOL_SOCKET;
+	control_un.cmsgh.cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(&control_un.cmsgh), &fd, sizeof(int));
+
+	if (sendmsg(chan->socks[chan->side], &msgh, 0) != sizeof(byte))
+		fail("sendmsg");
+
+	close(fd);
+}
+
+static void recv_scm(struct chan *chan, void *buf)
+{
+	union {
+		struct cmsghdr cmsgh;
+		char control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+	char byte;
+	struct iovec iov = {
+		.iov_base = &byte,
+		.iov_len = sizeof(byte),
+	};
+	struct msghdr msgh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control_un.control,
+		.msg_controllen = sizeof(control_un.control),
+	};
+	struct cmsghdr *cmsgh;
+	void *ptr;
+	int fd;
+
+	if (recvmsg(chan->socks[chan->side], &msgh, 0) != sizeof(byte))
+		fail("recvmsg");
+
+	cmsgh = CMSG_FIRSTHDR(&msgh);
+	if (cmsgh == NULL || cmsgh->cmsg_level != SOL_SOCKET ||
+	    cmsgh->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "recvmsg: no fd\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&fd, CMSG_DATA(cmsgh), sizeof(int));
+
+	ptr = mmap(NULL, chan->msg_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		fail("mmap");
+	memcpy(buf, ptr, chan->msg_size);
+	munmap(ptr, chan->msg_size);
+	close(fd);
+}
+
+static void chan_send(struct chan *chan, const void *buf)
+{
+	struct ring *ring;
+	unsigned int spins = 0;
+
+	switch (chan->transport) {
+	case TRANSPORT_SOCKET:
+		send_all(chan->socks[chan->side], buf, chan->msg_size);
+		return;
+	case TRANSPORT_SCM_RIGHTS:
+		send_scm(chan, buf);
+		return;
+	case TRANSPORT_FUTEX:
+		channel_send(chan->channel, chan->side, buf);
+		return;
+	default:
+		break;
+	}
+
+	ring = chan->rings[chan->side];
+	while (!ring_try_push(ring, buf, chan->msg_size))
+		relax(&spins);
+}
+
+static void chan_recv(struct chan *chan, void *buf)
+{
+	struct ring *ring;
+	unsigned int spins = 0;
+
+	switch (chan->transport) {
+	case TRANSPORT_SOCKET:
+		recv_all(chan->socks[chan->side], buf, chan->msg_size);
+		return;
+	case TRANSPORT_SCM_RIGHTS:
+		recv_scm(chan, buf);
+		return;
+	case TRANSPORT_FUTEX:
+		channel_recv(chan->channel, chan->side, buf);
+		return;
+	default:
+		break;
+	}
+
+	ring = chan->rings[!chan->side];
+	while (!ring_try_pop(ring, buf, chan->msg_size))
+		relax(&spins);
+}
+
+static unsigned long stream_msgs(size_t msg_size)
+{
+	const unsigned long count = STREAM_BYTES / msg_size;
+
+	return count > MAX_STREAM_MSGS ? MAX_STREAM_MSGS : count;
+}
+
+static unsigned long pingpong_iters(size_t msg_size)
+{
+	const unsigned long iters = PINGPONG_BYTES / msg_size;
+
+	if (iters < MIN_PINGPONG_ITERS)
+		return MIN_PINGPONG_ITERS;
+
+	return iters > PINGPONG_ITERS ? PINGPONG_ITERS : iters;
+}
+
+// Echo ping-pongs, then consume the stream and acknowledge it.
+static void child(struct chan *chan, char *buf)
+{
+	const unsigned long iters = pingpong_iters(chan->msg_size);
+	const unsigned long count = stream_msgs(chan->msg_size);
+	unsigned long i;
+
+	for (i = 0; i < iters; i++) {
+		chan_recv(chan, buf);
+		chan_send(chan, buf);
+	}
+
+	for (i = 0; i < count; i++)
+		chan_recv(chan, buf);
+	chan_send(chan, buf);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(enum transport transport, size_t msg_size)
+{
+	const unsigned long iters = pingpong_iters(msg_size);
+	const unsigned long count = stream_msgs(msg_size);
+	uint64_t *lat_ns = malloc(iters * sizeof(uint64_t));
+	char *buf = malloc(msg_size);
+	uint64_t start, elapsed_ns;
+	struct chan chan;
+	unsigned long i;
+	int status;
+	pid_t pid;
+
+	if (lat_ns == NULL || buf == NULL)
+		fail("malloc");
+	memset(buf, 'x', msg_size);
+
+	chan_open(&chan, transport, msg_size);
+
+	// Don't let the child inherit buffered output.
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		fail("fork");
+	if (pid == 0) {
+		chan_set_side(&chan, 1);
+		child(&chan, buf);
+		chan_close(&chan);
+		_exit(EXIT_SUCCESS);
+	}
+	chan_set_side(&chan, 0);
+
+	// One-way latency is half the round trip.
+	for (i = 0; i < iters; i++) {
+		start = now_ns();
+		chan_send(&chan, buf);
+		chan_recv(&chan, buf);
+		lat_ns[i] = (now_ns() - start) / 2;
+	}
+
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		chan_send(&chan, buf);
+	chan_recv(&chan, buf);
+	elapsed_ns = now_ns() - start;
+
+	if (waitpid(pid, &status, 0) < 0)
+		fail("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "child failed\n");
+		exit(EXIT_FAILURE);
+	}
+	chan_close(&chan);
+
+	qsort(lat_ns, iters, sizeof(uint64_t), cmp_u64);
+
+	printf("%-12s size=%-8zu %10.0f msgs/s %9.1f MiB/s "
+	       "p50=%6luns p99=%7luns p99.9=%7luns\n",
+	       transport_names[transport], msg_size,
+	       (double)count * NS_PER_SEC / elapsed_ns,
+	       (double)count * msg_size * NS_PER_SEC / elapsed_ns / (1 << 20),
+	       lat_ns[iters / 2], lat_ns[iters * 99 / 100],
+	       lat_ns[iters * 999 / 1000]);
+
+	free(buf);
+	free(lat_ns);
+}
+
+int main(void)
+{
+	static const size_t sizes[] = { 64, 1024, 16384, 262144, 1048576 };
+	unsigned long i;
+	int transport;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (transport = 0; transport < NUM_TRANSPORTS; transport++)
+			run(transport, sizes[i]);
+		printf("\n");
+	}
+
+	return EXIT_SUCCESS;
+}
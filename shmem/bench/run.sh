@@ -0,0 +1,6 @@
+#!/bin/bash
+set -e; set -o pipefail
+
+gcc -O2 -Wall -Werror -I.. ipc_bench.c ../channel.c -o ipc_bench -lrt
+
+./ipc_bench
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CHANNEL_MAGIC (0x4348414e) // "CHAN"
+
+// Bounds on the number of pause iterations before sleeping. Each side's
+// budget doubles when spinning pays off and halves when it has to sleep.
+#define MIN_SPIN (16)
+#define MAX_SPIN (16384)
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+// Not FUTEX_PRIVATE_FLAG, the word is shared between processes.
+static void futex_wait(uint32_t *uaddr, uint32_t val)
+{
+	// EAGAIN (val changed) and EINTR just mean re-check.
+	syscall(SYS_futex, uaddr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *uaddr)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static size_t ring_bytes(size_t msg_size, unsigned int num_slots)
+{
+	const size_t bytes = ring_size(num_slots, msg_size);
+
+	return (bytes + RING_CACHELINE - 1) & ~(size_t)(RING_CACHELINE - 1);
+}
+
+static struct ring *dir_ring(struct channel *chan, struct channel_dir *dir)
+{
+	return (struct ring *)((char *)chan + dir->ring_offset);
+}
+
+size_t channel_size(size_t msg_size, unsigned int num_slots)
+{
+	return sizeof(struct channel) + 2 * ring_bytes(msg_size, num_slots);
+}
+
+struct channel *channel_init(void *mem, size_t msg_size, unsigned int num_slots)
+{
+	struct channel *chan = mem;
+	int i;
+
+	chan->magic = CHANNEL_MAGIC;
+	chan->msg_size = msg_size;
+	chan->num_slots = num_slots;
+
+	for (i = 0; i < 2; i++) {
+		struct channel_dir *dir = &chan->dirs[i];
+
+		dir->seq = 0;
+		dir->waiters = 0;
+		dir->send_spin = MIN_SPIN;
+		dir->recv_spin = MIN_SPIN;
+		dir->ring_offset = sizeof(*chan) + i * ring_bytes(msg_size, num_slots);
+		ring_init(dir_ring(chan, dir), num_slots, msg_size);
+	}
+
+	__atomic_store_n(&chan->ready, 1, __ATOMIC_RELEASE);
+	futex_wake(&chan->ready);
+
+	return chan;
+}
+
+struct channel *channel_attach(void *mem)
+{
+	struct channel *chan = mem;
+
+	while (!__atomic_load_n(&chan->ready, __ATOMIC_ACQUIRE))
+		futex_wait(&chan->ready, 0);
+
+	if (chan->magic != CHANNEL_MAGIC) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return chan;
+}
+
+int channel_memfd_create(const char *name, size_t msg_size,
+			 unsigned int num_slots)
+{
+	int fd, saved_errno;
+
+	fd = memfd_create(name, MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, channel_size(msg_size, num_slots)))
+		goto err;
+
+	// The client maps whatever size it finds, so do not permit it to change.
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		goto err;
+
+	return fd;
+
+err:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return -1;
+}
+
+void *channel_map_fd(int fd, size_t *size)
+{
+	struct stat st;
+	void *ptr;
+
+	if (fstat(fd, &st))
+		return NULL;
+
+	ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	if (size != NULL)
+		*size = st.st_size;
+	return ptr;
+}
+
+static bool try_op(struct channel *chan, struct channel_dir *dir, bool send,
+		   void *msg)
+{
+	struct ring *ring = dir_ring(chan, dir);
+	bool done;
+
+	if (send)
+		done = ring_try_push(ring, msg, chan->msg_size);
+	else
+		done = ring_try_pop(ring, msg, chan->msg_size);
+	if (!done)
+		return false;
+
+	// Pairs with wait_op() counting itself in waiters before re-checking:
+	// either it sees our push/pop, or we see it waiting and wake it. With
+	// nobody waiting this costs a fence and no writes to shared lines.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&dir->waiters, __ATOMIC_RELAXED))
+		return true;
+
+	// Clear waiters as we wake them, so that until they next sleep further
+	// pushes/pops don't make the syscall again.
+	if (__atomic_exchange_n(&dir->waiters, 0, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&dir->seq, 1, __ATOMIC_RELAXED);
+		futex_wake(&dir->seq);
+	}
+
+	return true;
+}
+
+static void wait_op(struct channel *chan, struct channel_dir *dir, bool send,
+		    void *msg)
+{
+	uint32_t *spin = send ? &dir->send_spin : &dir->recv_spin;
+	uint32_t i, seq;
+
+	for (;;) {
+		for (i = 0; i < *spin; i++) {
+			if (try_op(chan, dir, send, msg)) {
+				if (i > 0 && *spin < MAX_SPIN)
+					*spin *= 2;
+				return;
+			}
+			cpu_relax();
+		}
+
+		// Spinning didn't pay off, spin less next time.
+		if (*spin > MIN_SPIN)
+			*spin /= 2;
+
+		__atomic_fetch_add(&dir->waiters, 1, __ATOMIC_RELAXED);
+		seq = __atomic_load_n(&dir->seq, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (try_op(chan, dir, send, msg))
+			return;
+		// Whoever wakes us resets waiters.
+		futex_wait(&dir->seq, seq);
+	}
+}
+
+bool channel_try_send(struct channel *chan, enum channel_side side,
+		      const void *msg)
+{
+	return try_op(chan, &chan->dirs[!side], true, (void *)msg);
+}
+
+bool channel_try_recv(struct channel *chan, enum channel_side side, void *msg)
+{
+	return try_op(chan, &chan->dirs[side], false, msg);
+}
+
+void channel_send(struct channel *chan, enum channel_side side, const void *msg)
+{
+	wait_op(chan, &chan->dirs[!side], true, (void *)msg);
+}
+
+void channel_recv(struct channel *chan, enum channel_side side, void *msg)
+{
+	wait_op(chan, &chan->dirs[side], false, msg);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "ring.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bidirectional message channel between a server and a client laid out in a
+// shared mapping. Each direction is a ring.h SPSC ring plus a futex word, so a
+// blocked sender or receiver spins briefly and then sleeps in the kernel until
+// the other side makes progress, rather than polling.
+//
+// Messages are fixed-size, set by the server when it initialises the channel.
+
+enum channel_side {
+	CHANNEL_SERVER = 0,
+	CHANNEL_CLIENT = 1,
+};
+
+struct channel_dir {
+	// Bumped when waking waiters, slept on with FUTEX_WAIT.
+	uint32_t seq __attribute__((aligned(RING_CACHELINE)));
+	// Non-zero if anyone may be sleeping on seq, so wakers can skip the
+	// syscall. Reset by the waker.
+	uint32_t waiters;
+	// Adaptive spin budgets, each written only by the one sender or receiver.
+	uint32_t send_spin, recv_spin;
+	// Offset of the ring from the start of the channel.
+	uint64_t ring_offset;
+};
+
+struct channel {
+	uint32_t magic;
+	// Set once the server has initialised the channel, waited on by clients.
+	uint32_t ready;
+	uint64_t msg_size;
+	uint64_t num_slots;
+	// dirs[side] carries messages to side.
+	struct channel_dir dirs[2];
+};
+
+// Bytes of shared memory required for a channel.
+size_t channel_size(size_t msg_size, unsigned int num_slots);
+
+// Initialise a channel in mem, which must be at least channel_size() bytes.
+struct channel *channel_init(void *mem, size_t msg_size, unsigned int num_slots);
+
+// Wait for the server to initialise the channel in mem, then return it.
+struct channel *channel_attach(void *mem);
+
+// Create a memfd sized for a channel, sealed against resizing.
+int channel_memfd_create(const char *name, size_t msg_size,
+			 unsigned int num_slots);
+
+// Map the whole of a (sealed) memfd shared. Returns NULL on error.
+void *channel_map_fd(int fd, size_t *size);
+
+// Send msg_size bytes from msg to the other side, blocking while the ring is
+// full.
+void channel_send(struct channel *chan, enum channel_side side, const void *msg);
+
+// Receive msg_size bytes into msg from the other side, blocking while the ring
+// is empty.
+void channel_recv(struct channel *chan, enum channel_side side, void *msg);
+
+// Non-blocking variants, returning false if the ring is full/empty.
+bool channel_try_send(struct channel *chan, enum channel_side side,
+		      const void *msg);
+bool channel_try_recv(struct channel *chan, enum channel_side side, void *msg);
@@ -0,0 +1,13 @@
+#!/bin/bash
+set -e; set -o pipefail
+
+gcc -Wall -Werror -I.. shmem_memfd_client.c ../channel.c -o shmem_memfd_client
+gcc -Wall -Werror -I.. shmem_memfd_server.c ../channel.c -o shmem_memfd_server
+
+# The server tells us where to find its memfd.
+coproc SERVER { ./shmem_memfd_server; }
+# bash closes the coproc's fds when it exits, keep our own copy.
+exec {server_out}<&"${SERVER[0]}"
+read -r -u "$server_out" _ _ path
+./shmem_memfd_client "$path"
+cat <&"$server_out"
@@ -1,16 +1,18 @@
+#include "channel.h"
+
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
 #include <unistd.h>
 
-#define SIZE (4096)
 #define NUM_LOOPS (10)
 
 int main(int argc, char **argv)
 {
+	char msg[3] = { 0 };
+	struct channel *chan;
 	int i, fd;
-	char *ptr;
+	void *ptr;
 
 	if (argc < 2) {
 		fprintf(stderr, "usage: %s [path to fd]\n", argv[0]);
@@ -23,18 +25,26 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	ptr = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (ptr == MAP_FAILED) {
-		perror("mmap");
+	/* The memfd is sealed, so its size is the channel's. */
+	ptr = channel_map_fd(fd, NULL);
+	if (ptr == NULL) {
+		perror("channel_map_fd");
 		return EXIT_FAILURE;
 	}
 
 	close(fd);
 
+	chan = channel_attach(ptr);
+	if (chan == NULL) {
+		perror("channel_attach");
+		return EXIT_FAILURE;
+	}
+
 	for (i = 0; i < NUM_LOOPS; i++) {
-		ptr[1] = 'a' + i;
-		printf("client: %s\n", ptr);
-		sleep(1);
+		msg[1] = 'a' + i;
+		channel_send(chan, CHANNEL_CLIENT, &msg[1]);
+		channel_recv(chan, CHANNEL_CLIENT, &msg[0]);
+		printf("client: %s\n", msg);
 	}
 
 	return EXIT_SUCCESS;
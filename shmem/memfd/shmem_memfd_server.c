@@ -1,59 +1,47 @@
 #define _GNU_SOURCE
-#include <fcntl.h>
+#include "channel.h"
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
-#include <sys/mman.h>
 #include <unistd.h>
 
 #define NAME "test"
-#define SIZE (4096)
+#define NUM_SLOTS (16)
 #define NUM_LOOPS (10)
 
 int main(void)
 {
+	char msg[3] = { 0 };
+	struct channel *chan;
 	int i, fd;
 	pid_t pid;
-	char *ptr;
+	void *ptr;
 
-	fd = memfd_create(NAME, MFD_ALLOW_SEALING);
+	/* Sized for the channel and sealed against resizing. */
+	fd = channel_memfd_create(NAME, sizeof(char), NUM_SLOTS);
 	if (fd < 0) {
-		perror("memfd_create");
+		perror("channel_memfd_create");
 		return EXIT_FAILURE;
 	}
 
-	if (ftruncate(fd, SIZE)) {
-		perror("ftruncate");
+	ptr = channel_map_fd(fd, NULL);
+	if (ptr == NULL) {
+		perror("channel_map_fd");
 		return EXIT_FAILURE;
 	}
 
-	/* Do not permit the size to change henceforth. */
-	if (fcntl(fd, F_ADD_SEALS,
-		  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
-		perror("fcntl");
-		return EXIT_FAILURE;
-	}
-
-	ptr = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (ptr == MAP_FAILED) {
-		perror("mmap");
-		return EXIT_FAILURE;
-	}
-
-	memset(ptr, 0, SIZE);
+	chan = channel_init(ptr, sizeof(char), NUM_SLOTS);
 
 	pid = getpid();
 	printf("Running at /proc/%d/fd/%d\n", pid, fd);
+	fflush(stdout);
 
-	/* Wait for client... */
-	while (ptr[1] < 'a') {
-		sleep(1);
-	}
-
+	/* Sleeps in the kernel until the client sends, no polling. */
 	for (i = 0; i < NUM_LOOPS; i++) {
-		ptr[0] = 'a' + i;
-		printf("server: %s\n", ptr);
-		sleep(1);
+		channel_recv(chan, CHANNEL_SERVER, &msg[1]);
+		msg[0] = 'a' + i;
+		printf("server: %s\n", msg);
+		channel_send(chan, CHANNEL_SERVER, &msg[0]);
 	}
 
 	return EXIT_SUCCESS;
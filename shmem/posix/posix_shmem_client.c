@@ -1,35 +1,57 @@
+#include "channel.h"
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
-#include <sys/shm.h>
 #include <unistd.h>
 
 #define SHM_NAME "test"
-#define SIZE (4096)
 #define NUM_LOOPS (10)
+#define OPEN_TRIES (1000)
+#define OPEN_RETRY_US (1000)
 
 int main(void)
 {
-	int i, fd;
-	char *ptr;
+	char msg[3] = { 0 };
+	struct channel *chan;
+	int i, fd, tries;
+	void *ptr;
 
-	fd = shm_open(SHM_NAME, O_RDWR, 0666);
-	if (fd < 0) {
-		perror("shm_open");
-		return EXIT_FAILURE;
+	/* The server may not have created and sized the object yet. */
+	for (tries = 0;; tries++) {
+		fd = shm_open(SHM_NAME, O_RDWR, 0666);
+		if (fd < 0 && (errno != ENOENT || tries == OPEN_TRIES)) {
+			perror("shm_open");
+			return EXIT_FAILURE;
+		}
+
+		if (fd >= 0) {
+			ptr = channel_map_fd(fd, NULL);
+			close(fd);
+			if (ptr != NULL)
+				break;
+			if (tries == OPEN_TRIES) {
+				perror("channel_map_fd");
+				return EXIT_FAILURE;
+			}
+		}
+
+		usleep(OPEN_RETRY_US);
 	}
 
-	ptr = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (ptr == MAP_FAILED) {
-		perror("mmap");
+	chan = channel_attach(ptr);
+	if (chan == NULL) {
+		perror("channel_attach");
 		return EXIT_FAILURE;
 	}
 
 	for (i = 0; i < NUM_LOOPS; i++) {
-		ptr[1] = 'a' + i;
-		printf("client: %s\n", ptr);
-		sleep(1);
+		msg[1] = 'a' + i;
+		channel_send(chan, CHANNEL_CLIENT, &msg[1]);
+		channel_recv(chan, CHANNEL_CLIENT, &msg[0]);
+		printf("client: %s\n", msg);
 	}
 
 	return EXIT_SUCCESS;
@@ -1,50 +1,52 @@
+#include "channel.h"
+
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <sys/mman.h>
-#include <sys/shm.h>
 #include <unistd.h>
 
 #define SHM_NAME "test"
-#define SIZE (4096)
+#define NUM_SLOTS (16)
 #define NUM_LOOPS (10)
 
 int main(void)
 {
+	char msg[3] = { 0 };
+	struct channel *chan;
 	int i, fd;
-	char *ptr;
+	void *ptr;
+
+	/* Don't let the client find a stale channel left by an earlier run. */
+	shm_unlink(SHM_NAME);
 
-	fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
+	fd = shm_open(SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0666);
 	if (fd < 0) {
 		perror("shm_open");
 		return EXIT_FAILURE;
 	}
 
-	if (ftruncate(fd, SIZE)) {
+	if (ftruncate(fd, channel_size(sizeof(char), NUM_SLOTS))) {
 		perror("ftruncate");
 		return EXIT_FAILURE;
 	}
 
-	ptr = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (ptr == MAP_FAILED) {
-		perror("mmap");
+	ptr = channel_map_fd(fd, NULL);
+	if (ptr == NULL) {
+		perror("channel_map_fd");
 		return EXIT_FAILURE;
 	}
 
-	memset(ptr, 0, SIZE);
+	chan = channel_init(ptr, sizeof(char), NUM_SLOTS);
 
 	for (i = 0; i < NUM_LOOPS; i++) {
-		ptr[0] = 'a' + i;
-		printf("server: %s\n", ptr);
-		sleep(1);
-	}
-
-	/* Wait until client is done. */
-	while (ptr[1] != 'a' + (NUM_LOOPS - 1)) {
-		sleep(1);
+		channel_recv(chan, CHANNEL_SERVER, &msg[1]);
+		msg[0] = 'a' + i;
+		printf("server: %s\n", msg);
+		channel_send(chan, CHANNEL_SERVER, &msg[0]);
 	}
 
+	/* The client has its mapping by now. */
 	if (shm_unlink(SHM_NAME)) {
 		perror("shm_unlink");
 		return EXIT_FAILURE;
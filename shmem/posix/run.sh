@@ -1,8 +1,8 @@
 #!/bin/bash
 set -e; set -o pipefail
 
-gcc -Wall -Werror posix_shmem_client.c -o posix_shmem_client
-gcc -Wall -Werror posix_shmem_server.c -o posix_shmem_server
+gcc -Wall -Werror -I.. posix_shmem_client.c ../channel.c -o posix_shmem_client
+gcc -Wall -Werror -I.. posix_shmem_server.c ../channel.c -o posix_shmem_server
 
 ./posix_shmem_server &
 ./posix_shmem_client
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Lock-free single-producer single-consumer ring of fixed-size slots, laid
+// out in place so it can live in any shared mapping. head is written only by
+// the producer and tail only by the consumer, each on its own cacheline.
+
+#define RING_CACHELINE (64)
+
+struct ring {
+	uint64_t head __attribute__((aligned(RING_CACHELINE)));
+	uint64_t tail __attribute__((aligned(RING_CACHELINE)));
+
+	uint64_t num_slots __attribute__((aligned(RING_CACHELINE)));
+	uint64_t slot_size;
+	char data[] __attribute__((aligned(RING_CACHELINE)));
+};
+
+// Bytes required for a ring of num_slots slots of slot_size bytes each.
+static inline size_t ring_size(uint64_t num_slots, uint64_t slot_size)
+{
+	return sizeof(struct ring) + num_slots * slot_size;
+}
+
+static inline void ring_init(struct ring *ring, uint64_t num_slots,
+			     uint64_t slot_size)
+{
+	ring->head = 0;
+	ring->tail = 0;
+	ring->num_slots = num_slots;
+	ring->slot_size = slot_size;
+}
+
+static inline void *ring_slot(struct ring *ring, uint64_t index)
+{
+	return &ring->data[(index % ring->num_slots) * ring->slot_size];
+}
+
+// Returns false if the ring is full.
+static inline bool ring_try_push(struct ring *ring, const void *msg, size_t len)
+{
+	const uint64_t head = ring->head;
+	const uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail == ring->num_slots)
+		return false;
+
+	memcpy(ring_slot(ring, head), msg, len);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+// Returns false if the ring is empty.
+static inline bool ring_try_pop(struct ring *ring, void *msg, size_t len)
+{
+	const uint64_t tail = ring->tail;
+	const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return false;
+
+	memcpy(msg, ring_slot(ring, tail), len);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
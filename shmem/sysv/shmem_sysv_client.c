@@ -1,3 +1,6 @@
+#include "channel.h"
+
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -6,18 +9,28 @@
 #include <unistd.h>
 
 #define KEY (1234)
-#define SIZE (4096)
 #define NUM_LOOPS (10)
+#define OPEN_TRIES (1000)
+#define OPEN_RETRY_US (1000)
 
 int main(void)
 {
-	int i, shmid;
-	char *shm;
+	char msg[3] = { 0 };
+	struct channel *chan;
+	int i, shmid, tries;
+	void *shm;
 
-	shmid = shmget(KEY, SIZE, 0666);
-	if (shmid < 0) {
-		perror("shmget");
-		return EXIT_FAILURE;
+	/* The server may not have created the segment yet. */
+	for (tries = 0;; tries++) {
+		/* Size 0 attaches to whatever size the server created. */
+		shmid = shmget(KEY, 0, 0666);
+		if (shmid >= 0)
+			break;
+		if (errno != ENOENT || tries == OPEN_TRIES) {
+			perror("shmget");
+			return EXIT_FAILURE;
+		}
+		usleep(OPEN_RETRY_US);
 	}
 
 	shm = shmat(shmid, NULL, 0);
@@ -26,10 +39,17 @@ int main(void)
 		return EXIT_FAILURE;
 	}
 
+	chan = channel_attach(shm);
+	if (chan == NULL) {
+		perror("channel_attach");
+		return EXIT_FAILURE;
+	}
+
 	for (i = 0; i < NUM_LOOPS; i++) {
-		shm[1] = 'a' + i;
-		printf("client: %s\n", shm);
-		sleep(1);
+		msg[1] = 'a' + i;
+		channel_send(chan, CHANNEL_CLIENT, &msg[1]);
+		channel_recv(chan, CHANNEL_CLIENT, &msg[0]);
+		printf("client: %s\n", msg);
 	}
 
 	return EXIT_SUCCESS;
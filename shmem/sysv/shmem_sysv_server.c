@@ -1,21 +1,30 @@
+#include "channel.h"
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <unistd.h>
 
 #define KEY (1234)
-#define SIZE (4096)
+#define NUM_SLOTS (16)
 #define NUM_LOOPS (10)
 
 int main(void)
 {
+	char msg[3] = { 0 };
+	struct channel *chan;
 	int i, shmid;
-	char *shm;
+	void *shm;
+
+	/* Don't let the client find a stale channel left by an earlier run. */
+	shmid = shmget(KEY, 0, 0666);
+	if (shmid >= 0)
+		shmctl(shmid, IPC_RMID, NULL);
 
-	shmid = shmget(KEY, SIZE, IPC_CREAT | 0666);
+	shmid = shmget(KEY, channel_size(sizeof(char), NUM_SLOTS),
+		       IPC_CREAT | IPC_EXCL | 0666);
 	if (shmid < 0) {
 		perror("shmget");
 		return EXIT_FAILURE;
@@ -27,12 +36,19 @@ int main(void)
 		return EXIT_FAILURE;
 	}
 
-	memset(shm, 0, SIZE);
+	chan = channel_init(shm, sizeof(char), NUM_SLOTS);
 
 	for (i = 0; i < NUM_LOOPS; i++) {
-		shm[0] = 'a' + i;
-		printf("server: %s\n", shm);
-		sleep(1);
+		channel_recv(chan, CHANNEL_SERVER, &msg[1]);
+		msg[0] = 'a' + i;
+		printf("server: %s\n", msg);
+		channel_send(chan, CHANNEL_SERVER, &msg[0]);
+	}
+
+	/* The client is attached by now, destroy on last detach. */
+	if (shmctl(shmid, IPC_RMID, NULL)) {
+		perror("shmctl");
+		return EXIT_FAILURE;
 	}
 
 	return EXIT_SUCCESS;
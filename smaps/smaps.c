@@ -0,0 +1,413 @@
+#include "smaps.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIN_CAPACITY (256)
+#define MIN_READ_SIZE (1UL << 20)
+
+#define KEY(_name) { _name, sizeof(_name) - 1 }
+
+static const struct {
+	const char *name;
+	size_t len;
+} field_keys[SMAPS_NUM_FIELDS] = {
+	[SMAPS_SIZE] = KEY("Size"),
+	[SMAPS_KERNEL_PAGE_SIZE] = KEY("KernelPageSize"),
+	[SMAPS_MMU_PAGE_SIZE] = KEY("MMUPageSize"),
+	[SMAPS_RSS] = KEY("Rss"),
+	[SMAPS_PSS] = KEY("Pss"),
+	[SMAPS_PSS_DIRTY] = KEY("Pss_Dirty"),
+	[SMAPS_PSS_ANON] = KEY("Pss_Anon"),
+	[SMAPS_PSS_FILE] = KEY("Pss_File"),
+	[SMAPS_PSS_SHMEM] = KEY("Pss_Shmem"),
+	[SMAPS_SHARED_CLEAN] = KEY("Shared_Clean"),
+	[SMAPS_SHARED_DIRTY] = KEY("Shared_Dirty"),
+	[SMAPS_PRIVATE_CLEAN] = KEY("Private_Clean"),
+	[SMAPS_PRIVATE_DIRTY] = KEY("Private_Dirty"),
+	[SMAPS_REFERENCED] = KEY("Referenced"),
+	[SMAPS_ANONYMOUS] = KEY("Anonymous"),
+	[SMAPS_KSM] = KEY("KSM"),
+	[SMAPS_LAZYFREE] = KEY("LazyFree"),
+	[SMAPS_ANON_HUGE_PAGES] = KEY("AnonHugePages"),
+	[SMAPS_SHMEM_PMD_MAPPED] = KEY("ShmemPmdMapped"),
+	[SMAPS_FILE_PMD_MAPPED] = KEY("FilePmdMapped"),
+	[SMAPS_SHARED_HUGETLB] = KEY("Shared_Hugetlb"),
+	[SMAPS_PRIVATE_HUGETLB] = KEY("Private_Hugetlb"),
+	[SMAPS_SWAP] = KEY("Swap"),
+	[SMAPS_SWAP_PSS] = KEY("SwapPss"),
+	[SMAPS_LOCKED] = KEY("Locked"),
+	[SMAPS_THP_ELIGIBLE] = KEY("THPeligible"),
+	[SMAPS_PROTECTION_KEY] = KEY("ProtectionKey"),
+};
+
+_Static_assert(SMAPS_NUM_FIELDS <= 32, "present mask is 32 bits");
+
+const char *smaps_field_name(enum smaps_field field)
+{
+	return field_keys[field].name;
+}
+
+void smaps_init(struct smaps *smaps)
+{
+	memset(smaps, 0, sizeof(*smaps));
+}
+
+void smaps_free(struct smaps *smaps)
+{
+	int i;
+
+	free(smaps->start);
+	free(smaps->end);
+	free(smaps->offset);
+	free(smaps->inode);
+	free(smaps->dev_major);
+	free(smaps->dev_minor);
+	free(smaps->perms);
+	free(smaps->name);
+	free(smaps->present);
+	free(smaps->vm_flags);
+	for (i = 0; i < SMAPS_NUM_FIELDS; i++)
+		free(smaps->fields[i]);
+
+	smaps_init(smaps);
+}
+
+// Grow every column to capacity entries. On failure the columns are still
+// valid at their old capacity.
+#define GROW_COLUMN(_col, _capacity)					\
+	do {								\
+		void *_new = realloc(_col, (_capacity) * sizeof(*(_col))); \
+									\
+		if (_new == NULL)					\
+			return false;					\
+		_col = _new;						\
+	} while (0)
+
+static bool grow(struct smaps *smaps)
+{
+	const size_t capacity = smaps->capacity ? smaps->capacity * 2 :
+		MIN_CAPACITY;
+	int i;
+
+	GROW_COLUMN(smaps->start, capacity);
+	GROW_COLUMN(smaps->end, capacity);
+	GROW_COLUMN(smaps->offset, capacity);
+	GROW_COLUMN(smaps->inode, capacity);
+	GROW_COLUMN(smaps->dev_major, capacity);
+	GROW_COLUMN(smaps->dev_minor, capacity);
+	GROW_COLUMN(smaps->perms, capacity);
+	GROW_COLUMN(smaps->name, capacity);
+	GROW_COLUMN(smaps->present, capacity);
+	GROW_COLUMN(smaps->vm_flags, capacity);
+	for (i = 0; i < SMAPS_NUM_FIELDS; i++)
+		GROW_COLUMN(smaps->fields[i], capacity);
+
+	smaps->capacity = capacity;
+	return true;
+}
+
+static inline int hex_digit(char chr)
+{
+	if ((unsigned char)(chr - '0') < 10)
+		return chr - '0';
+	if ((unsigned char)(chr - 'a') < 6)
+		return chr - 'a' + 10;
+
+	return -1;
+}
+
+// Header lines start with the VMA's start address in lower case hex, field
+// lines with a capitalised key.
+static inline bool is_header(char chr)
+{
+	return hex_digit(chr) >= 0;
+}
+
+static inline bool parse_hex(const char **pos, const char *eol, uint64_t *val)
+{
+	const char *ptr = *pos;
+	uint64_t ret = 0;
+	int digit;
+
+	for (; ptr < eol && (digit = hex_digit(*ptr)) >= 0; ptr++)
+		ret = (ret << 4) | digit;
+
+	if (ptr == *pos)
+		return false;
+
+	*pos = ptr;
+	*val = ret;
+	return true;
+}
+
+static inline bool parse_dec(const char **pos, const char *eol, uint64_t *val)
+{
+	const char *ptr = *pos;
+	uint64_t ret = 0;
+	unsigned int digit;
+
+	for (; ptr < eol && (digit = (unsigned char)(*ptr - '0')) < 10; ptr++)
+		ret = ret * 10 + digit;
+
+	if (ptr == *pos)
+		return false;
+
+	*pos = ptr;
+	*val = ret;
+	return true;
+}
+
+static inline bool expect(const char **pos, const char *eol, char chr)
+{
+	if (*pos >= eol || **pos != chr)
+		return false;
+
+	(*pos)++;
+	return true;
+}
+
+static inline const char *skip_spaces(const char *ptr, const char *eol)
+{
+	while (ptr < eol && *ptr == ' ')
+		ptr++;
+
+	return ptr;
+}
+
+// The span of [from, to) with trailing spaces dropped.
+static inline struct smaps_span make_span(const char *text, const char *from,
+					  const char *to)
+{
+	struct smaps_span span;
+
+	while (to > from && to[-1] == ' ')
+		to--;
+
+	span.off = from - text;
+	span.len = to - from;
+	return span;
+}
+
+// e.g. "7f0c1a2b3000-7f0c1a2b5000 rw-p 00001000 fe:00 123456   /usr/lib/x"
+static bool parse_header(struct smaps *smaps, size_t idx, const char *text,
+			 const char *line, const char *eol)
+{
+	const char *pos = line;
+	uint64_t major, minor;
+	int i;
+
+	if (!parse_hex(&pos, eol, &smaps->start[idx]) ||
+	    !expect(&pos, eol, '-') ||
+	    !parse_hex(&pos, eol, &smaps->end[idx]) ||
+	    !expect(&pos, eol, ' ') || eol - pos < 5)
+		return false;
+
+	memcpy(smaps->perms[idx], pos, 4);
+	pos += 4;
+
+	if (!expect(&pos, eol, ' ') ||
+	    !parse_hex(&pos, eol, &smaps->offset[idx]) ||
+	    !expect(&pos, eol, ' ') ||
+	    !parse_hex(&pos, eol, &major) ||
+	    !expect(&pos, eol, ':') ||
+	    !parse_hex(&pos, eol, &minor) ||
+	    !expect(&pos, eol, ' ') ||
+	    !parse_dec(&pos, eol, &smaps->inode[idx]))
+		return false;
+
+	smaps->dev_major[idx] = major;
+	smaps->dev_minor[idx] = minor;
+
+	// The name is the rest of the line and may contain spaces.
+	pos = skip_spaces(pos, eol);
+	smaps->name[idx] = make_span(text, pos, eol);
+
+	smaps->present[idx] = 0;
+	smaps->vm_flags[idx] = (struct smaps_span){ 0, 0 };
+	for (i = 0; i < SMAPS_NUM_FIELDS; i++)
+		smaps->fields[i][idx] = 0;
+
+	return true;
+}
+
+static int find_field(const char *key, size_t len)
+{
+	int i;
+
+	for (i = 0; i < SMAPS_NUM_FIELDS; i++) {
+		if (field_keys[i].len == len && !memcmp(field_keys[i].name, key, len))
+			return i;
+	}
+
+	return -1;
+}
+
+// Values are right aligned, so parse them from the end of the line rather
+// than skipping the padding. Either a bare count or kB, nothing else is
+// expected.
+static inline bool parse_value(const char *from, const char *eol, uint64_t *val)
+{
+	const char *end = eol, *pos;
+	uint64_t ret = 0, scale = 1;
+	unsigned int digit;
+
+	if (eol - from > 3 && !memcmp(eol - 3, " kB", 3))
+		end -= 3;
+
+	for (pos = end; pos > from && (digit = (unsigned char)(pos[-1] - '0')) < 10;
+	     pos--) {
+		ret += digit * scale;
+		scale *= 10;
+	}
+
+	if (pos == end || (pos > from && pos[-1] != ' '))
+		return false;
+
+	*val = ret;
+	return true;
+}
+
+// e.g. "Rss:                  24 kB". next_field is our guess at the key,
+// fields being emitted in enum order, which saves searching for it.
+static bool parse_field(struct smaps *smaps, size_t idx, const char *text,
+			const char *line, const char *eol, int *next_field)
+{
+	const size_t line_len = eol - line;
+	const char *colon;
+	uint64_t val;
+	int field;
+
+	field = *next_field;
+	if (field < SMAPS_NUM_FIELDS && field_keys[field].len < line_len &&
+	    line[field_keys[field].len] == ':' &&
+	    !memcmp(field_keys[field].name, line, field_keys[field].len)) {
+		colon = &line[field_keys[field].len];
+	} else {
+		colon = memchr(line, ':', line_len);
+		if (colon == NULL)
+			return false;
+
+		if (colon - line == sizeof("VmFlags") - 1 &&
+		    !memcmp(line, "VmFlags", sizeof("VmFlags") - 1)) {
+			smaps->vm_flags[idx] = make_span(text,
+				skip_spaces(colon + 1, eol), eol);
+			return true;
+		}
+
+		field = find_field(line, colon - line);
+		if (field < 0) {
+			smaps->unknown_fields++;
+			return true;
+		}
+	}
+	*next_field = field + 1;
+
+	if (!parse_value(colon + 1, eol, &val))
+		return false;
+
+	smaps->fields[field][idx] = val;
+	smaps->present[idx] |= 1U << field;
+	return true;
+}
+
+bool smaps_parse(struct smaps *smaps, const char *text, size_t len)
+{
+	const char *const text_end = text + len;
+	const char *line, *eol = text;
+	size_t line_num = 0;
+	int next_field = 0;
+
+	smaps->count = 0;
+	smaps->unknown_fields = 0;
+
+	if (len > UINT32_MAX) {
+		errno = EFBIG;
+		return false;
+	}
+
+	for (line = text; line < text_end; line = eol + 1) {
+		eol = memchr(line, '\n', text_end - line);
+		if (eol == NULL)
+			eol = text_end;
+		line_num++;
+
+		if (eol == line)
+			continue;
+
+		if (is_header(*line)) {
+			if (smaps->count == smaps->capacity && !grow(smaps)) {
+				errno = ENOMEM;
+				return false;
+			}
+
+			if (!parse_header(smaps, smaps->count, text, line, eol))
+				goto malformed;
+			smaps->count++;
+			next_field = 0;
+			continue;
+		}
+
+		if (smaps->count == 0 ||
+		    !parse_field(smaps, smaps->count - 1, text, line, eol,
+				 &next_field))
+			goto malformed;
+	}
+
+	return true;
+
+malformed:
+	fprintf(stderr, "ERROR: Can't parse smaps line %zu [%.*s]\n", line_num,
+		(int)(eol - line), line);
+	errno = EINVAL;
+	return false;
+}
+
+ssize_t smaps_read(const char *path, char **buf, size_t *size)
+{
+	size_t len = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	for (;;) {
+		ssize_t ret;
+
+		if (len == *size) {
+			const size_t new_size = *size ? *size * 2 : MIN_READ_SIZE;
+			char *new_buf = realloc(*buf, new_size);
+
+			if (new_buf == NULL) {
+				close(fd);
+				errno = ENOMEM;
+				return -1;
+			}
+			*buf = new_buf;
+			*size = new_size;
+		}
+
+		// seq_file fills as much of a large read as it can, so this
+		// takes few calls.
+		ret = read(fd, *buf + len, *size - len);
+		if (ret < 0) {
+			const int saved_errno = errno;
+
+			close(fd);
+			errno = saved_errno;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+
+		len += ret;
+	}
+
+	close(fd);
+	return len;
+}
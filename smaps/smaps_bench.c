@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smaps.h"
+
+// Measure how fast smaps text is read and parsed, by the smaps library and by
+// a getline() + sscanf() loop as pagestat used to use. Optionally creates
+// many VMAs in this process first so /proc/self/smaps is large.
+
+struct options {
+	size_t vmas;
+	unsigned int reps;
+	bool baseline;
+	bool verbose;
+};
+
+static struct options opts;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Split one mapping into count VMAs by alternating protections.
+static bool make_vmas(size_t count)
+{
+	const long page_size = sysconf(_SC_PAGESIZE);
+	char *ptr;
+	size_t i;
+
+	ptr = mmap(NULL, count * page_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+
+	for (i = 0; i < count; i += 2) {
+		if (mprotect(&ptr[i * page_size], page_size, PROT_READ)) {
+			perror("mprotect (vm.max_map_count?)");
+			return false;
+		}
+		// Give the writable ones some RSS so the fields aren't all
+		// zero.
+		if (i + 1 < count)
+			ptr[(i + 1) * page_size] = 1;
+	}
+
+	return true;
+}
+
+// As pagestat used to: a line at a time, the first token by sscanf(), then
+// key, value and unit by sscanf() again for field lines.
+static size_t parse_baseline(char *text, size_t len, uint64_t *rss_kib)
+{
+	FILE *fp = fmemopen(text, len, "r");
+	char *line = NULL;
+	size_t size = 0, vmas = 0;
+
+	*rss_kib = 0;
+	if (fp == NULL) {
+		perror("fmemopen");
+		exit(EXIT_FAILURE);
+	}
+
+	while (getline(&line, &size, fp) > 0) {
+		char first[255], key[255], unit[16];
+		uint64_t val;
+
+		if (sscanf(line, "%254s", first) != 1)
+			continue;
+
+		if (first[strlen(first) - 1] != ':') {
+			vmas++;
+			continue;
+		}
+
+		if (sscanf(line, "%254s %lu %15s", key, &val, unit) >= 2 &&
+		    !strcmp(key, "Rss:"))
+			*rss_kib += val;
+	}
+
+	free(line);
+	fclose(fp);
+	return vmas;
+}
+
+static void print_totals(const struct smaps *smaps)
+{
+	int field;
+	size_t i;
+
+	for (field = 0; field < SMAPS_NUM_FIELDS; field++) {
+		uint64_t total = 0;
+
+		for (i = 0; i < smaps->count; i++)
+			total += smaps->fields[field][i];
+
+		printf("  %-16s %lu\n", smaps_field_name(field), total);
+	}
+}
+
+static void print_vmas(const struct smaps *smaps, const char *text)
+{
+	size_t i;
+
+	for (i = 0; i < smaps->count; i++) {
+		printf("%012lx-%012lx %.4s rss=%lu vm_flags=[%.*s] %.*s\n",
+		       smaps->start[i], smaps->end[i], smaps->perms[i],
+		       smaps->fields[SMAPS_RSS][i],
+		       (int)smaps->vm_flags[i].len, &text[smaps->vm_flags[i].off],
+		       (int)smaps->name[i].len, &text[smaps->name[i].off]);
+	}
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [-m vmas] [-n reps] [-b] [-v] [pid|path]\n", bin);
+	fprintf(stderr, "  -m  create this many VMAs in ourselves first\n");
+	fprintf(stderr, "  -n  parse repetitions, the best is reported (default 20)\n");
+	fprintf(stderr, "  -b  also time a getline() + sscanf() baseline\n");
+	fprintf(stderr, "  -v  print each VMA parsed\n");
+	fprintf(stderr, "  Defaults to /proc/self/smaps.\n");
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t start, read_ns, best_ns = UINT64_MAX, total_ns = 0;
+	char path[4096], *buf = NULL;
+	struct smaps smaps;
+	size_t size = 0;
+	unsigned int i;
+	ssize_t len;
+	int opt;
+
+	opts.reps = 20;
+
+	while ((opt = getopt(argc, argv, "m:n:bvh")) != -1) {
+		switch (opt) {
+		case 'm':
+			opts.vmas = strtoull(optarg, NULL, 10);
+			break;
+		case 'n':
+			opts.reps = atoi(optarg);
+			break;
+		case 'b':
+			opts.baseline = true;
+			break;
+		case 'v':
+			opts.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind > 1 || opts.reps == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (optind == argc)
+		snprintf(path, sizeof(path), "/proc/self/smaps");
+	else if (argv[optind][0] == '/' || argv[optind][0] == '.')
+		snprintf(path, sizeof(path), "%s", argv[optind]);
+	else
+		snprintf(path, sizeof(path), "/proc/%s/smaps", argv[optind]);
+
+	if (opts.vmas > 0 && !make_vmas(opts.vmas))
+		return EXIT_FAILURE;
+
+	start = now_ns();
+	len = smaps_read(path, &buf, &size);
+	read_ns = now_ns() - start;
+	if (len < 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	smaps_init(&smaps);
+	for (i = 0; i < opts.reps; i++) {
+		uint64_t elapsed;
+
+		start = now_ns();
+		if (!smaps_parse(&smaps, buf, len)) {
+			perror("smaps_parse");
+			return EXIT_FAILURE;
+		}
+		elapsed = now_ns() - start;
+
+		total_ns += elapsed;
+		if (elapsed < best_ns)
+			best_ns = elapsed;
+	}
+
+	if (opts.verbose)
+		print_vmas(&smaps, buf);
+
+	printf("%s: %zd bytes, %zu VMAs, %zu unknown fields\n", path, len,
+	       smaps.count, smaps.unknown_fields);
+	printf("  read:  %.2f ms, %.1f MB/s\n", read_ns / 1e6,
+	       len * 1e3 / (read_ns ? read_ns : 1));
+	printf("  parse: best %.3f ms (%.2f GB/s, %.1f ns/VMA), avg %.3f ms\n",
+	       best_ns / 1e6, (double)len / (best_ns ? best_ns : 1),
+	       smaps.count ? (double)best_ns / smaps.count : 0.,
+	       total_ns / 1e6 / opts.reps);
+
+	if (opts.baseline) {
+		uint64_t rss_kib;
+		size_t vmas;
+
+		start = now_ns();
+		vmas = parse_baseline(buf, len, &rss_kib);
+		best_ns = now_ns() - start;
+
+		printf("  baseline: %.3f ms (%.2f GB/s), %zu VMAs, Rss %lu kB\n",
+		       best_ns / 1e6, (double)len / (best_ns ? best_ns : 1),
+		       vmas, rss_kib);
+	}
+
+	print_totals(&smaps);
+
+	smaps_free(&smaps);
+	free(buf);
+	return EXIT_SUCCESS;
+}
@@ -1,32 +1,117 @@
+#include "fdpass.h"
+#include "protocol.h"
+
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
 
-static const char *socket_path = "/home/lorenzo/test.socket";
-
-#define MAX_NAME_SIZE (20)
+#define DEFAULT_PAYLOAD_SIZE (1UL << 20)
 
-struct custom_socket_msg {
-	char name[MAX_NAME_SIZE];
-	int n;
+static const char *mode_names[] = {
+	[MODE_PASS_FD] = "pass",
+	[MODE_COPY] = "copy",
+	[MODE_MEMFD] = "memfd",
+	[MODE_FILE] = "file",
 };
 
-int main(void)
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int parse_mode(const char *str)
+{
+	unsigned long i;
+
+	for (i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++) {
+		if (!strcmp(str, mode_names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+// Receive the server's payload and read through it. For memfd and file modes
+// the data is mapped from the passed fd, never copied.
+static int receive_payload(int sock_fd, int mode)
+{
+	struct payload_reply reply;
+	unsigned long sum;
+	double start = now_us();
+	size_t size;
+	void *ptr;
+	int fd;
+
+	if (recv_with_fd(sock_fd, &reply, sizeof(reply), &fd) != sizeof(reply)) {
+		perror("recvmsg");
+		return -1;
+	}
+
+	if (mode == MODE_COPY) {
+		size = reply.size;
+		ptr = malloc(size);
+		if (ptr == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		if (read_all(sock_fd, ptr, size)) {
+			perror("read");
+			return -1;
+		}
+		sum = payload_sum(ptr, size);
+		free(ptr);
+	} else {
+		if (fd < 0) {
+			fprintf(stderr, "No fd passed\n");
+			return -1;
+		}
+		ptr = map_received_fd(fd, &size, 0);
+		if (ptr == NULL) {
+			perror("map_received_fd");
+			return -1;
+		}
+		close(fd);
+		sum = payload_sum(ptr, size);
+		munmap(ptr, size);
+	}
+
+	printf("received %zu bytes by %s in %.1fus, sum=%lu\n", size,
+	       mode_names[mode], now_us() - start, sum);
+	return 0;
+}
+
+int main(int argc, char **argv)
 {
 	struct sockaddr_un remote;
-	int sock_fd, send_fd;
-	int len;
+	int sock_fd, send_fd = -1;
+	int len, mode = MODE_PASS_FD;
+
+	if (argc > 1) {
+		mode = parse_mode(argv[1]);
+		if (mode < 0) {
+			fprintf(stderr, "usage: %s [pass|copy|memfd|file] [size]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
 
-	send_fd = open("test.txt", O_RDONLY);
-	if (send_fd < 0) {
-		perror("open");
-		return EXIT_FAILURE;
+	if (mode == MODE_PASS_FD) {
+		send_fd = open("test.txt", O_RDONLY);
+		if (send_fd < 0) {
+			perror("open");
+			return EXIT_FAILURE;
+		}
 	}
 
 	sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -36,8 +121,8 @@ int main(void)
 	}
 
 	remote.sun_family = AF_UNIX;
-	strcpy(remote.sun_path, socket_path);
-	len = strlen(socket_path) + sizeof(remote.sun_family);
+	strcpy(remote.sun_path, SOCKET_PATH);
+	len = strlen(SOCKET_PATH) + sizeof(remote.sun_family);
 
 	if (connect(sock_fd, (struct sockaddr *)&remote, len) != 0) {
 		perror("connect");
@@ -48,36 +133,21 @@ int main(void)
 
 	struct custom_socket_msg custom_msg;
 
+	memset(&custom_msg, 0, sizeof(custom_msg));
 	strcpy(custom_msg.name, "lozzy");
 	custom_msg.n = 100;
+	custom_msg.mode = mode;
+	custom_msg.size = argc > 2 ? strtoull(argv[2], NULL, 0) :
+		DEFAULT_PAYLOAD_SIZE;
 
-	struct msghdr msgh;
-	struct iovec iov;
-	union {
-		struct cmsghdr cmsgh;
-		char control[CMSG_SPACE(sizeof(int))];
-	} control_un;
-
-	iov.iov_base = &custom_msg;
-	iov.iov_len = sizeof(custom_msg);
-
-	msgh.msg_name = NULL;
-	msgh.msg_namelen = 0;
-	msgh.msg_iov = &iov;
-	msgh.msg_iovlen = 1;
-	msgh.msg_control = control_un.control;
-	msgh.msg_controllen = sizeof(control_un.control);
-
-	control_un.cmsgh.cmsg_len = CMSG_LEN(sizeof(int));
-	control_un.cmsgh.cmsg_level = SOL_SOCKET;
-	control_un.cmsgh.cmsg_type = SCM_RIGHTS;
-	*((int *) CMSG_DATA(CMSG_FIRSTHDR(&msgh))) = send_fd;
-
-	int size = sendmsg(sock_fd, &msgh, 0);
+	int size = send_with_fd(sock_fd, &custom_msg, sizeof(custom_msg), send_fd);
 	if (size < 0) {
 		perror("sendmsg");
 		return EXIT_FAILURE;
 	}
 
+	if (mode != MODE_PASS_FD && receive_payload(sock_fd, mode))
+		return EXIT_FAILURE;
+
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include "fdpass.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compare moving a payload through a unix socket by copying it against
+// handing over an fd to it with SCM_RIGHTS and mapping it on the other side.
+// The receiver reads every word of the payload before acknowledging, so both
+// sides of the comparison include actually touching the data.
+
+#define NS_PER_SEC (1000000000ULL)
+
+#define MIN_SIZE (4UL << 10)
+#define MAX_SIZE (1UL << 30)
+
+// Transfer about this much per size and mode, within the bounds below.
+#define BYTES_PER_RUN (4UL << 30)
+#define MIN_ITERS (3)
+#define MAX_ITERS (2000)
+
+enum mode {
+	// write() through the socket into a buffer the receiver reuses.
+	MODE_COPY,
+	// Pass a sealed memfd, the receiver maps and faults it in.
+	MODE_MEMFD,
+	// As above, but mapped with MAP_POPULATE.
+	MODE_MEMFD_POPULATE,
+	// Pass an fd to a file in the page cache, the receiver maps it.
+	MODE_FILE,
+	NUM_MODES,
+};
+
+static const char *mode_names[] = {
+	[MODE_COPY] = "copy",
+	[MODE_MEMFD] = "memfd",
+	[MODE_MEMFD_POPULATE] = "memfd-populate",
+	[MODE_FILE] = "file",
+};
+
+struct run {
+	enum mode mode;
+	size_t size;
+	unsigned long iters;
+	// Sender's side: a buffer for MODE_COPY, otherwise an fd.
+	char *buf;
+	int fd;
+};
+
+static void fail(const char *msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static unsigned long expected_sum(size_t size)
+{
+	const unsigned long words = size / sizeof(unsigned long);
+
+	return words * (words - 1) / 2;
+}
+
+// Produce the payload up front, we are only timing getting it across.
+static void prepare(struct run *run)
+{
+	char path[] = "/tmp/fd_bench.XXXXXX";
+	void *ptr;
+
+	run->buf = NULL;
+	run->fd = -1;
+
+	switch (run->mode) {
+	case MODE_COPY:
+		run->buf = malloc(run->size);
+		if (run->buf == NULL)
+			fail("malloc");
+		payload_fill(run->buf, run->size);
+		break;
+	case MODE_MEMFD:
+	case MODE_MEMFD_POPULATE:
+		run->fd = payload_memfd_create("fd_bench", run->size, &ptr);
+		if (run->fd < 0)
+			fail("payload_memfd_create");
+		payload_fill(ptr, run->size);
+		munmap(ptr, run->size);
+		if (payload_memfd_seal(run->fd))
+			fail("payload_memfd_seal");
+		break;
+	case MODE_FILE:
+		run->fd = mkstemp(path);
+		if (run->fd < 0)
+			fail("mkstemp");
+		unlink(path);
+		if (ftruncate(run->fd, run->size))
+			fail("ftruncate");
+		ptr = mmap(NULL, run->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   run->fd, 0);
+		if (ptr == MAP_FAILED)
+			fail("mmap");
+		payload_fill(ptr, run->size);
+		munmap(ptr, run->size);
+		break;
+	default:
+		break;
+	}
+}
+
+static void cleanup(struct run *run)
+{
+	free(run->buf);
+	if (run->fd >= 0)
+		close(run->fd);
+}
+
+static void sender(struct run *run, int sock_fd)
+{
+	uint64_t size = run->size;
+	unsigned long sum;
+	unsigned long i;
+	int fd;
+
+	for (i = 0; i < run->iters; i++) {
+		if (run->mode == MODE_COPY) {
+			if (write_all(sock_fd, &size, sizeof(size)) ||
+			    write_all(sock_fd, run->buf, size))
+				fail("write");
+		} else if (send_with_fd(sock_fd, &size, sizeof(size), run->fd) < 0) {
+			fail("sendmsg");
+		}
+
+		if (recv_with_fd(sock_fd, &sum, sizeof(sum), &fd) != sizeof(sum))
+			fail("recvmsg");
+		if (sum != expected_sum(run->size)) {
+			fprintf(stderr, "%s: bad sum %lu\n", mode_names[run->mode], sum);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void receiver(struct run *run, int sock_fd)
+{
+	const int flags = run->mode == MODE_MEMFD_POPULATE ? MAP_POPULATE : 0;
+	char *buf = NULL;
+	unsigned long sum;
+	unsigned long i;
+	uint64_t size;
+	size_t mapped;
+	void *ptr;
+	int fd;
+
+	if (run->mode == MODE_COPY) {
+		buf = malloc(run->size);
+		if (buf == NULL)
+			fail("malloc");
+		// Fault in up front, as a long-lived receive buffer would be.
+		memset(buf, 0, run->size);
+	}
+
+	for (i = 0; i < run->iters; i++) {
+		if (recv_with_fd(sock_fd, &size, sizeof(size), &fd) != sizeof(size))
+			fail("recvmsg");
+
+		if (run->mode == MODE_COPY) {
+			if (read_all(sock_fd, buf, size))
+				fail("read");
+			sum = payload_sum(buf, size);
+		} else {
+			if (fd < 0) {
+				fprintf(stderr, "no fd received\n");
+				exit(EXIT_FAILURE);
+			}
+			ptr = map_received_fd(fd, &mapped, flags);
+			if (ptr == NULL)
+				fail("map_received_fd");
+			close(fd);
+			sum = payload_sum(ptr, mapped);
+			munmap(ptr, mapped);
+		}
+
+		if (write_all(sock_fd, &sum, sizeof(sum)))
+			fail("write");
+	}
+
+	free(buf);
+}
+
+static void bench(enum mode mode, size_t size)
+{
+	struct run run = {
+		.mode = mode,
+		.size = size,
+		.iters = BYTES_PER_RUN / size,
+	};
+	uint64_t start, elapsed_ns;
+	int socks[2], status;
+	pid_t pid;
+
+	if (run.iters < MIN_ITERS)
+		run.iters = MIN_ITERS;
+	if (run.iters > MAX_ITERS)
+		run.iters = MAX_ITERS;
+
+	prepare(&run);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks))
+		fail("socketpair");
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		fail("fork");
+	if (pid == 0) {
+		close(socks[0]);
+		// The receiver has no use for the sender's copy of the payload.
+		cleanup(&run);
+		receiver(&run, socks[1]);
+		_exit(EXIT_SUCCESS);
+	}
+	close(socks[1]);
+
+	start = now_ns();
+	sender(&run, socks[0]);
+	elapsed_ns = now_ns() - start;
+
+	close(socks[0]);
+	if (waitpid(pid, &status, 0) < 0)
+		fail("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "receiver failed\n");
+		exit(EXIT_FAILURE);
+	}
+	cleanup(&run);
+
+	printf("%-15s size=%-10zu iters=%-5lu %10.1fus/xfer %8.2f GiB/s\n",
+	       mode_names[mode], size, run.iters,
+	       (double)elapsed_ns / run.iters / 1000.,
+	       (double)size * run.iters * NS_PER_SEC / elapsed_ns / (1UL << 30));
+}
+
+int main(int argc, char **argv)
+{
+	const size_t max_size = argc > 1 ? strtoull(argv[1], NULL, 0) : MAX_SIZE;
+	size_t size;
+	int mode;
+
+	for (size = MIN_SIZE; size <= max_size; size *= 4) {
+		for (mode = 0; mode < NUM_MODES; mode++)
+			bench(mode, size);
+		printf("\n");
+	}
+
+	return EXIT_SUCCESS;
+}
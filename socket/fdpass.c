@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "fdpass.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ssize_t send_with_fd(int sock_fd, const void *data, size_t len, int fd)
+{
+	struct msghdr msgh;
+	struct iovec iov;
+	union {
+		struct cmsghdr cmsgh;
+		char control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		msgh.msg_control = control_un.control;
+		msgh.msg_controllen = sizeof(control_un.control);
+
+		control_un.cmsgh.cmsg_len = CMSG_LEN(sizeof(int));
+		control_un.cmsgh.cmsg_level = SOL_SOCKET;
+		control_un.cmsgh.cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msgh)), &fd, sizeof(int));
+	}
+
+	return sendmsg(sock_fd, &msgh, 0);
+}
+
+ssize_t recv_with_fd(int sock_fd, void *data, size_t len, int *fd)
+{
+	struct msghdr msgh;
+	struct iovec iov;
+	union {
+		struct cmsghdr cmsgh;
+		char control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+	struct cmsghdr *cmsgh;
+	ssize_t size;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_control = control_un.control;
+	msgh.msg_controllen = sizeof(control_un.control);
+
+	*fd = -1;
+
+	size = recvmsg(sock_fd, &msgh, MSG_CMSG_CLOEXEC);
+	if (size < 0)
+		return -1;
+
+	cmsgh = CMSG_FIRSTHDR(&msgh);
+	if (cmsgh != NULL && cmsgh->cmsg_level == SOL_SOCKET &&
+	    cmsgh->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsgh), sizeof(int));
+
+	return size;
+}
+
+int write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+
+	while (len > 0) {
+		ssize_t written = write(fd, ptr, len);
+
+		if (written < 0)
+			return -1;
+
+		ptr += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+int read_all(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+
+	while (len > 0) {
+		ssize_t num_read = read(fd, ptr, len);
+
+		if (num_read <= 0)
+			return -1;
+
+		ptr += num_read;
+		len -= num_read;
+	}
+
+	return 0;
+}
+
+int payload_memfd_create(const char *name, size_t size, void **ptr)
+{
+	int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size))
+		goto err;
+
+	*ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*ptr == MAP_FAILED)
+		goto err;
+
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+int payload_memfd_seal(int fd)
+{
+	// F_SEAL_WRITE is refused while any writable shared mapping exists, so
+	// the sender must have unmapped its view, making this a real handover.
+	return fcntl(fd, F_ADD_SEALS,
+		     F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+}
+
+void *map_received_fd(int fd, size_t *size, int flags)
+{
+	struct stat st;
+	void *ptr;
+
+	if (fstat(fd, &st))
+		return NULL;
+	if (st.st_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | flags, fd, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+	return ptr;
+}
+
+void payload_fill(void *buf, size_t size)
+{
+	unsigned long *words = buf;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(*words); i++)
+		words[i] = i;
+}
+
+unsigned long payload_sum(const void *buf, size_t size)
+{
+	const unsigned long *words = buf;
+	unsigned long sum = 0;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(*words); i++)
+		sum += words[i];
+
+	return sum;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Send len bytes of data with fd attached as SCM_RIGHTS, or no fd if fd < 0.
+// Returns the number of bytes sent or -1 on error.
+ssize_t send_with_fd(int sock_fd, const void *data, size_t len, int fd);
+
+// Receive up to len bytes into data, storing any fd passed with them in *fd,
+// or -1 if there was none. Returns the number of bytes received or -1 on error.
+ssize_t recv_with_fd(int sock_fd, void *data, size_t len, int *fd);
+
+// Loop until all of len has been written/read. Return 0 on success, -1 on
+// error or EOF.
+int write_all(int fd, const void *buf, size_t len);
+int read_all(int fd, void *buf, size_t len);
+
+// Create a memfd holding size bytes, mapped at *ptr for the caller to fill.
+// Returns the fd, or -1 on error.
+int payload_memfd_create(const char *name, size_t size, void **ptr);
+
+// Seal a filled payload memfd so that the receiver can map it knowing that
+// its size and contents can no longer change under it.
+int payload_memfd_seal(int fd);
+
+// Map the whole of a received fd read-only. Returns NULL on error.
+void *map_received_fd(int fd, size_t *size, int flags);
+
+// Fill a payload with a known pattern, and sum it back by reading every word,
+// as a stand-in for producing and consuming real data.
+void payload_fill(void *buf, size_t size);
+unsigned long payload_sum(const void *buf, size_t size);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SOCKET_PATH "/home/lorenzo/test.socket"
+
+#define MAX_NAME_SIZE (20)
+
+enum payload_mode {
+	// The client passes the server an open file, which it prints.
+	MODE_PASS_FD,
+	// The server writes the payload through the socket.
+	MODE_COPY,
+	// The server passes a sealed memfd holding the payload.
+	MODE_MEMFD,
+	// The server passes its open file for the client to map.
+	MODE_FILE,
+};
+
+struct custom_socket_msg {
+	char name[MAX_NAME_SIZE];
+	int n;
+	int mode;
+	// Payload size requested for MODE_COPY and MODE_MEMFD.
+	uint64_t size;
+};
+
+// Sent by the server in reply to all but MODE_PASS_FD, with the payload fd
+// attached or, for MODE_COPY, followed by the payload itself.
+struct payload_reply {
+	uint64_t size;
+};
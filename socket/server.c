@@ -1,28 +1,24 @@
+#include "fdpass.h"
+#include "protocol.h"
+
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/types.h>
 
-static const char *socket_path = "/home/lorenzo/test.socket";
-
-#define MAX_NAME_SIZE (20)
-
-struct custom_socket_msg {
-	char name[MAX_NAME_SIZE];
-	int n;
-};
-
 static void output_file(int fd)
 {
 	char buf[512];
 	int num_bytes;
 
-	num_bytes = read(fd, &buf, sizeof(buf));
+	num_bytes = read(fd, &buf, sizeof(buf) - 1);
 	if (num_bytes < 0) {
 		perror("read");
 		exit(1);
@@ -34,12 +30,90 @@ static void output_file(int fd)
 	close(fd);
 }
 
-int main(void)
+// Copy the payload through the socket.
+static int serve_copy(int accepted_fd, size_t size)
+{
+	struct payload_reply reply = { .size = size };
+	char *buf = malloc(size);
+	int ret = -1;
+
+	if (buf == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	payload_fill(buf, size);
+
+	if (write_all(accepted_fd, &reply, sizeof(reply)) ||
+	    write_all(accepted_fd, buf, size))
+		perror("write");
+	else
+		ret = 0;
+
+	free(buf);
+	return ret;
+}
+
+// Fill a memfd, seal it and hand it over. Nothing is copied, the client maps
+// the very pages we wrote.
+static int serve_memfd(int accepted_fd, size_t size)
+{
+	struct payload_reply reply = { .size = size };
+	void *ptr;
+	int fd, ret = -1;
+
+	fd = payload_memfd_create("payload", size, &ptr);
+	if (fd < 0) {
+		perror("payload_memfd_create");
+		return -1;
+	}
+
+	payload_fill(ptr, size);
+	munmap(ptr, size);
+
+	if (payload_memfd_seal(fd))
+		perror("payload_memfd_seal");
+	else if (send_with_fd(accepted_fd, &reply, sizeof(reply), fd) < 0)
+		perror("sendmsg");
+	else
+		ret = 0;
+
+	close(fd);
+	return ret;
+}
+
+// Pass our open file, the client maps its page cache pages directly.
+static int serve_file(int accepted_fd, int file_fd)
+{
+	struct payload_reply reply;
+	struct stat st;
+
+	if (fstat(file_fd, &st)) {
+		perror("fstat");
+		return -1;
+	}
+	reply.size = st.st_size;
+
+	if (send_with_fd(accepted_fd, &reply, sizeof(reply), file_fd) < 0) {
+		perror("sendmsg");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
 {
+	const char *file_path = argc > 1 ? argv[1] : "test.txt";
 	struct sockaddr_un local, remote;
-	int sock_fd;
+	int sock_fd, file_fd;
 	int len;
 
+	file_fd = open(file_path, O_RDONLY);
+	if (file_fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+
 	sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (sock_fd < 0) {
 		perror("socket");
@@ -47,11 +121,11 @@ int main(void)
 	}
 
 	// Delete socket file if already exists.
-	unlink(socket_path);
+	unlink(SOCKET_PATH);
 
 	local.sun_family = AF_UNIX;
-	strcpy(local.sun_path, socket_path);
-	len = strlen(socket_path) + sizeof(local.sun_family);
+	strcpy(local.sun_path, SOCKET_PATH);
+	len = strlen(SOCKET_PATH) + sizeof(local.sun_family);
 
 	if (bind(sock_fd, (struct sockaddr *)&local, len) != 0) {
 		perror("bind");
@@ -67,7 +141,7 @@ int main(void)
 
 	while (true) {
 		int accepted_fd;
-		unsigned int sock_len;
+		unsigned int sock_len = sizeof(remote);
 		puts("Waiting for connection...");
 		int recv_fd;
 
@@ -79,26 +153,10 @@ int main(void)
 
 		puts("Server connected.");
 
-		struct msghdr msgh;
-		struct iovec iov;
-		union {
-			struct cmsghdr cmsgh;
-			char control[CMSG_SPACE(sizeof(int))];
-		} control_un;
-		struct cmsghdr *cmsgh;
 		struct custom_socket_msg custom_msg;
 
-		iov.iov_base = &custom_msg;
-		iov.iov_len = sizeof(custom_msg);
-
-		msgh.msg_name = NULL;
-		msgh.msg_namelen = 0;
-		msgh.msg_iov = &iov;
-		msgh.msg_iovlen = 1;
-		msgh.msg_control = control_un.control;
-		msgh.msg_controllen = sizeof(control_un.control);
-
-		int size = recvmsg(accepted_fd, &msgh, 0);
+		int size = recv_with_fd(accepted_fd, &custom_msg, sizeof(custom_msg),
+					&recv_fd);
 		if (size < 0) {
 			perror("recvmsg");
 			return EXIT_FAILURE;
@@ -109,24 +167,33 @@ int main(void)
 			return EXIT_FAILURE;
 		}
 
-		printf("CONNECT: name=[%s], n=[%d]\n", custom_msg.name, custom_msg.n);
-
-		cmsgh = CMSG_FIRSTHDR(&msgh);
-		if (!cmsgh) {
-			printf("<no fd>\n");
-			continue;
-		}
-
-		if (cmsgh->cmsg_level != SOL_SOCKET ||
-		    cmsgh->cmsg_type != SCM_RIGHTS) {
-			fprintf(stderr,
-				"Invalid level/rights %d/%d\n", cmsgh->cmsg_level,
-				cmsgh->cmsg_type);
-			return EXIT_FAILURE;
+		printf("CONNECT: name=[%s], n=[%d], mode=[%d]\n", custom_msg.name,
+		       custom_msg.n, custom_msg.mode);
+
+		switch (custom_msg.mode) {
+		case MODE_PASS_FD:
+			if (recv_fd < 0)
+				printf("<no fd>\n");
+			else
+				output_file(recv_fd);
+			break;
+		case MODE_COPY:
+			serve_copy(accepted_fd, custom_msg.size);
+			break;
+		case MODE_MEMFD:
+			serve_memfd(accepted_fd, custom_msg.size);
+			break;
+		case MODE_FILE:
+			serve_file(accepted_fd, file_fd);
+			break;
+		default:
+			fprintf(stderr, "Unknown mode %d\n", custom_msg.mode);
+			break;
 		}
 
-		recv_fd = *((int *) CMSG_DATA(cmsgh));
-		output_file(recv_fd);
+		if (custom_msg.mode != MODE_PASS_FD && recv_fd >= 0)
+			close(recv_fd);
+		close(accepted_fd);
 	}
 
 	return EXIT_SUCCESS;
@@ -1,143 +1,110 @@
+#include <cerrno>
+#include <cinttypes>
 #include <cstdint>
-#include <iostream>
-#include <map>
-#include <sstream>
-
-#define BIT(n) (1UL << n)
-
-// Flags only used by other flags.
-#define VM_ARCH_1	0x01000000
-#define VM_HIGH_ARCH_BIT_0	32
-#define VM_HIGH_ARCH_BIT_1	33
-#define VM_HIGH_ARCH_BIT_2	34
-#define VM_HIGH_ARCH_BIT_3	35
-#define VM_HIGH_ARCH_BIT_4	36
-#define VM_HIGH_ARCH_0	BIT(VM_HIGH_ARCH_BIT_0)
-#define VM_HIGH_ARCH_1	BIT(VM_HIGH_ARCH_BIT_1)
-#define VM_HIGH_ARCH_2	BIT(VM_HIGH_ARCH_BIT_2)
-#define VM_HIGH_ARCH_3	BIT(VM_HIGH_ARCH_BIT_3)
-#define VM_HIGH_ARCH_4	BIT(VM_HIGH_ARCH_BIT_4)
-#define VM_UFFD_MINOR_BIT	37
-
-// Named flags.
-#define VM_NONE		0x00000000
-#define VM_READ		0x00000001
-#define VM_WRITE	0x00000002
-#define VM_EXEC		0x00000004
-#define VM_SHARED	0x00000008
-#define VM_MAYREAD	0x00000010
-#define VM_MAYWRITE	0x00000020
-#define VM_MAYEXEC	0x00000040
-#define VM_MAYSHARE	0x00000080
-#define VM_GROWSDOWN	0x00000100
-#define VM_UFFD_MISSING	0x00000200
-#define VM_PFNMAP	0x00000400
-#define VM_UFFD_WP	0x00001000
-#define VM_LOCKED	0x00002000
-#define VM_IO           0x00004000
-#define VM_SEQ_READ	0x00008000
-#define VM_RAND_READ	0x00010000
-#define VM_DONTCOPY	0x00020000
-#define VM_DONTEXPAND	0x00040000
-#define VM_LOCKONFAULT	0x00080000
-#define VM_ACCOUNT	0x00100000
-#define VM_NORESERVE	0x00200000
-#define VM_HUGETLB	0x00400000
-#define VM_SYNC		0x00800000
-#define VM_WIPEONFORK	0x02000000
-#define VM_DONTDUMP	0x04000000
-#define VM_SOFTDIRTY	0x08000000
-#define VM_MIXEDMAP	0x10000000
-#define VM_HUGEPAGE	0x20000000
-#define VM_NOHUGEPAGE	0x40000000
-#define VM_MERGEABLE	0x80000000
-#define VM_PKEY_SHIFT	VM_HIGH_ARCH_BIT_0
-#define VM_PKEY_BIT0	VM_HIGH_ARCH_0
-#define VM_PKEY_BIT1	VM_HIGH_ARCH_1
-#define VM_PKEY_BIT2	VM_HIGH_ARCH_2
-#define VM_PKEY_BIT3	VM_HIGH_ARCH_3
-#define VM_PKEY_BIT4	VM_HIGH_ARCH_4
-#define VM_PAT		VM_ARCH_1
-#define VM_UFFD_MINOR	BIT(VM_UFFD_MINOR_BIT)
-
-namespace vm_flags
-{
-// Use map so we get ordering.
-std::map<uint64_t, const char*> flag_map = {
-	// VM_NONE is handled separately.
-	{ VM_READ, "VM_READ" },
-	{ VM_WRITE, "VM_WRITE" },
-	{ VM_EXEC, "VM_EXEC" },
-	{ VM_SHARED, "VM_SHARED" },
-	{ VM_MAYREAD, "VM_MAYREAD" },
-	{ VM_MAYWRITE, "VM_MAYWRITE" },
-	{ VM_MAYEXEC, "VM_MAYEXEC" },
-	{ VM_MAYSHARE, "VM_MAYSHARE" },
-	{ VM_GROWSDOWN, "VM_GROWSDOWN" },
-	{ VM_UFFD_MISSING, "VM_UFFD_MISSING" },
-	{ VM_PFNMAP, "VM_PFNMAP" },
-	{ VM_UFFD_WP, "VM_UFFD_WP" },
-	{ VM_LOCKED, "VM_LOCKED" },
-	{ VM_IO, "VM_IO" },
-	{ VM_SEQ_READ, "VM_SEQ_READ" },
-	{ VM_RAND_READ, "VM_RAND_READ" },
-	{ VM_DONTCOPY, "VM_DONTCOPY" },
-	{ VM_DONTEXPAND, "VM_DONTEXPAND" },
-	{ VM_LOCKONFAULT, "VM_LOCKONFAULT" },
-	{ VM_ACCOUNT, "VM_ACCOUNT" },
-	{ VM_NORESERVE, "VM_NORESERVE" },
-	{ VM_HUGETLB, "VM_HUGETLB" },
-	{ VM_SYNC, "VM_SYNC" },
-	{ VM_WIPEONFORK, "VM_WIPEONFORK" },
-	{ VM_DONTDUMP, "VM_DONTDUMP" },
-	{ VM_SOFTDIRTY, "VM_SOFTDIRTY" },
-	{ VM_MIXEDMAP, "VM_MIXEDMAP" },
-	{ VM_HUGEPAGE, "VM_HUGEPAGE" },
-	{ VM_NOHUGEPAGE, "VM_NOHUGEPAGE" },
-	{ VM_MERGEABLE, "VM_MERGEABLE" },
-	{ VM_PKEY_SHIFT, "VM_PKEY_SHIFT" },
-	{ VM_PKEY_BIT0, "VM_PKEY_BIT0" },
-	{ VM_PKEY_BIT1, "VM_PKEY_BIT1" },
-	{ VM_PKEY_BIT2, "VM_PKEY_BIT2" },
-	{ VM_PKEY_BIT3, "VM_PKEY_BIT3" },
-	{ VM_PKEY_BIT4, "VM_PKEY_BIT4" },
-	{ VM_PAT, "VM_PAT" },
-	{ VM_UFFD_MINOR, "VM_UFFD_MINOR" },
-};
-} // namespace vm_flags
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+
+#include "vm_flags.h"
+
+// Decode VMA flags given in hex, or read lines from stdin with "-" and decode
+// each: hex values (e.g. vmaflags output, error=... lines are passed through)
+// or smaps VmFlags mnemonics (e.g. pagestat's vm_flags), with or without the
+// "VmFlags:" prefix. Mnemonic lines are encoded to hex first. A lone
+// mnemonic which is also valid hex (e.g. "ac") is taken as hex unless prefixed.
 
 namespace
 {
 void print_vma_flags(uint64_t flags)
 {
-	if (flags == 0) {
-		std::cout << "VM_NONE\n";
+	char buf[vm_flags::max_formatted + sizeof("VM_NONE")];
+	uint64_t unknown;
+
+	vm_flags::format(flags, buf, sizeof(buf), &unknown);
+	std::puts(buf);
+
+	if (unknown != 0)
+		std::printf("INVALID: %" PRIu64 " remains.\n", unknown);
+}
+
+bool parse_hex(std::string_view str, uint64_t *flags)
+{
+	char buf[32];
+	char *end;
+
+	if (str.substr(0, 2) == "0x")
+		str.remove_prefix(2);
+	if (str.empty() || str.size() >= sizeof(buf))
+		return false;
+
+	std::memcpy(buf, str.data(), str.size());
+	buf[str.size()] = '\0';
+
+	errno = 0;
+	*flags = std::strtoull(buf, &end, 16);
+	return errno == 0 && *end == '\0';
+}
+
+void decode_line(std::string_view line)
+{
+	uint64_t flags;
+	size_t unknown;
+
+	while (!line.empty() && (line.back() == '\n' || line.back() == ' '))
+		line.remove_suffix(1);
+	while (!line.empty() && line.front() == ' ')
+		line.remove_prefix(1);
+
+	if (line.empty() || line.substr(0, 6) == "error=") {
+		std::printf("%.*s\n", (int)line.size(), line.data());
 		return;
 	}
 
-	for (const auto& [ flag, str ] : vm_flags::flag_map) {
-		if ((flags & flag) != flag)
-			continue;
-
-		std::cout << str << " ";
-		flags &= ~flag;
+	if (!parse_hex(line, &flags)) {
+		flags = vm_flags::parse_mnemonics(line, &unknown);
+		std::printf("%" PRIx64 ": ", flags);
+		if (unknown != 0)
+			std::printf("(%zu unknown mnemonic(s)) ", unknown);
+	} else {
+		std::printf("%" PRIx64 ": ", flags);
 	}
 
-	std::cout << "\n";
+	print_vma_flags(flags);
+}
+
+void decode_stdin()
+{
+	char *line = nullptr;
+	size_t size = 0;
+	ssize_t len;
 
-	if (flags != 0)
-		std::cout << "INVALID: " << flags << " remains.\n";
+	while ((len = getline(&line, &size, stdin)) > 0)
+		decode_line(std::string_view(line, len));
+
+	std::free(line);
 }
 };
 
 int main(int argc, char **argv)
 {
 	if (argc < 2) {
-		std::cerr << "usage: " << argv[0] << " [vma flags in hex]\n";
+		std::fprintf(stderr, "usage: %s [vma flags in hex...|-]\n", argv[0]);
 		return 1;
 	}
 
-	print_vma_flags(std::stoul(argv[1], nullptr, 16));
+	for (int i = 1; i < argc; i++) {
+		uint64_t flags;
+
+		if (std::strcmp(argv[i], "-") == 0) {
+			decode_stdin();
+		} else if (parse_hex(argv[i], &flags)) {
+			print_vma_flags(flags);
+		} else {
+			std::fprintf(stderr, "%s: not a hex value\n", argv[i]);
+			return 1;
+		}
+	}
 
 	return 0;
 }
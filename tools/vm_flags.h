@@ -0,0 +1,299 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// Decode VMA flags without building anything at runtime. The flag table is
+// constexpr, as are the per-bit and per-mnemonic lookup tables derived from
+// it, so decoding a value is a walk over its set bits and encoding a smaps
+// "VmFlags:" line is a table lookup per mnemonic. Suitable for decoding
+// vmaflags/vmainfo output or pagestat's vm_flags in bulk.
+//
+// Values are as of the kernels we test on, some bits differ between
+// architectures and versions.
+
+namespace vm_flags
+{
+constexpr uint64_t BIT(unsigned int n) { return 1UL << n; }
+
+// Flags only used by other flags.
+constexpr uint64_t VM_ARCH_1 = 0x01000000;
+constexpr unsigned int VM_HIGH_ARCH_BIT_0 = 32;
+constexpr unsigned int VM_HIGH_ARCH_BIT_1 = 33;
+constexpr unsigned int VM_HIGH_ARCH_BIT_2 = 34;
+constexpr unsigned int VM_HIGH_ARCH_BIT_3 = 35;
+constexpr unsigned int VM_HIGH_ARCH_BIT_4 = 36;
+constexpr uint64_t VM_HIGH_ARCH_0 = BIT(VM_HIGH_ARCH_BIT_0);
+constexpr uint64_t VM_HIGH_ARCH_1 = BIT(VM_HIGH_ARCH_BIT_1);
+constexpr uint64_t VM_HIGH_ARCH_2 = BIT(VM_HIGH_ARCH_BIT_2);
+constexpr uint64_t VM_HIGH_ARCH_3 = BIT(VM_HIGH_ARCH_BIT_3);
+constexpr uint64_t VM_HIGH_ARCH_4 = BIT(VM_HIGH_ARCH_BIT_4);
+constexpr unsigned int VM_UFFD_MINOR_BIT = 37;
+
+// Named flags.
+constexpr uint64_t VM_NONE = 0x00000000;
+constexpr uint64_t VM_READ = 0x00000001;
+constexpr uint64_t VM_WRITE = 0x00000002;
+constexpr uint64_t VM_EXEC = 0x00000004;
+constexpr uint64_t VM_SHARED = 0x00000008;
+constexpr uint64_t VM_MAYREAD = 0x00000010;
+constexpr uint64_t VM_MAYWRITE = 0x00000020;
+constexpr uint64_t VM_MAYEXEC = 0x00000040;
+constexpr uint64_t VM_MAYSHARE = 0x00000080;
+constexpr uint64_t VM_GROWSDOWN = 0x00000100;
+constexpr uint64_t VM_UFFD_MISSING = 0x00000200;
+constexpr uint64_t VM_PFNMAP = 0x00000400;
+constexpr uint64_t VM_UFFD_WP = 0x00001000;
+constexpr uint64_t VM_LOCKED = 0x00002000;
+constexpr uint64_t VM_IO = 0x00004000;
+constexpr uint64_t VM_SEQ_READ = 0x00008000;
+constexpr uint64_t VM_RAND_READ = 0x00010000;
+constexpr uint64_t VM_DONTCOPY = 0x00020000;
+constexpr uint64_t VM_DONTEXPAND = 0x00040000;
+constexpr uint64_t VM_LOCKONFAULT = 0x00080000;
+constexpr uint64_t VM_ACCOUNT = 0x00100000;
+constexpr uint64_t VM_NORESERVE = 0x00200000;
+constexpr uint64_t VM_HUGETLB = 0x00400000;
+constexpr uint64_t VM_SYNC = 0x00800000;
+constexpr uint64_t VM_WIPEONFORK = 0x02000000;
+constexpr uint64_t VM_DONTDUMP = 0x04000000;
+constexpr uint64_t VM_SOFTDIRTY = 0x08000000;
+constexpr uint64_t VM_MIXEDMAP = 0x10000000;
+constexpr uint64_t VM_HUGEPAGE = 0x20000000;
+constexpr uint64_t VM_NOHUGEPAGE = 0x40000000;
+constexpr uint64_t VM_MERGEABLE = 0x80000000;
+constexpr uint64_t VM_PKEY_BIT0 = VM_HIGH_ARCH_0;
+constexpr uint64_t VM_PKEY_BIT1 = VM_HIGH_ARCH_1;
+constexpr uint64_t VM_PKEY_BIT2 = VM_HIGH_ARCH_2;
+constexpr uint64_t VM_PKEY_BIT3 = VM_HIGH_ARCH_3;
+constexpr uint64_t VM_PKEY_BIT4 = VM_HIGH_ARCH_4;
+constexpr uint64_t VM_PAT = VM_ARCH_1;
+constexpr uint64_t VM_UFFD_MINOR = BIT(VM_UFFD_MINOR_BIT);
+
+struct flag_desc {
+	uint64_t flag;
+	std::string_view name;
+	// As shown in /proc/$pid/smaps VmFlags, empty if never shown.
+	std::string_view mnemonic;
+};
+
+// In bit order. VM_NONE is handled separately.
+constexpr flag_desc flag_table[] = {
+	{ VM_READ, "VM_READ", "rd" },
+	{ VM_WRITE, "VM_WRITE", "wr" },
+	{ VM_EXEC, "VM_EXEC", "ex" },
+	{ VM_SHARED, "VM_SHARED", "sh" },
+	{ VM_MAYREAD, "VM_MAYREAD", "mr" },
+	{ VM_MAYWRITE, "VM_MAYWRITE", "mw" },
+	{ VM_MAYEXEC, "VM_MAYEXEC", "me" },
+	{ VM_MAYSHARE, "VM_MAYSHARE", "ms" },
+	{ VM_GROWSDOWN, "VM_GROWSDOWN", "gd" },
+	{ VM_UFFD_MISSING, "VM_UFFD_MISSING", "um" },
+	{ VM_PFNMAP, "VM_PFNMAP", "pf" },
+	{ VM_UFFD_WP, "VM_UFFD_WP", "uw" },
+	{ VM_LOCKED, "VM_LOCKED", "lo" },
+	{ VM_IO, "VM_IO", "io" },
+	{ VM_SEQ_READ, "VM_SEQ_READ", "sr" },
+	{ VM_RAND_READ, "VM_RAND_READ", "rr" },
+	{ VM_DONTCOPY, "VM_DONTCOPY", "dc" },
+	{ VM_DONTEXPAND, "VM_DONTEXPAND", "de" },
+	{ VM_LOCKONFAULT, "VM_LOCKONFAULT", "lf" },
+	{ VM_ACCOUNT, "VM_ACCOUNT", "ac" },
+	{ VM_NORESERVE, "VM_NORESERVE", "nr" },
+	{ VM_HUGETLB, "VM_HUGETLB", "ht" },
+	{ VM_SYNC, "VM_SYNC", "sf" },
+	{ VM_PAT, "VM_PAT", "ar" },
+	{ VM_WIPEONFORK, "VM_WIPEONFORK", "wf" },
+	{ VM_DONTDUMP, "VM_DONTDUMP", "dd" },
+	{ VM_SOFTDIRTY, "VM_SOFTDIRTY", "sd" },
+	{ VM_MIXEDMAP, "VM_MIXEDMAP", "mm" },
+	{ VM_HUGEPAGE, "VM_HUGEPAGE", "hg" },
+	{ VM_NOHUGEPAGE, "VM_NOHUGEPAGE", "nh" },
+	{ VM_MERGEABLE, "VM_MERGEABLE", "mg" },
+	// Protection keys get their own smaps field, not mnemonics.
+	{ VM_PKEY_BIT0, "VM_PKEY_BIT0", "" },
+	{ VM_PKEY_BIT1, "VM_PKEY_BIT1", "" },
+	{ VM_PKEY_BIT2, "VM_PKEY_BIT2", "" },
+	{ VM_PKEY_BIT3, "VM_PKEY_BIT3", "" },
+	{ VM_PKEY_BIT4, "VM_PKEY_BIT4", "" },
+	{ VM_UFFD_MINOR, "VM_UFFD_MINOR", "ui" },
+};
+
+// Every flag is a single bit, so the table can be indexed by bit number.
+constexpr std::array<std::string_view, 64> make_bit_names()
+{
+	std::array<std::string_view, 64> names{};
+
+	for (const auto &desc : flag_table)
+		names[__builtin_ctzll(desc.flag)] = desc.name;
+
+	return names;
+}
+
+constexpr uint64_t make_known_mask()
+{
+	uint64_t mask = 0;
+
+	for (const auto &desc : flag_table)
+		mask |= desc.flag;
+
+	return mask;
+}
+
+// Mnemonics are two lower case letters, index by them directly.
+constexpr size_t MNEMONIC_SLOTS = 26 * 26;
+
+constexpr size_t mnemonic_slot(char a, char b)
+{
+	return (a - 'a') * 26 + (b - 'a');
+}
+
+constexpr std::array<uint64_t, MNEMONIC_SLOTS> make_mnemonic_flags()
+{
+	std::array<uint64_t, MNEMONIC_SLOTS> flags{};
+
+	for (const auto &desc : flag_table) {
+		if (desc.mnemonic.size() == 2)
+			flags[mnemonic_slot(desc.mnemonic[0], desc.mnemonic[1])] =
+				desc.flag;
+	}
+
+	return flags;
+}
+
+constexpr auto bit_names = make_bit_names();
+constexpr uint64_t known_mask = make_known_mask();
+constexpr auto mnemonic_flags = make_mnemonic_flags();
+
+// Longest possible output of format(), all names plus separators.
+constexpr size_t make_max_formatted()
+{
+	size_t len = 0;
+
+	for (const auto &desc : flag_table)
+		len += desc.name.size() + 1;
+
+	return len;
+}
+constexpr size_t max_formatted = make_max_formatted();
+
+// Catches duplicate or multi-bit entries, which would break bit indexing.
+static_assert(__builtin_popcountll(known_mask) ==
+	      sizeof(flag_table) / sizeof(flag_table[0]));
+
+// Name of a single flag, empty if unknown.
+constexpr std::string_view flag_name(uint64_t flag)
+{
+	if (flag == 0)
+		return "VM_NONE";
+	if ((flag & (flag - 1)) != 0)
+		return {};
+
+	return bit_names[__builtin_ctzll(flag)];
+}
+
+// Flag from its name, with or without the VM_ prefix. 0 if unknown.
+constexpr uint64_t flag_from_name(std::string_view name)
+{
+	if (name.substr(0, 3) == "VM_")
+		name.remove_prefix(3);
+
+	for (const auto &desc : flag_table) {
+		if (desc.name.substr(3) == name)
+			return desc.flag;
+	}
+
+	return 0;
+}
+
+// Flag from its smaps mnemonic. 0 if unknown.
+constexpr uint64_t flag_from_mnemonic(std::string_view mnemonic)
+{
+	if (mnemonic.size() != 2 || mnemonic[0] < 'a' || mnemonic[0] > 'z' ||
+	    mnemonic[1] < 'a' || mnemonic[1] > 'z')
+		return 0;
+
+	return mnemonic_flags[mnemonic_slot(mnemonic[0], mnemonic[1])];
+}
+
+// Write the space separated names of flags into buf, NUL terminated and
+// truncated to size, returning the length of the full output as snprintf()
+// does. Bits we don't know are left out and stored in unknown if non-NULL.
+inline size_t format(uint64_t flags, char *buf, size_t size,
+		     uint64_t *unknown = nullptr)
+{
+	// Build in full in scratch so the loop needn't check bounds.
+	char scratch[max_formatted + sizeof("VM_NONE")];
+	uint64_t bits = flags & known_mask;
+	size_t len = 0;
+
+	if (unknown != nullptr)
+		*unknown = flags & ~known_mask;
+
+	if (flags == 0) {
+		std::memcpy(scratch, "VM_NONE ", 8);
+		len = 8;
+	}
+
+	for (; bits != 0; bits &= bits - 1) {
+		const std::string_view name = bit_names[__builtin_ctzll(bits)];
+
+		std::memcpy(&scratch[len], name.data(), name.size());
+		scratch[len + name.size()] = ' ';
+		len += name.size() + 1;
+	}
+
+	// Drop the trailing separator.
+	len -= len > 0;
+
+	if (size > 0) {
+		const size_t copy = len < size - 1 ? len : size - 1;
+
+		std::memcpy(buf, scratch, copy);
+		buf[copy] = '\0';
+	}
+
+	return len;
+}
+
+// Encode the mnemonics of a smaps "VmFlags:" line, the prefix being optional.
+// Mnemonics we don't know are counted in unknown if non-NULL.
+inline uint64_t parse_mnemonics(std::string_view line, size_t *unknown = nullptr)
+{
+	constexpr std::string_view prefix = "VmFlags:";
+	uint64_t flags = 0;
+	size_t missed = 0;
+
+	if (line.substr(0, prefix.size()) == prefix)
+		line.remove_prefix(prefix.size());
+
+	while (!line.empty()) {
+		const size_t start = line.find_first_not_of(" \t\n");
+		size_t end;
+		uint64_t flag;
+
+		if (start == std::string_view::npos)
+			break;
+		line.remove_prefix(start);
+
+		end = line.find_first_of(" \t\n");
+		flag = flag_from_mnemonic(line.substr(0, end));
+		flags |= flag;
+		missed += flag == 0;
+
+		line.remove_prefix(end == std::string_view::npos ? line.size() : end);
+	}
+
+	if (unknown != nullptr)
+		*unknown = missed;
+
+	return flags;
+}
+
+static_assert(flag_from_name("VM_MAYSHARE") == VM_MAYSHARE);
+static_assert(flag_from_mnemonic("hg") == VM_HUGEPAGE);
+static_assert(flag_name(VM_UFFD_MINOR) == "VM_UFFD_MINOR");
+} // namespace vm_flags
@@ -0,0 +1,592 @@
+#define _GNU_SOURCE
+#include "read-pageflags.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/kernel-page-flags.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measure the cost of io_uring buffer registration, which pins the buffer's
+// pages with FOLL_LONGTERM, across the kinds of memory a buffer might live
+// in. For each we time register/unregister, compare read throughput into
+// registered (IORING_OP_READ_FIXED) and unregistered (IORING_OP_READ)
+// buffers, and diff pagemap, kpageflags and kpagecount across registration
+// to show what pinning did to the pages, e.g. migrating them out of movable
+// zones or breaking COW.
+
+#define DEFAULT_SIZE_MIB (64)
+#define DEFAULT_IO_SIZE (65536)
+#define DEFAULT_DEPTH (8)
+#define DEFAULT_REPS (10)
+#define DEFAULT_LOOPS (4)
+#define DEFAULT_PATH "pin_bench.dat"
+#define BACKING_PATH "pin_bench.buf"
+#define FILL_CHUNK (1UL << 20)
+#define THP_SIZE (2UL << 20)
+
+// As per the pagemap documentation.
+#define PAGEMAP_EXCLUSIVE_BIT (56)
+
+enum buf_type {
+	BUF_ANON,
+	BUF_THP,
+	BUF_HUGETLB,
+	BUF_SHMEM,
+	BUF_FILE,
+	NUM_BUF_TYPES
+};
+
+static const char *const buf_names[] = {
+	"anon", "thp", "hugetlb", "shmem", "file",
+};
+
+struct options {
+	const char *path;
+	uint64_t size;
+	unsigned int io_size;
+	unsigned int depth;
+	unsigned int reps;
+	unsigned int loops;
+	bool buffered;
+	unsigned int types;
+};
+
+// Per-page state sampled from /proc.
+struct page_sample {
+	uint64_t *pagemaps;
+	uint64_t *pfns;
+	uint64_t *kpageflags;
+	uint64_t *mapcounts;
+};
+
+struct buffer {
+	// The mapping, and the buffer within it, which differ only for THP
+	// where we align to a PMD.
+	char *map, *ptr;
+	size_t map_size;
+	int fd;
+};
+
+struct result {
+	double reg_us, unreg_us;
+	double normal_mibs, fixed_mibs;
+	// Changes across registration.
+	uint64_t moved, flags_changed, count_changed, became_exclusive;
+	// After registration.
+	uint64_t thp, huge;
+	bool sampled;
+};
+
+static struct options opts;
+static long page_size;
+static uint64_t num_pages;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Create the file we read from if it doesn't already exist at the right size.
+static void prepare_file(void)
+{
+	struct stat st;
+	uint64_t offset;
+	char *buf;
+	int fd;
+
+	fd = open(opts.path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror(opts.path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((uint64_t)st.st_size == opts.size)
+		goto out;
+
+	buf = malloc(FILL_CHUNK);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 'x', FILL_CHUNK);
+
+	for (offset = 0; offset < opts.size; offset += FILL_CHUNK) {
+		const size_t len = opts.size - offset < FILL_CHUNK ?
+			opts.size - offset : FILL_CHUNK;
+
+		if (pwrite(fd, buf, len, offset) != (ssize_t)len) {
+			perror("pwrite");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(buf);
+
+	if (ftruncate(fd, opts.size) || fsync(fd)) {
+		perror("ftruncate/fsync");
+		exit(EXIT_FAILURE);
+	}
+
+out:
+	close(fd);
+}
+
+static void populate(char *ptr, size_t size)
+{
+	size_t offset;
+
+	for (offset = 0; offset < size; offset += page_size)
+		ptr[offset] = 'y';
+}
+
+// Map a buffer of the specified type and fault it in. Returns false if this
+// kind of memory isn't available.
+static bool alloc_buffer(enum buf_type type, struct buffer *buf)
+{
+	const int prot = PROT_READ | PROT_WRITE;
+	char *ptr;
+
+	buf->fd = -1;
+	buf->map_size = opts.size;
+
+	switch (type) {
+	case BUF_ANON:
+		ptr = mmap(NULL, opts.size, prot, MAP_PRIVATE | MAP_ANONYMOUS,
+			   -1, 0);
+		if (ptr != MAP_FAILED)
+			madvise(ptr, opts.size, MADV_NOHUGEPAGE);
+		break;
+	case BUF_THP:
+		// Over-allocate so we can align to a PMD.
+		buf->map_size = opts.size + THP_SIZE;
+		ptr = mmap(NULL, buf->map_size, prot,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			break;
+
+		buf->map = ptr;
+		buf->ptr = (char *)(((uintptr_t)ptr + THP_SIZE - 1) &
+				    ~(THP_SIZE - 1));
+		if (madvise(buf->ptr, opts.size, MADV_HUGEPAGE)) {
+			munmap(ptr, buf->map_size);
+			return false;
+		}
+
+		populate(buf->ptr, opts.size);
+		return true;
+	case BUF_HUGETLB:
+		ptr = mmap(NULL, opts.size, prot,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		break;
+	case BUF_SHMEM:
+		buf->fd = memfd_create("pin_bench", MFD_CLOEXEC);
+		if (buf->fd < 0 || ftruncate(buf->fd, opts.size))
+			return false;
+		ptr = mmap(NULL, opts.size, prot, MAP_SHARED, buf->fd, 0);
+		break;
+	case BUF_FILE:
+		buf->fd = open(BACKING_PATH, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			       0644);
+		if (buf->fd < 0 || ftruncate(buf->fd, opts.size))
+			return false;
+		ptr = mmap(NULL, opts.size, prot, MAP_SHARED, buf->fd, 0);
+		break;
+	default:
+		abort();
+	}
+
+	if (ptr == MAP_FAILED) {
+		if (buf->fd >= 0)
+			close(buf->fd);
+		return false;
+	}
+
+	buf->map = buf->ptr = ptr;
+	populate(ptr, opts.size);
+	return true;
+}
+
+static void free_buffer(enum buf_type type, struct buffer *buf)
+{
+	munmap(buf->map, buf->map_size);
+	if (buf->fd >= 0)
+		close(buf->fd);
+	if (type == BUF_FILE)
+		unlink(BACKING_PATH);
+}
+
+static void alloc_sample(struct page_sample *sample)
+{
+	sample->pagemaps = malloc(num_pages * sizeof(uint64_t));
+	sample->pfns = malloc(num_pages * sizeof(uint64_t));
+	sample->kpageflags = malloc(num_pages * sizeof(uint64_t));
+	sample->mapcounts = malloc(num_pages * sizeof(uint64_t));
+
+	if (sample->pagemaps == NULL || sample->pfns == NULL ||
+	    sample->kpageflags == NULL || sample->mapcounts == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void free_sample(struct page_sample *sample)
+{
+	free(sample->pagemaps);
+	free(sample->pfns);
+	free(sample->kpageflags);
+	free(sample->mapcounts);
+}
+
+// Sample every page of the buffer. kpageflags and kpagecount need root.
+static bool take_sample(const void *const *ptrs, struct page_sample *sample)
+{
+	return read_pageflags_batch(ptrs, num_pages, sample->pagemaps,
+				    sample->pfns, sample->kpageflags,
+				    sample->mapcounts);
+}
+
+static void diff_samples(const struct page_sample *before,
+			 const struct page_sample *after, struct result *result)
+{
+	uint64_t i;
+
+	for (i = 0; i < num_pages; i++) {
+		const uint64_t flags = after->kpageflags[i];
+
+		if (before->pfns[i] != after->pfns[i])
+			result->moved++;
+		if (before->kpageflags[i] != flags)
+			result->flags_changed++;
+		if (before->mapcounts[i] != after->mapcounts[i])
+			result->count_changed++;
+		if (!(before->pagemaps[i] & (1UL << PAGEMAP_EXCLUSIVE_BIT)) &&
+		    (after->pagemaps[i] & (1UL << PAGEMAP_EXCLUSIVE_BIT)))
+			result->became_exclusive++;
+
+		if (flags == INVALID_VALUE)
+			continue;
+		if (flags & (1UL << KPF_THP))
+			result->thp++;
+		if (flags & (1UL << KPF_HUGE))
+			result->huge++;
+	}
+}
+
+static void reap(struct uring *ring, unsigned int len)
+{
+	struct io_uring_cqe *cqe = uring_wait_cqe(ring);
+
+	if (cqe == NULL) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cqe->res != (int)len) {
+		fprintf(stderr, "io_uring read: %s\n",
+			cqe->res < 0 ? strerror(-cqe->res) : "short read");
+		exit(EXIT_FAILURE);
+	}
+
+	uring_cqe_seen(ring);
+}
+
+// Read the whole file into the buffer opts.loops times with up to
+// opts.depth reads in flight, returning MiB/s.
+static double read_file(struct uring *ring, int fd, char *ptr, bool fixed)
+{
+	const uint64_t num_ios = opts.size / opts.io_size;
+	unsigned int in_flight = 0;
+	uint64_t start, i;
+
+	start = now_ns();
+
+	for (i = 0; i < num_ios * opts.loops; i++) {
+		const uint64_t offset = (i % num_ios) * opts.io_size;
+		struct io_uring_sqe *sqe;
+
+		if (in_flight == opts.depth) {
+			reap(ring, opts.io_size);
+			in_flight--;
+		}
+
+		sqe = uring_get_sqe(ring);
+		if (sqe == NULL) {
+			fprintf(stderr, "io_uring submission queue full\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (fixed)
+			uring_prep_read_fixed(sqe, fd, &ptr[offset], opts.io_size,
+					      offset, 0, i);
+		else
+			uring_prep_read(sqe, fd, &ptr[offset], opts.io_size,
+					offset, i);
+
+		if (uring_submit(ring, 0) < 0) {
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+		in_flight++;
+	}
+
+	for (; in_flight > 0; in_flight--)
+		reap(ring, opts.io_size);
+
+	return (double)opts.size * opts.loops / (1UL << 20) /
+		((now_ns() - start) / 1e9);
+}
+
+// Returns false, having reported why, if the buffer can't be registered.
+static bool run_type(enum buf_type type, struct buffer *buf, int fd,
+		     struct result *result)
+{
+	const struct iovec iov = { .iov_base = buf->ptr, .iov_len = opts.size };
+	struct page_sample before, after;
+	const void **ptrs;
+	struct uring ring;
+	uint64_t reg_ns = 0, unreg_ns = 0, start, i;
+
+	memset(result, 0, sizeof(*result));
+
+	if (uring_init(&ring, opts.depth)) {
+		perror("io_uring_setup");
+		exit(EXIT_FAILURE);
+	}
+
+	ptrs = malloc(num_pages * sizeof(*ptrs));
+	if (ptrs == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < num_pages; i++)
+		ptrs[i] = buf->ptr + i * page_size;
+
+	alloc_sample(&before);
+	alloc_sample(&after);
+	result->sampled = take_sample(ptrs, &before);
+
+	// Time the pin and unpin, leaving the buffer registered after the
+	// last round.
+	for (i = 0; i < opts.reps; i++) {
+		start = now_ns();
+		if (uring_register_buffers(&ring, &iov, 1)) {
+			printf("%-8s registration failed: %s\n", buf_names[type],
+			       strerror(errno));
+			goto fail;
+		}
+		reg_ns += now_ns() - start;
+
+		if (i == opts.reps - 1)
+			break;
+
+		start = now_ns();
+		if (uring_unregister_buffers(&ring)) {
+			perror("io_uring_register");
+			exit(EXIT_FAILURE);
+		}
+		unreg_ns += now_ns() - start;
+	}
+	result->reg_us = reg_ns / 1000.0 / opts.reps;
+	result->unreg_us = opts.reps > 1 ? unreg_ns / 1000.0 / (opts.reps - 1) : 0;
+
+	// What pinning did to the pages, while they're still pinned.
+	result->sampled &= take_sample(ptrs, &after);
+	diff_samples(&before, &after, result);
+
+	// Warm up (and with buffered I/O, populate the page cache) first.
+	read_file(&ring, fd, buf->ptr, false);
+	result->normal_mibs = read_file(&ring, fd, buf->ptr, false);
+	result->fixed_mibs = read_file(&ring, fd, buf->ptr, true);
+
+	free_sample(&before);
+	free_sample(&after);
+	free(ptrs);
+	uring_exit(&ring);
+	return true;
+
+fail:
+	free_sample(&before);
+	free_sample(&after);
+	free(ptrs);
+	uring_exit(&ring);
+	return false;
+}
+
+static void print_header(void)
+{
+	printf("%-8s %9s %9s %10s %10s %8s %8s %8s %8s %8s %8s\n",
+	       "buffer", "reg us", "unreg us", "read MiB/s", "fixed MiB/s",
+	       "moved", "flagchg", "cntchg", "excl", "thp", "huge");
+}
+
+static void print_result(enum buf_type type, const struct result *result)
+{
+	printf("%-8s %9.1f %9.1f %10.1f %10.1f", buf_names[type],
+	       result->reg_us, result->unreg_us, result->normal_mibs,
+	       result->fixed_mibs);
+
+	if (result->sampled)
+		printf(" %8lu %8lu %8lu %8lu %8lu %8lu\n", result->moved,
+		       result->flags_changed, result->count_changed,
+		       result->became_exclusive, result->thp, result->huge);
+	else
+		printf(" %8s %8s %8s %8s %8s %8s\n", "-", "-", "-", "-", "-",
+		       "-");
+	fflush(stdout);
+}
+
+static unsigned int parse_types(char *arg)
+{
+	unsigned int mask = 0, i;
+	char *name;
+
+	for (name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+		for (i = 0; i < NUM_BUF_TYPES; i++) {
+			if (!strcmp(name, buf_names[i]))
+				break;
+		}
+
+		if (i == NUM_BUF_TYPES) {
+			fprintf(stderr, "unknown buffer type '%s'\n", name);
+			exit(EXIT_FAILURE);
+		}
+		mask |= 1U << i;
+	}
+
+	return mask;
+}
+
+static void usage(const char *bin)
+{
+	unsigned int i;
+
+	fprintf(stderr, "usage: %s [-f file] [-s MiB] [-b io size] [-q depth] "
+		"[-r reps] [-l loops] [-B] [-t types]\n", bin);
+	fprintf(stderr, "  -f  file to read, created if needed (default %s)\n",
+		DEFAULT_PATH);
+	fprintf(stderr, "  -s  buffer and file size in MiB (default %d)\n",
+		DEFAULT_SIZE_MIB);
+	fprintf(stderr, "  -b  bytes per read (default %d)\n", DEFAULT_IO_SIZE);
+	fprintf(stderr, "  -q  reads in flight (default %d)\n", DEFAULT_DEPTH);
+	fprintf(stderr, "  -r  register/unregister rounds to average (default %d)\n",
+		DEFAULT_REPS);
+	fprintf(stderr, "  -l  passes over the file per measurement (default %d)\n",
+		DEFAULT_LOOPS);
+	fprintf(stderr, "  -B  buffered rather than O_DIRECT reads\n");
+	fprintf(stderr, "  -t  buffer types to run, of: ");
+	for (i = 0; i < NUM_BUF_TYPES; i++)
+		fprintf(stderr, "%s%s", i ? "," : "", buf_names[i]);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int type;
+	int opt, fd;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	opts.path = DEFAULT_PATH;
+	opts.size = (uint64_t)DEFAULT_SIZE_MIB << 20;
+	opts.io_size = DEFAULT_IO_SIZE;
+	opts.depth = DEFAULT_DEPTH;
+	opts.reps = DEFAULT_REPS;
+	opts.loops = DEFAULT_LOOPS;
+	opts.types = (1U << NUM_BUF_TYPES) - 1;
+
+	while ((opt = getopt(argc, argv, "f:s:b:q:r:l:Bt:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			opts.path = optarg;
+			break;
+		case 's':
+			opts.size = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'b':
+			opts.io_size = atoi(optarg);
+			break;
+		case 'q':
+			opts.depth = atoi(optarg);
+			break;
+		case 'r':
+			opts.reps = atoi(optarg);
+			break;
+		case 'l':
+			opts.loops = atoi(optarg);
+			break;
+		case 'B':
+			opts.buffered = true;
+			break;
+		case 't':
+			opts.types = parse_types(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc || opts.size == 0 || opts.depth == 0 ||
+	    opts.reps == 0 || opts.loops == 0 || opts.io_size == 0 ||
+	    opts.io_size % page_size != 0 || opts.size % opts.io_size != 0 ||
+	    opts.size % THP_SIZE != 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	num_pages = opts.size / page_size;
+
+	prepare_file();
+
+	fd = open(opts.path, O_RDONLY | O_CLOEXEC | (opts.buffered ? 0 : O_DIRECT));
+	if (fd < 0 && !opts.buffered && errno == EINVAL) {
+		fprintf(stderr, "O_DIRECT unsupported, using buffered reads\n");
+		fd = open(opts.path, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		perror(opts.path);
+		return EXIT_FAILURE;
+	}
+
+	if (getuid() != 0)
+		fprintf(stderr, "not root, kpageflags/kpagecount unavailable\n");
+
+	print_header();
+
+	for (type = 0; type < NUM_BUF_TYPES; type++) {
+		struct buffer buf;
+		struct result result;
+
+		if (!(opts.types & (1U << type)))
+			continue;
+
+		if (!alloc_buffer(type, &buf)) {
+			printf("%-8s unavailable: %s\n", buf_names[type],
+			       type == BUF_HUGETLB ?
+			       "reserve pages via /proc/sys/vm/nr_hugepages" :
+			       strerror(errno));
+			continue;
+		}
+
+		if (run_type(type, &buf, fd, &result))
+			print_result(type, &result);
+
+		free_buffer(type, &buf);
+	}
+
+	close(fd);
+	return EXIT_SUCCESS;
+}
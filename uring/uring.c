@@ -0,0 +1,213 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *map_ring(int fd, size_t size, uint64_t offset)
+{
+	return mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	int fd, saved_errno;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	fd = io_uring_setup(entries, &params);
+	if (fd < 0)
+		return -1;
+	ring->fd = fd;
+	ring->sq_entries = params.sq_entries;
+	ring->cq_entries = params.cq_entries;
+
+	ring->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	// Since 5.4 both rings live in the one mapping.
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = map_ring(fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err;
+
+	if (ring->cq_ring_size == 0) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = map_ring(fd, ring->cq_ring_size,
+					 IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+
+	ring->sqes = (struct io_uring_sqe *)map_ring(fd, ring->sqes_size,
+						     IORING_OFF_SQES);
+	if ((void *)ring->sqes == MAP_FAILED)
+		goto err_cq;
+
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+	return 0;
+
+err_cq:
+	saved_errno = errno;
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	errno = saved_errno;
+err_sq:
+	saved_errno = errno;
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	errno = saved_errno;
+err:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return -1;
+}
+
+void uring_exit(struct uring *ring)
+{
+	munmap((void *)ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iovecs,
+			   unsigned int nr)
+{
+	return io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, nr) < 0 ?
+		-1 : 0;
+}
+
+int uring_unregister_buffers(struct uring *ring)
+{
+	return io_uring_register(ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0) < 0 ?
+		-1 : 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	const unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	const unsigned int tail = *ring->sq_tail + ring->sq_pending;
+	const unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= ring->sq_entries)
+		return NULL;
+
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->sq_pending++;
+
+	return sqe;
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+		     unsigned int len, uint64_t offset, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+}
+
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+			   unsigned int len, uint64_t offset,
+			   unsigned int buf_index, uint64_t user_data)
+{
+	uring_prep_read(sqe, fd, buf, len, offset, user_data);
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->buf_index = buf_index;
+}
+
+int uring_submit(struct uring *ring, unsigned int wait_nr)
+{
+	const unsigned int to_submit = ring->sq_pending;
+	int ret;
+
+	// Publish the SQEs before the kernel can see the new tail.
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit,
+			 __ATOMIC_RELEASE);
+	ring->sq_pending = 0;
+
+	do {
+		ret = io_uring_enter(ring->fd, to_submit, wait_nr,
+				     wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	const unsigned int head = *ring->cq_head;
+	const unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+struct io_uring_cqe *uring_wait_cqe(struct uring *ring)
+{
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = uring_peek_cqe(ring)) == NULL) {
+		if (io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			return NULL;
+	}
+
+	return cqe;
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Minimal io_uring wrapper over the raw syscalls, so tools can use io_uring
+// without liburing. Just enough to queue SQEs, submit them and reap CQEs.
+//
+// Not thread-safe, use a ring per thread.
+
+struct uring {
+	int fd;
+	unsigned int sq_entries, cq_entries;
+
+	// Submission queue, shared with the kernel.
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	// SQEs queued by uring_get_sqe() but not yet submitted.
+	unsigned int sq_pending;
+
+	// Completion queue, shared with the kernel.
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+// Set up a ring with at least entries SQEs. Returns 0, or -1 with errno set,
+// e.g. ENOSYS or EPERM if io_uring is unavailable or disabled.
+int uring_init(struct uring *ring, unsigned int entries);
+
+// Tear down the ring. In-flight requests are cancelled by the kernel.
+void uring_exit(struct uring *ring);
+
+// Register nr buffers for use with uring_prep_read_fixed(), pinning them for
+// the lifetime of the ring. Returns 0, or -1 with errno set.
+int uring_register_buffers(struct uring *ring, const struct iovec *iovecs,
+			   unsigned int nr);
+
+// Unregister all buffers, unpinning them. Returns 0, or -1 with errno set.
+int uring_unregister_buffers(struct uring *ring);
+
+// Get a zeroed SQE to fill in, or NULL if the submission queue is full.
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+// Fill in sqe to read len bytes at offset of fd into buf.
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+		     unsigned int len, uint64_t offset, uint64_t user_data);
+
+// As uring_prep_read(), only buf must lie within registered buffer buf_index,
+// saving the kernel from pinning and mapping it on each request.
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+			   unsigned int len, uint64_t offset,
+			   unsigned int buf_index, uint64_t user_data);
+
+// Submit all queued SQEs and wait for at least wait_nr completions. Returns
+// the number of SQEs submitted, or -1 with errno set.
+int uring_submit(struct uring *ring, unsigned int wait_nr);
+
+// Return the next completion, or NULL if none are ready. Call
+// uring_cqe_seen() once done with it.
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+// Wait for and return the next completion, or NULL with errno set on error.
+struct io_uring_cqe *uring_wait_cqe(struct uring *ring);
+
+// Release the CQE returned by uring_peek_cqe() or uring_wait_cqe().
+void uring_cqe_seen(struct uring *ring);
@@ -0,0 +1,120 @@
+#include "checkpoint.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BITS_PER_WORD (64)
+
+static unsigned long page_size;
+
+static void mark_dirty(void *priv, unsigned long addr)
+{
+	struct checkpoint *cp = priv;
+	const unsigned long page = (addr - (unsigned long)cp->region) / page_size;
+
+	__atomic_fetch_or(&cp->dirty[page / BITS_PER_WORD],
+			  1UL << (page % BITS_PER_WORD), __ATOMIC_RELAXED);
+}
+
+struct checkpoint *checkpoint_create(void *region, unsigned long len,
+				     int num_threads)
+{
+	struct checkpoint *cp = calloc(1, sizeof(*cp));
+	unsigned long num_words;
+
+	if (cp == NULL)
+		pfatal("calloc");
+
+	page_size = sysconf(_SC_PAGE_SIZE);
+
+	cp->region = region;
+	cp->len = len;
+	cp->num_pages = len / page_size;
+
+	num_words = (cp->num_pages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	cp->dirty = calloc(num_words, sizeof(uint64_t));
+	if (cp->dirty == NULL)
+		pfatal("calloc");
+
+	cp->buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (cp->buf == MAP_FAILED)
+		pfatal("mmap");
+
+	// WP_UNPOPULATED so writes to pages not yet faulted in are caught too.
+	cp->uffd = make_handler_features(false, UFFD_FEATURE_PAGEFAULT_FLAG_WP |
+					 UFFD_FEATURE_WP_UNPOPULATED);
+	register_range_mode(cp->uffd, region, len, UFFDIO_REGISTER_MODE_WP);
+
+	// Protect before copying so nothing slips between the two.
+	write_protect_range(cp->uffd, region, len, true);
+	memcpy(cp->buf, region, len);
+
+	cp->server = fault_server_start_wp(cp->uffd, num_threads, mark_dirty, cp);
+
+	return cp;
+}
+
+// Re-protect and copy the run of dirty pages [first, first + count).
+static void copy_run(struct checkpoint *cp, unsigned long first,
+		     unsigned long count)
+{
+	const unsigned long offset = first * page_size;
+	const unsigned long len = count * page_size;
+
+	// Protect first, so any write racing with the copy faults and marks
+	// the page dirty for next time.
+	write_protect_range(cp->uffd, cp->region + offset, len, true);
+	memcpy(cp->buf + offset, cp->region + offset, len);
+}
+
+unsigned long checkpoint_take(struct checkpoint *cp)
+{
+	const unsigned long num_words =
+		(cp->num_pages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	unsigned long run_start = 0, run_len = 0, copied = 0;
+	unsigned long i;
+
+	for (i = 0; i < num_words; i++) {
+		uint64_t word = __atomic_exchange_n(&cp->dirty[i], 0,
+						    __ATOMIC_RELAXED);
+
+		while (word != 0) {
+			const int bit = __builtin_ctzll(word);
+			const unsigned long page = i * BITS_PER_WORD + bit;
+
+			word &= word - 1;
+			copied++;
+
+			// Coalesce adjacent dirty pages into a single
+			// ioctl/memcpy.
+			if (run_len > 0 && run_start + run_len == page) {
+				run_len++;
+				continue;
+			}
+
+			if (run_len > 0)
+				copy_run(cp, run_start, run_len);
+
+			run_start = page;
+			run_len = 1;
+		}
+	}
+
+	if (run_len > 0)
+		copy_run(cp, run_start, run_len);
+
+	return copied;
+}
+
+void checkpoint_destroy(struct checkpoint *cp)
+{
+	fault_server_stop(cp->server);
+	close(cp->uffd);
+	munmap(cp->buf, cp->len);
+	free(cp->dirty);
+	free(cp);
+}
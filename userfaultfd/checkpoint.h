@@ -0,0 +1,43 @@
+#pragma once
+
+#include "fault_server.h"
+
+#include <stdint.h>
+
+// Incremental checkpointing of a memory region using userfaultfd
+// write-protection. The region is write-protected, each write-protect fault
+// unprotects the page and then marks it dirty before waking the writer, and
+// a checkpoint clears dirty bits, then re-protects and copies those pages
+// into the checkpoint buffer.
+//
+// A fault racing with a checkpoint either marks the page after the
+// checkpoint cleared its bit, or faults again once the checkpoint has
+// re-protected it, so no write is lost. Pages written to while a checkpoint
+// is being taken may be captured mid-write, but are recaptured by the next
+// checkpoint. Writers must be quiesced for a fully consistent checkpoint.
+struct checkpoint {
+	char *region;
+	unsigned long len;
+	unsigned long num_pages;
+
+	// The most recent checkpoint of region.
+	char *buf;
+
+	// One bit per page, set by handler threads on write-protect faults.
+	uint64_t *dirty;
+
+	long uffd;
+	struct fault_server *server;
+};
+
+// Start tracking writes to the page-aligned region [region, region + len),
+// taking an initial full checkpoint.
+struct checkpoint *checkpoint_create(void *region, unsigned long len,
+				     int num_threads);
+
+// Copy pages dirtied since the last checkpoint into the checkpoint buffer.
+// Returns the number of pages copied.
+unsigned long checkpoint_take(struct checkpoint *cp);
+
+// Stop tracking writes and free the checkpoint.
+void checkpoint_destroy(struct checkpoint *cp);
@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include "checkpoint.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MB (1UL << 20)
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+#define DEFAULT_SIZE_MB (256)
+#define ROUNDS (5)
+
+#define PAGEMAP_SOFT_DIRTY_BIT (55)
+// Value written to /proc/$pid/clear_refs to clear soft-dirty bits.
+#define CLEAR_REFS_SOFT_DIRTY "4"
+
+enum method {
+	METHOD_MEMCPY,
+	METHOD_UFFD_WP,
+	METHOD_SOFT_DIRTY,
+	NUM_METHODS,
+};
+
+static const char *method_names[] = {
+	[METHOD_MEMCPY] = "memcpy",
+	[METHOD_UFFD_WP] = "uffd-wp",
+	[METHOD_SOFT_DIRTY] = "soft-dirty",
+};
+
+struct bench {
+	char *region;
+	char *buf;
+	unsigned long len;
+	unsigned long num_pages;
+
+	// Random permutation of page indices, a prefix of which is dirtied.
+	unsigned long *order;
+
+	struct checkpoint *cp;
+
+	int pagemap_fd;
+	int clear_refs_fd;
+	uint64_t *pagemap;
+};
+
+static unsigned long page_size;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void clear_soft_dirty(struct bench *bench)
+{
+	if (pwrite(bench->clear_refs_fd, CLEAR_REFS_SOFT_DIRTY, 1, 0) != 1)
+		pfatal("clear_refs");
+}
+
+// Scan pagemap for soft-dirty pages, copy them and clear soft-dirty bits.
+static unsigned long soft_dirty_checkpoint(struct bench *bench)
+{
+	const size_t size = bench->num_pages * sizeof(uint64_t);
+	const off_t offset = (unsigned long)bench->region / page_size * sizeof(uint64_t);
+	unsigned long i, copied = 0;
+
+	if (pread(bench->pagemap_fd, bench->pagemap, size, offset) != (ssize_t)size)
+		pfatal("pread pagemap");
+
+	for (i = 0; i < bench->num_pages; i++) {
+		const unsigned long start = i;
+
+		if (!((bench->pagemap[i] >> PAGEMAP_SOFT_DIRTY_BIT) & 1))
+			continue;
+
+		while (i + 1 < bench->num_pages &&
+		       ((bench->pagemap[i + 1] >> PAGEMAP_SOFT_DIRTY_BIT) & 1))
+			i++;
+
+		memcpy(bench->buf + start * page_size,
+		       bench->region + start * page_size,
+		       (i - start + 1) * page_size);
+		copied += i - start + 1;
+	}
+
+	clear_soft_dirty(bench);
+
+	return copied;
+}
+
+// Soft-dirty tracking requires CONFIG_MEM_SOFT_DIRTY, check it actually works.
+static bool soft_dirty_supported(struct bench *bench)
+{
+	const off_t offset = (unsigned long)bench->region / page_size * sizeof(uint64_t);
+	uint64_t entry;
+
+	clear_soft_dirty(bench);
+	bench->region[0] = 'x';
+
+	if (pread(bench->pagemap_fd, &entry, sizeof(entry), offset) != sizeof(entry))
+		pfatal("pread pagemap");
+
+	return (entry >> PAGEMAP_SOFT_DIRTY_BIT) & 1;
+}
+
+static void shuffle(unsigned long *arr, unsigned long count)
+{
+	unsigned long i;
+
+	for (i = count - 1; i > 0; i--) {
+		const unsigned long j = random() % (i + 1);
+		const unsigned long tmp = arr[i];
+
+		arr[i] = arr[j];
+		arr[j] = tmp;
+	}
+}
+
+static void setup(struct bench *bench, enum method method)
+{
+	memset(bench->region, 'x', bench->len);
+	memcpy(bench->buf, bench->region, bench->len);
+
+	switch (method) {
+	case METHOD_MEMCPY:
+		break;
+	case METHOD_UFFD_WP:
+		bench->cp = checkpoint_create(bench->region, bench->len, 1);
+		break;
+	case METHOD_SOFT_DIRTY:
+		clear_soft_dirty(bench);
+		break;
+	default:
+		break;
+	}
+}
+
+static void teardown(struct bench *bench, enum method method)
+{
+	if (method == METHOD_UFFD_WP) {
+		checkpoint_destroy(bench->cp);
+		bench->cp = NULL;
+	}
+}
+
+static unsigned long take(struct bench *bench, enum method method)
+{
+	switch (method) {
+	case METHOD_MEMCPY:
+		memcpy(bench->buf, bench->region, bench->len);
+		return bench->num_pages;
+	case METHOD_UFFD_WP:
+		return checkpoint_take(bench->cp);
+	case METHOD_SOFT_DIRTY:
+		return soft_dirty_checkpoint(bench);
+	default:
+		return 0;
+	}
+}
+
+static const char *checkpoint_buf(struct bench *bench, enum method method)
+{
+	return method == METHOD_UFFD_WP ? bench->cp->buf : bench->buf;
+}
+
+static void run(struct bench *bench, enum method method, double fraction)
+{
+	const unsigned long num_dirty = bench->num_pages * fraction > 1
+		? bench->num_pages * fraction : 1;
+	uint64_t dirty_ns = 0, take_ns = 0;
+	unsigned long copied = 0;
+	int round;
+
+	setup(bench, method);
+
+	for (round = 0; round < ROUNDS; round++) {
+		uint64_t start;
+		unsigned long i;
+
+		shuffle(bench->order, bench->num_pages);
+
+		start = now_ns();
+		for (i = 0; i < num_dirty; i++)
+			bench->region[bench->order[i] * page_size] = 'a' + round;
+		dirty_ns += now_ns() - start;
+
+		start = now_ns();
+		copied += take(bench, method);
+		take_ns += now_ns() - start;
+
+		if (memcmp(checkpoint_buf(bench, method), bench->region, bench->len) != 0)
+			fatal("%s checkpoint doesn't match region\n", method_names[method]);
+	}
+
+	teardown(bench, method);
+
+	printf("%-10s dirty=%6.2f%% write=%8.0fns/page checkpoint=%9.3fms copied=%lu pages\n",
+	       method_names[method], fraction * 100.,
+	       (double)dirty_ns / (ROUNDS * num_dirty),
+	       (double)take_ns / (ROUNDS * NS_PER_MS),
+	       copied / ROUNDS);
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s <size in MiB>\n", bin);
+}
+
+int main(int argc, char **argv)
+{
+	static const double fractions[] = { 0.001, 0.01, 0.1, 0.5, 1.0 };
+	struct bench bench = {};
+	unsigned long size_mb = DEFAULT_SIZE_MB;
+	unsigned long i;
+	bool soft_dirty;
+	int method;
+
+	if (argc > 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 1)
+		size_mb = strtoul(argv[1], NULL, 10);
+	if (size_mb == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	init();
+	page_size = sysconf(_SC_PAGE_SIZE);
+
+	bench.len = size_mb * MB;
+	bench.num_pages = bench.len / page_size;
+
+	bench.region = mmap(NULL, bench.len, PROT_READ | PROT_WRITE,
+			    MAP_ANON | MAP_PRIVATE, -1, 0);
+	bench.buf = mmap(NULL, bench.len, PROT_READ | PROT_WRITE,
+			 MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (bench.region == MAP_FAILED || bench.buf == MAP_FAILED)
+		pfatal("mmap");
+
+	// Both soft-dirty and uffd-wp track at PMD granularity for THPs, which
+	// would make every method copy everything.
+	if (madvise(bench.region, bench.len, MADV_NOHUGEPAGE))
+		pfatal("madvise");
+
+	bench.order = malloc(bench.num_pages * sizeof(unsigned long));
+	bench.pagemap = malloc(bench.num_pages * sizeof(uint64_t));
+	if (bench.order == NULL || bench.pagemap == NULL)
+		pfatal("malloc");
+	for (i = 0; i < bench.num_pages; i++)
+		bench.order[i] = i;
+
+	bench.pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+	if (bench.pagemap_fd < 0)
+		pfatal("open pagemap");
+	bench.clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (bench.clear_refs_fd < 0)
+		pfatal("open clear_refs");
+
+	soft_dirty = soft_dirty_supported(&bench);
+	if (!soft_dirty)
+		fprintf(stderr, "WARN: soft-dirty not supported, skipping\n");
+
+	for (i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++) {
+		for (method = 0; method < NUM_METHODS; method++) {
+			if (method == METHOD_SOFT_DIRTY && !soft_dirty)
+				continue;
+
+			run(&bench, method, fractions[i]);
+		}
+		printf("\n");
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include "fault_server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MB (1UL << 20)
+#define NS_PER_SEC 1000000000ULL
+
+#define DEFAULT_SIZE_MB (256)
+
+static unsigned long page_size;
+
+// Region being faulted in, and the source image it is populated from.
+struct bench {
+	char *dst;
+	const char *src;
+	unsigned long len;
+
+	// Per-page touch latencies, indexed by page.
+	uint64_t *lat_ns;
+};
+
+struct toucher {
+	struct bench *bench;
+	unsigned long first_page, num_pages;
+	pthread_t thread;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static bool resolve(void *priv, unsigned long addr, struct fault_region *region)
+{
+	struct bench *bench = priv;
+	const unsigned long start = (unsigned long)bench->dst;
+
+	if (addr < start || addr >= start + bench->len)
+		return false;
+
+	region->start = start;
+	region->len = bench->len;
+	region->src = bench->src;
+
+	return true;
+}
+
+static void *touch_thread(void *arg)
+{
+	struct toucher *toucher = arg;
+	struct bench *bench = toucher->bench;
+	unsigned long i;
+
+	for (i = toucher->first_page; i < toucher->first_page + toucher->num_pages; i++) {
+		volatile char *ptr = &bench->dst[i * page_size];
+		const uint64_t start = now_ns();
+
+		(void)*ptr;
+		bench->lat_ns[i] = now_ns() - start;
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, unsigned long count, double pct)
+{
+	unsigned long idx = (unsigned long)(pct / 100. * (double)(count - 1));
+
+	return sorted[idx];
+}
+
+// Map the source image. For minor mode this is a shared memfd mapping whose
+// page cache the destination mapping will fault against.
+static char *map_src(unsigned long len, bool minor, int *memfd)
+{
+	char *ptr;
+
+	if (minor) {
+		*memfd = memfd_create("fault_bench", MFD_CLOEXEC);
+		if (*memfd < 0)
+			pfatal("memfd_create");
+		if (ftruncate(*memfd, len))
+			pfatal("ftruncate");
+
+		ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   *memfd, 0);
+	} else {
+		ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_ANON | MAP_PRIVATE, -1, 0);
+	}
+	if (ptr == MAP_FAILED)
+		pfatal("mmap src");
+
+	memset(ptr, 'x', len);
+	return ptr;
+}
+
+static char *map_dst(unsigned long len, bool minor, int memfd)
+{
+	char *ptr;
+
+	if (minor)
+		ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   memfd, 0);
+	else
+		ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (ptr == MAP_FAILED)
+		pfatal("mmap dst");
+
+	// UFFDIO_COPY installs base pages anyway, avoid THP muddying the
+	// comparison between batch sizes.
+	if (!minor && madvise(ptr, len, MADV_NOHUGEPAGE))
+		pfatal("madvise");
+
+	return ptr;
+}
+
+static void run(unsigned long len, int num_handlers, int num_touchers,
+		unsigned long batch_pages, bool minor)
+{
+	const unsigned long num_pages = len / page_size;
+	struct bench bench = { .len = len };
+	struct toucher *touchers = calloc(num_touchers, sizeof(*touchers));
+	struct fault_server_stats stats;
+	struct fault_server *server;
+	uint64_t start_ns, elapsed_ns;
+	int memfd = -1;
+	long uffd;
+	int i;
+
+	bench.lat_ns = calloc(num_pages, sizeof(uint64_t));
+	if (touchers == NULL || bench.lat_ns == NULL)
+		pfatal("calloc");
+
+	bench.src = map_src(len, minor, &memfd);
+	bench.dst = map_dst(len, minor, memfd);
+
+	uffd = make_handler_features(false, minor ? UFFD_FEATURE_MINOR_SHMEM : 0);
+	register_range_mode(uffd, bench.dst, len,
+			    minor ? UFFDIO_REGISTER_MODE_MINOR : UFFDIO_REGISTER_MODE_MISSING);
+
+	server = fault_server_start(uffd, num_handlers, batch_pages, resolve, &bench);
+
+	start_ns = now_ns();
+	for (i = 0; i < num_touchers; i++) {
+		struct toucher *toucher = &touchers[i];
+		int err;
+
+		toucher->bench = &bench;
+		toucher->first_page = i * (num_pages / num_touchers);
+		toucher->num_pages = i == num_touchers - 1
+			? num_pages - toucher->first_page
+			: num_pages / num_touchers;
+
+		err = pthread_create(&toucher->thread, NULL, touch_thread, toucher);
+		if (err) {
+			errno = err;
+			pfatal("pthread_create");
+		}
+	}
+	for (i = 0; i < num_touchers; i++)
+		pthread_join(touchers[i].thread, NULL);
+	elapsed_ns = now_ns() - start_ns;
+
+	fault_server_get_stats(server, &stats);
+	fault_server_stop(server);
+
+	if (memcmp(bench.dst, bench.src, len) != 0)
+		fatal("Faulted in data doesn't match source\n");
+
+	qsort(bench.lat_ns, num_pages, sizeof(uint64_t), cmp_u64);
+
+	printf("%-8s handlers=%-2d touchers=%-2d batch=%-4lu "
+	       "%10.0f faults/s %10.0f pages/s %6.2f msgs/read "
+	       "p50=%luns p99=%luns p99.9=%luns max=%luns eexist=%lu wakes=%lu\n",
+	       minor ? "continue" : "copy", num_handlers, num_touchers, batch_pages,
+	       (double)stats.faults * NS_PER_SEC / elapsed_ns,
+	       (double)num_pages * NS_PER_SEC / elapsed_ns,
+	       stats.reads ? (double)stats.msgs / stats.reads : 0.,
+	       percentile(bench.lat_ns, num_pages, 50),
+	       percentile(bench.lat_ns, num_pages, 99),
+	       percentile(bench.lat_ns, num_pages, 99.9),
+	       bench.lat_ns[num_pages - 1],
+	       stats.eexist, stats.wakes);
+
+	close(uffd);
+	munmap(bench.dst, len);
+	munmap((void *)bench.src, len);
+	if (memfd >= 0)
+		close(memfd);
+	free(bench.lat_ns);
+	free(touchers);
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s <size in MiB> <max threads>\n", bin);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned long batches[] = { 1, 4, 16, 64 };
+	unsigned long size_mb = DEFAULT_SIZE_MB;
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int mode;
+
+	if (argc > 3) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 1)
+		size_mb = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		max_threads = strtol(argv[2], NULL, 10);
+	if (size_mb == 0 || max_threads <= 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	init();
+	page_size = sysconf(_SC_PAGE_SIZE);
+
+	for (mode = 0; mode < 2; mode++) {
+		const bool minor = mode == 1;
+		long threads;
+		unsigned long i;
+
+		for (threads = 1; threads <= max_threads; threads *= 2) {
+			for (i = 0; i < sizeof(batches) / sizeof(batches[0]); i++)
+				run(size_mb * MB, threads, threads, batches[i], minor);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,563 @@
+#include "fault_server.h"
+#include "shadow.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+static unsigned long page_size;
+
+// Populate [start, start + len) from src, skipping pages which are already
+// present. Returns true if any page was skipped.
+static bool copy_range(long uffd, struct fault_server_stats *stats,
+		       unsigned long start, unsigned long len, const char *src)
+{
+	unsigned long done = 0;
+	bool skipped = false;
+
+	while (done < len) {
+		struct uffdio_copy copy = {
+			.dst = start + done,
+			.src = (unsigned long)(src + done),
+			.len = len - done,
+			.mode = 0,
+		};
+
+		stats->ioctls++;
+		if (ioctl(uffd, UFFDIO_COPY, &copy) == 0) {
+			stats->pages += (len - done) / page_size;
+			break;
+		}
+
+		// A partial copy returns -EAGAIN with the bytes copied so far.
+		if (copy.copy > 0) {
+			stats->pages += copy.copy / page_size;
+			done += copy.copy;
+			continue;
+		}
+
+		switch (errno) {
+		case EEXIST:
+			// Another thread (or an earlier batch) got here first.
+			stats->eexist++;
+			skipped = true;
+			done += page_size;
+			break;
+		case EAGAIN:
+			// Address space changing under us, try again.
+			break;
+		default:
+			pfatal("UFFDIO_COPY");
+		}
+	}
+
+	return skipped;
+}
+
+// Map [start, start + len) from the page cache, skipping pages which are
+// already mapped. Returns true if any page was skipped.
+static bool continue_range(long uffd, struct fault_server_stats *stats,
+			   unsigned long start, unsigned long len)
+{
+	unsigned long done = 0;
+	bool skipped = false;
+
+	while (done < len) {
+		struct uffdio_continue cont = {
+			.range = {
+				.start = start + done,
+				.len = len - done,
+			},
+			.mode = 0,
+		};
+
+		stats->ioctls++;
+		if (ioctl(uffd, UFFDIO_CONTINUE, &cont) == 0) {
+			stats->pages += (len - done) / page_size;
+			break;
+		}
+
+		if (cont.mapped > 0) {
+			stats->pages += cont.mapped / page_size;
+			done += cont.mapped;
+			continue;
+		}
+
+		switch (errno) {
+		case EEXIST:
+			stats->eexist++;
+			skipped = true;
+			done += page_size;
+			break;
+		case EAGAIN:
+			break;
+		default:
+			pfatal("UFFDIO_CONTINUE");
+		}
+	}
+
+	return skipped;
+}
+
+// Zero-fill [start, start + len), skipping pages which are already present.
+// Returns true if any page was skipped.
+static bool zero_range(long uffd, struct fault_server_stats *stats,
+		       unsigned long start, unsigned long len)
+{
+	unsigned long done = 0;
+	bool skipped = false;
+
+	while (done < len) {
+		struct uffdio_zeropage zero = {
+			.range = {
+				.start = start + done,
+				.len = len - done,
+			},
+			.mode = 0,
+		};
+
+		stats->ioctls++;
+		if (ioctl(uffd, UFFDIO_ZEROPAGE, &zero) == 0) {
+			stats->pages += (len - done) / page_size;
+			break;
+		}
+
+		if (zero.zeropage > 0) {
+			stats->pages += zero.zeropage / page_size;
+			done += zero.zeropage;
+			continue;
+		}
+
+		switch (errno) {
+		case EEXIST:
+			stats->eexist++;
+			skipped = true;
+			done += page_size;
+			break;
+		case EAGAIN:
+			break;
+		default:
+			pfatal("UFFDIO_ZEROPAGE");
+		}
+	}
+
+	return skipped;
+}
+
+// Find the bounds of the VMA containing addr in the address space of tid.
+static bool find_vma(pid_t tid, unsigned long addr, unsigned long *start,
+		     unsigned long *end)
+{
+	char path[64], line[512];
+	bool found = false;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", tid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return false;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%lx-%lx", start, end) == 2 &&
+		    addr >= *start && addr < *end) {
+			found = true;
+			break;
+		}
+	}
+
+	fclose(fp);
+	return found;
+}
+
+// Default resolver, using the shadow map maintained by handle_event(). A
+// miss may be in the grown tail of a range, so if we know the faulting
+// thread, tid, check its VMA.
+static bool resolve_shadow(long uffd, pid_t tid, unsigned long addr,
+			   struct fault_region *region)
+{
+	struct shadow_range range;
+	unsigned long vma_start, vma_end;
+
+	if (!shadow_lookup(uffd, addr, &range) &&
+	    (tid == 0 || !find_vma(tid, addr, &vma_start, &vma_end) ||
+	     !shadow_grow(uffd, addr, vma_start, vma_end) ||
+	     !shadow_lookup(uffd, addr, &range)))
+		return false;
+
+	region->start = range.start;
+	region->len = range.end - range.start;
+	region->src = range.backing;
+
+	return true;
+}
+
+static void wake_page(struct fault_server_thread *thr, long uffd,
+		      unsigned long addr)
+{
+	struct uffdio_range range = {
+		.start = addr,
+		.len = page_size,
+	};
+
+	thr->stats.wakes++;
+	if (ioctl(uffd, UFFDIO_WAKE, &range))
+		pfatal("UFFDIO_WAKE");
+}
+
+// Resolve a write-protect fault. The page is unprotected before the
+// write_protect callback is told about it, so a checkpoint which clears and
+// re-protects it in between can't leave it writable but unrecorded, and the
+// faulting task is only woken after that, so its write can't precede it.
+static void unprotect_page(struct fault_server_thread *thr, long uffd,
+			   unsigned long addr)
+{
+	struct fault_server *server = thr->server;
+	struct uffdio_writeprotect wp = {
+		.range = {
+			.start = addr,
+			.len = page_size,
+		},
+		.mode = UFFDIO_WRITEPROTECT_MODE_DONTWAKE,
+	};
+
+	if (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) == -1)
+		pfatal("UFFDIO_WRITEPROTECT");
+
+	server->write_protect(server->priv, addr);
+	wake_page(thr, uffd, addr);
+}
+
+// Populate the batch-aligned window around addr in the address space of
+// uffd, clamped to its region. Returns true if any page in the window was
+// already present.
+static bool populate(struct fault_server *server, long uffd, pid_t tid,
+		     struct fault_server_stats *stats, unsigned long addr,
+		     unsigned long batch_len, bool minor)
+{
+	struct fault_region region;
+	unsigned long start, end;
+
+	if (server->resolve == NULL) {
+		if (!resolve_shadow(uffd, tid, addr, &region))
+			fatal("No shadow range for fault at %lx\n", addr);
+	} else if (!server->resolve(server->priv, addr, &region)) {
+		fatal("No region for fault at %lx\n", addr);
+	}
+
+	start = addr - (addr % batch_len);
+	end = start + batch_len;
+	if (start < region.start)
+		start = region.start;
+	if (end > region.start + region.len)
+		end = region.start + region.len;
+
+	if (minor)
+		return continue_range(uffd, stats, start, end - start);
+
+	if (region.src == NULL)
+		return zero_range(uffd, stats, start, end - start);
+
+	return copy_range(uffd, stats, start, end - start,
+			  (const char *)region.src + (start - region.start));
+}
+
+static void serve_fault(struct fault_server_thread *thr, long uffd,
+			struct uffd_msg *msg)
+{
+	struct fault_server *server = thr->server;
+	const unsigned long addr = msg->arg.pagefault.address & ~(page_size - 1);
+	const bool minor = msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_MINOR;
+
+	thr->stats.faults++;
+
+	if (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) {
+		if (server->write_protect == NULL)
+			fatal("Unexpected write-protect fault at %lx\n", addr);
+
+		thr->stats.wp_faults++;
+		unprotect_page(thr, uffd, addr);
+		return;
+	}
+
+	// If we skipped a page the faulting page may have been populated by
+	// another thread which raced with the fault being raised, so make sure
+	// the faulting task isn't left asleep.
+	if (populate(server, uffd, msg->arg.pagefault.feat.ptid, &thr->stats,
+		     addr, server->batch_pages * page_size, minor))
+		wake_page(thr, uffd, addr);
+}
+
+// Watch uffd from every handler thread.
+static void watch_uffd(struct fault_server *server, long uffd)
+{
+	// EPOLLEXCLUSIVE so a fault wakes one handler rather than all of them.
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLEXCLUSIVE,
+		.data.fd = uffd,
+	};
+	int i;
+
+	for (i = 0; i < server->num_threads; i++) {
+		if (epoll_ctl(server->threads[i].epoll_fd, EPOLL_CTL_ADD, uffd,
+			      &event))
+			pfatal("epoll_ctl uffd");
+	}
+}
+
+// A forked child has inherited registrations under a new uffd, track it and
+// serve its faults alongside ours.
+static void add_child(struct fault_server *server, long uffd)
+{
+	int flags = fcntl(uffd, F_GETFL);
+
+	if (flags < 0 || fcntl(uffd, F_SETFL, flags | O_NONBLOCK))
+		pfatal("fcntl");
+
+	pthread_mutex_lock(&server->children_lock);
+	if (server->num_children == server->children_capacity) {
+		const int capacity = server->children_capacity ?
+			server->children_capacity * 2 : 8;
+
+		server->children = realloc(server->children,
+					   capacity * sizeof(server->children[0]));
+		if (server->children == NULL)
+			pfatal("realloc");
+		server->children_capacity = capacity;
+	}
+	server->children[server->num_children++] = uffd;
+	pthread_mutex_unlock(&server->children_lock);
+
+	watch_uffd(server, uffd);
+}
+
+// Drain all available messages from uffd, ours or a forked child's. Returns
+// once it would block.
+static void drain(struct fault_server_thread *thr, long uffd)
+{
+	struct uffd_msg msgs[FAULT_SERVER_MAX_MSGS];
+
+	while (true) {
+		ssize_t nread = read(uffd, msgs, sizeof(msgs));
+		int i, count;
+
+		if (nread < 0) {
+			if (errno == EAGAIN)
+				return;
+			if (errno == EINTR)
+				continue;
+
+			pfatal("read");
+		}
+		if (nread == 0)
+			fatal("EOF\n");
+
+		count = nread / sizeof(msgs[0]);
+		thr->stats.reads++;
+		thr->stats.msgs += count;
+
+		for (i = 0; i < count; i++) {
+			struct uffd_msg *msg = &msgs[i];
+
+			if (msg->event == UFFD_EVENT_PAGEFAULT) {
+				serve_fault(thr, uffd, msg);
+			} else {
+				const long child = handle_event(uffd, msg);
+
+				thr->stats.events++;
+				if (msg->event == UFFD_EVENT_FORK)
+					add_child(thr->server, child);
+			}
+		}
+	}
+}
+
+static void *handler_thread(void *arg)
+{
+	struct fault_server_thread *thr = arg;
+	const int stop_fd = thr->server->stop_fd;
+
+	while (true) {
+		struct epoll_event events[FAULT_SERVER_MAX_EVENTS];
+		int i, count;
+
+		count = epoll_wait(thr->epoll_fd, events, FAULT_SERVER_MAX_EVENTS,
+				   -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+
+			pfatal("epoll_wait");
+		}
+
+		for (i = 0; i < count; i++) {
+			if (events[i].data.fd == stop_fd)
+				return NULL;
+
+			drain(thr, events[i].data.fd);
+		}
+	}
+}
+
+static int make_epoll(int stop_fd)
+{
+	struct epoll_event stop_event = {
+		.events = EPOLLIN,
+		.data.fd = stop_fd,
+	};
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (epoll_fd < 0)
+		pfatal("epoll_create1");
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &stop_event))
+		pfatal("epoll_ctl stop");
+
+	return epoll_fd;
+}
+
+static struct fault_server *start(struct fault_server *server)
+{
+	const int num_threads = server->num_threads;
+	int i;
+
+	server->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (server->stop_fd < 0)
+		pfatal("eventfd");
+
+	errno = posix_memalign((void **)&server->threads, 64,
+			       num_threads * sizeof(server->threads[0]));
+	if (errno)
+		pfatal("posix_memalign");
+	memset(server->threads, 0, num_threads * sizeof(server->threads[0]));
+
+	// Every thread's epoll must watch the uffd before any thread may see a
+	// fork event and add a child to them all.
+	for (i = 0; i < num_threads; i++) {
+		server->threads[i].server = server;
+		server->threads[i].epoll_fd = make_epoll(server->stop_fd);
+	}
+	watch_uffd(server, server->uffd);
+
+	for (i = 0; i < num_threads; i++) {
+		struct fault_server_thread *thr = &server->threads[i];
+		int err;
+
+		err = pthread_create(&thr->thread, NULL, handler_thread, thr);
+		if (err) {
+			errno = err;
+			pfatal("pthread_create");
+		}
+	}
+
+	return server;
+}
+
+static struct fault_server *alloc_server(long uffd, int num_threads, void *priv)
+{
+	struct fault_server *server = calloc(1, sizeof(*server));
+
+	if (server == NULL)
+		pfatal("calloc");
+
+	page_size = sysconf(_SC_PAGE_SIZE);
+
+	server->uffd = uffd;
+	server->batch_pages = 1;
+	server->priv = priv;
+	server->num_threads = num_threads;
+	pthread_mutex_init(&server->children_lock, NULL);
+
+	return server;
+}
+
+long fault_server_make_handler(__u64 features)
+{
+	return make_handler_features(false, UFFD_FEATURE_EVENT_UNMAP | features);
+}
+
+struct fault_server *fault_server_start(long uffd, int num_threads,
+					unsigned long batch_pages,
+					fault_resolve_t resolve, void *priv)
+{
+	struct fault_server *server = alloc_server(uffd, num_threads, priv);
+
+	if (batch_pages > 0)
+		server->batch_pages = batch_pages;
+	server->resolve = resolve;
+
+	return start(server);
+}
+
+struct fault_server *fault_server_start_wp(long uffd, int num_threads,
+					   fault_wp_t wp, void *priv)
+{
+	struct fault_server *server = alloc_server(uffd, num_threads, priv);
+
+	server->write_protect = wp;
+
+	return start(server);
+}
+
+void fault_server_stop(struct fault_server *server)
+{
+	const uint64_t val = 1;
+	int i;
+
+	// The eventfd stays readable so every thread sees it.
+	if (write(server->stop_fd, &val, sizeof(val)) != sizeof(val))
+		pfatal("write");
+
+	for (i = 0; i < server->num_threads; i++) {
+		struct fault_server_thread *thr = &server->threads[i];
+
+		pthread_join(thr->thread, NULL);
+		close(thr->epoll_fd);
+	}
+
+	for (i = 0; i < server->num_children; i++) {
+		shadow_drop(server->children[i]);
+		close(server->children[i]);
+	}
+
+	pthread_mutex_destroy(&server->children_lock);
+	close(server->stop_fd);
+	free(server->children);
+	free(server->threads);
+	free(server);
+}
+
+void fault_server_populate(struct fault_server *server,
+			   struct fault_server_stats *stats,
+			   unsigned long addr, unsigned long num_pages)
+{
+	populate(server, server->uffd, 0, stats, addr, num_pages * page_size,
+		 false);
+}
+
+void fault_server_get_stats(struct fault_server *server,
+			    struct fault_server_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < server->num_threads; i++) {
+		const struct fault_server_stats *thr_stats = &server->threads[i].stats;
+
+		stats->msgs += thr_stats->msgs;
+		stats->reads += thr_stats->reads;
+		stats->faults += thr_stats->faults;
+		stats->wp_faults += thr_stats->wp_faults;
+		stats->ioctls += thr_stats->ioctls;
+		stats->pages += thr_stats->pages;
+		stats->eexist += thr_stats->eexist;
+		stats->wakes += thr_stats->wakes;
+		stats->events += thr_stats->events;
+	}
+}
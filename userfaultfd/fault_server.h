@@ -0,0 +1,112 @@
+#pragma once
+
+#include "shared.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Maximum number of uffd_msg entries a handler thread reads in one go.
+#define FAULT_SERVER_MAX_MSGS (64)
+// Maximum number of ready uffds a handler thread picks up per epoll_wait().
+#define FAULT_SERVER_MAX_EVENTS (16)
+
+// Describes the registered region a fault falls within, as determined by the
+// server's resolve callback.
+struct fault_region {
+	unsigned long start;
+	unsigned long len;
+	// Source data corresponding to start, or NULL to zero-fill. Ignored for
+	// minor faults which are resolved with UFFDIO_CONTINUE against the page
+	// cache.
+	const void *src;
+};
+
+// Look up the region containing page-aligned address addr. Returns false if
+// the address is unknown to us, which is fatal.
+typedef bool (*fault_resolve_t)(void *priv, unsigned long addr,
+				struct fault_region *region);
+
+// Called for each write-protect fault on page-aligned address addr, after the
+// page is unprotected but before the faulting task is woken.
+typedef void (*fault_wp_t)(void *priv, unsigned long addr);
+
+// Per-handler thread statistics. Cacheline-aligned so threads don't bounce
+// each other's counters.
+struct fault_server_stats {
+	uint64_t msgs;		// Messages read.
+	uint64_t reads;		// read() calls which returned messages.
+	uint64_t faults;	// Page fault messages.
+	uint64_t wp_faults;	// Of which write-protect faults.
+	uint64_t ioctls;	// UFFDIO_COPY/CONTINUE ioctls issued.
+	uint64_t pages;		// Pages populated by this thread.
+	uint64_t eexist;	// Pages somebody else got to first.
+	uint64_t wakes;		// UFFDIO_WAKE calls required.
+	uint64_t events;	// Non-fault events passed to handle_event().
+} __attribute__((aligned(64)));
+
+struct fault_server_thread {
+	struct fault_server *server;
+	pthread_t thread;
+	int epoll_fd;
+	struct fault_server_stats stats;
+};
+
+struct fault_server {
+	long uffd;
+	// Written to in order to tell handler threads to exit.
+	int stop_fd;
+
+	// Number of pages to populate around each faulting address, the window
+	// being aligned to this size and clamped to the faulting region.
+	unsigned long batch_pages;
+
+	fault_resolve_t resolve;
+	fault_wp_t write_protect;
+	void *priv;
+
+	int num_threads;
+	struct fault_server_thread *threads;
+
+	// Uffds of forked children, whose faults are served alongside ours and
+	// which are closed when the server stops.
+	pthread_mutex_t children_lock;
+	long *children;
+	int num_children, children_capacity;
+};
+
+// Make a non-blocking uffd for fault_server_start(), requesting the specified
+// features in addition to the munmap events the shadow map relies on.
+long fault_server_make_handler(__u64 features);
+
+// Start num_threads handler threads servicing faults on uffd, which must have
+// been created non-blocking. Each fault populates up to batch_pages pages.
+//
+// If resolve is NULL faults are resolved against the shadow map of ranges
+// registered with register_range_backed().
+//
+// If the uffd was created with UFFD_FEATURE_EVENT_FORK, faults in forked
+// children are served too, resolved as if they were in the parent.
+struct fault_server *fault_server_start(long uffd, int num_threads,
+					unsigned long batch_pages,
+					fault_resolve_t resolve, void *priv);
+
+// Start num_threads handler threads servicing write-protect faults on uffd,
+// invoking wp for each.
+struct fault_server *fault_server_start_wp(long uffd, int num_threads,
+					   fault_wp_t wp, void *priv);
+
+// Stop handler threads and free the server.
+void fault_server_stop(struct fault_server *server);
+
+// Populate up to num_pages pages from the num_pages-aligned window containing
+// addr, skipping those already present, as a fault would. Intended for
+// prefetching alongside the handler threads. Statistics are accumulated in
+// stats.
+void fault_server_populate(struct fault_server *server,
+			   struct fault_server_stats *stats,
+			   unsigned long addr, unsigned long num_pages);
+
+// Sum statistics across all handler threads.
+void fault_server_get_stats(struct fault_server *server,
+			    struct fault_server_stats *stats);
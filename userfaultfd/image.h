@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+// On-disk memory image as written by image_save and consumed by
+// lazy_restore. Layout:
+//
+//   struct image_header
+//   struct image_vma[num_vmas]
+//   uint64_t hot[num_hot]        - page addresses, hottest first
+//   (pad to page_size)
+//   page data                    - each VMA's pages at image_vma.offset
+//
+// Only pages which were present (or swapped) are written, the rest are left
+// as holes in a sparse file and so read back as zero.
+
+#define IMAGE_MAGIC "MMXIMG01"
+
+struct image_header {
+	char magic[8];
+	uint32_t page_size;
+	uint32_t num_vmas;
+	uint64_t num_hot;
+	// Total file size, including holes.
+	uint64_t size;
+};
+
+struct image_vma {
+	uint64_t start, end;
+	// File offset of page data for this VMA, page-aligned.
+	uint64_t offset;
+	char perms[5];
+	char pad[3];
+};
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include "image.h"
+#include "pagestat.h"
+#include "shared.h"
+
+#include <fcntl.h>
+#include <linux/kernel-page-flags.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAGEMAP_SWAPPED_BIT (62)
+#define PAGEMAP_PRESENT_BIT (63)
+
+#define CHECK_BIT(_val, _bit) (((_val) >> (_bit)) & 1)
+
+struct hot_page {
+	uint64_t addr;
+	int heat;
+};
+
+static unsigned long page_size;
+
+// We can only restore memory whose entire contents live in the image, so
+// anything file-backed is out, as are the kernel-provided special mappings.
+static bool is_restorable(const struct pagestat *ps)
+{
+	if (ps->perms[0] != 'r')
+		return false;
+
+	if (ps->name == NULL)
+		return true;
+
+	return strcmp(ps->name, "[heap]") == 0 ||
+		strcmp(ps->name, "[stack]") == 0 ||
+		strncmp(ps->name, "[anon:", sizeof("[anon:") - 1) == 0;
+}
+
+static bool has_data(uint64_t pagemap)
+{
+	return CHECK_BIT(pagemap, PAGEMAP_PRESENT_BIT) ||
+		CHECK_BIT(pagemap, PAGEMAP_SWAPPED_BIT);
+}
+
+// Active and referenced pages are likely to be touched first on restore.
+static int page_heat(uint64_t kpageflags)
+{
+	if (kpageflags == (uint64_t)-1)
+		return 0;
+
+	return 2 * CHECK_BIT(kpageflags, KPF_ACTIVE) +
+		CHECK_BIT(kpageflags, KPF_REFERENCED);
+}
+
+static int cmp_hot(const void *a, const void *b)
+{
+	const struct hot_page *x = a, *y = b;
+
+	if (x->heat != y->heat)
+		return y->heat - x->heat;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [pid] [image]\n", bin);
+}
+
+int main(int argc, char **argv)
+{
+	struct image_header header = {
+		.magic = IMAGE_MAGIC,
+	};
+	struct image_vma *vmas;
+	struct hot_page *hot;
+	uint64_t *hot_addrs;
+	struct pagestat **pss;
+	uint64_t data_offset, num_pages = 0, saved = 0;
+	char path[512];
+	char *buf;
+	int mem_fd, fd, i, num_vmas = 0;
+	uint64_t j;
+
+	if (argc != 3) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	page_size = sysconf(_SC_PAGE_SIZE);
+	header.page_size = page_size;
+
+	pss = pagestat_snapshot_all(argv[1]);
+	// Should have already reported error.
+	if (pss == NULL)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < MAX_MAPS && pss[i] != NULL; i++) {
+		if (!is_restorable(pss[i]))
+			continue;
+
+		num_vmas++;
+		num_pages += (pss[i]->vma_end - pss[i]->vma_start) / page_size;
+	}
+
+	vmas = calloc(num_vmas, sizeof(*vmas));
+	hot = calloc(num_pages, sizeof(*hot));
+	hot_addrs = calloc(num_pages, sizeof(*hot_addrs));
+	buf = malloc(page_size);
+	if (vmas == NULL || hot == NULL || hot_addrs == NULL || buf == NULL)
+		pfatal("calloc");
+
+	snprintf(path, sizeof(path), "/proc/%s/mem", argv[1]);
+	mem_fd = open(path, O_RDONLY);
+	if (mem_fd < 0)
+		pfatal("open mem");
+
+	fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		pfatal("open image");
+
+	data_offset = sizeof(header) + num_vmas * sizeof(*vmas);
+	// We don't know how many hot pages there are yet, so reserve room for
+	// all of them.
+	data_offset += num_pages * sizeof(uint64_t);
+	data_offset = (data_offset + page_size - 1) & ~(page_size - 1);
+
+	header.num_vmas = num_vmas;
+	num_vmas = 0;
+	for (i = 0; i < MAX_MAPS && pss[i] != NULL; i++) {
+		const struct pagestat *ps = pss[i];
+		struct image_vma *vma = &vmas[num_vmas];
+		const uint64_t count = (ps->vma_end - ps->vma_start) / page_size;
+
+		if (!is_restorable(ps))
+			continue;
+		num_vmas++;
+
+		vma->start = ps->vma_start;
+		vma->end = ps->vma_end;
+		vma->offset = data_offset;
+		memcpy(vma->perms, ps->perms, sizeof(vma->perms));
+
+		for (j = 0; j < count; j++) {
+			const uint64_t addr = ps->vma_start + j * page_size;
+
+			if (!has_data(ps->pagemaps[j]))
+				continue;
+
+			if (pread(mem_fd, buf, page_size, addr) != (ssize_t)page_size) {
+				fprintf(stderr, "WARN: Can't read page at %lx\n", addr);
+				continue;
+			}
+			if (pwrite(fd, buf, page_size, data_offset + j * page_size) !=
+			    (ssize_t)page_size)
+				pfatal("pwrite");
+
+			hot[header.num_hot].addr = addr;
+			hot[header.num_hot].heat = page_heat(ps->kpageflags[j]);
+			header.num_hot++;
+			saved++;
+		}
+
+		data_offset += count * page_size;
+	}
+
+	// Record pages in descending heat, address order within each level.
+	qsort(hot, header.num_hot, sizeof(*hot), cmp_hot);
+	header.size = data_offset;
+
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+		pfatal("pwrite header");
+	if (pwrite(fd, vmas, num_vmas * sizeof(*vmas), sizeof(header)) !=
+	    (ssize_t)(num_vmas * sizeof(*vmas)))
+		pfatal("pwrite vmas");
+	for (j = 0; j < header.num_hot; j++)
+		hot_addrs[j] = hot[j].addr;
+	if (pwrite(fd, hot_addrs, header.num_hot * sizeof(uint64_t),
+		   sizeof(header) + num_vmas * sizeof(*vmas)) !=
+	    (ssize_t)(header.num_hot * sizeof(uint64_t)))
+		pfatal("pwrite hot");
+	// Extend over any trailing hole.
+	if (ftruncate(fd, data_offset))
+		pfatal("ftruncate");
+
+	printf("Saved %lu of %lu pages across %d VMAs\n", saved, num_pages, num_vmas);
+
+	close(fd);
+	close(mem_fd);
+	free(buf);
+	free(hot_addrs);
+	free(hot);
+	free(vmas);
+	pagestat_free_all(pss);
+
+	return EXIT_SUCCESS;
+}
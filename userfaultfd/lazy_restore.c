@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include "fault_server.h"
+#include "image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+#define DEFAULT_THREADS (2)
+#define DEFAULT_BATCH (16)
+
+enum prefetch_order {
+	PREFETCH_NONE,
+	PREFETCH_ADDR,
+	PREFETCH_HOT,
+};
+
+struct restore {
+	const char *image;
+	const struct image_header *header;
+	const struct image_vma *vmas;
+	const uint64_t *hot;
+
+	// Whether each VMA could be mapped at its original address.
+	bool *mapped;
+	uint32_t num_skipped;
+	unsigned long skipped_pages;
+
+	long uffd;
+	struct fault_server *server;
+	unsigned long batch_pages;
+	enum prefetch_order order;
+
+	// Prefetcher state.
+	pthread_t prefetch_thread;
+	struct fault_server_stats prefetch_stats;
+	uint64_t prefetch_done_ns;
+};
+
+static unsigned long page_size;
+static uint64_t start_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static double elapsed_ms(uint64_t ns)
+{
+	return (double)(ns - start_ns) / NS_PER_MS;
+}
+
+static int perms_to_prot(const char *perms)
+{
+	return (perms[0] == 'r' ? PROT_READ : 0) |
+		(perms[1] == 'w' ? PROT_WRITE : 0) |
+		(perms[2] == 'x' ? PROT_EXEC : 0);
+}
+
+// VMAs are recorded in address order so we can binary search.
+static const struct image_vma *find_vma(struct restore *restore, unsigned long addr)
+{
+	const struct image_vma *vmas = restore->vmas;
+	uint32_t lo = 0, hi = restore->header->num_vmas;
+
+	while (lo < hi) {
+		const uint32_t mid = lo + (hi - lo) / 2;
+
+		if (addr < vmas[mid].start)
+			hi = mid;
+		else if (addr >= vmas[mid].end)
+			lo = mid + 1;
+		else
+			return &vmas[mid];
+	}
+
+	return NULL;
+}
+
+static bool resolve(void *priv, unsigned long addr, struct fault_region *region)
+{
+	struct restore *restore = priv;
+	const struct image_vma *vma = find_vma(restore, addr);
+
+	if (vma == NULL)
+		return false;
+
+	region->start = vma->start;
+	region->len = vma->end - vma->start;
+	region->src = restore->image + vma->offset;
+
+	return true;
+}
+
+static void prefetch_vma(struct restore *restore, const struct image_vma *vma)
+{
+	const unsigned long stride = restore->batch_pages * page_size;
+	unsigned long addr;
+
+	for (addr = vma->start; addr < vma->end; addr += stride)
+		fault_server_populate(restore->server, &restore->prefetch_stats,
+				      addr, restore->batch_pages);
+}
+
+static void *prefetch_thread(void *arg)
+{
+	struct restore *restore = arg;
+	uint32_t i;
+
+	// Hot pages first, then sweep everything in address order to pick up
+	// the rest, stepping over anything already present.
+	if (restore->order == PREFETCH_HOT) {
+		const unsigned long stride = restore->batch_pages * page_size;
+		unsigned long last_window = 0;
+		uint64_t j;
+
+		for (j = 0; j < restore->header->num_hot; j++) {
+			const unsigned long addr = restore->hot[j];
+			const struct image_vma *vma = find_vma(restore, addr);
+
+			if (vma == NULL || !restore->mapped[vma - restore->vmas])
+				continue;
+
+			// Hot pages are address ordered within each heat level
+			// so neighbours tend to share a window.
+			if (addr / stride == last_window)
+				continue;
+			last_window = addr / stride;
+
+			fault_server_populate(restore->server, &restore->prefetch_stats,
+					      addr, restore->batch_pages);
+		}
+	}
+
+	for (i = 0; i < restore->header->num_vmas; i++) {
+		if (restore->mapped[i])
+			prefetch_vma(restore, &restore->vmas[i]);
+	}
+
+	restore->prefetch_done_ns = now_ns();
+	return NULL;
+}
+
+static void load_image(struct restore *restore, const char *path)
+{
+	const struct image_header *header;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		pfatal("open");
+	if (fstat(fd, &st))
+		pfatal("fstat");
+	if ((size_t)st.st_size < sizeof(*header))
+		fatal("Image too small\n");
+
+	restore->image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (restore->image == MAP_FAILED)
+		pfatal("mmap image");
+	close(fd);
+
+	header = (const struct image_header *)restore->image;
+	if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0)
+		fatal("Bad image magic\n");
+	if (header->page_size != page_size)
+		fatal("Image page size %u doesn't match ours\n", header->page_size);
+	if (header->size != (uint64_t)st.st_size)
+		fatal("Image truncated\n");
+
+	restore->header = header;
+	restore->vmas = (const struct image_vma *)(header + 1);
+	restore->hot = (const uint64_t *)(restore->vmas + header->num_vmas);
+}
+
+// Recreate the saved layout in our own address space. There's no fresh
+// process to restore into, so anything which collides with our own mappings
+// (our binary, libraries, stack, the image itself) can't be restored, and is
+// reported and skipped.
+static void map_layout(struct restore *restore)
+{
+	uint32_t i;
+
+	restore->mapped = calloc(restore->header->num_vmas, sizeof(bool));
+	if (restore->mapped == NULL)
+		pfatal("calloc");
+
+	for (i = 0; i < restore->header->num_vmas; i++) {
+		const struct image_vma *vma = &restore->vmas[i];
+		const unsigned long len = vma->end - vma->start;
+		void *ptr = mmap((void *)vma->start, len, perms_to_prot(vma->perms),
+				 MAP_ANON | MAP_PRIVATE | MAP_FIXED_NOREPLACE, -1, 0);
+
+		if (ptr == MAP_FAILED || ptr != (void *)vma->start) {
+			fprintf(stderr, "WARN: Skipping %lx-%lx, not restored: %s\n",
+				vma->start, vma->end,
+				ptr != MAP_FAILED ? "moved" :
+				errno == EEXIST ? "collides with our own mapping" :
+				strerror(errno));
+			if (ptr != MAP_FAILED)
+				munmap(ptr, len);
+			restore->num_skipped++;
+			restore->skipped_pages += len / page_size;
+			continue;
+		}
+
+		register_range(restore->uffd, ptr, len);
+		restore->mapped[i] = true;
+	}
+}
+
+// Touch every restored page, as a restored workload eventually would, and
+// check it against the image.
+static unsigned long verify(struct restore *restore)
+{
+	unsigned long pages = 0;
+	uint32_t i;
+
+	for (i = 0; i < restore->header->num_vmas; i++) {
+		const struct image_vma *vma = &restore->vmas[i];
+		const unsigned long len = vma->end - vma->start;
+
+		if (!restore->mapped[i])
+			continue;
+
+		if (memcmp((void *)vma->start, restore->image + vma->offset, len) != 0)
+			fatal("Mismatch in %lx-%lx\n", vma->start, vma->end);
+
+		pages += len / page_size;
+	}
+
+	return pages;
+}
+
+static void usage(const char *bin)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-b batch pages] [-o none|addr|hot] [image]\n",
+		bin);
+	fprintf(stderr, "  The image is restored into this process's own address space, as a\n"
+		"  benchmark of lazy restore rather than a restore of the saved process.\n"
+		"  VMAs which collide with our own mappings are reported and skipped.\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct restore restore = {
+		.batch_pages = DEFAULT_BATCH,
+		.order = PREFETCH_ADDR,
+	};
+	struct fault_server_stats stats;
+	int num_threads = DEFAULT_THREADS;
+	uint64_t ready_ns, verified_ns;
+	unsigned long pages;
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "t:b:o:")) != -1) {
+		switch (opt) {
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'b':
+			restore.batch_pages = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			if (strcmp(optarg, "none") == 0) {
+				restore.order = PREFETCH_NONE;
+			} else if (strcmp(optarg, "addr") == 0) {
+				restore.order = PREFETCH_ADDR;
+			} else if (strcmp(optarg, "hot") == 0) {
+				restore.order = PREFETCH_HOT;
+			} else {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1 || num_threads <= 0 || restore.batch_pages == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	init();
+	page_size = sysconf(_SC_PAGE_SIZE);
+	start_ns = now_ns();
+
+	load_image(&restore, argv[optind]);
+	restore.uffd = make_handler(false);
+	map_layout(&restore);
+	restore.server = fault_server_start(restore.uffd, num_threads,
+					    restore.batch_pages, resolve, &restore);
+	ready_ns = now_ns();
+
+	if (restore.order != PREFETCH_NONE) {
+		err = pthread_create(&restore.prefetch_thread, NULL,
+				     prefetch_thread, &restore);
+		if (err) {
+			errno = err;
+			pfatal("pthread_create");
+		}
+	}
+
+	pages = verify(&restore);
+	verified_ns = now_ns();
+
+	if (restore.order != PREFETCH_NONE)
+		pthread_join(restore.prefetch_thread, NULL);
+
+	fault_server_get_stats(restore.server, &stats);
+	fault_server_stop(restore.server);
+
+	printf("ready in %.2fms, verified %lu pages in %.2fms",
+	       elapsed_ms(ready_ns), pages, elapsed_ms(verified_ns));
+	if (restore.order != PREFETCH_NONE)
+		printf(", prefetch done in %.2fms", elapsed_ms(restore.prefetch_done_ns));
+	printf("\nfaults=%lu faulted pages=%lu prefetched pages=%lu eexist=%lu\n",
+	       stats.faults, stats.pages, restore.prefetch_stats.pages,
+	       stats.eexist + restore.prefetch_stats.eexist);
+	if (restore.num_skipped > 0)
+		printf("skipped %u of %u VMAs (%lu pages), not restored\n",
+		       restore.num_skipped, restore.header->num_vmas,
+		       restore.skipped_pages);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,341 @@
+#include "shadow.h"
+#include "shared.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Non-overlapping ranges sorted by address.
+struct shadow_space {
+	pthread_rwlock_t lock;
+	struct shadow_range *ranges;
+	unsigned long count, capacity;
+};
+
+// Indexed by uffd. Spaces are never freed once allocated so that lookups need
+// only hold the table lock while indexing.
+static struct shadow_space **spaces;
+static long num_spaces;
+static pthread_rwlock_t spaces_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct shadow_space *get_space(long uffd, bool create)
+{
+	struct shadow_space *space = NULL;
+
+	pthread_rwlock_rdlock(&spaces_lock);
+	if (uffd < num_spaces)
+		space = spaces[uffd];
+	pthread_rwlock_unlock(&spaces_lock);
+
+	if (space != NULL || !create)
+		return space;
+
+	pthread_rwlock_wrlock(&spaces_lock);
+	if (uffd >= num_spaces) {
+		long new_num = num_spaces ? num_spaces : 64;
+
+		while (new_num <= uffd)
+			new_num *= 2;
+
+		spaces = realloc(spaces, new_num * sizeof(spaces[0]));
+		if (spaces == NULL)
+			pfatal("realloc");
+		memset(&spaces[num_spaces], 0,
+		       (new_num - num_spaces) * sizeof(spaces[0]));
+		num_spaces = new_num;
+	}
+
+	space = spaces[uffd];
+	if (space == NULL) {
+		space = calloc(1, sizeof(*space));
+		if (space == NULL)
+			pfatal("calloc");
+		pthread_rwlock_init(&space->lock, NULL);
+		spaces[uffd] = space;
+	}
+	pthread_rwlock_unlock(&spaces_lock);
+
+	return space;
+}
+
+static void reserve(struct shadow_space *space, unsigned long count)
+{
+	unsigned long capacity = space->capacity ? space->capacity : 16;
+
+	if (count <= space->capacity)
+		return;
+
+	while (capacity < count)
+		capacity *= 2;
+
+	space->ranges = realloc(space->ranges, capacity * sizeof(space->ranges[0]));
+	if (space->ranges == NULL)
+		pfatal("realloc");
+	space->capacity = capacity;
+}
+
+// Index of the first range ending after addr.
+static unsigned long first_after(struct shadow_space *space, unsigned long addr)
+{
+	unsigned long lo = 0, hi = space->count;
+
+	while (lo < hi) {
+		const unsigned long mid = lo + (hi - lo) / 2;
+
+		if (space->ranges[mid].end <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static const char *advance(const char *backing, unsigned long offset)
+{
+	return backing == NULL ? NULL : backing + offset;
+}
+
+// Remove [start, end) from the space, splitting ranges which straddle either
+// end. If pieces is non-NULL the removed portions are returned in a newly
+// allocated array.
+static void carve(struct shadow_space *space, unsigned long start, unsigned long end,
+		  struct shadow_range **pieces, unsigned long *num_pieces)
+{
+	const unsigned long i = first_after(space, start);
+	struct shadow_range keep[2];
+	struct shadow_range first, last;
+	unsigned long j, k, num_keep = 0;
+
+	if (pieces != NULL) {
+		*pieces = NULL;
+		*num_pieces = 0;
+	}
+
+	for (j = i; j < space->count && space->ranges[j].start < end; j++)
+		;
+	if (j == i)
+		return;
+
+	first = space->ranges[i];
+	last = space->ranges[j - 1];
+
+	if (pieces != NULL) {
+		*pieces = malloc((j - i) * sizeof(**pieces));
+		if (*pieces == NULL)
+			pfatal("malloc");
+
+		for (k = i; k < j; k++) {
+			const struct shadow_range *range = &space->ranges[k];
+			const unsigned long from = range->start > start ? range->start : start;
+			const unsigned long to = range->end < end ? range->end : end;
+
+			(*pieces)[k - i].start = from;
+			(*pieces)[k - i].end = to;
+			(*pieces)[k - i].backing = advance(range->backing, from - range->start);
+		}
+		*num_pieces = j - i;
+	}
+
+	if (first.start < start) {
+		keep[num_keep].start = first.start;
+		keep[num_keep].end = start;
+		keep[num_keep].backing = first.backing;
+		num_keep++;
+	}
+	if (last.end > end) {
+		keep[num_keep].start = end;
+		keep[num_keep].end = last.end;
+		keep[num_keep].backing = advance(last.backing, end - last.start);
+		num_keep++;
+	}
+
+	// Splitting a single range in two grows the array by one.
+	reserve(space, space->count + 1);
+	memmove(&space->ranges[i + num_keep], &space->ranges[j],
+		(space->count - j) * sizeof(space->ranges[0]));
+	memcpy(&space->ranges[i], keep, num_keep * sizeof(keep[0]));
+	space->count = space->count - (j - i) + num_keep;
+}
+
+// Insert a range which must not overlap any existing one.
+static void insert(struct shadow_space *space, const struct shadow_range *range)
+{
+	const unsigned long i = first_after(space, range->start);
+
+	reserve(space, space->count + 1);
+	memmove(&space->ranges[i + 1], &space->ranges[i],
+		(space->count - i) * sizeof(space->ranges[0]));
+	space->ranges[i] = *range;
+	space->count++;
+}
+
+void shadow_add(long uffd, unsigned long start, unsigned long len,
+		const void *backing)
+{
+	struct shadow_space *space = get_space(uffd, true);
+	const struct shadow_range range = {
+		.start = start,
+		.end = start + len,
+		.backing = backing,
+	};
+
+	pthread_rwlock_wrlock(&space->lock);
+	carve(space, range.start, range.end, NULL, NULL);
+	insert(space, &range);
+	pthread_rwlock_unlock(&space->lock);
+}
+
+bool shadow_lookup(long uffd, unsigned long addr, struct shadow_range *range)
+{
+	struct shadow_space *space = get_space(uffd, false);
+	bool found = false;
+	unsigned long i;
+
+	if (space == NULL)
+		return false;
+
+	pthread_rwlock_rdlock(&space->lock);
+	i = first_after(space, addr);
+	if (i < space->count && space->ranges[i].start <= addr) {
+		*range = space->ranges[i];
+		found = true;
+	}
+	pthread_rwlock_unlock(&space->lock);
+
+	return found;
+}
+
+void shadow_fork(long parent_uffd, long child_uffd)
+{
+	struct shadow_space *parent = get_space(parent_uffd, false);
+	struct shadow_space *child = get_space(child_uffd, true);
+
+	pthread_rwlock_wrlock(&child->lock);
+	child->count = 0;
+
+	if (parent != NULL) {
+		pthread_rwlock_rdlock(&parent->lock);
+		reserve(child, parent->count);
+		memcpy(child->ranges, parent->ranges,
+		       parent->count * sizeof(parent->ranges[0]));
+		child->count = parent->count;
+		pthread_rwlock_unlock(&parent->lock);
+	}
+
+	pthread_rwlock_unlock(&child->lock);
+}
+
+void shadow_move(long uffd, unsigned long from, unsigned long to,
+		 unsigned long len)
+{
+	struct shadow_space *space = get_space(uffd, false);
+	struct shadow_range *pieces;
+	unsigned long num_pieces, i;
+
+	if (space == NULL)
+		return;
+
+	pthread_rwlock_wrlock(&space->lock);
+	carve(space, from, from + len, &pieces, &num_pieces);
+	// Anything previously at the destination has been unmapped.
+	carve(space, to, to + len, NULL, NULL);
+
+	for (i = 0; i < num_pieces; i++) {
+		pieces[i].start = pieces[i].start - from + to;
+		pieces[i].end = pieces[i].end - from + to;
+		insert(space, &pieces[i]);
+	}
+	pthread_rwlock_unlock(&space->lock);
+
+	free(pieces);
+}
+
+bool shadow_grow(long uffd, unsigned long addr, unsigned long vma_start,
+		 unsigned long vma_end)
+{
+	struct shadow_space *space = get_space(uffd, false);
+	struct shadow_range tail = { .backing = NULL };
+	unsigned long i;
+	bool found = false;
+
+	if (space == NULL)
+		return false;
+
+	pthread_rwlock_wrlock(&space->lock);
+	i = first_after(space, addr);
+	if (i < space->count && space->ranges[i].start <= addr) {
+		// Somebody else got here first.
+		found = true;
+	} else if (i > 0 && space->ranges[i - 1].end > vma_start &&
+		   addr < vma_end) {
+		tail.start = space->ranges[i - 1].end;
+		tail.end = vma_end;
+		if (i < space->count && space->ranges[i].start < tail.end)
+			tail.end = space->ranges[i].start;
+		insert(space, &tail);
+		found = true;
+	}
+	pthread_rwlock_unlock(&space->lock);
+
+	return found;
+}
+
+void shadow_discard(long uffd, unsigned long start, unsigned long end)
+{
+	struct shadow_space *space = get_space(uffd, false);
+	struct shadow_range *pieces;
+	unsigned long num_pieces, i;
+
+	if (space == NULL)
+		return;
+
+	pthread_rwlock_wrlock(&space->lock);
+	carve(space, start, end, &pieces, &num_pieces);
+	for (i = 0; i < num_pieces; i++) {
+		pieces[i].backing = NULL;
+		insert(space, &pieces[i]);
+	}
+	pthread_rwlock_unlock(&space->lock);
+
+	free(pieces);
+}
+
+void shadow_remove(long uffd, unsigned long start, unsigned long end)
+{
+	struct shadow_space *space = get_space(uffd, false);
+
+	if (space == NULL)
+		return;
+
+	pthread_rwlock_wrlock(&space->lock);
+	carve(space, start, end, NULL, NULL);
+	pthread_rwlock_unlock(&space->lock);
+}
+
+void shadow_drop(long uffd)
+{
+	struct shadow_space *space = get_space(uffd, false);
+
+	if (space == NULL)
+		return;
+
+	pthread_rwlock_wrlock(&space->lock);
+	space->count = 0;
+	pthread_rwlock_unlock(&space->lock);
+}
+
+unsigned long shadow_count(long uffd)
+{
+	struct shadow_space *space = get_space(uffd, false);
+	unsigned long count;
+
+	if (space == NULL)
+		return 0;
+
+	pthread_rwlock_rdlock(&space->lock);
+	count = space->count;
+	pthread_rwlock_unlock(&space->lock);
+
+	return count;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Shadow map of userfaultfd-registered ranges, kept per uffd (and so per
+// address space, as each forked child gets its own uffd). Each range records
+// the buffer backing it so fault handlers can find the data for a faulting
+// address with a binary search rather than any syscalls.
+//
+// The map is kept up to date from fork, mremap, madvise(DONTNEED) and, where
+// the uffd requested UFFD_FEATURE_EVENT_UNMAP, munmap events by
+// handle_event().
+
+struct shadow_range {
+	unsigned long start, end;
+	// Data for start, or NULL if the range should be zero-filled.
+	const char *backing;
+};
+
+// Record [start, start + len) on uffd as backed by backing, replacing
+// anything previously recorded there.
+void shadow_add(long uffd, unsigned long start, unsigned long len,
+		const void *backing);
+
+// Look up the range containing addr. Returns false if there is none.
+bool shadow_lookup(long uffd, unsigned long addr, struct shadow_range *range);
+
+// The child uffd's address space is a copy of the parent's.
+void shadow_fork(long parent_uffd, long child_uffd);
+
+// [from, from + len) has been moved to [to, to + len).
+void shadow_move(long uffd, unsigned long from, unsigned long to,
+		 unsigned long len);
+
+// A fault at addr missed, and the VMA containing it is [vma_start, vma_end).
+// If that VMA also contains a recorded range before addr, it has grown in
+// place or by mremap() (whose event only gives the old length), so record
+// its new tail up to vma_end as zero-filled. Returns true if addr is now
+// covered.
+bool shadow_grow(long uffd, unsigned long addr, unsigned long vma_start,
+		 unsigned long vma_end);
+
+// [start, end) has been zapped, so remains registered but is zero-filled from
+// here on.
+void shadow_discard(long uffd, unsigned long start, unsigned long end);
+
+// [start, end) is no longer mapped.
+void shadow_remove(long uffd, unsigned long start, unsigned long end);
+
+// Forget everything recorded against uffd.
+void shadow_drop(long uffd);
+
+// Number of ranges recorded against uffd.
+unsigned long shadow_count(long uffd);
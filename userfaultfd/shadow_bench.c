@@ -0,0 +1,175 @@
+#include "shadow.h"
+#include "shared.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_SEC 1000000000ULL
+
+#define NUM_LOOKUPS (1000000)
+#define NUM_CHILDREN (1000)
+// Cap on ranges across all children, to bound memory use.
+#define MAX_CHILD_RANGES (4000000)
+
+// We don't need real uffds, the shadow map is keyed on the number alone.
+#define BENCH_UFFD (1000)
+#define CHILD_UFFD_BASE (2000)
+
+static unsigned long page_size;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void expect(long uffd, unsigned long addr, bool found,
+		   unsigned long start, unsigned long end, const char *backing)
+{
+	struct shadow_range range;
+
+	if (shadow_lookup(uffd, addr, &range) != found)
+		fatal("lookup %lx: expected %sfound\n", addr, found ? "" : "not ");
+	if (!found)
+		return;
+
+	if (range.start != start || range.end != end || range.backing != backing)
+		fatal("lookup %lx: got [%lx, %lx) %p expected [%lx, %lx) %p\n",
+		      addr, range.start, range.end, range.backing,
+		      start, end, backing);
+}
+
+// Check the events handle_event() feeds us split and move ranges correctly.
+static void check(void)
+{
+	const long uffd = BENCH_UFFD;
+	const unsigned long base = 0x100000, len = 16 * page_size;
+	char *backing = (char *)0x800000;
+
+	shadow_drop(uffd);
+	shadow_add(uffd, base, len, backing);
+	expect(uffd, base + page_size, true, base, base + len, backing);
+	expect(uffd, base + len, false, 0, 0, NULL);
+
+	// madvise(DONTNEED) in the middle splits into three.
+	shadow_discard(uffd, base + 4 * page_size, base + 8 * page_size);
+	expect(uffd, base, true, base, base + 4 * page_size, backing);
+	expect(uffd, base + 5 * page_size, true, base + 4 * page_size,
+	       base + 8 * page_size, NULL);
+	expect(uffd, base + 8 * page_size, true, base + 8 * page_size, base + len,
+	       backing + 8 * page_size);
+
+	// munmap across the first split.
+	shadow_remove(uffd, base + 2 * page_size, base + 6 * page_size);
+	expect(uffd, base + 3 * page_size, false, 0, 0, NULL);
+	expect(uffd, base + 6 * page_size, true, base + 6 * page_size,
+	       base + 8 * page_size, NULL);
+
+	// mremap the tail elsewhere, backing follows.
+	shadow_move(uffd, base + 8 * page_size, base + len * 4, 8 * page_size);
+	expect(uffd, base + 8 * page_size, false, 0, 0, NULL);
+	expect(uffd, base + len * 4, true, base + len * 4,
+	       base + len * 4 + 8 * page_size, backing + 8 * page_size);
+
+	// The child sees the same, independently of the parent.
+	shadow_fork(uffd, CHILD_UFFD_BASE);
+	shadow_remove(uffd, 0, ~0UL);
+	expect(uffd, base, false, 0, 0, NULL);
+	expect(CHILD_UFFD_BASE, base, true, base, base + 2 * page_size, backing);
+
+	if (shadow_count(CHILD_UFFD_BASE) != 3)
+		fatal("child has %lu ranges, expected 3\n",
+		      shadow_count(CHILD_UFFD_BASE));
+
+	// mremap growing the range, the event only gives us the old length.
+	// The fault beyond it finds the new VMA end and fills in the tail.
+	shadow_add(uffd, base, len, backing);
+	shadow_move(uffd, base, base + len * 4, len);
+	expect(uffd, base, false, 0, 0, NULL);
+	expect(uffd, base + len * 5, false, 0, 0, NULL);
+	if (!shadow_grow(uffd, base + len * 5, base + len * 4, base + len * 6))
+		fatal("grow %lx: expected to extend range\n", base + len * 5);
+	expect(uffd, base + len * 5, true, base + len * 5, base + len * 6, NULL);
+	expect(uffd, base + len * 4, true, base + len * 4, base + len * 5,
+	       backing);
+
+	// A miss in a VMA we have no range in stays a miss.
+	if (shadow_grow(uffd, base + len * 9, base + len * 8, base + len * 10))
+		fatal("grow %lx: expected no range\n", base + len * 9);
+	expect(uffd, base + len * 9, false, 0, 0, NULL);
+	shadow_drop(uffd);
+
+	shadow_drop(CHILD_UFFD_BASE);
+}
+
+static void bench(unsigned long num_ranges)
+{
+	const long uffd = BENCH_UFFD;
+	// Leave a gap page between each range so they don't abut.
+	const unsigned long stride = 2 * page_size;
+	const unsigned long base = 0x10000000;
+	const unsigned long num_children = num_ranges * NUM_CHILDREN > MAX_CHILD_RANGES
+		? MAX_CHILD_RANGES / num_ranges : NUM_CHILDREN;
+	uint64_t start, lookup_ns, fork_ns, event_ns;
+	unsigned long i, hits = 0;
+
+	shadow_drop(uffd);
+	for (i = 0; i < num_ranges; i++)
+		shadow_add(uffd, base + i * stride, page_size, NULL);
+
+	start = now_ns();
+	for (i = 0; i < NUM_LOOKUPS; i++) {
+		const unsigned long addr = base + (random() % (num_ranges * 2)) * page_size;
+		struct shadow_range range;
+
+		hits += shadow_lookup(uffd, addr, &range);
+	}
+	lookup_ns = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < num_children; i++)
+		shadow_fork(uffd, CHILD_UFFD_BASE + i);
+	fork_ns = now_ns() - start;
+
+	// Alternate discard/move/remove events scattered over the space.
+	start = now_ns();
+	for (i = 0; i < num_children; i++) {
+		const long child = CHILD_UFFD_BASE + i;
+		const unsigned long addr = base + (random() % num_ranges) * stride;
+
+		shadow_discard(child, addr, addr + page_size);
+		shadow_move(child, addr, addr + stride * num_ranges, page_size);
+		shadow_remove(child, addr + stride * num_ranges,
+			      addr + stride * num_ranges + page_size);
+	}
+	event_ns = now_ns() - start;
+
+	printf("ranges=%-7lu lookup=%6.1fns (%lu%% hit) children=%-4lu fork=%8.1fus/child events=%8.1fus/child\n",
+	       num_ranges, (double)lookup_ns / NUM_LOOKUPS,
+	       hits * 100 / NUM_LOOKUPS, num_children,
+	       (double)fork_ns / num_children / 1000.,
+	       (double)event_ns / num_children / 1000.);
+
+	for (i = 0; i < num_children; i++)
+		shadow_drop(CHILD_UFFD_BASE + i);
+}
+
+int main(void)
+{
+	unsigned long num_ranges;
+
+	init();
+	page_size = sysconf(_SC_PAGE_SIZE);
+
+	check();
+
+	for (num_ranges = 100; num_ranges <= 100000; num_ranges *= 10)
+		bench(num_ranges);
+
+	return EXIT_SUCCESS;
+}
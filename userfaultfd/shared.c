@@ -1,4 +1,5 @@
 #include "shared.h"
+#include "shadow.h"
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -18,10 +19,13 @@
 		UFFD_FEATURE_EVENT_REMOVE)
 
 static int page_size;
+// Source page for UFFDIO_COPY, so we needn't map a page for every fault.
+static void *src_page;
 
 void init(void)
 {
 	page_size = sysconf(_SC_PAGE_SIZE);
+	src_page = map_page(true);
 }
 
 void *map_page(bool populate)
@@ -48,13 +52,18 @@ static void handle_fault(long uffd, struct uffd_msg* msg)
 	printf("flags=%llx addr=%llx pid=%u\n",
 	       msg->arg.pagefault.flags, msg->arg.pagefault.address, msg->arg.pagefault.feat.ptid);
 
-	void *ptr = map_page(true);
+	const unsigned long addr = PAGE_ALIGN(msg->arg.pagefault.address);
+	struct shadow_range range;
+	const char *src = src_page;
+
+	if (shadow_lookup(uffd, addr, &range) && range.backing != NULL)
+		src = range.backing + (addr - range.start);
 
 	struct uffdio_copy copy = {
 		.mode = 0,
 		.copy = 0,
-		.src = (unsigned long)ptr,
-		.dst = PAGE_ALIGN(msg->arg.pagefault.address),
+		.src = (unsigned long)src,
+		.dst = addr,
 		.len = page_size,
 	};
 
@@ -68,6 +77,8 @@ static unsigned handle_fork(long uffd, struct uffd_msg* msg)
 
 	printf("Child uffd=[%u]\n", msg->arg.fork.ufd);
 
+	shadow_fork(uffd, msg->arg.fork.ufd);
+
 	return msg->arg.fork.ufd;
 }
 
@@ -75,21 +86,23 @@ static void handle_remap(long uffd, struct uffd_msg* msg)
 {
 	printf("-- remap uffd=[%ld] --\n", uffd);
 
-	(void)msg;
+	shadow_move(uffd, msg->arg.remap.from, msg->arg.remap.to,
+		    msg->arg.remap.len);
 }
 
 static void handle_remove(long uffd, struct uffd_msg* msg)
 {
 	printf("-- remove uffd=[%ld] --\n", uffd);
 
-	(void)msg;
+	shadow_discard(uffd, msg->arg.remove.start, msg->arg.remove.end);
 }
 
 static void handle_unmap(long uffd, struct uffd_msg* msg)
 {
 	printf("-- unmap uffd=[%lx] --\n", uffd);
 
-	(void)msg;
+	// Unmap events share the remove event layout.
+	shadow_remove(uffd, msg->arg.remove.start, msg->arg.remove.end);
 }
 
 unsigned handle_event(long uffd, struct uffd_msg* msg)
@@ -121,6 +134,11 @@ unsigned handle_event(long uffd, struct uffd_msg* msg)
 }
 
 long make_handler(bool block)
+{
+	return make_handler_features(block, 0);
+}
+
+long make_handler_features(bool block, __u64 features)
 {
 	long uffd = syscall(__NR_userfaultfd, block ? 0 : O_NONBLOCK);
 	if (uffd == -1)
@@ -128,30 +146,69 @@ long make_handler(bool block)
 
 	struct uffdio_api api = {
 		.api = UFFD_API,
-		.features = REQUIRED_FEATURES,
+		.features = REQUIRED_FEATURES | features,
 	};
 
 	if (ioctl(uffd, UFFDIO_API, &api) == -1)
 		pfatal("UFFDIO_API");
 
+	// The fd number may have been used by a previous uffd.
+	shadow_drop(uffd);
+
 	return uffd;
 }
 
 void register_range(long uffd, void *ptr, unsigned long len)
+{
+	register_range_mode(uffd, ptr, len,
+			    UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP);
+}
+
+static void register_range_shadow(long uffd, void *ptr, unsigned long len,
+				  __u64 mode, const void *backing)
 {
 	struct uffdio_register reg = {
 		.range = {
 			.start = (unsigned long)ptr,
 			.len = len,
 		},
-		.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP,
+		.mode = mode,
 	};
 
 	if (ioctl(uffd, UFFDIO_REGISTER, &reg) == -1)
 		pfatal("UFFDIO_REGISTER");
+
+	shadow_add(uffd, (unsigned long)ptr, len, backing);
+}
+
+void register_range_mode(long uffd, void *ptr, unsigned long len, __u64 mode)
+{
+	register_range_shadow(uffd, ptr, len, mode, NULL);
+}
+
+void register_range_backed(long uffd, void *ptr, unsigned long len,
+			   const void *backing)
+{
+	register_range_shadow(uffd, ptr, len,
+			      UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP,
+			      backing);
 }
 
 void register_page_range(long uffd, void *ptr, int num_pages)
 {
 	register_range(uffd, PAGE_ALIGN(ptr), num_pages * page_size);
 }
+
+void write_protect_range(long uffd, void *ptr, unsigned long len, bool protect)
+{
+	struct uffdio_writeprotect wp = {
+		.range = {
+			.start = (unsigned long)ptr,
+			.len = len,
+		},
+		.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+	};
+
+	if (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) == -1)
+		pfatal("UFFDIO_WRITEPROTECT");
+}
@@ -39,8 +39,27 @@ unsigned handle_event(long uffd, struct uffd_msg* msg);
 // Register userfaultfd handler in current process.
 long make_handler(bool block);
 
+// Register userfaultfd handler in current process, requesting the specified
+// features in addition to those we always require.
+long make_handler_features(bool block, __u64 features);
+
 // Register a range of pages. ptr will be page-aligned.
 void register_page_range(long uffd, void *ptr, int num_pages);
 
 // Register address range to be handled by userfaultfd.
 void register_range(long uffd, void *ptr, unsigned long len);
+
+// Register address range to be handled by userfaultfd, faults being populated
+// from the corresponding offset in backing. The range is tracked across fork,
+// mremap, madvise(DONTNEED) and, given UFFD_FEATURE_EVENT_UNMAP, munmap events
+// by handle_event().
+void register_range_backed(long uffd, void *ptr, unsigned long len,
+			   const void *backing);
+
+// Register address range to be handled by userfaultfd with the specified
+// UFFDIO_REGISTER_MODE_xxx mode flags.
+void register_range_mode(long uffd, void *ptr, unsigned long len, __u64 mode);
+
+// Write-protect (or unprotect, waking any faulting tasks) an address range
+// registered with UFFDIO_REGISTER_MODE_WP.
+void write_protect_range(long uffd, void *ptr, unsigned long len, bool protect);